@@ -0,0 +1,382 @@
+/**
+ * Transfers accelerator plugin for Orthanc
+ * Copyright (C) 2018-2023 Osimis S.A., Belgium
+ * Copyright (C) 2024-2026 Orthanc Team SRL, Belgium
+ * Copyright (C) 2021-2026 Sebastien Jodogne, ICTEAM UCLouvain, Belgium
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU Affero General Public License
+ * as published by the Free Software Foundation, either version 3 of
+ * the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Affero General Public License for more details.
+ * 
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ **/
+
+
+
+#include "AutoCompression.h"
+
+#include <OrthancException.h>
+
+#include <algorithm>
+#include <string.h>
+#include <zlib.h>
+
+#if ORTHANC_TRANSFERS_ENABLE_ZSTD == 1
+#  include <zstd.h>
+#endif
+
+
+namespace OrthancPlugins
+{
+  // Method of the parts, with the same values as in the binary manifest
+  static const uint8_t PART_NONE = 0;
+  static const uint8_t PART_GZIP = 1;
+  static const uint8_t PART_ZSTD = 2;
+
+  // The data is sampled by windows that are spread over its extent
+  static const size_t SAMPLE_WINDOW_SIZE = 4096;
+  static const size_t SAMPLE_WINDOWS_COUNT = 4;
+
+  // Only scan the beginning of the files for the transfer syntax
+  static const size_t MAX_META_HEADER_SIZE = 64 * 1024;
+
+
+  bool AutoCompression::LookupTransferSyntax(std::string& target,
+                                             const void* dicom,
+                                             size_t size)
+  {
+    // 128-byte preamble, followed by the "DICM" prefix
+    const uint8_t* p = reinterpret_cast<const uint8_t*>(dicom);
+
+    if (p == NULL ||
+        size < 132 ||
+        memcmp(p + 128, "DICM", 4) != 0)
+    {
+      return false;
+    }
+
+    size = std::min(size, MAX_META_HEADER_SIZE);
+
+    // The meta-information is always encoded as explicit VR little endian
+    size_t pos = 132;
+    while (pos + 8 <= size)
+    {
+      const uint16_t group = static_cast<uint16_t>(p[pos] | (p[pos + 1] << 8));
+      const uint16_t element = static_cast<uint16_t>(p[pos + 2] | (p[pos + 3] << 8));
+
+      if (group != 0x0002)
+      {
+        return false;  // End of the meta-information
+      }
+
+      const char vr[2] = { static_cast<char>(p[pos + 4]), static_cast<char>(p[pos + 5]) };
+
+      size_t length;
+      if (memcmp(vr, "OB", 2) == 0 ||
+          memcmp(vr, "OW", 2) == 0 ||
+          memcmp(vr, "OF", 2) == 0 ||
+          memcmp(vr, "SQ", 2) == 0 ||
+          memcmp(vr, "UT", 2) == 0 ||
+          memcmp(vr, "UN", 2) == 0)
+      {
+        // 2 reserved bytes, then a 32-bit length
+        if (pos + 12 > size)
+        {
+          return false;
+        }
+
+        length = (static_cast<size_t>(p[pos + 8]) |
+                  (static_cast<size_t>(p[pos + 9]) << 8) |
+                  (static_cast<size_t>(p[pos + 10]) << 16) |
+                  (static_cast<size_t>(p[pos + 11]) << 24));
+        pos += 12;
+      }
+      else
+      {
+        length = static_cast<size_t>(p[pos + 6] | (p[pos + 7] << 8));
+        pos += 8;
+      }
+
+      if (length > size - pos)
+      {
+        return false;
+      }
+
+      if (element == 0x0010)
+      {
+        // Transfer Syntax UID, which might be padded with a null byte
+        target.assign(reinterpret_cast<const char*>(p + pos), length);
+
+        while (!target.empty() &&
+               (target[target.size() - 1] == '\0' ||
+                target[target.size() - 1] == ' '))
+        {
+          target.resize(target.size() - 1);
+        }
+
+        return !target.empty();
+      }
+
+      pos += length;
+    }
+
+    return false;
+  }
+
+
+  static bool StartsWith(const std::string& value,
+                         const char* prefix)
+  {
+    return value.compare(0, strlen(prefix), prefix) == 0;
+  }
+
+
+  bool AutoCompression::IsCompressedTransferSyntax(const std::string& transferSyntax)
+  {
+    return (StartsWith(transferSyntax, "1.2.840.10008.1.2.4.") ||     // JPEG, JPEG-LS, JPEG 2000, HTJ2K, MPEG, HEVC
+            transferSyntax == "1.2.840.10008.1.2.5" ||                 // RLE lossless
+            transferSyntax == "1.2.840.10008.1.2.1.99");               // Deflated explicit VR little endian
+  }
+
+
+  bool AutoCompression::IsCompressible(const void* data,
+                                       size_t size)
+  {
+    if (size <= SAMPLE_WINDOW_SIZE * SAMPLE_WINDOWS_COUNT)
+    {
+      // Small data (typically, DICOM headers) is cheap to compress
+      return true;
+    }
+
+    std::string sample;
+    sample.reserve(SAMPLE_WINDOW_SIZE * SAMPLE_WINDOWS_COUNT);
+
+    const size_t step = (size - SAMPLE_WINDOW_SIZE) / (SAMPLE_WINDOWS_COUNT - 1);
+    for (size_t i = 0; i < SAMPLE_WINDOWS_COUNT; i++)
+    {
+      sample.append(reinterpret_cast<const char*>(data) + i * step, SAMPLE_WINDOW_SIZE);
+    }
+
+    size_t compressedSize;
+
+#if ORTHANC_TRANSFERS_ENABLE_ZSTD == 1
+    std::string compressed;
+    compressed.resize(ZSTD_compressBound(sample.size()));
+
+    compressedSize = ZSTD_compress(&compressed[0], compressed.size(), sample.c_str(), sample.size(), 1);
+    if (ZSTD_isError(compressedSize))
+    {
+      throw Orthanc::OrthancException(Orthanc::ErrorCode_InternalError);
+    }
+#else
+    std::string compressed;
+    uLongf length = compressBound(static_cast<uLong>(sample.size()));
+    compressed.resize(length);
+
+    if (compress2(reinterpret_cast<Bytef*>(&compressed[0]), &length,
+                  reinterpret_cast<const Bytef*>(sample.c_str()), static_cast<uLong>(sample.size()), 1) != Z_OK)
+    {
+      throw Orthanc::OrthancException(Orthanc::ErrorCode_InternalError);
+    }
+
+    compressedSize = length;
+#endif
+
+    // Compress if this saves at least 10%
+    return compressedSize * 10 < sample.size() * 9;
+  }
+
+
+  static void WriteVarint(std::string& target,
+                          uint64_t value)
+  {
+    while (value >= 0x80)
+    {
+      target.push_back(static_cast<char>((value & 0x7f) | 0x80));
+      value >>= 7;
+    }
+
+    target.push_back(static_cast<char>(value));
+  }
+
+
+  static size_t ReadVarint(const uint8_t*& current,
+                           const uint8_t* end)
+  {
+    uint64_t value = 0;
+
+    for (unsigned int shift = 0; shift < 64; shift += 7)
+    {
+      if (current == end)
+      {
+        break;
+      }
+
+      const uint8_t byte = *(current++);
+      value |= static_cast<uint64_t>(byte & 0x7f) << shift;
+
+      if ((byte & 0x80) == 0)
+      {
+        if (static_cast<uint64_t>(static_cast<size_t>(value)) != value)
+        {
+          break;
+        }
+        else
+        {
+          return static_cast<size_t>(value);
+        }
+      }
+    }
+
+    throw Orthanc::OrthancException(Orthanc::ErrorCode_BadFileFormat, "Bad part in an \"auto\" bucket");
+  }
+
+
+  static void WritePart(std::string& target,
+                        const BlockCompression::Segments& segments,
+                        bool compressible,
+                        int zstdLevel,
+                        CompressionDictionaries::Dictionary* dictionary)
+  {
+    size_t size = 0;
+    for (size_t i = 0; i < segments.size(); i++)
+    {
+      size += segments[i].second;
+    }
+
+    if (compressible &&
+        IsBucketCompressionSupported(BucketCompression_Zstd))
+    {
+      std::string compressed;
+      BlockCompression::Compress(compressed, segments, BucketCompression_Zstd, zstdLevel, dictionary);
+
+      // The sampling can be wrong: Don't send data that has grown
+      if (compressed.size() < size)
+      {
+        target.push_back(static_cast<char>(PART_ZSTD));
+        WriteVarint(target, size);
+        WriteVarint(target, compressed.size());
+        target.append(compressed);
+        return;
+      }
+    }
+
+    target.push_back(static_cast<char>(PART_NONE));
+    WriteVarint(target, size);
+    WriteVarint(target, size);
+
+    for (size_t i = 0; i < segments.size(); i++)
+    {
+      target.append(reinterpret_cast<const char*>(segments[i].first), segments[i].second);
+    }
+  }
+
+
+  void AutoCompression::Compress(std::string& target,
+                                 const BlockCompression::Segments& segments,
+                                 const std::vector<bool>& compressible,
+                                 int zstdLevel,
+                                 CompressionDictionaries::Dictionary* dictionary)
+  {
+    if (segments.size() != compressible.size())
+    {
+      throw Orthanc::OrthancException(Orthanc::ErrorCode_ParameterOutOfRange);
+    }
+
+    target.clear();
+
+    size_t start = 0;
+    while (start < segments.size())
+    {
+      size_t end = start + 1;
+      while (end < segments.size() &&
+             compressible[end] == compressible[start])
+      {
+        end++;
+      }
+
+      BlockCompression::Segments part(segments.begin() + start, segments.begin() + end);
+      WritePart(target, part, compressible[start], zstdLevel, dictionary);
+
+      start = end;
+    }
+  }
+
+
+  void AutoCompression::Uncompress(std::string& target,
+                                   const void* data,
+                                   size_t size,
+                                   size_t uncompressedSize)
+  {
+    target.resize(uncompressedSize);
+
+    const uint8_t* current = reinterpret_cast<const uint8_t*>(data);
+    const uint8_t* end = current + size;
+
+    size_t pos = 0;
+    while (current != end)
+    {
+      const uint8_t method = *(current++);
+      const size_t partSize = ReadVarint(current, end);
+      const size_t payloadSize = ReadVarint(current, end);
+
+      if (partSize > uncompressedSize - pos ||
+          payloadSize > static_cast<size_t>(end - current))
+      {
+        throw Orthanc::OrthancException(Orthanc::ErrorCode_BadFileFormat, "Bad part in an \"auto\" bucket");
+      }
+
+      switch (method)
+      {
+        case PART_NONE:
+          if (payloadSize != partSize)
+          {
+            throw Orthanc::OrthancException(Orthanc::ErrorCode_BadFileFormat, "Bad part in an \"auto\" bucket");
+          }
+
+          if (partSize > 0)
+          {
+            memcpy(&target[pos], current, partSize);
+          }
+          break;
+
+        case PART_GZIP:
+        case PART_ZSTD:
+        {
+          std::string part;
+          BlockCompression::Uncompress(part, current, payloadSize, partSize,
+                                       method == PART_GZIP ? BucketCompression_Gzip : BucketCompression_Zstd);
+
+          if (part.size() != partSize)
+          {
+            throw Orthanc::OrthancException(Orthanc::ErrorCode_BadFileFormat, "Bad part in an \"auto\" bucket");
+          }
+
+          if (partSize > 0)
+          {
+            memcpy(&target[pos], part.c_str(), partSize);
+          }
+          break;
+        }
+
+        default:
+          throw Orthanc::OrthancException(Orthanc::ErrorCode_BadFileFormat, "Bad part in an \"auto\" bucket");
+      }
+
+      current += payloadSize;
+      pos += partSize;
+    }
+
+    if (pos != uncompressedSize)
+    {
+      throw Orthanc::OrthancException(Orthanc::ErrorCode_BadFileFormat, "Bad size of an \"auto\" bucket");
+    }
+  }
+}
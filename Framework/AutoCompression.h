@@ -0,0 +1,79 @@
+/**
+ * Transfers accelerator plugin for Orthanc
+ * Copyright (C) 2018-2023 Osimis S.A., Belgium
+ * Copyright (C) 2024-2026 Orthanc Team SRL, Belgium
+ * Copyright (C) 2021-2026 Sebastien Jodogne, ICTEAM UCLouvain, Belgium
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU Affero General Public License
+ * as published by the Free Software Foundation, either version 3 of
+ * the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Affero General Public License for more details.
+ * 
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ **/
+
+
+
+#pragma once
+
+#include "BlockCompression.h"
+
+#include <string>
+#include <vector>
+
+namespace OrthancPlugins
+{
+  /**
+   * "auto" compression of the buckets: The bucket is a sequence of
+   * parts that are either sent raw or compressed with zstd, so that no
+   * CPU is spent on the DICOM instances whose pixel data is already
+   * compressed (JPEG, JPEG 2000, JPEG-LS, RLE...). Each part is made
+   * of one byte for its compression method (0 for none, 1 for gzip, 2
+   * for zstd, as in the binary manifest), the varint of its
+   * uncompressed size, the varint of the size of its payload, and the
+   * payload itself.
+   **/
+  class AutoCompression : public boost::noncopyable
+  {
+  public:
+    // Reads the transfer syntax from the meta-information header at
+    // the beginning of a DICOM file (PS3.10, section 7.1)
+    static bool LookupTransferSyntax(std::string& target,
+                                     const void* dicom,
+                                     size_t size);
+
+    static bool IsCompressedTransferSyntax(const std::string& transferSyntax);
+
+    // Estimates whether compressing the data is worth it, by
+    // compressing a sample at the fastest level
+    static bool IsCompressible(const void* data,
+                               size_t size);
+
+    // The consecutive segments that share the same flag are grouped
+    // into a single part. The dictionary can be NULL.
+    static void Compress(std::string& target,
+                         const BlockCompression::Segments& segments,
+                         const std::vector<bool>& compressible,
+                         int zstdLevel,
+                         CompressionDictionaries::Dictionary* dictionary);
+
+    static void Compress(std::string& target,
+                         const BlockCompression::Segments& segments,
+                         const std::vector<bool>& compressible,
+                         int zstdLevel)
+    {
+      Compress(target, segments, compressible, zstdLevel, NULL);
+    }
+
+    static void Uncompress(std::string& target,
+                           const void* data,
+                           size_t size,
+                           size_t uncompressedSize);
+  };
+}
@@ -0,0 +1,962 @@
+/**
+ * Transfers accelerator plugin for Orthanc
+ * Copyright (C) 2018-2023 Osimis S.A., Belgium
+ * Copyright (C) 2024-2026 Orthanc Team SRL, Belgium
+ * Copyright (C) 2021-2026 Sebastien Jodogne, ICTEAM UCLouvain, Belgium
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU Affero General Public License
+ * as published by the Free Software Foundation, either version 3 of
+ * the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Affero General Public License for more details.
+ * 
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ **/
+
+
+
+#include "BlockCompression.h"
+
+#include <Compatibility.h>  // For std::unique_ptr
+#include <Compression/GzipCompressor.h>
+#include <OrthancException.h>
+
+#include <algorithm>
+#include <boost/lexical_cast.hpp>
+#include <boost/thread/mutex.hpp>
+#include <limits>
+#include <string.h>
+#include <zlib.h>
+
+#if ORTHANC_TRANSFERS_ENABLE_ZSTD == 1
+#  include <zstd.h>
+#endif
+
+
+namespace OrthancPlugins
+{
+  static boost::mutex           configurationMutex;
+  static CompressionThreadPool* compressionPool = NULL;
+  static size_t                 compressionBlockSize = 0;
+
+  // Identifier of the subfield of the gzip header that stores the
+  // (compressed, uncompressed) sizes of the blocks
+  static const uint8_t GZIP_SUBFIELD_ID1 = 'O';
+  static const uint8_t GZIP_SUBFIELD_ID2 = 'T';
+
+  // The extra field of the gzip header is limited to 64KB, and each
+  // block takes 8 bytes in the index
+  static const size_t MAX_GZIP_BLOCKS = (65535 - 4) / 8;
+
+  static const size_t GZIP_HEADER_SIZE = 10;
+  static const size_t GZIP_TRAILER_SIZE = 8;
+
+
+  class BlocksCollection : public boost::noncopyable
+  {
+  private:
+    std::vector<CompressionThreadPool::ITask*>  tasks_;
+
+  public:
+    ~BlocksCollection()
+    {
+      for (size_t i = 0; i < tasks_.size(); i++)
+      {
+        assert(tasks_[i] != NULL);
+        delete tasks_[i];
+      }
+    }
+
+    void Add(CompressionThreadPool::ITask* task)  // Takes ownership
+    {
+      if (task == NULL)
+      {
+        throw Orthanc::OrthancException(Orthanc::ErrorCode_NullPointer);
+      }
+      else
+      {
+        tasks_.push_back(task);
+      }
+    }
+
+    size_t GetSize() const
+    {
+      return tasks_.size();
+    }
+
+    template <typename T>
+    T& GetBlock(size_t index) const
+    {
+      assert(index < tasks_.size());
+      return dynamic_cast<T&>(*tasks_[index]);
+    }
+
+    void Run()
+    {
+      CompressionThreadPool* pool;
+
+      {
+        boost::mutex::scoped_lock lock(configurationMutex);
+        pool = compressionPool;
+      }
+
+      CompressionThreadPool::Run(pool, tasks_);
+    }
+  };
+
+
+  static size_t ComputeSize(const BlockCompression::Segments& segments)
+  {
+    size_t size = 0;
+
+    for (size_t i = 0; i < segments.size(); i++)
+    {
+      size += segments[i].second;
+    }
+
+    return size;
+  }
+
+
+  // Extracts the range [offset, offset + size) out of the
+  // concatenation of the segments, without copying the data
+  static void ExtractRange(BlockCompression::Segments& target,
+                           const BlockCompression::Segments& segments,
+                           size_t offset,
+                           size_t size)
+  {
+    target.clear();
+
+    size_t start = 0;  // Offset of the current segment in the concatenation
+
+    for (size_t i = 0; i < segments.size() && size > 0; i++)
+    {
+      const size_t end = start + segments[i].second;
+
+      if (offset < end)
+      {
+        const size_t skip = offset - start;
+        const size_t count = std::min(size, segments[i].second - skip);
+
+        target.push_back(std::make_pair(reinterpret_cast<const uint8_t*>(segments[i].first) + skip, count));
+        offset += count;
+        size -= count;
+      }
+
+      start = end;
+    }
+
+    if (size != 0)
+    {
+      throw Orthanc::OrthancException(Orthanc::ErrorCode_ParameterOutOfRange);
+    }
+  }
+
+
+  static void CheckZlibSize(size_t size)
+  {
+    if (size > static_cast<size_t>(std::numeric_limits<uInt>::max()))
+    {
+      throw Orthanc::OrthancException(Orthanc::ErrorCode_NotEnoughMemory);
+    }
+  }
+
+
+  static uint32_t ComputeCrc32(const BlockCompression::Segments& segments)
+  {
+    uLong crc = crc32(0L, Z_NULL, 0);
+
+    for (size_t i = 0; i < segments.size(); i++)
+    {
+      CheckZlibSize(segments[i].second);
+      crc = crc32(crc, reinterpret_cast<const Bytef*>(segments[i].first), static_cast<uInt>(segments[i].second));
+    }
+
+    return static_cast<uint32_t>(crc);
+  }
+
+
+  /**
+   * If "windowBits" is "MAX_WBITS + 16", the output is a complete
+   * gzip member, with the same format as "Orthanc::GzipCompressor".
+   * If "windowBits" is "-MAX_WBITS", the output is raw deflate data
+   * that is terminated either by the last block of the stream (if
+   * "last" is true), or by a "sync flush" marker that ends on a
+   * byte boundary, so that another deflate stream can follow.
+   **/
+  static void Deflate(std::string& target,
+                      const BlockCompression::Segments& segments,
+                      size_t size,
+                      int level,
+                      int windowBits,
+                      bool last)
+  {
+    z_stream stream;
+    memset(&stream, 0, sizeof(stream));
+
+    if (deflateInit2(&stream, (level == 0 ? Z_DEFAULT_COMPRESSION : level), Z_DEFLATED,
+                     windowBits, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+    {
+      throw Orthanc::OrthancException(Orthanc::ErrorCode_InternalError);
+    }
+
+    try
+    {
+      // Some room is added for the "sync flush" marker (5 bytes)
+      target.resize(deflateBound(&stream, static_cast<uLong>(size)) + 16);
+
+      stream.next_out = reinterpret_cast<Bytef*>(&target[0]);
+      stream.avail_out = static_cast<uInt>(target.size());
+
+      for (size_t i = 0; i <= segments.size(); i++)
+      {
+        int flush;
+
+        if (i == segments.size())
+        {
+          stream.next_in = NULL;
+          stream.avail_in = 0;
+          flush = (last ? Z_FINISH : Z_SYNC_FLUSH);
+        }
+        else
+        {
+          CheckZlibSize(segments[i].second);
+          stream.next_in = reinterpret_cast<Bytef*>(const_cast<void*>(segments[i].first));
+          stream.avail_in = static_cast<uInt>(segments[i].second);
+          flush = Z_NO_FLUSH;
+        }
+
+        // The output buffer is large enough, as given by "deflateBound()"
+        int error = deflate(&stream, flush);
+
+        if ((flush == Z_FINISH && error != Z_STREAM_END) ||
+            (flush != Z_FINISH && error != Z_OK) ||
+            stream.avail_in != 0 ||
+            stream.avail_out == 0)
+        {
+          throw Orthanc::OrthancException(Orthanc::ErrorCode_InternalError);
+        }
+      }
+
+      target.resize(stream.total_out);
+      deflateEnd(&stream);
+    }
+    catch (Orthanc::OrthancException&)
+    {
+      deflateEnd(&stream);
+      throw;
+    }
+  }
+
+
+#if ORTHANC_TRANSFERS_ENABLE_ZSTD == 1
+  static void CompressZstdFrame(std::string& target,
+                                const BlockCompression::Segments& segments,
+                                size_t size,
+                                int level,
+                                CompressionDictionaries::Dictionary* dictionary)
+  {
+    ZSTD_CCtx* context = ZSTD_createCCtx();
+    if (context == NULL)
+    {
+      throw Orthanc::OrthancException(Orthanc::ErrorCode_NotEnoughMemory);
+    }
+
+    try
+    {
+      // The size of the content is written in the frame header, so
+      // that the receiver can check it before uncompressing
+      if (ZSTD_isError(ZSTD_CCtx_setParameter(context, ZSTD_c_compressionLevel, level)) ||
+          ZSTD_isError(ZSTD_CCtx_setPledgedSrcSize(context, size)))
+      {
+        throw Orthanc::OrthancException(Orthanc::ErrorCode_InternalError);
+      }
+
+      // The ID of the dictionary is written in the frame header
+      if (dictionary != NULL &&
+          ZSTD_isError(ZSTD_CCtx_refCDict(context, dictionary->GetCompressionDictionary(level))))
+      {
+        throw Orthanc::OrthancException(Orthanc::ErrorCode_InternalError);
+      }
+
+      target.resize(ZSTD_compressBound(size));
+
+      ZSTD_outBuffer output;
+      output.dst = target.empty() ? NULL : &target[0];
+      output.size = target.size();
+      output.pos = 0;
+
+      for (size_t i = 0; i <= segments.size(); i++)
+      {
+        ZSTD_inBuffer input;
+        ZSTD_EndDirective mode;
+
+        if (i == segments.size())
+        {
+          input.src = NULL;
+          input.size = 0;
+          mode = ZSTD_e_end;
+        }
+        else
+        {
+          input.src = segments[i].first;
+          input.size = segments[i].second;
+          mode = ZSTD_e_continue;
+        }
+
+        input.pos = 0;
+
+        // The output buffer is large enough, as given by
+        // "ZSTD_compressBound()", so each call makes progress
+        for (;;)
+        {
+          size_t remaining = ZSTD_compressStream2(context, &output, &input, mode);
+
+          if (ZSTD_isError(remaining))
+          {
+            throw Orthanc::OrthancException(Orthanc::ErrorCode_InternalError,
+                                            std::string("Cannot compress with zstd: ") + ZSTD_getErrorName(remaining));
+          }
+          else if ((mode == ZSTD_e_end && remaining == 0) ||
+                   (mode == ZSTD_e_continue && input.pos == input.size))
+          {
+            break;
+          }
+          else if (output.pos == output.size)
+          {
+            throw Orthanc::OrthancException(Orthanc::ErrorCode_InternalError);
+          }
+        }
+      }
+
+      target.resize(output.pos);
+      ZSTD_freeCCtx(context);
+    }
+    catch (Orthanc::OrthancException&)
+    {
+      ZSTD_freeCCtx(context);
+      throw;
+    }
+  }
+
+
+  // Uncompresses one or more frames, with the dictionary whose ID is
+  // given by the header of the first frame, if any
+  static size_t UncompressZstdFrames(void* target,
+                                     size_t targetSize,
+                                     const void* source,
+                                     size_t sourceSize)
+  {
+    const uint32_t id = ZSTD_getDictID_fromFrame(source, sourceSize);
+
+    if (id == 0)
+    {
+      return ZSTD_decompress(target, targetSize, source, sourceSize);
+    }
+
+    CompressionDictionaries::DictionaryPtr dictionary = CompressionDictionaries::Lookup(id);
+    if (dictionary.get() == NULL)
+    {
+      throw Orthanc::OrthancException(Orthanc::ErrorCode_UnknownResource,
+                                      "Unknown compression dictionary: " + boost::lexical_cast<std::string>(id));
+    }
+
+    ZSTD_DCtx* context = ZSTD_createDCtx();
+    if (context == NULL)
+    {
+      throw Orthanc::OrthancException(Orthanc::ErrorCode_NotEnoughMemory);
+    }
+
+    size_t result = ZSTD_decompress_usingDDict(context, target, targetSize, source, sourceSize,
+                                               dictionary->GetDecompressionDictionary());
+    ZSTD_freeDCtx(context);
+
+    return result;
+  }
+#endif
+
+
+  namespace
+  {
+    class CompressBlock : public CompressionThreadPool::ITask
+    {
+    private:
+      BlockCompression::Segments  segments_;
+      size_t                      size_;
+      BucketCompression           compression_;
+      int                         level_;
+      CompressionDictionaries::Dictionary*  dictionary_;
+      bool                        last_;
+      std::string                 compressed_;
+      uint32_t                    crc32_;
+
+    public:
+      CompressBlock(const BlockCompression::Segments& segments,
+                    size_t offset,
+                    size_t size,
+                    BucketCompression compression,
+                    int level,
+                    CompressionDictionaries::Dictionary* dictionary,
+                    bool last) :
+        size_(size),
+        compression_(compression),
+        level_(level),
+        dictionary_(dictionary),
+        last_(last),
+        crc32_(0)
+      {
+        ExtractRange(segments_, segments, offset, size);
+      }
+
+      virtual void Apply() ORTHANC_OVERRIDE
+      {
+        switch (compression_)
+        {
+          case BucketCompression_Gzip:
+            Deflate(compressed_, segments_, size_, level_, -MAX_WBITS, last_);
+            crc32_ = ComputeCrc32(segments_);
+            break;
+
+#if ORTHANC_TRANSFERS_ENABLE_ZSTD == 1
+          case BucketCompression_Zstd:
+            CompressZstdFrame(compressed_, segments_, size_, level_, dictionary_);
+            break;
+#endif
+
+          default:
+            throw Orthanc::OrthancException(Orthanc::ErrorCode_ParameterOutOfRange);
+        }
+      }
+
+      size_t GetSize() const
+      {
+        return size_;
+      }
+
+      const std::string& GetCompressed() const
+      {
+        return compressed_;
+      }
+
+      uint32_t GetCrc32() const
+      {
+        return crc32_;
+      }
+    };
+
+
+    class UncompressBlock : public CompressionThreadPool::ITask
+    {
+    private:
+      BucketCompression  compression_;
+      const uint8_t*     source_;
+      size_t             sourceSize_;
+      uint8_t*           target_;
+      size_t             targetSize_;
+      bool               last_;
+      uint32_t           crc32_;
+
+      void Inflate()
+      {
+        CheckZlibSize(sourceSize_);
+        CheckZlibSize(targetSize_);
+
+        z_stream stream;
+        memset(&stream, 0, sizeof(stream));
+
+        if (inflateInit2(&stream, -MAX_WBITS) != Z_OK)
+        {
+          throw Orthanc::OrthancException(Orthanc::ErrorCode_InternalError);
+        }
+
+        stream.next_in = const_cast<Bytef*>(source_);
+        stream.avail_in = static_cast<uInt>(sourceSize_);
+        stream.next_out = target_;
+        stream.avail_out = static_cast<uInt>(targetSize_);
+
+        int error = inflate(&stream, Z_SYNC_FLUSH);
+        inflateEnd(&stream);
+
+        // Only the last block contains the end of the deflate stream
+        if (stream.avail_in != 0 ||
+            stream.avail_out != 0 ||
+            (last_ && error != Z_STREAM_END) ||
+            (!last_ && error != Z_OK && error != Z_BUF_ERROR))
+        {
+          throw Orthanc::OrthancException(Orthanc::ErrorCode_BadFileFormat,
+                                          "Cannot uncompress a block of a bucket with gzip");
+        }
+
+        crc32_ = static_cast<uint32_t>(crc32(crc32(0L, Z_NULL, 0), target_, static_cast<uInt>(targetSize_)));
+      }
+
+    public:
+      UncompressBlock(BucketCompression compression,
+                      const uint8_t* source,
+                      size_t sourceSize,
+                      uint8_t* target,
+                      size_t targetSize,
+                      bool last) :
+        compression_(compression),
+        source_(source),
+        sourceSize_(sourceSize),
+        target_(target),
+        targetSize_(targetSize),
+        last_(last),
+        crc32_(0)
+      {
+      }
+
+      virtual void Apply() ORTHANC_OVERRIDE
+      {
+        switch (compression_)
+        {
+          case BucketCompression_Gzip:
+            Inflate();
+            break;
+
+#if ORTHANC_TRANSFERS_ENABLE_ZSTD == 1
+          case BucketCompression_Zstd:
+          {
+            size_t result = UncompressZstdFrames(target_, targetSize_, source_, sourceSize_);
+            if (ZSTD_isError(result) ||
+                result != targetSize_)
+            {
+              throw Orthanc::OrthancException(Orthanc::ErrorCode_BadFileFormat,
+                                              "Cannot uncompress a block of a bucket with zstd");
+            }
+            break;
+          }
+#endif
+
+          default:
+            throw Orthanc::OrthancException(Orthanc::ErrorCode_ParameterOutOfRange);
+        }
+      }
+
+      size_t GetSize() const
+      {
+        return targetSize_;
+      }
+
+      uint32_t GetCrc32() const
+      {
+        return crc32_;
+      }
+    };
+  }
+
+
+  static void WriteUInt16(std::string& target,
+                          size_t value)
+  {
+    assert(value <= 0xffffu);
+    target.push_back(static_cast<char>(value & 0xff));
+    target.push_back(static_cast<char>((value >> 8) & 0xff));
+  }
+
+
+  static void WriteUInt32(std::string& target,
+                          uint32_t value)
+  {
+    for (unsigned int i = 0; i < 4; i++)
+    {
+      target.push_back(static_cast<char>((value >> (8 * i)) & 0xff));
+    }
+  }
+
+
+  static uint32_t ReadUInt32(const uint8_t* data)
+  {
+    return (static_cast<uint32_t>(data[0]) |
+            (static_cast<uint32_t>(data[1]) << 8) |
+            (static_cast<uint32_t>(data[2]) << 16) |
+            (static_cast<uint32_t>(data[3]) << 24));
+  }
+
+
+  static void CheckBlockSize(size_t size)
+  {
+    if (static_cast<uint64_t>(size) > static_cast<uint64_t>(std::numeric_limits<uint32_t>::max()))
+    {
+      throw Orthanc::OrthancException(Orthanc::ErrorCode_NotEnoughMemory);
+    }
+  }
+
+
+  static void WriteGzipBlocks(std::string& target,
+                              const BlocksCollection& blocks)
+  {
+    size_t compressedSize = 0;
+    for (size_t i = 0; i < blocks.GetSize(); i++)
+    {
+      compressedSize += blocks.GetBlock<CompressBlock>(i).GetCompressed().size();
+    }
+
+    const size_t indexSize = 8 * blocks.GetSize();
+
+    target.clear();
+    target.reserve(GZIP_HEADER_SIZE + 2 + 4 + indexSize + compressedSize + GZIP_TRAILER_SIZE);
+
+    // Header of the gzip member, with the FEXTRA flag (no timestamp,
+    // unknown operating system)
+    static const uint8_t HEADER[GZIP_HEADER_SIZE] = { 0x1f, 0x8b, 0x08, 0x04, 0, 0, 0, 0, 0, 0xff };
+    target.append(reinterpret_cast<const char*>(HEADER), GZIP_HEADER_SIZE);
+
+    WriteUInt16(target, 4 + indexSize);  // XLEN
+    target.push_back(static_cast<char>(GZIP_SUBFIELD_ID1));
+    target.push_back(static_cast<char>(GZIP_SUBFIELD_ID2));
+    WriteUInt16(target, indexSize);
+
+    for (size_t i = 0; i < blocks.GetSize(); i++)
+    {
+      const CompressBlock& block = blocks.GetBlock<CompressBlock>(i);
+      CheckBlockSize(block.GetCompressed().size());
+      WriteUInt32(target, static_cast<uint32_t>(block.GetCompressed().size()));
+      WriteUInt32(target, static_cast<uint32_t>(block.GetSize()));
+    }
+
+    uLong crc = crc32(0L, Z_NULL, 0);
+    uint32_t totalSize = 0;
+
+    for (size_t i = 0; i < blocks.GetSize(); i++)
+    {
+      const CompressBlock& block = blocks.GetBlock<CompressBlock>(i);
+      target.append(block.GetCompressed());
+      crc = crc32_combine(crc, block.GetCrc32(), static_cast<z_off_t>(block.GetSize()));
+      totalSize += static_cast<uint32_t>(block.GetSize());  // ISIZE is modulo 2^32
+    }
+
+    WriteUInt32(target, static_cast<uint32_t>(crc));
+    WriteUInt32(target, totalSize);
+  }
+
+
+  void BlockCompression::Configure(CompressionThreadPool* pool,
+                                   size_t blockSize)
+  {
+    boost::mutex::scoped_lock lock(configurationMutex);
+    compressionPool = pool;
+    compressionBlockSize = blockSize;
+  }
+
+
+  size_t BlockCompression::GetBlockSize()
+  {
+    boost::mutex::scoped_lock lock(configurationMutex);
+    return compressionBlockSize;
+  }
+
+
+  void BlockCompression::Compress(std::string& target,
+                                  const Segments& segments,
+                                  BucketCompression compression,
+                                  int level,
+                                  CompressionDictionaries::Dictionary* dictionary)
+  {
+    const size_t size = ComputeSize(segments);
+
+    size_t blockSize = GetBlockSize();
+    if (blockSize == 0 ||
+        blockSize >= size)
+    {
+      blockSize = size;
+    }
+
+    if (compression == BucketCompression_Gzip &&
+        size > MAX_GZIP_BLOCKS * blockSize)
+    {
+      // Enlarge the blocks, so that their index fits in the gzip header
+      blockSize = (size + MAX_GZIP_BLOCKS - 1) / MAX_GZIP_BLOCKS;
+    }
+
+    CheckBlockSize(blockSize);
+
+    if (blockSize == size)
+    {
+      // Single block: Use the standard formats
+      switch (compression)
+      {
+        case BucketCompression_Gzip:
+          Deflate(target, segments, size, level, MAX_WBITS + 16 /* gzip wrapper */, true);
+          return;
+
+#if ORTHANC_TRANSFERS_ENABLE_ZSTD == 1
+        case BucketCompression_Zstd:
+          CompressZstdFrame(target, segments, size, level, dictionary);
+          return;
+#endif
+
+        default:
+          throw Orthanc::OrthancException(Orthanc::ErrorCode_ParameterOutOfRange);
+      }
+    }
+
+    BlocksCollection blocks;
+
+    for (size_t offset = 0; offset < size; offset += blockSize)
+    {
+      const size_t count = std::min(blockSize, size - offset);
+      blocks.Add(new CompressBlock(segments, offset, count, compression, level, dictionary, offset + count == size));
+    }
+
+    blocks.Run();
+
+    if (compression == BucketCompression_Gzip)
+    {
+      WriteGzipBlocks(target, blocks);
+    }
+    else
+    {
+      // Concatenation of zstd frames
+      target.clear();
+
+      for (size_t i = 0; i < blocks.GetSize(); i++)
+      {
+        target.append(blocks.GetBlock<CompressBlock>(i).GetCompressed());
+      }
+    }
+  }
+
+
+  /**
+   * Returns "false" if the gzip member does not contain the index of
+   * the blocks, in which case it must be uncompressed as a whole.
+   **/
+  static bool ParseGzipIndex(std::vector< std::pair<uint32_t, uint32_t> >& index,
+                             size_t& headerSize,
+                             const uint8_t* data,
+                             size_t size)
+  {
+    index.clear();
+
+    if (size < GZIP_HEADER_SIZE + 2 + GZIP_TRAILER_SIZE ||
+        data[0] != 0x1f ||
+        data[1] != 0x8b ||
+        data[2] != 0x08 ||
+        data[3] != 0x04 /* only FEXTRA */)
+    {
+      return false;
+    }
+
+    const size_t extraSize = static_cast<size_t>(data[10]) | (static_cast<size_t>(data[11]) << 8);
+
+    headerSize = GZIP_HEADER_SIZE + 2 + extraSize;
+    if (headerSize + GZIP_TRAILER_SIZE > size)
+    {
+      return false;
+    }
+
+    size_t pos = GZIP_HEADER_SIZE + 2;
+    while (pos + 4 <= headerSize)
+    {
+      const size_t length = static_cast<size_t>(data[pos + 2]) | (static_cast<size_t>(data[pos + 3]) << 8);
+      if (pos + 4 + length > headerSize)
+      {
+        return false;
+      }
+
+      if (data[pos] == GZIP_SUBFIELD_ID1 &&
+          data[pos + 1] == GZIP_SUBFIELD_ID2)
+      {
+        if (length == 0 ||
+            length % 8 != 0)
+        {
+          throw Orthanc::OrthancException(Orthanc::ErrorCode_BadFileFormat,
+                                          "Bad index of the blocks in a gzip bucket");
+        }
+
+        for (size_t i = 0; i < length; i += 8)
+        {
+          index.push_back(std::make_pair(ReadUInt32(data + pos + 4 + i),
+                                         ReadUInt32(data + pos + 4 + i + 4)));
+        }
+
+        return true;
+      }
+
+      pos += 4 + length;
+    }
+
+    return false;
+  }
+
+
+  static void UncompressGzip(std::string& target,
+                             const uint8_t* data,
+                             size_t size,
+                             size_t uncompressedSize)
+  {
+    std::vector< std::pair<uint32_t, uint32_t> > index;
+    size_t headerSize;
+
+    if (!ParseGzipIndex(index, headerSize, data, size))
+    {
+      Orthanc::GzipCompressor compressor;
+      compressor.Uncompress(target, data, size);
+      return;
+    }
+
+    uint64_t compressedSize = 0;
+    uint64_t totalSize = 0;
+
+    for (size_t i = 0; i < index.size(); i++)
+    {
+      compressedSize += index[i].first;
+      totalSize += index[i].second;
+    }
+
+    if (compressedSize != static_cast<uint64_t>(size - headerSize - GZIP_TRAILER_SIZE) ||
+        totalSize != static_cast<uint64_t>(uncompressedSize))
+    {
+      throw Orthanc::OrthancException(Orthanc::ErrorCode_BadFileFormat,
+                                      "Inconsistent index of the blocks in a gzip bucket");
+    }
+
+    target.resize(uncompressedSize);
+
+    BlocksCollection blocks;
+
+    {
+      size_t sourcePos = headerSize;
+      size_t targetPos = 0;
+
+      for (size_t i = 0; i < index.size(); i++)
+      {
+        blocks.Add(new UncompressBlock(BucketCompression_Gzip, data + sourcePos, index[i].first,
+                                       target.empty() ? NULL : reinterpret_cast<uint8_t*>(&target[targetPos]),
+                                       index[i].second, i + 1 == index.size()));
+        sourcePos += index[i].first;
+        targetPos += index[i].second;
+      }
+    }
+
+    blocks.Run();
+
+    uLong crc = crc32(0L, Z_NULL, 0);
+    for (size_t i = 0; i < blocks.GetSize(); i++)
+    {
+      const UncompressBlock& block = blocks.GetBlock<UncompressBlock>(i);
+      crc = crc32_combine(crc, block.GetCrc32(), static_cast<z_off_t>(block.GetSize()));
+    }
+
+    const uint8_t* trailer = data + size - GZIP_TRAILER_SIZE;
+    if (ReadUInt32(trailer) != static_cast<uint32_t>(crc) ||
+        ReadUInt32(trailer + 4) != static_cast<uint32_t>(uncompressedSize))
+    {
+      throw Orthanc::OrthancException(Orthanc::ErrorCode_BadFileFormat,
+                                      "Bad CRC32 in a gzip bucket");
+    }
+  }
+
+
+#if ORTHANC_TRANSFERS_ENABLE_ZSTD == 1
+  static void UncompressZstd(std::string& target,
+                             const uint8_t* data,
+                             size_t size,
+                             size_t uncompressedSize)
+  {
+    // List the frames, which are the blocks
+    std::vector< std::pair<size_t, size_t> > frames;
+    uint64_t totalSize = 0;
+    bool parallel = true;
+
+    for (size_t pos = 0; pos < size && parallel; )
+    {
+      const size_t compressed = ZSTD_findFrameCompressedSize(data + pos, size - pos);
+      const unsigned long long content = ZSTD_getFrameContentSize(data + pos, size - pos);
+
+      if (ZSTD_isError(compressed) ||
+          content == ZSTD_CONTENTSIZE_UNKNOWN ||
+          content == ZSTD_CONTENTSIZE_ERROR)
+      {
+        parallel = false;  // Let "ZSTD_decompress()" report the error, if any
+      }
+      else
+      {
+        frames.push_back(std::make_pair(compressed, static_cast<size_t>(content)));
+        totalSize += content;
+        pos += compressed;
+      }
+    }
+
+    if (!parallel ||
+        frames.size() <= 1)
+    {
+      // The size of the content is known from the bucket, which
+      // avoids trusting the frame header to allocate the buffer
+      target.resize(uncompressedSize);
+
+      size_t result = UncompressZstdFrames(target.empty() ? NULL : &target[0], target.size(), data, size);
+      if (ZSTD_isError(result))
+      {
+        throw Orthanc::OrthancException(Orthanc::ErrorCode_BadFileFormat,
+                                        std::string("Cannot uncompress a bucket with zstd: ") + ZSTD_getErrorName(result));
+      }
+
+      if (result != uncompressedSize)
+      {
+        throw Orthanc::OrthancException(Orthanc::ErrorCode_CorruptedFile,
+                                        "Bad size of a zstd bucket once uncompressed");
+      }
+
+      return;
+    }
+
+    if (totalSize != static_cast<uint64_t>(uncompressedSize))
+    {
+      throw Orthanc::OrthancException(Orthanc::ErrorCode_BadFileFormat,
+                                      "Inconsistent size of the frames in a zstd bucket");
+    }
+
+    target.resize(uncompressedSize);
+
+    BlocksCollection blocks;
+
+    {
+      size_t sourcePos = 0;
+      size_t targetPos = 0;
+
+      for (size_t i = 0; i < frames.size(); i++)
+      {
+        blocks.Add(new UncompressBlock(BucketCompression_Zstd, data + sourcePos, frames[i].first,
+                                       target.empty() ? NULL : reinterpret_cast<uint8_t*>(&target[targetPos]),
+                                       frames[i].second, i + 1 == frames.size()));
+        sourcePos += frames[i].first;
+        targetPos += frames[i].second;
+      }
+    }
+
+    blocks.Run();
+  }
+#endif
+
+
+  void BlockCompression::Uncompress(std::string& target,
+                                    const void* data,
+                                    size_t size,
+                                    size_t uncompressedSize,
+                                    BucketCompression compression)
+  {
+    switch (compression)
+    {
+      case BucketCompression_Gzip:
+        UncompressGzip(target, reinterpret_cast<const uint8_t*>(data), size, uncompressedSize);
+        break;
+
+#if ORTHANC_TRANSFERS_ENABLE_ZSTD == 1
+      case BucketCompression_Zstd:
+        UncompressZstd(target, reinterpret_cast<const uint8_t*>(data), size, uncompressedSize);
+        break;
+#endif
+
+      default:
+        throw Orthanc::OrthancException(Orthanc::ErrorCode_ParameterOutOfRange);
+    }
+  }
+}
@@ -0,0 +1,86 @@
+/**
+ * Transfers accelerator plugin for Orthanc
+ * Copyright (C) 2018-2023 Osimis S.A., Belgium
+ * Copyright (C) 2024-2026 Orthanc Team SRL, Belgium
+ * Copyright (C) 2021-2026 Sebastien Jodogne, ICTEAM UCLouvain, Belgium
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU Affero General Public License
+ * as published by the Free Software Foundation, either version 3 of
+ * the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Affero General Public License for more details.
+ * 
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ **/
+
+
+
+#pragma once
+
+#include "CompressionDictionaries.h"
+#include "CompressionThreadPool.h"
+#include "TransferToolbox.h"
+
+#include <string>
+#include <vector>
+
+namespace OrthancPlugins
+{
+  /**
+   * Compression of the large buckets as a sequence of blocks that
+   * are compressed independently of each other, which allows both
+   * the sender and the receiver to process the blocks in parallel.
+   *
+   * The output remains readable by the receivers that do not know
+   * about the blocks. With zstd, the bucket is a concatenation of
+   * frames. With gzip, the bucket is a single gzip member whose
+   * raw deflate blocks are separated by a "sync flush" (as in pigz),
+   * and the size of each block is stored in an "OT" subfield of the
+   * extra field of the gzip header (RFC 1952, section 2.3.1.1).
+   **/
+  class BlockCompression : public boost::noncopyable
+  {
+  public:
+    typedef std::vector< std::pair<const void*, size_t> >  Segments;
+
+    // Shared by all the transfers. The pool can be NULL, in which
+    // case the blocks are processed by the calling thread. A block
+    // size of zero disables the splitting into blocks.
+    static void Configure(CompressionThreadPool* pool,
+                          size_t blockSize);
+
+    static size_t GetBlockSize();
+
+    // The segments are compressed one after the other, as if they
+    // were concatenated. A level of zero selects the default level of
+    // the compression method. The dictionary can be NULL, and is
+    // only used by zstd.
+    static void Compress(std::string& target,
+                         const Segments& segments,
+                         BucketCompression compression,
+                         int level,
+                         CompressionDictionaries::Dictionary* dictionary);
+
+    static void Compress(std::string& target,
+                         const Segments& segments,
+                         BucketCompression compression,
+                         int level)
+    {
+      Compress(target, segments, compression, level, NULL);
+    }
+
+    // The zstd frames that were compressed with a dictionary are
+    // uncompressed with the registered dictionary of the same ID
+
+    static void Uncompress(std::string& target,
+                           const void* data,
+                           size_t size,
+                           size_t uncompressedSize,
+                           BucketCompression compression);
+  };
+}
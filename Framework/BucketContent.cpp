@@ -0,0 +1,215 @@
+/**
+ * Transfers accelerator plugin for Orthanc
+ * Copyright (C) 2018-2023 Osimis S.A., Belgium
+ * Copyright (C) 2024-2026 Orthanc Team SRL, Belgium
+ * Copyright (C) 2021-2026 Sebastien Jodogne, ICTEAM UCLouvain, Belgium
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU Affero General Public License
+ * as published by the Free Software Foundation, either version 3 of
+ * the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Affero General Public License for more details.
+ * 
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ **/
+
+
+
+
+#include "BucketContent.h"
+
+#include "AutoCompression.h"
+
+#include <OrthancException.h>
+
+#include <boost/lexical_cast.hpp>
+#include <string.h>
+
+#if ORTHANC_TRANSFERS_ENABLE_ZSTD == 1
+#  include <zstd.h>
+#endif
+
+
+namespace OrthancPlugins
+{
+  static int zstdLevel = 3;  // Default level of the zstd command-line tool
+
+  // Above this average size of the slices, the gain of a dictionary
+  // is negligible with respect to the size of the frames
+  static const size_t MAX_DICTIONARY_SLICE_SIZE = 256 * 1024;
+
+
+  BucketContent::Slice::Slice(const boost::shared_ptr<SourceDicomInstance>& instance,
+                              size_t offset,
+                              size_t size) :
+    instance_(instance),
+    offset_(offset),
+    size_(size)
+  {
+    if (instance.get() == NULL)
+    {
+      throw Orthanc::OrthancException(Orthanc::ErrorCode_NullPointer);
+    }
+
+    if (offset + size > instance->GetInfo().GetSize())
+    {
+      throw Orthanc::OrthancException(Orthanc::ErrorCode_ParameterOutOfRange);
+    }
+  }
+
+
+  const void* BucketContent::Slice::GetData() const
+  {
+    return reinterpret_cast<const uint8_t*>(instance_->GetBuffer()) + offset_;
+  }
+
+
+  void BucketContent::AddSlice(const boost::shared_ptr<SourceDicomInstance>& instance,
+                               size_t offset,
+                               size_t size)
+  {
+    if (size != 0)
+    {
+      slices_.push_back(Slice(instance, offset, size));
+      size_ += size;
+    }
+  }
+
+
+  const BucketContent::Slice& BucketContent::GetSlice(size_t index) const
+  {
+    if (index >= slices_.size())
+    {
+      throw Orthanc::OrthancException(Orthanc::ErrorCode_ParameterOutOfRange);
+    }
+    else
+    {
+      return slices_[index];
+    }
+  }
+
+
+  void BucketContent::Flatten(std::string& target) const
+  {
+    target.resize(size_);
+
+    size_t pos = 0;
+    for (size_t i = 0; i < slices_.size(); i++)
+    {
+      memcpy(&target[pos], slices_[i].GetData(), slices_[i].GetSize());
+      pos += slices_[i].GetSize();
+    }
+
+    assert(pos == size_);
+  }
+
+
+  bool BucketContent::IsMadeOfSmallInstances() const
+  {
+    return (!slices_.empty() &&
+            size_ / slices_.size() <= MAX_DICTIONARY_SLICE_SIZE);
+  }
+
+
+  void BucketContent::Compress(std::string& target,
+                               BucketCompression compression,
+                               int level,
+                               CompressionDictionaries::Dictionary* dictionary) const
+  {
+    if (level == 0 &&
+        (compression == BucketCompression_Zstd ||
+         compression == BucketCompression_Auto))
+    {
+      level = zstdLevel;
+    }
+
+    if (compression == BucketCompression_Gzip ||
+        !IsMadeOfSmallInstances())
+    {
+      dictionary = NULL;
+    }
+
+    switch (compression)
+    {
+      case BucketCompression_None:
+        Flatten(target);
+        break;
+
+      case BucketCompression_Gzip:
+      case BucketCompression_Zstd:
+      {
+        BlockCompression::Segments segments;
+        segments.reserve(slices_.size());
+
+        for (size_t i = 0; i < slices_.size(); i++)
+        {
+          segments.push_back(std::make_pair(slices_[i].GetData(), slices_[i].GetSize()));
+        }
+
+        BlockCompression::Compress(target, segments, compression, level, dictionary);
+        break;
+      }
+
+      case BucketCompression_Auto:
+      {
+        BlockCompression::Segments segments;
+        std::vector<bool> compressible;
+        segments.reserve(slices_.size());
+        compressible.reserve(slices_.size());
+
+        for (size_t i = 0; i < slices_.size(); i++)
+        {
+          segments.push_back(std::make_pair(slices_[i].GetData(), slices_[i].GetSize()));
+
+          // The transfer syntax is only available if the slice comes
+          // from a whole instance, or from its first page
+          const SourceDicomInstance& instance = slices_[i].GetInstance();
+
+          std::string transferSyntax;
+          if (AutoCompression::LookupTransferSyntax(transferSyntax, instance.GetBuffer(), instance.GetInfo().GetSize()))
+          {
+            compressible.push_back(!AutoCompression::IsCompressedTransferSyntax(transferSyntax));
+          }
+          else
+          {
+            compressible.push_back(AutoCompression::IsCompressible(slices_[i].GetData(), slices_[i].GetSize()));
+          }
+        }
+
+        AutoCompression::Compress(target, segments, compressible, level, dictionary);
+        break;
+      }
+
+      default:
+        throw Orthanc::OrthancException(Orthanc::ErrorCode_ParameterOutOfRange);
+    }
+  }
+
+
+  void BucketContent::SetZstdLevel(int level)
+  {
+#if ORTHANC_TRANSFERS_ENABLE_ZSTD == 1
+    if (level < ZSTD_minCLevel() ||
+        level > ZSTD_maxCLevel())
+    {
+      throw Orthanc::OrthancException(Orthanc::ErrorCode_ParameterOutOfRange,
+                                      "The zstd compression level must be between " +
+                                      boost::lexical_cast<std::string>(ZSTD_minCLevel()) + " and " +
+                                      boost::lexical_cast<std::string>(ZSTD_maxCLevel()));
+    }
+#endif
+
+    zstdLevel = level;
+  }
+
+
+  int BucketContent::GetZstdLevel()
+  {
+    return zstdLevel;
+  }
+}
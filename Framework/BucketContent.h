@@ -0,0 +1,133 @@
+/**
+ * Transfers accelerator plugin for Orthanc
+ * Copyright (C) 2018-2023 Osimis S.A., Belgium
+ * Copyright (C) 2024-2026 Orthanc Team SRL, Belgium
+ * Copyright (C) 2021-2026 Sebastien Jodogne, ICTEAM UCLouvain, Belgium
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU Affero General Public License
+ * as published by the Free Software Foundation, either version 3 of
+ * the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Affero General Public License for more details.
+ * 
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ **/
+
+
+
+
+#pragma once
+
+#include "CompressionDictionaries.h"
+#include "SourceDicomInstance.h"
+#include "TransferToolbox.h"
+
+#include <boost/shared_ptr.hpp>
+#include <vector>
+
+namespace OrthancPlugins
+{
+  /**
+   * Content of one bucket, as a list of read-only slices into the
+   * DICOM instances of the cache. The slices share the ownership of
+   * the instances, so that no data is copied until the bucket is
+   * actually sent, even if the instances are evicted in the meantime.
+   **/
+  class BucketContent : public boost::noncopyable
+  {
+  public:
+    class Slice
+    {
+    private:
+      boost::shared_ptr<SourceDicomInstance>  instance_;
+      size_t                                  offset_;
+      size_t                                  size_;
+
+    public:
+      Slice(const boost::shared_ptr<SourceDicomInstance>& instance,
+            size_t offset,
+            size_t size);
+
+      const void* GetData() const;
+
+      const SourceDicomInstance& GetInstance() const
+      {
+        return *instance_;
+      }
+
+      // Offset of the slice in the buffer of its instance
+      size_t GetOffset() const
+      {
+        return offset_;
+      }
+
+      size_t GetSize() const
+      {
+        return size_;
+      }
+    };
+
+  private:
+    std::vector<Slice>  slices_;
+    size_t              size_;
+
+  public:
+    BucketContent() :
+      size_(0)
+    {
+    }
+
+    void AddSlice(const boost::shared_ptr<SourceDicomInstance>& instance,
+                  size_t offset,
+                  size_t size);
+
+    size_t GetSize() const
+    {
+      return size_;
+    }
+
+    size_t GetSlicesCount() const
+    {
+      return slices_.size();
+    }
+
+    const Slice& GetSlice(size_t index) const;
+
+    void Flatten(std::string& target) const;
+
+    // Compresses the slices one after the other, without flattening.
+    // A level of zero selects the default level of the method (for
+    // zstd, the one given to "SetZstdLevel()"). The zstd dictionary
+    // can be NULL, and is only used if the bucket is made of small
+    // instances, as it only helps the beginning of each frame.
+    void Compress(std::string& target,
+                  BucketCompression compression,
+                  int level,
+                  CompressionDictionaries::Dictionary* dictionary) const;
+
+    void Compress(std::string& target,
+                  BucketCompression compression,
+                  int level) const
+    {
+      Compress(target, compression, level, NULL);
+    }
+
+    void Compress(std::string& target,
+                  BucketCompression compression) const
+    {
+      Compress(target, compression, 0, NULL);
+    }
+
+    bool IsMadeOfSmallInstances() const;
+
+    // Level of the zstd compression, shared by all the buckets
+    static void SetZstdLevel(int level);
+
+    static int GetZstdLevel();
+  };
+}
@@ -0,0 +1,251 @@
+/**
+ * Transfers accelerator plugin for Orthanc
+ * Copyright (C) 2018-2023 Osimis S.A., Belgium
+ * Copyright (C) 2024-2026 Orthanc Team SRL, Belgium
+ * Copyright (C) 2021-2026 Sebastien Jodogne, ICTEAM UCLouvain, Belgium
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU Affero General Public License
+ * as published by the Free Software Foundation, either version 3 of
+ * the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Affero General Public License for more details.
+ * 
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ **/
+
+
+
+#include "CompactIdentifier.h"
+
+#include <OrthancException.h>
+
+#include <cassert>
+#include <string.h>
+
+
+namespace OrthancPlugins
+{
+  static const size_t ORTHANC_ID_LENGTH = 44;
+  static const size_t ORTHANC_ID_GROUP = 8;
+  static const size_t MD5_LENGTH = 32;
+
+  static const char HEX_DIGITS[] = "0123456789abcdef";
+
+
+  static bool DecodeHexDigit(uint8_t& target,
+                             char c)
+  {
+    // Only the lowercase digits, so that "ToString()" gives back the
+    // original string
+    if (c >= '0' && c <= '9')
+    {
+      target = static_cast<uint8_t>(c - '0');
+      return true;
+    }
+    else if (c >= 'a' && c <= 'f')
+    {
+      target = static_cast<uint8_t>(c - 'a' + 10);
+      return true;
+    }
+    else
+    {
+      return false;
+    }
+  }
+
+
+  // Decodes the hexadecimal digits of "value", skipping the dashes
+  // that separate the groups of "group" digits (if "group" is not 0)
+  static bool DecodeHash(uint8_t* target,
+                         size_t targetSize,
+                         const std::string& value,
+                         size_t group)
+  {
+    size_t pos = 0;
+
+    for (size_t i = 0; i < 2 * targetSize; i++)
+    {
+      if (group != 0 &&
+          i != 0 &&
+          i % group == 0)
+      {
+        if (pos >= value.size() ||
+            value[pos] != '-')
+        {
+          return false;
+        }
+
+        pos++;
+      }
+
+      uint8_t digit;
+      if (pos >= value.size() ||
+          !DecodeHexDigit(digit, value[pos]))
+      {
+        return false;
+      }
+
+      pos++;
+
+      if (i % 2 == 0)
+      {
+        target[i / 2] = static_cast<uint8_t>(digit << 4);
+      }
+      else
+      {
+        target[i / 2] |= digit;
+      }
+    }
+
+    return (pos == value.size());
+  }
+
+
+  size_t CompactIdentifier::GetHashSize(uint8_t format)
+  {
+    switch (format)
+    {
+      case Format_OrthancId:
+        return 20;
+
+      case Format_MD5:
+        return 16;
+
+      default:
+        return 0;
+    }
+  }
+
+
+  CompactIdentifier::CompactIdentifier(const std::string& value)
+  {
+    if (value.empty())
+    {
+      format_ = Format_Empty;
+    }
+    else if (value.size() == ORTHANC_ID_LENGTH &&
+             DecodeHash(hash_, GetHashSize(Format_OrthancId), value, ORTHANC_ID_GROUP))
+    {
+      format_ = Format_OrthancId;
+    }
+    else if (value.size() == MD5_LENGTH &&
+             DecodeHash(hash_, GetHashSize(Format_MD5), value, 0))
+    {
+      format_ = Format_MD5;
+    }
+    else
+    {
+      format_ = Format_Other;
+      other_.reset(new std::string(value));
+    }
+  }
+
+
+  std::string CompactIdentifier::ToString() const
+  {
+    switch (format_)
+    {
+      case Format_Empty:
+        return std::string();
+
+      case Format_OrthancId:
+      case Format_MD5:
+      {
+        const size_t group = (format_ == Format_OrthancId ? ORTHANC_ID_GROUP : 0);
+        const size_t hashSize = GetHashSize(format_);
+
+        std::string s;
+        s.reserve(format_ == Format_OrthancId ? ORTHANC_ID_LENGTH : MD5_LENGTH);
+
+        for (size_t i = 0; i < 2 * hashSize; i++)
+        {
+          if (group != 0 &&
+              i != 0 &&
+              i % group == 0)
+          {
+            s.push_back('-');
+          }
+
+          const uint8_t byte = hash_[i / 2];
+          s.push_back(HEX_DIGITS[i % 2 == 0 ? (byte >> 4) : (byte & 0x0f)]);
+        }
+
+        return s;
+      }
+
+      case Format_Other:
+        assert(other_.get() != NULL);
+        return *other_;
+
+      default:
+        throw Orthanc::OrthancException(Orthanc::ErrorCode_InternalError);
+    }
+  }
+
+
+  size_t CompactIdentifier::GetLength() const
+  {
+    switch (format_)
+    {
+      case Format_Empty:
+        return 0;
+
+      case Format_OrthancId:
+        return ORTHANC_ID_LENGTH;
+
+      case Format_MD5:
+        return MD5_LENGTH;
+
+      case Format_Other:
+        assert(other_.get() != NULL);
+        return other_->size();
+
+      default:
+        throw Orthanc::OrthancException(Orthanc::ErrorCode_InternalError);
+    }
+  }
+
+
+  bool CompactIdentifier::operator== (const CompactIdentifier& other) const
+  {
+    // A string has a single representation, given its format
+    if (format_ != other.format_)
+    {
+      return false;
+    }
+    else if (format_ == Format_Other)
+    {
+      return *other_ == *other.other_;
+    }
+    else
+    {
+      return memcmp(hash_, other.hash_, GetHashSize(format_)) == 0;
+    }
+  }
+
+
+  bool CompactIdentifier::operator< (const CompactIdentifier& other) const
+  {
+    if (format_ == other.format_ &&
+        format_ != Format_Other)
+    {
+      // The lowercase hexadecimal digits are sorted like the bytes
+      // they encode, and the dashes are at the same positions
+      return memcmp(hash_, other.hash_, GetHashSize(format_)) < 0;
+    }
+    else if (format_ == Format_Other &&
+             other.format_ == Format_Other)
+    {
+      return *other_ < *other.other_;
+    }
+    else
+    {
+      return ToString() < other.ToString();
+    }
+  }
+}
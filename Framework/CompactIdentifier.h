@@ -0,0 +1,87 @@
+/**
+ * Transfers accelerator plugin for Orthanc
+ * Copyright (C) 2018-2023 Osimis S.A., Belgium
+ * Copyright (C) 2024-2026 Orthanc Team SRL, Belgium
+ * Copyright (C) 2021-2026 Sebastien Jodogne, ICTEAM UCLouvain, Belgium
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU Affero General Public License
+ * as published by the Free Software Foundation, either version 3 of
+ * the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Affero General Public License for more details.
+ * 
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ **/
+
+
+
+#pragma once
+
+#include <boost/shared_ptr.hpp>
+#include <stdint.h>
+#include <string>
+
+namespace OrthancPlugins
+{
+  /**
+   * Immutable string that is stored in binary form if it is the
+   * hexadecimal representation of a hash, which is the case of the
+   * Orthanc identifiers (SHA-1 as 5 dash-separated groups of 8
+   * lowercase hexadecimal digits) and of the MD5 of the instances
+   * (32 lowercase hexadecimal digits). This divides by 4 the memory
+   * that is used by the tables of instances of the large transfers.
+   * The other strings are stored as such, and shared by the copies.
+   *
+   * The comparison operators are consistent with those of the
+   * original strings.
+   **/
+  class CompactIdentifier
+  {
+  private:
+    enum Format
+    {
+      Format_Empty,
+      Format_OrthancId,
+      Format_MD5,
+      Format_Other
+    };
+
+    uint8_t                                format_;
+    uint8_t                                hash_[20];
+    boost::shared_ptr<const std::string>   other_;
+
+    static size_t GetHashSize(uint8_t format);
+
+  public:
+    CompactIdentifier() :
+      format_(Format_Empty)
+    {
+    }
+
+    explicit CompactIdentifier(const std::string& value);
+
+    bool IsEmpty() const
+    {
+      return format_ == Format_Empty;
+    }
+
+    std::string ToString() const;
+
+    // Length of "ToString()", without building the string
+    size_t GetLength() const;
+
+    bool operator== (const CompactIdentifier& other) const;
+
+    bool operator!= (const CompactIdentifier& other) const
+    {
+      return !(*this == other);
+    }
+
+    bool operator< (const CompactIdentifier& other) const;
+  };
+}
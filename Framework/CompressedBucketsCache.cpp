@@ -0,0 +1,352 @@
+/**
+ * Transfers accelerator plugin for Orthanc
+ * Copyright (C) 2018-2023 Osimis S.A., Belgium
+ * Copyright (C) 2024-2026 Orthanc Team SRL, Belgium
+ * Copyright (C) 2021-2026 Sebastien Jodogne, ICTEAM UCLouvain, Belgium
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU Affero General Public License
+ * as published by the Free Software Foundation, either version 3 of
+ * the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Affero General Public License for more details.
+ * 
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ **/
+
+
+
+#include "CompressedBucketsCache.h"
+
+#include <Toolbox.h>
+
+#include <boost/date_time/posix_time/posix_time.hpp>
+#include <boost/lexical_cast.hpp>
+#include <cassert>
+#include <set>
+
+
+namespace OrthancPlugins
+{
+  CompressedBucketsCache::Payload::Payload(std::string& data,
+                                           double compressionTime) :
+    compressionTime_(compressionTime)
+  {
+    data_.swap(data);
+  }
+
+
+  bool CompressedBucketsCache::Payload::LookupMD5(std::string& md5) const
+  {
+    if (md5_.empty())
+    {
+      return false;
+    }
+    else
+    {
+      md5 = md5_;
+      return true;
+    }
+  }
+
+
+  void CompressedBucketsCache::Payload::ComputeMD5()
+  {
+    Orthanc::Toolbox::ComputeMD5(md5_, data_);
+  }
+
+
+  size_t CompressedBucketsCache::GetEntrySize(const std::string& key,
+                                              const Payload& payload)
+  {
+    // The key is accounted twice, as it is also stored in the recency list
+    return payload.GetData().size() + 2 * key.size();
+  }
+
+
+  void CompressedBucketsCache::RemoveEntry(Entries::iterator entry)
+  {
+    assert(entry != entries_.end());
+
+    const size_t entrySize = GetEntrySize(entry->first, *entry->second.payload_);
+    assert(size_ >= entrySize);
+    size_ -= entrySize;
+
+    const std::vector<std::string>& instances = entry->second.instances_;
+
+    for (size_t i = 0; i < instances.size(); i++)
+    {
+      std::pair<InstancesIndex::iterator, InstancesIndex::iterator> range = instancesIndex_.equal_range(instances[i]);
+
+      for (InstancesIndex::iterator it = range.first; it != range.second; ++it)
+      {
+        if (it->second == entry->first)
+        {
+          instancesIndex_.erase(it);
+          break;
+        }
+      }
+    }
+
+    recency_.erase(entry->second.position_);
+    entries_.erase(entry);
+  }
+
+
+  void CompressedBucketsCache::RemoveLeastRecent()
+  {
+    // The mutex must be locked
+    assert(!recency_.empty());
+
+    Entries::iterator victim = entries_.find(recency_.back());
+    RemoveEntry(victim);
+  }
+
+
+  bool CompressedBucketsCache::Lookup(PayloadPtr& target,
+                                      const std::string& key)
+  {
+    boost::mutex::scoped_lock lock(mutex_);
+
+    Entries::iterator found = entries_.find(key);
+
+    if (found == entries_.end())
+    {
+      missCount_++;
+      return false;
+    }
+    else
+    {
+      hitCount_++;
+      savedTime_ += found->second.payload_->GetCompressionTime();
+
+      // Move the entry to the front of the recency list
+      recency_.splice(recency_.begin(), recency_, found->second.position_);
+
+      target = found->second.payload_;
+      return true;
+    }
+  }
+
+
+  void CompressedBucketsCache::Store(const std::string& key,
+                                     const PayloadPtr& payload,
+                                     const std::vector<std::string>& instances)
+  {
+    const size_t entrySize = GetEntrySize(key, *payload);
+
+    boost::mutex::scoped_lock lock(mutex_);
+
+    if (entrySize > maxSize_ ||
+        entries_.find(key) != entries_.end())  // Compressed by another thread in the meantime
+    {
+      return;
+    }
+
+    while (size_ + entrySize > maxSize_)
+    {
+      RemoveLeastRecent();
+    }
+
+    recency_.push_front(key);
+
+    Entry& entry = entries_[key];
+    entry.payload_ = payload;
+    entry.position_ = recency_.begin();
+    entry.instances_ = instances;
+
+    for (size_t i = 0; i < instances.size(); i++)
+    {
+      instancesIndex_.insert(std::make_pair(instances[i], key));
+    }
+
+    size_ += entrySize;
+  }
+
+
+  CompressedBucketsCache::CompressedBucketsCache(size_t maxSize) :
+    maxSize_(maxSize),
+    size_(0),
+    hitCount_(0),
+    missCount_(0),
+    savedTime_(0)
+  {
+  }
+
+
+  void CompressedBucketsCache::SetMaxSize(size_t maxSize)
+  {
+    boost::mutex::scoped_lock lock(mutex_);
+
+    maxSize_ = maxSize;
+
+    while (size_ > maxSize_)
+    {
+      RemoveLeastRecent();
+    }
+  }
+
+
+  size_t CompressedBucketsCache::GetMaxSize()
+  {
+    boost::mutex::scoped_lock lock(mutex_);
+    return maxSize_;
+  }
+
+
+  size_t CompressedBucketsCache::GetSize()
+  {
+    boost::mutex::scoped_lock lock(mutex_);
+    return size_;
+  }
+
+
+  size_t CompressedBucketsCache::GetCount()
+  {
+    boost::mutex::scoped_lock lock(mutex_);
+    return entries_.size();
+  }
+
+
+  void CompressedBucketsCache::ComputeKey(std::string& key,
+                                          const BucketContent& content,
+                                          BucketCompression compression,
+                                          int level,
+                                          uint32_t dictionaryId)
+  {
+    // The identifier of a slice is the one of its instance, or of its
+    // page for the range reads (whose MD5 is unknown). The MD5 of the
+    // instance protects against an instance whose content has changed.
+    std::string description = (std::string(EnumerationToString(compression)) + "|" +
+                               boost::lexical_cast<std::string>(level));
+
+    if (dictionaryId != 0)
+    {
+      description += "|dictionary:" + boost::lexical_cast<std::string>(dictionaryId);
+    }
+
+    for (size_t i = 0; i < content.GetSlicesCount(); i++)
+    {
+      const BucketContent::Slice& slice = content.GetSlice(i);
+      const DicomInstanceInfo& info = slice.GetInstance().GetInfo();
+
+      description += ("|" + info.GetId() + ":" + info.GetMD5() + ":" +
+                      boost::lexical_cast<std::string>(slice.GetOffset()) + ":" +
+                      boost::lexical_cast<std::string>(slice.GetSize()));
+    }
+
+    // Bounds the size of the keys, whatever the number of slices
+    Orthanc::Toolbox::ComputeMD5(key, description);
+  }
+
+
+  CompressedBucketsCache::PayloadPtr CompressedBucketsCache::Compress(const BucketContent& content,
+                                                                      BucketCompression compression,
+                                                                      int level,
+                                                                      CompressionDictionaries::Dictionary* dictionary)
+  {
+    const bool cacheable = (compression != BucketCompression_None &&
+                            GetMaxSize() != 0);
+
+    std::string key;
+
+    if (cacheable)
+    {
+      ComputeKey(key, content, compression, level,
+                 dictionary == NULL ? 0 : dictionary->GetId());
+
+      PayloadPtr payload;
+      if (Lookup(payload, key))
+      {
+        return payload;
+      }
+    }
+
+    const boost::posix_time::ptime start = boost::posix_time::microsec_clock::universal_time();
+
+    std::string data;
+    content.Compress(data, compression, level, dictionary);
+
+    const boost::posix_time::ptime end = boost::posix_time::microsec_clock::universal_time();
+
+    boost::shared_ptr<Payload> payload(
+      new Payload(data, static_cast<double>((end - start).total_microseconds()) / 1000000.0));
+
+    if (cacheable)
+    {
+      std::set<std::string> instances;
+      for (size_t i = 0; i < content.GetSlicesCount(); i++)
+      {
+        instances.insert(content.GetSlice(i).GetInstance().GetInfo().GetId());
+      }
+
+      payload->ComputeMD5();
+      Store(key, payload, std::vector<std::string>(instances.begin(), instances.end()));
+    }
+
+    return payload;
+  }
+
+
+  void CompressedBucketsCache::Invalidate(const std::string& instanceId)
+  {
+    boost::mutex::scoped_lock lock(mutex_);
+
+    std::set<std::string> keys;
+
+    for (InstancesIndex::const_iterator it = instancesIndex_.lower_bound(instanceId);
+         it != instancesIndex_.end() && it->first.compare(0, instanceId.size(), instanceId) == 0; ++it)
+    {
+      keys.insert(it->second);
+    }
+
+    for (std::set<std::string>::const_iterator it = keys.begin(); it != keys.end(); ++it)
+    {
+      Entries::iterator found = entries_.find(*it);
+      if (found != entries_.end())
+      {
+        RemoveEntry(found);
+      }
+    }
+  }
+
+
+  uint64_t CompressedBucketsCache::GetHitCount()
+  {
+    boost::mutex::scoped_lock lock(mutex_);
+    return hitCount_;
+  }
+
+
+  uint64_t CompressedBucketsCache::GetMissCount()
+  {
+    boost::mutex::scoped_lock lock(mutex_);
+    return missCount_;
+  }
+
+
+  double CompressedBucketsCache::GetHitRatio()
+  {
+    boost::mutex::scoped_lock lock(mutex_);
+
+    if (hitCount_ + missCount_ == 0)
+    {
+      return 0;
+    }
+    else
+    {
+      return static_cast<double>(hitCount_) / static_cast<double>(hitCount_ + missCount_);
+    }
+  }
+
+
+  double CompressedBucketsCache::GetSavedCompressionTime()
+  {
+    boost::mutex::scoped_lock lock(mutex_);
+    return savedTime_;
+  }
+}
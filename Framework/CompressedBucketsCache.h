@@ -0,0 +1,177 @@
+/**
+ * Transfers accelerator plugin for Orthanc
+ * Copyright (C) 2018-2023 Osimis S.A., Belgium
+ * Copyright (C) 2024-2026 Orthanc Team SRL, Belgium
+ * Copyright (C) 2021-2026 Sebastien Jodogne, ICTEAM UCLouvain, Belgium
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU Affero General Public License
+ * as published by the Free Software Foundation, either version 3 of
+ * the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Affero General Public License for more details.
+ * 
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ **/
+
+
+
+#pragma once
+
+#include "BucketContent.h"
+
+#include <boost/thread/mutex.hpp>
+#include <list>
+#include <map>
+
+namespace OrthancPlugins
+{
+  /**
+   * Bounded cache of the compressed payloads of the buckets, which
+   * avoids compressing the same bytes again if a bucket is retried,
+   * or if the same instances are sent to several peers. The key is
+   * computed from the slices of the bucket (hence from the MD5 of
+   * the instances, if known), from the compression method, from its
+   * level and from the zstd dictionary. The memory of this cache is accounted separately from
+   * the cache of the DICOM instances. The least recently used
+   * payloads are evicted first.
+   **/
+  class CompressedBucketsCache : public boost::noncopyable
+  {
+  public:
+    class Payload : public boost::noncopyable
+    {
+    private:
+      std::string  data_;
+      std::string  md5_;
+      double       compressionTime_;
+
+    public:
+      // Takes the content of "data"
+      Payload(std::string& data,
+              double compressionTime);
+
+      const std::string& GetData() const
+      {
+        return data_;
+      }
+
+      // The MD5 of the payloads is computed once, when they enter
+      // the cache. Returns "false" if the payload was not cached.
+      bool LookupMD5(std::string& md5) const;
+
+      void ComputeMD5();
+
+      // In seconds, as measured when the payload was compressed
+      double GetCompressionTime() const
+      {
+        return compressionTime_;
+      }
+    };
+
+    typedef boost::shared_ptr<const Payload>  PayloadPtr;
+
+  private:
+    typedef std::list<std::string>  Recency;  // The front is the most recent
+
+    struct Entry
+    {
+      PayloadPtr                payload_;
+      Recency::iterator         position_;
+      std::vector<std::string>  instances_;  // Identifiers of the slices
+    };
+
+    typedef std::map<std::string, Entry>  Entries;
+
+    // Maps the identifier of a slice to the keys of the payloads
+    typedef std::multimap<std::string, std::string>  InstancesIndex;
+
+    boost::mutex    mutex_;
+    Entries         entries_;
+    Recency         recency_;
+    InstancesIndex  instancesIndex_;
+    size_t        maxSize_;
+    size_t        size_;
+    uint64_t      hitCount_;
+    uint64_t      missCount_;
+    double        savedTime_;
+
+    static size_t GetEntrySize(const std::string& key,
+                               const Payload& payload);
+
+    // The mutex must be locked
+    void RemoveEntry(Entries::iterator entry);
+
+    void RemoveLeastRecent();
+
+    bool Lookup(PayloadPtr& target,
+                const std::string& key);
+
+    void Store(const std::string& key,
+               const PayloadPtr& payload,
+               const std::vector<std::string>& instances);
+
+  public:
+    // A size of zero disables the cache
+    explicit CompressedBucketsCache(size_t maxSize = 0);
+
+    void SetMaxSize(size_t maxSize);
+
+    size_t GetMaxSize();
+
+    // Memory used by the payloads and by their keys
+    size_t GetSize();
+
+    size_t GetCount();
+
+    // A dictionary ID of zero stands for no dictionary
+    static void ComputeKey(std::string& key,
+                           const BucketContent& content,
+                           BucketCompression compression,
+                           int level,
+                           uint32_t dictionaryId);
+
+    static void ComputeKey(std::string& key,
+                           const BucketContent& content,
+                           BucketCompression compression,
+                           int level)
+    {
+      ComputeKey(key, content, compression, level, 0);
+    }
+
+    // Returns the payload from the cache, or compresses the bucket and
+    // stores its payload. The "none" compression is never cached. The
+    // dictionary can be NULL.
+    PayloadPtr Compress(const BucketContent& content,
+                        BucketCompression compression,
+                        int level,
+                        CompressionDictionaries::Dictionary* dictionary);
+
+    PayloadPtr Compress(const BucketContent& content,
+                        BucketCompression compression,
+                        int level)
+    {
+      return Compress(content, compression, level, NULL);
+    }
+
+    // Discards the payloads that contain a slice of the instance, or
+    // of its pages (whose identifiers start with the one of the
+    // instance), as the instance was deleted or stored again
+    void Invalidate(const std::string& instanceId);
+
+    uint64_t GetHitCount();
+
+    uint64_t GetMissCount();
+
+    // Between 0 and 1, or 0 if the cache was never used
+    double GetHitRatio();
+
+    // Sum of the compression times of the payloads that were found in
+    // the cache, in seconds
+    double GetSavedCompressionTime();
+  };
+}
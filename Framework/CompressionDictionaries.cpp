@@ -0,0 +1,504 @@
+/**
+ * Transfers accelerator plugin for Orthanc
+ * Copyright (C) 2018-2023 Osimis S.A., Belgium
+ * Copyright (C) 2024-2026 Orthanc Team SRL, Belgium
+ * Copyright (C) 2021-2026 Sebastien Jodogne, ICTEAM UCLouvain, Belgium
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU Affero General Public License
+ * as published by the Free Software Foundation, either version 3 of
+ * the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Affero General Public License for more details.
+ * 
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ **/
+
+
+
+#include "CompressionDictionaries.h"
+
+#include <Logging.h>
+#include <OrthancException.h>
+
+#include <algorithm>
+#include <boost/lexical_cast.hpp>
+#include <boost/thread.hpp>
+#include <cassert>
+#include <list>
+#include <set>
+#include <string.h>
+
+#if ORTHANC_TRANSFERS_ENABLE_ZSTD == 1
+#  include <zdict.h>
+#  include <zstd.h>
+#endif
+
+
+namespace OrthancPlugins
+{
+  // Size of the trained dictionaries: zstd recommends about 100KB,
+  // which is more than enough for the DICOM headers
+  static const size_t DICTIONARY_SIZE = 64 * 1024;
+
+  // The samples are truncated to this size, and the smaller ones are
+  // not representative of the DICOM headers
+  static const size_t MAX_SAMPLE_SIZE = 16 * 1024;
+  static const size_t MIN_SAMPLE_SIZE = 256;
+
+  // Number of new samples before the first training, then before the
+  // training of each new version of the dictionary. Only the most
+  // recent samples are kept.
+  static const size_t TRAINING_SAMPLES = 1000;
+  static const size_t RETRAINING_SAMPLES = 20000;
+  static const size_t MAX_SAMPLES = 4000;
+
+  // The least recently used dictionaries are forgotten, which bounds
+  // the memory if many peers push their own dictionaries. The
+  // dictionaries in use by the transfers are never forgotten, so this
+  // limit can be temporarily exceeded.
+  static const size_t MAX_DICTIONARIES = 8;
+
+  static boost::mutex  registryMutex;
+  static bool          enabled = false;
+  static std::map<uint32_t, CompressionDictionaries::DictionaryPtr>  dictionaries;
+  static std::list<uint32_t>  recentlyUsed;      // The front is the least recently used
+  static uint32_t      currentDictionary = 0;     // Zero if none was trained
+  static std::vector<std::string>  collectedSamples;
+  static size_t        nextSample = 0;            // Next sample to be replaced, once "collectedSamples" is full
+  static size_t        newSamples = 0;
+  static std::set<std::string>  sampledInstances;  // Since the last training
+  static bool          isTraining = false;
+  static boost::thread*  trainingThread = NULL;  // Joined by the next training, or by "WaitForTraining()"
+
+
+  // Allows another training once the current one is over, whatever
+  // its outcome
+  class TrainingGuard : public boost::noncopyable
+  {
+  public:
+    ~TrainingGuard()
+    {
+      boost::mutex::scoped_lock lock(registryMutex);
+      isTraining = false;
+    }
+  };
+
+
+  static void TrainingWorker(boost::shared_ptr<std::vector<std::string> > samples)
+  {
+    Orthanc::Logging::SetCurrentThreadName("TF-DICTIONARY");
+
+    TrainingGuard guard;
+
+    try
+    {
+      CompressionDictionaries::Train(*samples);
+    }
+    catch (Orthanc::OrthancException& e)
+    {
+      LOG(WARNING) << "Cannot train a compression dictionary from the DICOM headers: " << e.What();
+    }
+    catch (std::exception& e)
+    {
+      LOG(WARNING) << "Cannot train a compression dictionary from the DICOM headers: " << e.what();
+    }
+    catch (...)
+    {
+      LOG(WARNING) << "Cannot train a compression dictionary from the DICOM headers";
+    }
+  }
+
+
+  CompressionDictionaries::Dictionary::Dictionary(const std::string& content) :
+    id_(0),
+    content_(content),
+    decompression_(NULL)
+  {
+#if ORTHANC_TRANSFERS_ENABLE_ZSTD == 1
+    id_ = ZDICT_getDictID(content_.c_str(), content_.size());
+
+    if (id_ == 0)
+    {
+      throw Orthanc::OrthancException(Orthanc::ErrorCode_BadFileFormat, "Not a zstd dictionary");
+    }
+
+    decompression_ = ZSTD_createDDict(content_.c_str(), content_.size());
+
+    if (decompression_ == NULL)
+    {
+      throw Orthanc::OrthancException(Orthanc::ErrorCode_BadFileFormat, "Cannot load a zstd dictionary");
+    }
+#else
+    throw Orthanc::OrthancException(Orthanc::ErrorCode_NotImplemented, "The plugin was built without zstd");
+#endif
+  }
+
+
+  CompressionDictionaries::Dictionary::~Dictionary()
+  {
+#if ORTHANC_TRANSFERS_ENABLE_ZSTD == 1
+    for (Levels::iterator it = levels_.begin(); it != levels_.end(); ++it)
+    {
+      ZSTD_freeCDict(it->second);
+    }
+
+    ZSTD_freeDDict(decompression_);
+#endif
+  }
+
+
+  ZSTD_CDict_s* CompressionDictionaries::Dictionary::GetCompressionDictionary(int level)
+  {
+#if ORTHANC_TRANSFERS_ENABLE_ZSTD == 1
+    boost::mutex::scoped_lock lock(mutex_);
+
+    Levels::const_iterator found = levels_.find(level);
+    if (found != levels_.end())
+    {
+      return found->second;
+    }
+
+    ZSTD_CDict* digested = ZSTD_createCDict(content_.c_str(), content_.size(), level);
+    if (digested == NULL)
+    {
+      throw Orthanc::OrthancException(Orthanc::ErrorCode_NotEnoughMemory);
+    }
+
+    levels_[level] = digested;
+    return digested;
+#else
+    throw Orthanc::OrthancException(Orthanc::ErrorCode_NotImplemented);
+#endif
+  }
+
+
+  bool CompressionDictionaries::IsSupported()
+  {
+#if ORTHANC_TRANSFERS_ENABLE_ZSTD == 1
+    return true;
+#else
+    return false;
+#endif
+  }
+
+
+  void CompressionDictionaries::SetEnabled(bool value)
+  {
+    boost::mutex::scoped_lock lock(registryMutex);
+    enabled = value;
+  }
+
+
+  bool CompressionDictionaries::IsEnabled()
+  {
+    boost::mutex::scoped_lock lock(registryMutex);
+    return enabled && IsSupported();
+  }
+
+
+  // The registry must be locked by the caller
+  static void MarkAsRecentlyUsed(uint32_t id)
+  {
+    recentlyUsed.remove(id);
+    recentlyUsed.push_back(id);
+  }
+
+
+  CompressionDictionaries::DictionaryPtr CompressionDictionaries::Register(const std::string& content)
+  {
+    // Digesting the dictionary can take some time, don't lock the registry
+    DictionaryPtr dictionary(new Dictionary(content));
+
+    boost::mutex::scoped_lock lock(registryMutex);
+
+    MarkAsRecentlyUsed(dictionary->GetId());
+
+    std::map<uint32_t, DictionaryPtr>::const_iterator found = dictionaries.find(dictionary->GetId());
+    if (found != dictionaries.end())
+    {
+      return found->second;
+    }
+
+    dictionaries[dictionary->GetId()] = dictionary;
+
+    // A dictionary that is referenced outside of the registry is in
+    // use by a transfer. This includes the one that was just added,
+    // as it is referenced by "dictionary".
+    std::list<uint32_t>::iterator oldest = recentlyUsed.begin();
+    while (dictionaries.size() > MAX_DICTIONARIES &&
+           oldest != recentlyUsed.end())
+    {
+      std::map<uint32_t, DictionaryPtr>::iterator victim = dictionaries.find(*oldest);
+      assert(victim != dictionaries.end());
+
+      if (*oldest == currentDictionary ||
+          victim->second.use_count() > 1)
+      {
+        ++oldest;
+      }
+      else
+      {
+        dictionaries.erase(victim);
+        oldest = recentlyUsed.erase(oldest);
+      }
+    }
+
+    return dictionary;
+  }
+
+
+  CompressionDictionaries::DictionaryPtr CompressionDictionaries::Lookup(uint32_t id)
+  {
+    boost::mutex::scoped_lock lock(registryMutex);
+
+    std::map<uint32_t, DictionaryPtr>::const_iterator found = dictionaries.find(id);
+    if (found == dictionaries.end())
+    {
+      return DictionaryPtr();
+    }
+    else
+    {
+      MarkAsRecentlyUsed(id);
+      return found->second;
+    }
+  }
+
+
+  CompressionDictionaries::DictionaryPtr CompressionDictionaries::GetCurrent()
+  {
+    boost::mutex::scoped_lock lock(registryMutex);
+
+    std::map<uint32_t, DictionaryPtr>::const_iterator found = dictionaries.find(currentDictionary);
+    if (found == dictionaries.end())
+    {
+      return DictionaryPtr();
+    }
+    else
+    {
+      return found->second;
+    }
+  }
+
+
+  void CompressionDictionaries::ListDictionaries(std::vector<uint32_t>& target)
+  {
+    boost::mutex::scoped_lock lock(registryMutex);
+
+    target.clear();
+    target.reserve(dictionaries.size());
+
+    for (std::map<uint32_t, DictionaryPtr>::const_iterator it = dictionaries.begin(); it != dictionaries.end(); ++it)
+    {
+      target.push_back(it->first);
+    }
+  }
+
+
+  bool CompressionDictionaries::ExtractHeader(std::string& target,
+                                              const void* dicom,
+                                              size_t size)
+  {
+    // Preamble of 128 bytes, followed by the "DICM" prefix (PS3.10)
+    if (dicom == NULL ||
+        size < 132 ||
+        memcmp(reinterpret_cast<const uint8_t*>(dicom) + 128, "DICM", 4) != 0)
+    {
+      return false;
+    }
+
+    // The header ends with the tag of the pixel data (7FE0,0010), in
+    // little endian. The files without pixel data (e.g. SR) are
+    // entirely made of their header.
+    static const uint8_t PIXEL_DATA[] = { 0xe0, 0x7f, 0x10, 0x00 };
+
+    const uint8_t* begin = reinterpret_cast<const uint8_t*>(dicom);
+    const uint8_t* end = std::search(begin, begin + std::min(size, MAX_SAMPLE_SIZE),
+                                     PIXEL_DATA, PIXEL_DATA + sizeof(PIXEL_DATA));
+
+    if (static_cast<size_t>(end - begin) < MIN_SAMPLE_SIZE)
+    {
+      return false;
+    }
+    else
+    {
+      target.assign(reinterpret_cast<const char*>(begin), end - begin);
+      return true;
+    }
+  }
+
+
+  void CompressionDictionaries::AddSample(const std::string& instanceId,
+                                          const void* dicom,
+                                          size_t size)
+  {
+    {
+      boost::mutex::scoped_lock lock(registryMutex);
+      if (!enabled ||
+          !IsSupported() ||
+          sampledInstances.find(instanceId) != sampledInstances.end())
+      {
+        return;
+      }
+    }
+
+    std::string header;
+    if (!ExtractHeader(header, dicom, size))
+    {
+      return;
+    }
+
+    boost::thread* previous = NULL;
+
+    {
+      boost::mutex::scoped_lock lock(registryMutex);
+
+      if (!sampledInstances.insert(instanceId).second)
+      {
+        return;  // Sampled by another thread in the meantime
+      }
+
+      if (collectedSamples.size() < MAX_SAMPLES)
+      {
+        collectedSamples.push_back(header);
+      }
+      else
+      {
+        collectedSamples[nextSample].swap(header);
+        nextSample = (nextSample + 1) % MAX_SAMPLES;
+      }
+
+      newSamples++;
+
+      if (!isTraining &&
+          newSamples >= (currentDictionary == 0 ? TRAINING_SAMPLES : RETRAINING_SAMPLES))
+      {
+        // The training takes seconds, which must not delay the HTTP
+        // thread that has read this instance
+        try
+        {
+          boost::shared_ptr<std::vector<std::string> > training(new std::vector<std::string>(collectedSamples));
+          boost::thread* thread = new boost::thread(TrainingWorker, training);
+
+          // The previous training is over, as "isTraining" was false
+          previous = trainingThread;
+          trainingThread = thread;
+
+          isTraining = true;
+          newSamples = 0;
+          sampledInstances.clear();
+        }
+        catch (...)
+        {
+          LOG(WARNING) << "Cannot start the training of a compression dictionary";
+        }
+      }
+    }
+
+    if (previous != NULL)
+    {
+      if (previous->joinable())
+      {
+        previous->join();
+      }
+
+      delete previous;
+    }
+  }
+
+
+  void CompressionDictionaries::WaitForTraining()
+  {
+    boost::thread* thread = NULL;
+
+    {
+      boost::mutex::scoped_lock lock(registryMutex);
+      std::swap(thread, trainingThread);
+    }
+
+    if (thread != NULL)
+    {
+      if (thread->joinable())
+      {
+        thread->join();
+      }
+
+      delete thread;
+    }
+  }
+
+
+  size_t CompressionDictionaries::GetSamplesCount()
+  {
+    boost::mutex::scoped_lock lock(registryMutex);
+    return collectedSamples.size();
+  }
+
+
+  CompressionDictionaries::DictionaryPtr CompressionDictionaries::Train(const std::vector<std::string>& samples)
+  {
+#if ORTHANC_TRANSFERS_ENABLE_ZSTD == 1
+    if (samples.empty())
+    {
+      throw Orthanc::OrthancException(Orthanc::ErrorCode_ParameterOutOfRange);
+    }
+
+    std::string buffer;
+    std::vector<size_t> sizes;
+    sizes.reserve(samples.size());
+
+    for (size_t i = 0; i < samples.size(); i++)
+    {
+      buffer.append(samples[i]);
+      sizes.push_back(samples[i].size());
+    }
+
+    std::string content;
+    content.resize(DICTIONARY_SIZE);
+
+    const size_t size = ZDICT_trainFromBuffer(&content[0], content.size(), buffer.c_str(),
+                                              &sizes[0], static_cast<unsigned int>(sizes.size()));
+
+    if (ZDICT_isError(size))
+    {
+      throw Orthanc::OrthancException(Orthanc::ErrorCode_InternalError,
+                                      std::string("Cannot train a zstd dictionary: ") + ZDICT_getErrorName(size));
+    }
+
+    content.resize(size);
+
+    DictionaryPtr dictionary = Register(content);
+
+    {
+      boost::mutex::scoped_lock lock(registryMutex);
+      currentDictionary = dictionary->GetId();
+    }
+
+    LOG(INFO) << "New compression dictionary " << dictionary->GetId() << " of "
+              << (size / 1024) << " KB, trained from " << samples.size() << " DICOM headers";
+
+    return dictionary;
+#else
+    throw Orthanc::OrthancException(Orthanc::ErrorCode_NotImplemented, "The plugin was built without zstd");
+#endif
+  }
+
+
+  void CompressionDictionaries::Clear()
+  {
+    WaitForTraining();
+
+    boost::mutex::scoped_lock lock(registryMutex);
+    dictionaries.clear();
+    recentlyUsed.clear();
+    currentDictionary = 0;
+    collectedSamples.clear();
+    nextSample = 0;
+    newSamples = 0;
+    sampledInstances.clear();
+  }
+}
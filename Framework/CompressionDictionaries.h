@@ -0,0 +1,148 @@
+/**
+ * Transfers accelerator plugin for Orthanc
+ * Copyright (C) 2018-2023 Osimis S.A., Belgium
+ * Copyright (C) 2024-2026 Orthanc Team SRL, Belgium
+ * Copyright (C) 2021-2026 Sebastien Jodogne, ICTEAM UCLouvain, Belgium
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU Affero General Public License
+ * as published by the Free Software Foundation, either version 3 of
+ * the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Affero General Public License for more details.
+ * 
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ **/
+
+
+
+#pragma once
+
+#include <boost/noncopyable.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/thread/mutex.hpp>
+#include <map>
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+struct ZSTD_CDict_s;
+struct ZSTD_DDict_s;
+
+namespace OrthancPlugins
+{
+  /**
+   * zstd dictionaries for the buckets made of small instances (SR, KO,
+   * PR, or the headers of single-frame images), which otherwise
+   * compress poorly, as each frame starts with an empty window. The
+   * dictionaries are trained from samples of the headers of the local
+   * DICOM instances, that are collected as the instances are read.
+   *
+   * Each dictionary is identified by the ID that zstd stores in its
+   * header, which acts as its version. This ID is also written in the
+   * zstd frames that are compressed with the dictionary, so the
+   * receiver finds the dictionary to be used by itself. The peers
+   * exchange the dictionaries before the transfer: The buckets are
+   * only compressed with a dictionary that the receiver has.
+   *
+   * The registry of the dictionaries is shared by all the transfers.
+   * The transfers keep a reference to the dictionary they have
+   * negotiated, which prevents the registry from forgetting it while
+   * the transfer is running.
+   **/
+  class CompressionDictionaries : public boost::noncopyable
+  {
+  public:
+    class Dictionary : public boost::noncopyable
+    {
+    private:
+      typedef std::map<int, ZSTD_CDict_s*>  Levels;
+
+      boost::mutex   mutex_;
+      uint32_t       id_;
+      std::string    content_;
+      Levels         levels_;         // Digested for each compression level
+      ZSTD_DDict_s*  decompression_;
+
+    public:
+      // Throws "BadFileFormat" if "content" is not a zstd dictionary
+      explicit Dictionary(const std::string& content);
+
+      ~Dictionary();
+
+      uint32_t GetId() const
+      {
+        return id_;
+      }
+
+      const std::string& GetContent() const
+      {
+        return content_;
+      }
+
+      // Digested dictionary for the given level, created on first use
+      ZSTD_CDict_s* GetCompressionDictionary(int level);
+
+      ZSTD_DDict_s* GetDecompressionDictionary() const
+      {
+        return decompression_;
+      }
+    };
+
+    typedef boost::shared_ptr<Dictionary>  DictionaryPtr;
+
+    // Tells whether this build supports the dictionaries (requires zstd)
+    static bool IsSupported();
+
+    // Whether the headers are sampled, and whether the dictionaries
+    // are used to send buckets. The dictionaries that are pushed by
+    // the peers are always accepted.
+    static void SetEnabled(bool enabled);
+
+    static bool IsEnabled();
+
+    // Adds a dictionary to the registry, or returns the registered
+    // dictionary with the same ID. The least recently used
+    // dictionaries are forgotten, except the current one and the ones
+    // that are still referenced by a transfer.
+    static DictionaryPtr Register(const std::string& content);
+
+    // Returns NULL if the dictionary is unknown. The dictionary
+    // becomes the most recently used one.
+    static DictionaryPtr Lookup(uint32_t id);
+
+    // Returns the last dictionary that was trained locally, or NULL
+    static DictionaryPtr GetCurrent();
+
+    static void ListDictionaries(std::vector<uint32_t>& target);
+
+    // Extracts the part of a DICOM file that precedes its pixel data,
+    // up to a bounded size. Returns "false" if this is not a DICOM
+    // file, or if its header is too small to be a useful sample.
+    static bool ExtractHeader(std::string& target,
+                              const void* dicom,
+                              size_t size);
+
+    // Samples the header of an instance that was read from Orthanc.
+    // Once enough samples are collected, a new dictionary is trained
+    // by a background thread, and becomes the current one.
+    static void AddSample(const std::string& instanceId,
+                          const void* dicom,
+                          size_t size);
+
+    // Waits for the background training to complete, if any
+    static void WaitForTraining();
+
+    static size_t GetSamplesCount();
+
+    // Trains a dictionary, registers it and makes it the current one
+    static DictionaryPtr Train(const std::vector<std::string>& samples);
+
+    // Forgets the dictionaries and the samples (for the unit tests)
+    static void Clear();
+  };
+}
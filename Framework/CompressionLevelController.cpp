@@ -0,0 +1,222 @@
+/**
+ * Transfers accelerator plugin for Orthanc
+ * Copyright (C) 2018-2023 Osimis S.A., Belgium
+ * Copyright (C) 2024-2026 Orthanc Team SRL, Belgium
+ * Copyright (C) 2021-2026 Sebastien Jodogne, ICTEAM UCLouvain, Belgium
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU Affero General Public License
+ * as published by the Free Software Foundation, either version 3 of
+ * the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Affero General Public License for more details.
+ * 
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ **/
+
+
+
+#include "CompressionLevelController.h"
+
+#include "BucketContent.h"
+
+#include <Logging.h>
+#include <OrthancException.h>
+
+#include <algorithm>
+#include <limits>
+
+
+namespace OrthancPlugins
+{
+  static bool adaptiveLevel = true;
+
+  // Number of buckets to be compressed at one level, before deciding
+  // whether it must be changed
+  static const size_t MIN_BUCKETS = 4;
+
+  // Hysteresis, so that the noise of the measurements does not make
+  // the level oscillate
+  static const double LOWER_FACTOR = 1.5;
+  static const double RAISE_FACTOR = 2.0;
+
+  // Default level of "Orthanc::GzipCompressor" and of "gzip -6"
+  static const int DEFAULT_GZIP_LEVEL = 6;
+
+  // The higher levels of zstd are very slow, and need much memory
+  static const int MAX_ZSTD_LEVEL = 19;
+
+
+  static void GetLevelBounds(int& minLevel,
+                             int& maxLevel,
+                             BucketCompression compression)
+  {
+    switch (compression)
+    {
+      case BucketCompression_None:
+        minLevel = 0;
+        maxLevel = 0;
+        break;
+
+      case BucketCompression_Gzip:
+        minLevel = 1;
+        maxLevel = 9;
+        break;
+
+      case BucketCompression_Zstd:
+      case BucketCompression_Auto:
+      {
+        // The configured level might be one of the fast (negative) levels
+        const int configured = BucketContent::GetZstdLevel();
+        minLevel = std::min(1, configured);
+        maxLevel = std::max(MAX_ZSTD_LEVEL, configured);
+        break;
+      }
+
+      default:
+        throw Orthanc::OrthancException(Orthanc::ErrorCode_ParameterOutOfRange);
+    }
+  }
+
+
+  CompressionLevelController::CompressionLevelController(BandwidthDelayEstimator& estimator,
+                                                         const std::string& peer,
+                                                         BucketCompression compression) :
+    estimator_(estimator),
+    peer_(peer),
+    compression_(compression),
+    adaptive_(IsAdaptive()),
+    count_(0),
+    rawSize_(0),
+    compressedSize_(0),
+    seconds_(0)
+  {
+    GetLevelBounds(minLevel_, maxLevel_, compression);
+
+    switch (compression)
+    {
+      case BucketCompression_None:
+        adaptive_ = false;
+        level_ = 0;
+        break;
+
+      case BucketCompression_Gzip:
+        level_ = DEFAULT_GZIP_LEVEL;
+        break;
+
+      default:
+        level_ = BucketContent::GetZstdLevel();
+        break;
+    }
+  }
+
+
+  int CompressionLevelController::ClampLevel(BucketCompression compression,
+                                             int level)
+  {
+    int minLevel, maxLevel;
+    GetLevelBounds(minLevel, maxLevel, compression);
+
+    if (level == 0)
+    {
+      return 0;  // Default level of the compression method
+    }
+    else
+    {
+      return std::max(minLevel, std::min(maxLevel, level));
+    }
+  }
+
+
+  int CompressionLevelController::GetLevel()
+  {
+    boost::mutex::scoped_lock lock(mutex_);
+    return level_;
+  }
+
+
+  void CompressionLevelController::RecordBucket(int level,
+                                                size_t rawSize,
+                                                size_t compressedSize,
+                                                double seconds)
+  {
+    if (!adaptive_ ||
+        rawSize == 0 ||
+        compressedSize == 0 ||
+        seconds < 0)
+    {
+      return;
+    }
+
+    double rtt, throughput;
+    const bool hasLink = estimator_.LookupLink(rtt, throughput, peer_);
+
+    boost::mutex::scoped_lock lock(mutex_);
+
+    if (level != level_)
+    {
+      return;
+    }
+
+    count_++;
+    rawSize_ += static_cast<double>(rawSize);
+    compressedSize_ += static_cast<double>(compressedSize);
+    seconds_ += seconds;
+
+    if (count_ < MIN_BUCKETS ||
+        !hasLink ||
+        throughput <= 0)
+    {
+      return;
+    }
+
+    // Uncompressed bytes per second, for one HTTP thread: The
+    // network throughput applies to the compressed bytes
+    const double network = throughput * rawSize_ / compressedSize_;
+    const double cpu = (seconds_ > 0 ? rawSize_ / seconds_ : std::numeric_limits<double>::max());
+
+    int newLevel = level_;
+
+    if (cpu * LOWER_FACTOR < network &&
+        level_ > minLevel_)
+    {
+      newLevel = level_ - 1;
+    }
+    else if (cpu > network * RAISE_FACTOR &&
+             level_ < maxLevel_)
+    {
+      newLevel = level_ + 1;
+    }
+
+    if (newLevel != level_)
+    {
+      LOG(INFO) << "Changing the " << EnumerationToString(compression_) << " compression level for peer \""
+                << peer_ << "\" from " << level_ << " to " << newLevel << " (compression: "
+                << static_cast<int>(cpu / 1024.0) << " KB/s, network: " << static_cast<int>(network / 1024.0)
+                << " KB/s of uncompressed data)";
+      level_ = newLevel;
+    }
+
+    // Start a new round of measurements
+    count_ = 0;
+    rawSize_ = 0;
+    compressedSize_ = 0;
+    seconds_ = 0;
+  }
+
+
+  void CompressionLevelController::SetAdaptive(bool adaptive)
+  {
+    adaptiveLevel = adaptive;
+  }
+
+
+  bool CompressionLevelController::IsAdaptive()
+  {
+    return adaptiveLevel;
+  }
+}
@@ -0,0 +1,94 @@
+/**
+ * Transfers accelerator plugin for Orthanc
+ * Copyright (C) 2018-2023 Osimis S.A., Belgium
+ * Copyright (C) 2024-2026 Orthanc Team SRL, Belgium
+ * Copyright (C) 2021-2026 Sebastien Jodogne, ICTEAM UCLouvain, Belgium
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU Affero General Public License
+ * as published by the Free Software Foundation, either version 3 of
+ * the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Affero General Public License for more details.
+ * 
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ **/
+
+
+
+#pragma once
+
+#include "HttpQueries/BandwidthDelayEstimator.h"
+#include "TransferToolbox.h"
+
+#include <boost/thread/mutex.hpp>
+
+namespace OrthancPlugins
+{
+  /**
+   * Adapts the compression level of the remaining buckets of one
+   * transfer to its bottleneck. Each HTTP thread compresses a bucket,
+   * then sends it: The level is lowered if the threads compress the
+   * buckets more slowly than the link to the peer can carry them
+   * (the CPU is the bottleneck), and it is raised if the link is much
+   * slower than the compression (the bandwidth is the bottleneck, and
+   * a better ratio shortens the transfer). The throughput of the link
+   * is given by the "BandwidthDelayEstimator".
+   **/
+  class CompressionLevelController : public boost::noncopyable
+  {
+  private:
+    boost::mutex              mutex_;
+    BandwidthDelayEstimator&  estimator_;
+    std::string               peer_;
+    BucketCompression         compression_;
+    bool                      adaptive_;
+    int                       minLevel_;
+    int                       maxLevel_;
+    int                       level_;
+
+    // Buckets that were compressed at the current level
+    size_t                    count_;
+    double                    rawSize_;
+    double                    compressedSize_;
+    double                    seconds_;
+
+  public:
+    CompressionLevelController(BandwidthDelayEstimator& estimator,
+                               const std::string& peer,
+                               BucketCompression compression);
+
+    BucketCompression GetCompression() const
+    {
+      return compression_;
+    }
+
+    // Returns 0 if the compression has no level (i.e. "none")
+    int GetLevel();
+
+    // The buckets that were compressed at another level than the
+    // current one are ignored
+    void RecordBucket(int level,
+                      size_t rawSize,
+                      size_t compressedSize,
+                      double seconds);
+
+    // Brings a level that is requested by a peer within the range
+    // that is explored by this class, so that a malformed request
+    // cannot reach the compressors, nor fill the cache of the
+    // compressed buckets with one entry per level. The peer might be
+    // configured with another zstd level, hence the clamping instead
+    // of an error. Throws "ParameterOutOfRange" on an unknown method.
+    static int ClampLevel(BucketCompression compression,
+                          int level);
+
+    // Shared by all the transfers
+    static void SetAdaptive(bool adaptive);
+
+    static bool IsAdaptive();
+  };
+}
@@ -0,0 +1,274 @@
+/**
+ * Transfers accelerator plugin for Orthanc
+ * Copyright (C) 2018-2023 Osimis S.A., Belgium
+ * Copyright (C) 2024-2026 Orthanc Team SRL, Belgium
+ * Copyright (C) 2021-2026 Sebastien Jodogne, ICTEAM UCLouvain, Belgium
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU Affero General Public License
+ * as published by the Free Software Foundation, either version 3 of
+ * the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Affero General Public License for more details.
+ * 
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ **/
+
+
+
+#include "CompressionThreadPool.h"
+
+#include <Compatibility.h>  // For std::unique_ptr
+#include <Logging.h>
+#include <OrthancException.h>
+
+
+namespace OrthancPlugins
+{
+  class CompressionThreadPool::Batch : public boost::noncopyable
+  {
+  private:
+    const std::vector<ITask*>&                   tasks_;
+    size_t                                       next_;       // Index of the next task to be started
+    size_t                                       completed_;
+    std::unique_ptr<Orthanc::OrthancException>  error_;
+    boost::condition_variable                    done_;
+
+  public:
+    explicit Batch(const std::vector<ITask*>& tasks) :
+      tasks_(tasks),
+      next_(0),
+      completed_(0)
+    {
+    }
+
+    // Must be called with the mutex of the pool locked
+    bool DequeueTask(ITask*& task)
+    {
+      if (next_ < tasks_.size())
+      {
+        task = tasks_[next_];
+        next_++;
+        return true;
+      }
+      else
+      {
+        return false;
+      }
+    }
+
+    bool IsStarted() const
+    {
+      return next_ == tasks_.size();
+    }
+
+    bool IsComplete() const
+    {
+      return completed_ == tasks_.size();
+    }
+
+    void SignalCompleted(const Orthanc::OrthancException* error)
+    {
+      if (error != NULL &&
+          error_.get() == NULL)
+      {
+        error_.reset(new Orthanc::OrthancException(*error));
+      }
+
+      completed_++;
+
+      if (IsComplete())
+      {
+        done_.notify_all();
+      }
+    }
+
+    void Wait(boost::mutex::scoped_lock& lock)
+    {
+      while (!IsComplete())
+      {
+        done_.wait(lock);
+      }
+    }
+
+    void CheckError() const
+    {
+      if (error_.get() != NULL)
+      {
+        throw Orthanc::OrthancException(*error_);
+      }
+    }
+  };
+
+
+  bool CompressionThreadPool::DequeueTask(Batch* batch,
+                                          ITask*& task)
+  {
+    // The mutex of the pool must be locked
+    if (batch->DequeueTask(task))
+    {
+      if (batch->IsStarted())
+      {
+        // The other threads have nothing more to take from this batch
+        batches_.remove(batch);
+      }
+
+      return true;
+    }
+    else
+    {
+      return false;
+    }
+  }
+
+
+  void CompressionThreadPool::ExecuteTask(Batch* batch,
+                                          ITask* task)
+  {
+    assert(task != NULL);
+
+    std::unique_ptr<Orthanc::OrthancException> error;
+
+    try
+    {
+      task->Apply();
+    }
+    catch (Orthanc::OrthancException& e)
+    {
+      error.reset(new Orthanc::OrthancException(e));
+    }
+    catch (...)
+    {
+      error.reset(new Orthanc::OrthancException(Orthanc::ErrorCode_InternalError));
+    }
+
+    // The batch cannot be released by its submitter before this point
+    boost::mutex::scoped_lock lock(mutex_);
+    batch->SignalCompleted(error.get());
+  }
+
+
+  void CompressionThreadPool::Worker(CompressionThreadPool* that)
+  {
+    Orthanc::Logging::SetCurrentThreadName("TF-COMPRESS");
+
+    for (;;)
+    {
+      Batch* batch = NULL;
+      ITask* task = NULL;
+
+      {
+        boost::mutex::scoped_lock lock(that->mutex_);
+
+        while (that->continue_ &&
+               that->batches_.empty())
+        {
+          that->batchAdded_.wait(lock);
+        }
+
+        if (!that->continue_)
+        {
+          return;
+        }
+
+        batch = that->batches_.front();
+
+        if (!that->DequeueTask(batch, task))
+        {
+          continue;
+        }
+      }
+
+      that->ExecuteTask(batch, task);
+    }
+  }
+
+
+  CompressionThreadPool::CompressionThreadPool(size_t threadsCount) :
+    continue_(true)
+  {
+    workers_.resize(threadsCount);
+
+    for (size_t i = 0; i < threadsCount; i++)
+    {
+      workers_[i] = new boost::thread(Worker, this);
+    }
+  }
+
+
+  CompressionThreadPool::~CompressionThreadPool()
+  {
+    {
+      boost::mutex::scoped_lock lock(mutex_);
+      continue_ = false;
+      batchAdded_.notify_all();
+    }
+
+    for (size_t i = 0; i < workers_.size(); i++)
+    {
+      if (workers_[i] != NULL)
+      {
+        if (workers_[i]->joinable())
+        {
+          workers_[i]->join();
+        }
+
+        delete workers_[i];
+      }
+    }
+  }
+
+
+  void CompressionThreadPool::Run(CompressionThreadPool* pool,
+                                  const std::vector<ITask*>& tasks)
+  {
+    if (pool == NULL ||
+        pool->workers_.empty() ||
+        tasks.size() <= 1)
+    {
+      for (size_t i = 0; i < tasks.size(); i++)
+      {
+        assert(tasks[i] != NULL);
+        tasks[i]->Apply();
+      }
+    }
+    else
+    {
+      Batch batch(tasks);
+
+      {
+        boost::mutex::scoped_lock lock(pool->mutex_);
+        pool->batches_.push_back(&batch);
+        pool->batchAdded_.notify_all();
+      }
+
+      for (;;)
+      {
+        ITask* task = NULL;
+
+        {
+          boost::mutex::scoped_lock lock(pool->mutex_);
+          if (!pool->DequeueTask(&batch, task))
+          {
+            break;
+          }
+        }
+
+        pool->ExecuteTask(&batch, task);
+      }
+
+      {
+        // The batch is not referenced by the pool anymore, but some
+        // of its tasks might still be running in the workers
+        boost::mutex::scoped_lock lock(pool->mutex_);
+        batch.Wait(lock);
+      }
+
+      batch.CheckError();
+    }
+  }
+}
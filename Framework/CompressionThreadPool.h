@@ -0,0 +1,87 @@
+/**
+ * Transfers accelerator plugin for Orthanc
+ * Copyright (C) 2018-2023 Osimis S.A., Belgium
+ * Copyright (C) 2024-2026 Orthanc Team SRL, Belgium
+ * Copyright (C) 2021-2026 Sebastien Jodogne, ICTEAM UCLouvain, Belgium
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU Affero General Public License
+ * as published by the Free Software Foundation, either version 3 of
+ * the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Affero General Public License for more details.
+ * 
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ **/
+
+
+
+#pragma once
+
+#include <boost/noncopyable.hpp>
+#include <boost/thread.hpp>
+#include <boost/thread/condition_variable.hpp>
+
+#include <list>
+#include <vector>
+
+namespace OrthancPlugins
+{
+  /**
+   * Pool of threads that is shared by all the transfers to compress
+   * and uncompress the blocks of the large buckets in parallel. The
+   * thread that submits a batch of tasks also executes some of them,
+   * so that a batch always progresses, even if all the threads of the
+   * pool are busy with other batches.
+   **/
+  class CompressionThreadPool : public boost::noncopyable
+  {
+  public:
+    class ITask : public boost::noncopyable
+    {
+    public:
+      virtual ~ITask()
+      {
+      }
+
+      virtual void Apply() = 0;
+    };
+
+  private:
+    class Batch;
+
+    boost::mutex                  mutex_;
+    boost::condition_variable     batchAdded_;
+    bool                          continue_;
+    std::list<Batch*>             batches_;
+    std::vector<boost::thread*>   workers_;
+
+    static void Worker(CompressionThreadPool* that);
+
+    bool DequeueTask(Batch* batch,
+                     ITask*& task);
+
+    void ExecuteTask(Batch* batch,
+                     ITask* task);
+
+  public:
+    explicit CompressionThreadPool(size_t threadsCount);
+
+    ~CompressionThreadPool();
+
+    size_t GetThreadsCount() const
+    {
+      return workers_.size();
+    }
+
+    // Returns once all the tasks are complete. The first exception
+    // that is raised by a task is rethrown. If "pool" is NULL, the
+    // tasks are executed by the calling thread.
+    static void Run(CompressionThreadPool* pool,
+                    const std::vector<ITask*>& tasks);
+  };
+}
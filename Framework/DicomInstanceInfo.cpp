@@ -38,7 +38,9 @@ namespace OrthancPlugins
     id_(id),
     size_(buffer.GetSize())
   {
-    Orthanc::Toolbox::ComputeMD5(md5_, buffer.GetData(), buffer.GetSize());
+    std::string md5;
+    Orthanc::Toolbox::ComputeMD5(md5, buffer.GetData(), buffer.GetSize());
+    md5_ = CompactIdentifier(md5);
   }
 
   
@@ -66,8 +68,8 @@ namespace OrthancPlugins
     }
     else
     {
-      id_ = serialized[KEY_ID].asString();
-      md5_ = serialized[KEY_MD5].asString();
+      id_ = CompactIdentifier(serialized[KEY_ID].asString());
+      md5_ = CompactIdentifier(serialized[KEY_MD5].asString());
         
       try
       {
@@ -84,8 +86,8 @@ namespace OrthancPlugins
   void DicomInstanceInfo::Serialize(Json::Value& target) const
   {
     target = Json::objectValue;
-    target[KEY_ID] = id_;
+    target[KEY_ID] = id_.ToString();
     target[KEY_SIZE] = boost::lexical_cast<std::string>(size_);
-    target[KEY_MD5] = md5_;
+    target[KEY_MD5] = md5_.ToString();
   }
 }
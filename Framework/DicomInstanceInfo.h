@@ -21,7 +21,8 @@
 
 #pragma once
 
-#include <string>
+#include "CompactIdentifier.h"
+
 #include <json/value.h>
 
 namespace OrthancPlugins
@@ -31,9 +32,9 @@ namespace OrthancPlugins
   class DicomInstanceInfo
   {
   private:
-    std::string   id_;
-    size_t        size_;
-    std::string   md5_;
+    CompactIdentifier  id_;
+    size_t             size_;
+    CompactIdentifier  md5_;
 
   public:
     DicomInstanceInfo() :
@@ -50,7 +51,12 @@ namespace OrthancPlugins
 
     explicit DicomInstanceInfo(const Json::Value& serialized);
 
-    const std::string& GetId() const
+    std::string GetId() const
+    {
+      return id_.ToString();
+    }
+
+    const CompactIdentifier& GetCompactId() const
     {
       return id_;
     }
@@ -60,9 +66,9 @@ namespace OrthancPlugins
       return size_;
     }
 
-    const std::string& GetMD5() const
+    std::string GetMD5() const
     {
-      return md5_;
+      return md5_.ToString();
     }
 
     void Serialize(Json::Value& target) const;
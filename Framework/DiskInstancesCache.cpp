@@ -0,0 +1,417 @@
+/**
+ * Transfers accelerator plugin for Orthanc
+ * Copyright (C) 2018-2023 Osimis S.A., Belgium
+ * Copyright (C) 2024-2026 Orthanc Team SRL, Belgium
+ * Copyright (C) 2021-2026 Sebastien Jodogne, ICTEAM UCLouvain, Belgium
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU Affero General Public License
+ * as published by the Free Software Foundation, either version 3 of
+ * the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Affero General Public License for more details.
+ * 
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ **/
+
+
+
+
+
+#include "DiskInstancesCache.h"
+
+#include <Logging.h>
+#include <OrthancException.h>
+
+#include <boost/filesystem/fstream.hpp>
+#include <cassert>
+#include <cctype>
+
+
+namespace OrthancPlugins
+{
+  static const char* const SUBFOLDER = "orthanc-transfers-cache";
+  static const char* const EXTENSION = ".dcm";
+  static const char* const TEMPORARY_EXTENSION = ".tmp";
+
+
+  // The identifiers come from the REST API, make sure they cannot
+  // escape from the folder of the cache
+  static bool IsValidIdentifier(const std::string& instanceId)
+  {
+    if (instanceId.empty())
+    {
+      return false;
+    }
+
+    for (size_t i = 0; i < instanceId.size(); i++)
+    {
+      if (!isalnum(instanceId[i]) &&
+          instanceId[i] != '-')
+      {
+        return false;
+      }
+    }
+
+    return true;
+  }
+
+
+  boost::filesystem::path DiskInstancesCache::GetPath(const std::string& instanceId) const
+  {
+    return folder_ / (instanceId + EXTENSION);
+  }
+
+
+  void DiskInstancesCache::Purge()
+  {
+    // Remove the files that were left by a previous execution. Only
+    // the files that follow the layout of the cache are removed, in
+    // case the subfolder also contains unrelated files.
+    std::vector<std::string> paths;
+
+    boost::system::error_code error;
+    for (boost::filesystem::directory_iterator it(folder_, error);
+         !error && it != boost::filesystem::directory_iterator(); it.increment(error))
+    {
+      const boost::filesystem::path& path = it->path();
+
+      if (boost::filesystem::is_regular_file(path) &&
+          (path.extension() == EXTENSION ||
+           path.extension() == TEMPORARY_EXTENSION) &&
+          IsValidIdentifier(path.stem().string()))
+      {
+        paths.push_back(path.string());
+      }
+    }
+
+    RemoveFiles(paths);
+  }
+
+
+  void DiskInstancesCache::RemoveInternal(std::vector<std::string>& removed,
+                                          const std::string& instanceId)
+  {
+    Content::iterator found = content_.find(instanceId);
+    assert(found != content_.end());
+
+    policy_->Remove(instanceId);
+
+    assert(size_ >= found->second.GetSize());
+    size_ -= found->second.GetSize();
+    content_.erase(found);
+
+    removed.push_back(GetPath(instanceId).string());
+  }
+
+
+  void DiskInstancesCache::CancelWriting(const std::string& instanceId)
+  {
+    // The file will be discarded by "Store()" once written
+    if (writing_.find(instanceId) != writing_.end())
+    {
+      cancelled_.insert(instanceId);
+    }
+  }
+
+
+  void DiskInstancesCache::RemoveFiles(const std::vector<std::string>& paths)
+  {
+    for (size_t i = 0; i < paths.size(); i++)
+    {
+      // The files that are still memory-mapped by some reader are
+      // only released by the filesystem once they are unmapped
+      boost::system::error_code error;
+      boost::filesystem::remove(paths[i], error);
+
+      if (error)
+      {
+        LOG(WARNING) << "Cannot remove file from the disk cache of the transfers accelerator: " << paths[i];
+      }
+    }
+  }
+
+
+  DiskInstancesCache::DiskInstancesCache(const std::string& folder,
+                                         size_t maxSize,
+                                         CachePolicy policy) :
+    folder_(boost::filesystem::path(folder) / SUBFOLDER),
+    policy_(IInstancesCachePolicy::Create(policy)),
+    size_(0),
+    maxSize_(maxSize),
+    hitCount_(0),
+    missCount_(0),
+    storedCount_(0)
+  {
+    if (folder.empty() ||
+        maxSize == 0)
+    {
+      throw Orthanc::OrthancException(Orthanc::ErrorCode_ParameterOutOfRange);
+    }
+
+    boost::system::error_code error;
+    boost::filesystem::create_directories(folder_, error);
+
+    if (!boost::filesystem::is_directory(folder_))
+    {
+      throw Orthanc::OrthancException(Orthanc::ErrorCode_DirectoryExpected,
+                                      "Cannot create the folder of the disk cache: " + folder_.string());
+    }
+
+    policy_->SetCapacity(maxSize);
+    Purge();
+  }
+
+
+  DiskInstancesCache::~DiskInstancesCache()
+  {
+    Purge();
+  }
+
+
+  SourceDicomInstance* DiskInstancesCache::Lookup(const std::string& instanceId)
+  {
+    if (!IsValidIdentifier(instanceId))
+    {
+      return NULL;
+    }
+
+    DicomInstanceInfo info;
+
+    {
+      boost::mutex::scoped_lock lock(mutex_);
+
+      policy_->RecordAccess(instanceId);
+
+      Content::const_iterator found = content_.find(instanceId);
+      if (found == content_.end())
+      {
+        missCount_++;
+        return NULL;
+      }
+
+      policy_->Touch(instanceId);
+      info = found->second;
+    }
+
+    // Map the file without holding the mutex
+    std::unique_ptr<SourceDicomInstance> instance;
+
+    try
+    {
+      instance.reset(new SourceDicomInstance(info, new MappedFile(GetPath(instanceId).string())));
+    }
+    catch (Orthanc::OrthancException& e)
+    {
+      LOG(WARNING) << "Cannot read instance " << instanceId
+                   << " from the disk cache of the transfers accelerator: " << e.What();
+
+      std::vector<std::string> removed;
+
+      {
+        boost::mutex::scoped_lock lock(mutex_);
+
+        if (content_.find(instanceId) != content_.end())
+        {
+          RemoveInternal(removed, instanceId);
+        }
+
+        missCount_++;
+      }
+
+      RemoveFiles(removed);
+      return NULL;
+    }
+
+    {
+      boost::mutex::scoped_lock lock(mutex_);
+      hitCount_++;
+    }
+
+    return instance.release();
+  }
+
+
+  void DiskInstancesCache::Store(const SourceDicomInstance& instance)
+  {
+    const std::string instanceId = instance.GetInfo().GetId();
+    const size_t size = instance.GetInfo().GetSize();
+
+    if (!IsValidIdentifier(instanceId) ||
+        instance.GetBuffer() == NULL)
+    {
+      return;
+    }
+
+    {
+      boost::mutex::scoped_lock lock(mutex_);
+
+      if (content_.find(instanceId) != content_.end() ||
+          writing_.find(instanceId) != writing_.end() ||
+          size > maxSize_ ||
+          !policy_->Admit(instanceId, size, size_ + size > maxSize_ ? size_ + size - maxSize_ : 0))
+      {
+        return;
+      }
+
+      writing_.insert(instanceId);
+    }
+
+    // Write the file without holding the mutex. The file is written
+    // under a temporary name, so that it is never read while partial.
+    const boost::filesystem::path target = GetPath(instanceId);
+    const boost::filesystem::path tmp = folder_ / (instanceId + TEMPORARY_EXTENSION);
+
+    bool success;
+
+    {
+      boost::filesystem::ofstream stream(tmp, std::ofstream::out | std::ofstream::binary);
+      stream.write(reinterpret_cast<const char*>(instance.GetBuffer()), size);
+      stream.close();
+      success = stream.good();
+    }
+
+    if (success)
+    {
+      boost::system::error_code error;
+      boost::filesystem::rename(tmp, target, error);
+      success = !error;
+    }
+
+    std::vector<std::string> removed;
+
+    {
+      boost::mutex::scoped_lock lock(mutex_);
+
+      writing_.erase(instanceId);
+
+      const bool cancelled = (cancelled_.erase(instanceId) > 0);
+
+      if (success &&
+          cancelled)
+      {
+        // The instance was removed while its file was being written
+        removed.push_back(target.string());
+      }
+      else if (success)
+      {
+        // Make room for the new instance
+        while (policy_->GetSize() > 0 &&
+               size_ + size > maxSize_)
+        {
+          RemoveInternal(removed, policy_->GetVictim());
+        }
+
+        policy_->Add(instanceId, size);
+        content_[instanceId] = instance.GetInfo();
+        size_ += size;
+        storedCount_++;
+      }
+    }
+
+    if (!success)
+    {
+      LOG(WARNING) << "Cannot write instance " << instanceId
+                   << " to the disk cache of the transfers accelerator in folder: " << folder_.string();
+      removed.push_back(tmp.string());
+    }
+
+    RemoveFiles(removed);
+  }
+
+
+  void DiskInstancesCache::Remove(const std::string& instanceId)
+  {
+    std::vector<std::string> removed;
+
+    {
+      boost::mutex::scoped_lock lock(mutex_);
+
+      if (content_.find(instanceId) != content_.end())
+      {
+        RemoveInternal(removed, instanceId);
+      }
+
+      CancelWriting(instanceId);
+    }
+
+    RemoveFiles(removed);
+  }
+
+
+  void DiskInstancesCache::RemoveByPrefix(const std::string& prefix)
+  {
+    std::vector<std::string> removed;
+
+    {
+      boost::mutex::scoped_lock lock(mutex_);
+
+      std::vector<std::string> keys;
+
+      for (Content::const_iterator it = content_.lower_bound(prefix);
+           it != content_.end() && it->first.compare(0, prefix.size(), prefix) == 0; ++it)
+      {
+        keys.push_back(it->first);
+      }
+
+      for (size_t i = 0; i < keys.size(); i++)
+      {
+        RemoveInternal(removed, keys[i]);
+      }
+
+      for (std::set<std::string>::const_iterator it = writing_.lower_bound(prefix);
+           it != writing_.end() && it->compare(0, prefix.size(), prefix) == 0; ++it)
+      {
+        cancelled_.insert(*it);
+      }
+    }
+
+    RemoveFiles(removed);
+  }
+
+
+  bool DiskInstancesCache::Contains(const std::string& instanceId)
+  {
+    boost::mutex::scoped_lock lock(mutex_);
+    return content_.find(instanceId) != content_.end();
+  }
+
+
+  size_t DiskInstancesCache::GetSize()
+  {
+    boost::mutex::scoped_lock lock(mutex_);
+    return size_;
+  }
+
+
+  size_t DiskInstancesCache::GetInstancesCount()
+  {
+    boost::mutex::scoped_lock lock(mutex_);
+    return content_.size();
+  }
+
+
+  size_t DiskInstancesCache::GetHitCount()
+  {
+    boost::mutex::scoped_lock lock(mutex_);
+    return hitCount_;
+  }
+
+
+  size_t DiskInstancesCache::GetMissCount()
+  {
+    boost::mutex::scoped_lock lock(mutex_);
+    return missCount_;
+  }
+
+
+  size_t DiskInstancesCache::GetStoredCount()
+  {
+    boost::mutex::scoped_lock lock(mutex_);
+    return storedCount_;
+  }
+}
@@ -0,0 +1,120 @@
+/**
+ * Transfers accelerator plugin for Orthanc
+ * Copyright (C) 2018-2023 Osimis S.A., Belgium
+ * Copyright (C) 2024-2026 Orthanc Team SRL, Belgium
+ * Copyright (C) 2021-2026 Sebastien Jodogne, ICTEAM UCLouvain, Belgium
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU Affero General Public License
+ * as published by the Free Software Foundation, either version 3 of
+ * the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Affero General Public License for more details.
+ * 
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ **/
+
+
+
+
+#pragma once
+
+#include "InstancesCachePolicy.h"
+#include "SourceDicomInstance.h"
+
+#include <boost/filesystem.hpp>
+#include <boost/thread/mutex.hpp>
+#include <set>
+
+namespace OrthancPlugins
+{
+  /**
+   * Second tier of the instances cache, that stores the instances
+   * that are evicted from the memory cache as files in a local
+   * folder (typically on a SSD). This avoids reading them again from
+   * the storage area of Orthanc, which is slow if it is a remote
+   * object storage. The files are memory-mapped when read back. The
+   * files are stored in a subfolder that is owned by the plugin,
+   * which is purged when the cache is created and destroyed.
+   **/
+  class DiskInstancesCache : public boost::noncopyable
+  {
+  private:
+    typedef std::map<std::string, DicomInstanceInfo>  Content;
+
+    boost::filesystem::path                 folder_;
+    boost::mutex                            mutex_;
+    std::unique_ptr<IInstancesCachePolicy>  policy_;
+    Content                                 content_;
+    std::set<std::string>                   writing_;   // Instances whose file is being written
+    std::set<std::string>                   cancelled_;  // Instances removed while being written
+    size_t                                  size_;
+    size_t                                  maxSize_;
+    size_t                                  hitCount_;
+    size_t                                  missCount_;
+    size_t                                  storedCount_;
+
+    boost::filesystem::path GetPath(const std::string& instanceId) const;
+
+    void Purge();
+
+    // The mutex must be locked!
+    void RemoveInternal(std::vector<std::string>& removed,
+                        const std::string& instanceId);
+
+    // The mutex must be locked!
+    void CancelWriting(const std::string& instanceId);
+
+    static void RemoveFiles(const std::vector<std::string>& paths);
+
+  public:
+    DiskInstancesCache(const std::string& folder,
+                       size_t maxSize,
+                       CachePolicy policy);
+
+    ~DiskInstancesCache();
+
+    // Returns NULL if the instance is not in the disk cache
+    SourceDicomInstance* Lookup(const std::string& instanceId);
+
+    // Writes the instance to the disk, if the policy admits it. Errors
+    // are only logged, as the instance can still be read from Orthanc.
+    void Store(const SourceDicomInstance& instance);
+
+    // Removes the instance, for instance if it was deleted from
+    // Orthanc, or if it was stored again with another content
+    void Remove(const std::string& instanceId);
+
+    // Removes all the entries whose key starts with the prefix (used
+    // for the pages of the instances that are read by ranges)
+    void RemoveByPrefix(const std::string& prefix);
+
+    bool Contains(const std::string& instanceId);
+
+    size_t GetSize();
+
+    size_t GetMaxSize() const
+    {
+      return maxSize_;
+    }
+
+    // The subfolder of the configured folder where the files are stored
+    const boost::filesystem::path& GetFolder() const
+    {
+      return folder_;
+    }
+
+    size_t GetInstancesCount();
+
+    size_t GetHitCount();
+
+    size_t GetMissCount();
+
+    // Number of instances that were written to the disk
+    size_t GetStoredCount();
+  };
+}
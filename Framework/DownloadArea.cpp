@@ -21,15 +21,16 @@
 
 #include "DownloadArea.h"
 
+#include "AutoCompression.h"
 #include "../Resources/Orthanc/Plugins/OrthancPluginCppWrapper.h"
 
-#include <Compression/GzipCompressor.h>
 #include <Logging.h>
 #include <SystemToolbox.h>
 
 #include <boost/filesystem.hpp>
 #include <boost/filesystem/fstream.hpp>
 
+
 namespace OrthancPlugins
 {
   static uint32_t commitWorkerThreadsCount = 1;
@@ -148,6 +149,8 @@ namespace OrthancPlugins
     std::string content;
     Orthanc::SystemToolbox::ReadFile(content, file_.GetPath());
 
+    // The digests of the buckets only protect the network transfer:
+    // The instance must still match the MD5 of the manifest
     std::string md5;
     Orthanc::Toolbox::ComputeMD5(md5, content);
 
@@ -189,7 +192,7 @@ namespace OrthancPlugins
   }
 
 
-  DownloadArea::Instance& DownloadArea::LookupInstance(const std::string& id)
+  DownloadArea::Instance& DownloadArea::LookupInstance(const CompactIdentifier& id)
   {
     boost::mutex::scoped_lock lock(instancesMutex_);
 
@@ -238,7 +241,7 @@ namespace OrthancPlugins
         throw Orthanc::OrthancException(Orthanc::ErrorCode_InternalError);
       }
 
-      Instance& instance = LookupInstance(bucket.GetChunkInstanceId(i));
+      Instance& instance = LookupInstance(bucket.GetChunkCompactId(i));
       instance.WriteChunk(offset, reinterpret_cast<const char*>(data) + pos, chunkSize);
 
       pos += chunkSize;
@@ -251,20 +254,19 @@ namespace OrthancPlugins
   }
 
 
-  void DownloadArea::Setup(const std::vector<DicomInstanceInfo>& instances)
+  void DownloadArea::AddInstances(const std::vector<DicomInstanceInfo>& instances)
   {
     boost::mutex::scoped_lock lock(instancesMutex_);
 
-    totalSize_ = 0;
-    
     for (size_t i = 0; i < instances.size(); i++)
     {
-      const std::string& id = instances[i].GetId();
+      const CompactIdentifier& id = instances[i].GetCompactId();
         
-      assert(instances_.find(id) == instances_.end());
-      instances_[id] = new Instance(instances[i]);
-
-      totalSize_ += instances[i].GetSize();
+      if (instances_.find(id) == instances_.end())
+      {
+        instances_[id] = new Instance(instances[i]);
+        totalSize_ += instances[i].GetSize();
+      }
     }
   }
 
@@ -361,28 +363,42 @@ namespace OrthancPlugins
   }
 
   DownloadArea::DownloadArea(const std::vector<DicomInstanceInfo>& instances)
-  : instancesToCommit_(0),
+  : totalSize_(0),
+    instancesToCommit_(0),
     workersShouldStop_(false)
   {
-    Setup(instances);
+    AddInstances(instances);
   }
 
 
   DownloadArea::DownloadArea(const TransferScheduler& scheduler)
-  : instancesToCommit_(0),
+  : totalSize_(0),
+    instancesToCommit_(0),
     workersShouldStop_(false)
   {
     std::vector<DicomInstanceInfo> instances;
     scheduler.ListInstances(instances);
-    Setup(instances);
+    AddInstances(instances);
   }
 
 
   void DownloadArea::WriteBucket(const TransferBucket& bucket,
                                  const void* data,
                                  size_t size,
-                                 BucketCompression compression)
+                                 BucketCompression compression,
+                                 const std::string& md5)
   {
+    if (!md5.empty())
+    {
+      std::string actual;
+      Orthanc::Toolbox::ComputeMD5(actual, data, size);
+
+      if (actual != md5)
+      {
+        throw Orthanc::OrthancException(Orthanc::ErrorCode_CorruptedFile, "Bad MD5 sum in a transfered bucket");
+      }
+    }
+
     switch (compression)
     {
       case BucketCompression_None:
@@ -390,10 +406,20 @@ namespace OrthancPlugins
         break;
           
       case BucketCompression_Gzip:
+      case BucketCompression_Zstd:
       {
+        // The size of the content is known from the bucket, which
+        // avoids trusting the compressed data to allocate the buffer
         std::string uncompressed;
-        Orthanc::GzipCompressor compressor;
-        compressor.Uncompress(uncompressed, data, size);
+        BlockCompression::Uncompress(uncompressed, data, size, bucket.GetTotalSize(), compression);
+        WriteUncompressedBucket(bucket, uncompressed.c_str(), uncompressed.size());
+        break;
+      }
+
+      case BucketCompression_Auto:
+      {
+        std::string uncompressed;
+        AutoCompression::Uncompress(uncompressed, data, size, bucket.GetTotalSize());
         WriteUncompressedBucket(bucket, uncompressed.c_str(), uncompressed.size());
         break;
       }
@@ -414,10 +440,12 @@ namespace OrthancPlugins
     {
       boost::mutex::scoped_lock lock(instancesMutex_);
 
-      Instances::const_iterator it = instances_.find(instanceId);
+      const CompactIdentifier id(instanceId);
+
+      Instances::const_iterator it = instances_.find(id);
       if (it == instances_.end() ||
           it->second == NULL ||
-          it->second->GetInfo().GetId() != instanceId ||
+          it->second->GetInfo().GetCompactId() != id ||
           it->second->GetInfo().GetSize() != size ||
           it->second->GetInfo().GetMD5() != md5)
       {
@@ -61,7 +61,7 @@ namespace OrthancPlugins
     };
 
 
-    typedef std::map<std::string, Instance*>   Instances;
+    typedef std::map<CompactIdentifier, Instance*>   Instances;
 
     boost::mutex  instancesMutex_;
     Instances     instances_;
@@ -78,14 +78,12 @@ namespace OrthancPlugins
 
     void ClearThreads();
 
-    Instance& LookupInstance(const std::string& id);
+    Instance& LookupInstance(const CompactIdentifier& id);
 
     void WriteUncompressedBucket(const TransferBucket& bucket,
                                  const void* data,
                                  size_t size);
 
-    void Setup(const std::vector<DicomInstanceInfo>& instances);
-    
     void CommitInternal(bool simulate);
 
     static void CommitWorker(DownloadArea* that);
@@ -99,6 +97,9 @@ namespace OrthancPlugins
       Clear();
     }
 
+    // The instances that are already part of the area are ignored
+    void AddInstances(const std::vector<DicomInstanceInfo>& instances);
+
     size_t GetTotalSize() const
     {
       return totalSize_;
@@ -107,7 +108,20 @@ namespace OrthancPlugins
     void WriteBucket(const TransferBucket& bucket,
                      const void* data,
                      size_t size,
-                     BucketCompression compression);
+                     BucketCompression compression)
+    {
+      WriteBucket(bucket, data, size, compression, "");
+    }
+
+    // If "md5" is not empty, it must be the MD5 of the bucket as it
+    // was sent (i.e. after compression). A bucket that doesn't match
+    // is rejected, so that it is sent again. The instances are still
+    // checked against the MD5 of the manifest on commit.
+    void WriteBucket(const TransferBucket& bucket,
+                     const void* data,
+                     size_t size,
+                     BucketCompression compression,
+                     const std::string& md5);
 
     void WriteInstance(const std::string& instanceId,
                        const void* data,
@@ -0,0 +1,255 @@
+/**
+ * Transfers accelerator plugin for Orthanc
+ * Copyright (C) 2018-2023 Osimis S.A., Belgium
+ * Copyright (C) 2024-2026 Orthanc Team SRL, Belgium
+ * Copyright (C) 2021-2026 Sebastien Jodogne, ICTEAM UCLouvain, Belgium
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU Affero General Public License
+ * as published by the Free Software Foundation, either version 3 of
+ * the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Affero General Public License for more details.
+ * 
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ **/
+
+
+
+#include "BandwidthDelayEstimator.h"
+
+#include <OrthancException.h>
+
+#include <algorithm>
+#include <cassert>
+
+
+namespace OrthancPlugins
+{
+  // Weight of the past queries, at each new query
+  static const double DECAY = 0.95;
+
+  // Minimum number of queries before the link is estimated
+  static const size_t MIN_QUERIES = 8;
+
+  // The buckets are sized so that the latency takes at most 20% of
+  // the duration of one query
+  static const double BDP_FACTOR = 4.0;
+
+
+  class BandwidthDelayEstimator::Link : public boost::noncopyable
+  {
+  private:
+    // Exponentially weighted sums for the regression "seconds = a + b * size"
+    size_t  count_;
+    double  w_;
+    double  x_;
+    double  y_;
+    double  xx_;
+    double  xy_;
+    double  uncompressed_;  // Exponentially weighted sum of the uncompressed sizes
+
+  public:
+    Link() :
+      count_(0),
+      w_(0),
+      x_(0),
+      y_(0),
+      xx_(0),
+      xy_(0),
+      uncompressed_(0)
+    {
+    }
+
+    void Add(double size,
+             double uncompressedSize,
+             double seconds)
+    {
+      count_++;
+      w_ = DECAY * w_ + 1.0;
+      x_ = DECAY * x_ + size;
+      y_ = DECAY * y_ + seconds;
+      xx_ = DECAY * xx_ + size * size;
+      xy_ = DECAY * xy_ + size * seconds;
+      uncompressed_ = DECAY * uncompressed_ + uncompressedSize;
+    }
+
+    // Ratio of the uncompressed size over the network size
+    double GetCompressionRatio() const
+    {
+      if (x_ <= 0 ||
+          uncompressed_ <= 0)
+      {
+        return 1;
+      }
+      else
+      {
+        return uncompressed_ / x_;
+      }
+    }
+
+    bool Estimate(double& rtt,
+                  double& throughput) const
+    {
+      if (count_ < MIN_QUERIES)
+      {
+        return false;
+      }
+
+      const double meanX = x_ / w_;
+      const double meanY = y_ / w_;
+      const double varX = xx_ / w_ - meanX * meanX;
+      const double covXY = xy_ / w_ - meanX * meanY;
+
+      if (meanX <= 0 ||
+          meanY <= 0)
+      {
+        return false;
+      }
+      else if (varX < 0.01 * meanX * meanX)
+      {
+        // The sizes of the queries are too similar to separate the
+        // latency from the transfer time: Assume a zero latency
+        rtt = 0;
+        throughput = meanX / meanY;
+        return true;
+      }
+
+      const double slope = covXY / varX;
+
+      if (slope <= 0)
+      {
+        // The duration does not depend on the size (e.g. the link is
+        // much faster than the peer): Only the latency matters
+        rtt = meanY;
+        throughput = meanX / meanY;
+      }
+      else
+      {
+        rtt = std::max(0.0, meanY - slope * meanX);
+        throughput = 1.0 / slope;
+      }
+
+      return true;
+    }
+  };
+
+
+  BandwidthDelayEstimator::BandwidthDelayEstimator(bool adaptive,
+                                                   size_t minBucketSize,
+                                                   size_t maxBucketSize) :
+    adaptive_(adaptive),
+    minBucketSize_(minBucketSize),
+    maxBucketSize_(maxBucketSize)
+  {
+    if (minBucketSize == 0 ||
+        minBucketSize > maxBucketSize)
+    {
+      throw Orthanc::OrthancException(Orthanc::ErrorCode_ParameterOutOfRange);
+    }
+  }
+
+
+  BandwidthDelayEstimator::~BandwidthDelayEstimator()
+  {
+    for (Links::iterator it = links_.begin(); it != links_.end(); ++it)
+    {
+      assert(it->second != NULL);
+      delete it->second;
+    }
+  }
+
+
+  void BandwidthDelayEstimator::RecordQuery(const std::string& peer,
+                                            size_t size,
+                                            size_t uncompressedSize,
+                                            double seconds)
+  {
+    if (size == 0 ||
+        seconds <= 0)
+    {
+      return;
+    }
+
+    boost::mutex::scoped_lock lock(mutex_);
+
+    Links::iterator found = links_.find(peer);
+
+    if (found == links_.end())
+    {
+      found = links_.insert(std::make_pair(peer, new Link)).first;
+    }
+
+    assert(found->second != NULL);
+    // The queries without a bucket are not compressed
+    found->second->Add(static_cast<double>(size),
+                       static_cast<double>(uncompressedSize == 0 ? size : uncompressedSize), seconds);
+  }
+
+
+  bool BandwidthDelayEstimator::LookupLink(double& rtt,
+                                           double& throughput,
+                                           const std::string& peer)
+  {
+    boost::mutex::scoped_lock lock(mutex_);
+
+    Links::const_iterator found = links_.find(peer);
+
+    if (found == links_.end())
+    {
+      return false;
+    }
+    else
+    {
+      assert(found->second != NULL);
+      return found->second->Estimate(rtt, throughput);
+    }
+  }
+
+
+  size_t BandwidthDelayEstimator::ComputeBucketSize(const std::string& peer,
+                                                    size_t defaultSize)
+  {
+    if (!adaptive_)
+    {
+      return defaultSize;
+    }
+
+    double rtt, throughput, ratio;
+
+    {
+      boost::mutex::scoped_lock lock(mutex_);
+
+      Links::const_iterator found = links_.find(peer);
+
+      if (found == links_.end() ||
+          !found->second->Estimate(rtt, throughput))
+      {
+        return defaultSize;
+      }
+
+      ratio = found->second->GetCompressionRatio();
+    }
+
+    // Uncompressed bytes, as the buckets are planned from the size of
+    // their instances
+    const double size = BDP_FACTOR * rtt * throughput * ratio;
+
+    if (size <= static_cast<double>(minBucketSize_))
+    {
+      return minBucketSize_;
+    }
+    else if (size >= static_cast<double>(maxBucketSize_))
+    {
+      return maxBucketSize_;
+    }
+    else
+    {
+      return static_cast<size_t>(size);
+    }
+  }
+}
@@ -0,0 +1,91 @@
+/**
+ * Transfers accelerator plugin for Orthanc
+ * Copyright (C) 2018-2023 Osimis S.A., Belgium
+ * Copyright (C) 2024-2026 Orthanc Team SRL, Belgium
+ * Copyright (C) 2021-2026 Sebastien Jodogne, ICTEAM UCLouvain, Belgium
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU Affero General Public License
+ * as published by the Free Software Foundation, either version 3 of
+ * the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Affero General Public License for more details.
+ * 
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ **/
+
+
+
+#pragma once
+
+#include <boost/noncopyable.hpp>
+#include <boost/thread/mutex.hpp>
+#include <map>
+#include <string>
+
+
+namespace OrthancPlugins
+{
+  /**
+   * Estimates the round-trip time and the throughput of the links to
+   * the peers, from the durations of the HTTP queries that transfer
+   * the buckets. The duration of one query is modeled as "RTT + size
+   * / throughput", whose parameters are fitted by a linear regression
+   * that gives more weight to the recent queries. The round-trip time
+   * also absorbs the fixed costs of the peer (e.g. reading the storage).
+   *
+   * The size of the buckets is chosen so that the latency only takes
+   * a small fraction of the duration of each query, i.e. a few times
+   * the bandwidth-delay product of the link. The link carries the
+   * compressed buckets, whereas the buckets are planned from the
+   * uncompressed size of their instances: The bandwidth-delay product
+   * is scaled by the compression ratio measured on the same queries.
+   **/
+  class BandwidthDelayEstimator : public boost::noncopyable
+  {
+  private:
+    class Link;
+
+    typedef std::map<std::string, Link*>  Links;
+
+    boost::mutex  mutex_;
+    Links         links_;
+    bool          adaptive_;
+    size_t        minBucketSize_;
+    size_t        maxBucketSize_;
+
+  public:
+    BandwidthDelayEstimator(bool adaptive,
+                            size_t minBucketSize,
+                            size_t maxBucketSize);
+
+    ~BandwidthDelayEstimator();
+
+    bool IsAdaptive() const
+    {
+      return adaptive_;
+    }
+
+    // "size" is the number of bytes on the network, and
+    // "uncompressedSize" the size of the bucket they carry
+    void RecordQuery(const std::string& peer,
+                     size_t size,
+                     size_t uncompressedSize,
+                     double seconds);
+
+    // Returns "false" if not enough queries were recorded for this
+    // peer. The throughput is measured on the network bytes.
+    bool LookupLink(double& rtt /* out, in seconds */,
+                    double& throughput /* out, in bytes per second */,
+                    const std::string& peer);
+
+    // Returns "defaultSize" if the adaptive bucket size is disabled,
+    // or if the link to the peer is not known yet
+    size_t ComputeBucketSize(const std::string& peer,
+                             size_t defaultSize);
+  };
+}
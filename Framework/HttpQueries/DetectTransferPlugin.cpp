@@ -48,7 +48,8 @@ namespace OrthancPlugins
 
 
   void DetectTransferPlugin::HandleAnswer(const void* answer,
-                                          size_t size)
+                                          size_t size,
+                                          const std::map<std::string, std::string>& answerHeaders)
   {
     Json::Value value;
 
@@ -63,7 +63,8 @@ namespace OrthancPlugins
     virtual void ReadBody(std::string& body) const ORTHANC_OVERRIDE;
 
     virtual void HandleAnswer(const void* answer,
-                              size_t size) ORTHANC_OVERRIDE;
+                              size_t size,
+                              const std::map<std::string, std::string>& answerHeaders) ORTHANC_OVERRIDE;
 
     virtual void GetHttpHeaders(std::map<std::string, std::string>& headers) const ORTHANC_OVERRIDE
     {/* no headers for this general purpose request*/}
@@ -24,11 +24,95 @@
 #include <Logging.h>
 #include <OrthancException.h>
 
+#include <algorithm>
+
 namespace OrthancPlugins
 {
+  // Number of times a query whose answer is corrupted is retried, in
+  // addition to the "MaxHttpRetries" configuration
+  static const unsigned int MAX_CORRUPTED_RETRIES = 3;
+
+
+  // Same as "OrthancPeers::DoPut()", but also reports the HTTP status
+  // of the answer, as the receiver of a bucket uses a dedicated status
+  // if the bucket was corrupted during the transfer
+  static bool DoPutWithStatus(uint16_t& status,
+                              const std::string& peer,
+                              const std::string& uri,
+                              const std::string& body,
+                              const std::map<std::string, std::string>& headers,
+                              unsigned int timeout)
+  {
+    status = 0;
+
+    OrthancPluginContext* context = GetGlobalContext();
+
+    OrthancPluginPeers* peers = OrthancPluginGetPeers(context);
+    if (peers == NULL)
+    {
+      throw Orthanc::OrthancException(Orthanc::ErrorCode_InternalError);
+    }
+
+    std::vector<const char*> keys, values;
+    keys.reserve(headers.size());
+    values.reserve(headers.size());
+
+    for (std::map<std::string, std::string>::const_iterator it = headers.begin(); it != headers.end(); ++it)
+    {
+      keys.push_back(it->first.c_str());
+      values.push_back(it->second.c_str());
+    }
+
+    bool success = false;
+
+    const uint32_t count = OrthancPluginGetPeersCount(context, peers);
+
+    for (uint32_t i = 0; i < count; i++)
+    {
+      const char* name = OrthancPluginGetPeerName(context, peers, i);
+
+      if (name != NULL &&
+          peer == name)
+      {
+        MemoryBuffer answer;
+        OrthancPluginErrorCode code = OrthancPluginCallPeerApi(
+          context, *answer, NULL, &status, peers, i, OrthancPluginHttpMethod_Put, uri.c_str(),
+          static_cast<uint32_t>(keys.size()), keys.empty() ? NULL : &keys[0], values.empty() ? NULL : &values[0],
+          body.empty() ? NULL : body.c_str(), static_cast<uint32_t>(body.size()), timeout);
+
+        success = (code == OrthancPluginErrorCode_Success &&
+                   status == 200);
+        break;
+      }
+    }
+
+    OrthancPluginFreePeers(context, peers);
+
+    return success;
+  }
+
+
+  static bool LookupPeerIndex(size_t& index,
+                              const OrthancPeers& peers,
+                              const std::string& name)
+  {
+    for (size_t i = 0; i < peers.GetPeersCount(); i++)
+    {
+      if (peers.GetPeerName(i) == name)
+      {
+        index = i;
+        return true;
+      }
+    }
+
+    return false;
+  }
+
+
   HttpQueriesQueue::Status HttpQueriesQueue::GetStatusInternal() const
   {
-    if (successQueries_ == queries_.size())
+    if (successQueries_ == queries_.size() &&
+        !isIncomplete_)
     {
       return Status_Success;
     }
@@ -44,7 +128,9 @@ namespace OrthancPlugins
 
 
   HttpQueriesQueue::HttpQueriesQueue() :
-    maxRetries_(0)
+    maxRetries_(0),
+    isIncomplete_(false),
+    estimator_(NULL)
   {
     Reset();
   }
@@ -102,6 +188,81 @@ namespace OrthancPlugins
     {
       boost::mutex::scoped_lock lock(mutex_);
       queries_.push_back(query);
+      queryAvailable_.notify_one();
+    }
+  }
+
+
+  void HttpQueriesQueue::SetIncomplete(bool incomplete)
+  {
+    boost::mutex::scoped_lock lock(mutex_);
+    isIncomplete_ = incomplete;
+
+    if (!incomplete)
+    {
+      // Wake up the workers that wait for new queries
+      queryAvailable_.notify_all();
+
+      if (successQueries_ == queries_.size())
+      {
+        completed_.notify_all();
+      }
+    }
+  }
+
+
+  void HttpQueriesQueue::SetBandwidthDelayEstimator(BandwidthDelayEstimator& estimator)
+  {
+    boost::mutex::scoped_lock lock(mutex_);
+    estimator_ = &estimator;
+  }
+
+
+  void HttpQueriesQueue::ReplanPendingQueries(IPlanner& planner)
+  {
+    boost::mutex::scoped_lock lock(mutex_);
+
+    if (isFailure_)
+    {
+      return;
+    }
+
+    std::vector<const IHttpQuery*> pending(queries_.begin() + position_, queries_.end());
+
+    std::vector<IHttpQuery*> replacement;
+
+    try
+    {
+      planner.Replan(replacement, pending);
+    }
+    catch (...)
+    {
+      for (size_t i = 0; i < replacement.size(); i++)
+      {
+        delete replacement[i];
+      }
+
+      throw;
+    }
+
+    for (size_t i = 0; i < pending.size(); i++)
+    {
+      assert(pending[i] != NULL);
+      delete pending[i];
+    }
+
+    queries_.resize(position_);
+    queries_.insert(queries_.end(), replacement.begin(), replacement.end());
+
+    if (!replacement.empty())
+    {
+      queryAvailable_.notify_all();
+    }
+
+    if (successQueries_ == queries_.size() &&
+        !isIncomplete_)
+    {
+      completed_.notify_all();
     }
   }
     
@@ -112,12 +273,30 @@ namespace OrthancPlugins
       
     unsigned int maxRetries;
     IHttpQuery* query = NULL;
+    BandwidthDelayEstimator* estimator;
 
     {
       boost::mutex::scoped_lock lock(mutex_);
 
       maxRetries = maxRetries_;
+      estimator = estimator_;
         
+      if (position_ == queries_.size() &&
+          isIncomplete_ &&
+          !isFailure_)
+      {
+        // Wait for the next queries, but return regularly so that
+        // the runner can stop its workers
+        queryAvailable_.timed_wait(lock, boost::posix_time::milliseconds(100));
+
+        if (position_ == queries_.size() &&
+            isIncomplete_ &&
+            !isFailure_)
+        {
+          return true;
+        }
+      }
+
       if (position_ == queries_.size() ||
           isFailure_)
       {
@@ -130,6 +309,23 @@ namespace OrthancPlugins
       }
     }
 
+    if (!query->Prepare())
+    {
+      boost::mutex::scoped_lock lock(mutex_);
+
+      // The query is still among the ones being processed, which are
+      // never modified by "ReplanPendingQueries()"
+      std::vector<IHttpQuery*>::iterator found = std::find(queries_.begin(), queries_.begin() + position_, query);
+      assert(found != queries_.begin() + position_);
+
+      queries_.erase(found);
+      queries_.push_back(query);
+      position_--;
+
+      queryAvailable_.notify_one();
+      return true;
+    }
+
     std::string body;
 
     if (query->GetMethod() == Orthanc::HttpMethod_Post ||
@@ -141,13 +337,17 @@ namespace OrthancPlugins
     std::map<std::string, std::string> headers;
     query->GetHttpHeaders(headers);
 
-    unsigned int retry = 0;
+    RetryBudget budget(maxRetries, MAX_CORRUPTED_RETRIES);
 
     for (;;)
     {
       MemoryBuffer answer;
+      std::map<std::string, std::string> answerHeaders;
 
       bool success;
+      bool corrupted = false;
+
+      const boost::posix_time::ptime start = boost::posix_time::microsec_clock::universal_time();
 
       try
       {
@@ -158,12 +358,32 @@ namespace OrthancPlugins
             break;
 
           case Orthanc::HttpMethod_Post:
-            success = peers_.DoPost(answer, query->GetPeer(), query->GetUri(), body, headers);
+          {
+            // Only this flavor of "DoPost()" gives access to the HTTP
+            // headers of the answer
+            size_t index;
+            success = (LookupPeerIndex(index, peers_, query->GetPeer()) &&
+                       peers_.DoPost(answer, answerHeaders, index, query->GetUri(), body, headers, peers_.GetTimeout()));
             break;
+          }
 
           case Orthanc::HttpMethod_Put:
-            success = peers_.DoPut(query->GetPeer(), query->GetUri(), body, headers);
+          {
+            uint16_t status;
+            success = DoPutWithStatus(status, query->GetPeer(), query->GetUri(), body, headers, peers_.GetTimeout());
+
+            if (!success &&
+                query->IsCorruptedAnswer(status))
+            {
+              // The query is retried on its own, as for the corrupted
+              // answers to the GET/POST queries
+              LOG(ERROR) << "Peer \"" << query->GetPeer() << "\" has received a corrupted body for "
+                         << query->GetUri();
+              corrupted = true;
+            }
+
             break;
+          }
 
           case Orthanc::HttpMethod_Delete:
             success = peers_.DoDelete(query->GetPeer(), query->GetUri(), headers);
@@ -180,15 +400,36 @@ namespace OrthancPlugins
         success = false;
       }
 
+      const boost::posix_time::ptime end = boost::posix_time::microsec_clock::universal_time();
+
+      const bool hasAnswer = (query->GetMethod() == Orthanc::HttpMethod_Get ||
+                              query->GetMethod() == Orthanc::HttpMethod_Post);
+
+      if (success &&
+          hasAnswer)
+      {
+        try
+        {
+          query->HandleAnswer(answer.GetData(), answer.GetSize(), answerHeaders);
+        }
+        catch (Orthanc::OrthancException& e)
+        {
+          // For instance, a bucket that was corrupted during the
+          // transfer: The query is retried on its own
+          LOG(ERROR) << "Cannot handle the answer to an HTTP query to peer \""
+                     << query->GetPeer() << " " << query->GetUri() << "\": " << e.What();
+          success = false;
+          corrupted = (e.GetErrorCode() == Orthanc::ErrorCode_CorruptedFile);
+        }
+      }
+
       if (success)
       {
         size_t downloaded = 0;
         size_t uploaded = 0;
 
-        if (query->GetMethod() == Orthanc::HttpMethod_Get ||
-            query->GetMethod() == Orthanc::HttpMethod_Post)
+        if (hasAnswer)
         {
-          query->HandleAnswer(answer.GetData(), answer.GetSize());
           downloaded = answer.GetSize();
         }
 
@@ -199,6 +440,16 @@ namespace OrthancPlugins
         }
           
         networkTraffic = downloaded + uploaded;
+
+        if (estimator != NULL &&
+            query->GetMethod() != Orthanc::HttpMethod_Delete)
+        {
+          estimator->RecordQuery(query->GetPeer(), networkTraffic, query->GetUncompressedSize(),
+                                 static_cast<double>((end - start).total_microseconds()) / 1000000.0);
+        }
+
+        // Before the completion of the queue is signaled
+        query->NotifyCompleted(true);
             
         {
           boost::mutex::scoped_lock lock(mutex_);
@@ -206,31 +457,36 @@ namespace OrthancPlugins
           uploadedSize_ += uploaded;
           successQueries_ ++;
 
-          if (successQueries_ == queries_.size())
+          if (successQueries_ == queries_.size() &&
+              !isIncomplete_)
           {
             completed_.notify_all();
           }
-
-          return true;
         }
+
+        return true;
       }
       else
       {
         // Error: Let's retry
-        retry ++;
-
-        if (retry <= maxRetries)
+        if (budget.Retry(corrupted))
         {
-          // Wait 1 second before retrying
-          boost::this_thread::sleep(boost::posix_time::seconds(1));
+          if (!corrupted)
+          {
+            // Wait 1 second before retrying, the peer might be busy
+            boost::this_thread::sleep(boost::posix_time::seconds(1));
+          }
         }
         else
         {
-          if (maxRetries > 0)
+          if (maxRetries > 0 ||
+              corrupted)
           {
             LOG(ERROR) << "Reached the maximum number of retries for a HTTP query to peer " << query->GetPeer() <<  " " << query->GetUri();
           }
 
+          query->NotifyCompleted(false);
+
           {
             boost::mutex::scoped_lock lock(mutex_);
             isFailure_ = true;
@@ -21,6 +21,7 @@
 
 #pragma once
 
+#include "BandwidthDelayEstimator.h"
 #include "IHttpQuery.h"
 
 #include "../../Resources/Orthanc/Plugins/OrthancPluginCppWrapper.h"
@@ -41,10 +42,60 @@ namespace OrthancPlugins
       Status_Failure
     };
 
+    class IPlanner : public boost::noncopyable
+    {
+    public:
+      virtual ~IPlanner()
+      {
+      }
+
+      // Creates the queries that replace the queries that are not
+      // started yet. Called while the mutex of the queue is locked.
+      virtual void Replan(std::vector<IHttpQuery*>& target,
+                          const std::vector<const IHttpQuery*>& pending) = 0;
+    };
+
+    // Tells whether a failed query can be retried. The corrupted
+    // answers (e.g. a bucket whose digest does not match) have their
+    // own budget, as they are retried even if "maxRetries" is zero.
+    class RetryBudget
+    {
+    private:
+      unsigned int  maxRetries_;
+      unsigned int  maxCorruptedRetries_;
+      unsigned int  retries_;
+      unsigned int  corruptedRetries_;
+
+    public:
+      RetryBudget(unsigned int maxRetries,
+                  unsigned int maxCorruptedRetries) :
+        maxRetries_(maxRetries),
+        maxCorruptedRetries_(maxCorruptedRetries),
+        retries_(0),
+        corruptedRetries_(0)
+      {
+      }
+
+      bool Retry(bool corrupted)
+      {
+        if (corrupted)
+        {
+          corruptedRetries_++;
+          return corruptedRetries_ <= maxCorruptedRetries_;
+        }
+        else
+        {
+          retries_++;
+          return retries_ <= maxRetries_;
+        }
+      }
+    };
+
   private:
     OrthancPeers                  peers_;
     boost::mutex                  mutex_;
     boost::condition_variable     completed_;
+    boost::condition_variable     queryAvailable_;
     std::vector<IHttpQuery*>      queries_;
     unsigned int                  maxRetries_;
 
@@ -53,6 +104,8 @@ namespace OrthancPlugins
     uint64_t                      uploadedSize_;     // PUT body + POST body
     size_t                        successQueries_;
     bool                          isFailure_;
+    bool                          isIncomplete_;
+    BandwidthDelayEstimator*      estimator_;
 
 
     Status GetStatusInternal() const;
@@ -77,6 +130,18 @@ namespace OrthancPlugins
 
     void Enqueue(IHttpQuery* query);  // Takes ownership
 
+    // The durations of the successful queries will be recorded by
+    // this estimator, whose lifetime must exceed the one of the queue
+    void SetBandwidthDelayEstimator(BandwidthDelayEstimator& estimator);
+
+    // While the queue is incomplete, more queries will be enqueued:
+    // The workers wait for them, and the queue is not successful yet
+    void SetIncomplete(bool incomplete);
+
+    // Atomically replaces the queries that are not started yet by
+    // the ones created by the planner
+    void ReplanPendingQueries(IPlanner& planner);
+
     bool ExecuteOneQuery(size_t& networkTraffic);
 
     Status WaitComplete(unsigned int timeoutMS);
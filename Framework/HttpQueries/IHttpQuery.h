@@ -23,6 +23,7 @@
 
 #include <Enumerations.h>
 #include <map>
+#include <stdint.h>
 
 #include <boost/noncopyable.hpp>
 
@@ -38,15 +39,48 @@ namespace OrthancPlugins
 
     virtual Orthanc::HttpMethod GetMethod() const = 0;
 
+    // Called by the worker before the query is sent. Returns "false"
+    // if the resources of the query are not available yet (e.g. the
+    // budget of the pinned instances is exhausted), in which case the
+    // query is moved to the end of the queue to be tried again later.
+    virtual bool Prepare()
+    {
+      return true;
+    }
+
     virtual const std::string& GetPeer() const = 0;
 
     virtual const std::string& GetUri() const = 0;
 
     virtual void ReadBody(std::string& body) const = 0;   // Only for PUT/POST
 
+    // The HTTP headers of the answer are only available for POST
+    // queries (they are empty for GET queries)
     virtual void HandleAnswer(const void* answer,
-                              size_t size) = 0;
+                              size_t size,
+                              const std::map<std::string, std::string>& answerHeaders) = 0;
 
     virtual void GetHttpHeaders(std::map<std::string, std::string>& headers) const = 0;
+
+    // Tells whether a failed PUT query was rejected by the peer because
+    // its body was corrupted during the transfer, in which case it is
+    // retried even if "MaxHttpRetries" is zero
+    virtual bool IsCorruptedAnswer(uint16_t httpStatus) const
+    {
+      return false;
+    }
+
+    // Number of bytes of DICOM data that are carried by the query once
+    // uncompressed, or zero if it does not carry a bucket
+    virtual size_t GetUncompressedSize() const
+    {
+      return 0;
+    }
+
+    // Called once the query is over, either because it has succeeded,
+    // or because it has failed after all its retries
+    virtual void NotifyCompleted(bool success)
+    {
+    }
   };
 }
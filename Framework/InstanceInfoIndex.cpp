@@ -0,0 +1,156 @@
+/**
+ * Transfers accelerator plugin for Orthanc
+ * Copyright (C) 2018-2023 Osimis S.A., Belgium
+ * Copyright (C) 2024-2026 Orthanc Team SRL, Belgium
+ * Copyright (C) 2021-2026 Sebastien Jodogne, ICTEAM UCLouvain, Belgium
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU Affero General Public License
+ * as published by the Free Software Foundation, either version 3 of
+ * the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Affero General Public License for more details.
+ * 
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ **/
+
+
+
+
+#include "InstanceInfoIndex.h"
+
+#include <OrthancException.h>
+
+
+namespace OrthancPlugins
+{
+  InstanceInfoIndex::InstanceInfoIndex(size_t maxSize) :
+    maxSize_(maxSize),
+    hitCount_(0),
+    missCount_(0)
+  {
+    if (maxSize == 0)
+    {
+      throw Orthanc::OrthancException(Orthanc::ErrorCode_ParameterOutOfRange);
+    }
+  }
+
+
+  void InstanceInfoIndex::RegisterInternal(const DicomInstanceInfo& info)
+  {
+    if (index_.Contains(info.GetId()))
+    {
+      index_.MakeMostRecent(info.GetId(), info);
+    }
+    else
+    {
+      while (index_.GetSize() >= maxSize_)
+      {
+        index_.RemoveOldest();
+      }
+
+      index_.Add(info.GetId(), info);
+    }
+  }
+
+
+  void InstanceInfoIndex::Register(const DicomInstanceInfo& info)
+  {
+    if (info.GetMD5().empty())
+    {
+      throw Orthanc::OrthancException(Orthanc::ErrorCode_ParameterOutOfRange);
+    }
+
+    boost::mutex::scoped_lock lock(mutex_);
+    RegisterInternal(info);
+  }
+
+
+  void InstanceInfoIndex::RegisterSize(const std::string& instanceId,
+                                       size_t size)
+  {
+    boost::mutex::scoped_lock lock(mutex_);
+
+    DicomInstanceInfo existing;
+    if (!index_.Contains(instanceId, existing) ||
+        existing.GetMD5().empty())
+    {
+      RegisterInternal(DicomInstanceInfo(instanceId, size, ""));
+    }
+  }
+
+
+  void InstanceInfoIndex::Forget(const std::string& instanceId)
+  {
+    boost::mutex::scoped_lock lock(mutex_);
+
+    if (index_.Contains(instanceId))
+    {
+      index_.Invalidate(instanceId);
+    }
+  }
+
+
+  bool InstanceInfoIndex::Lookup(DicomInstanceInfo& target,
+                                 const std::string& instanceId)
+  {
+    boost::mutex::scoped_lock lock(mutex_);
+
+    if (index_.Contains(instanceId, target) &&
+        !target.GetMD5().empty())
+    {
+      index_.MakeMostRecent(instanceId);
+      hitCount_++;
+      return true;
+    }
+    else
+    {
+      missCount_++;
+      return false;
+    }
+  }
+
+
+  bool InstanceInfoIndex::LookupSize(size_t& size,
+                                     const std::string& instanceId)
+  {
+    boost::mutex::scoped_lock lock(mutex_);
+
+    DicomInstanceInfo info;
+    if (index_.Contains(instanceId, info))
+    {
+      index_.MakeMostRecent(instanceId);
+      size = info.GetSize();
+      return true;
+    }
+    else
+    {
+      return false;
+    }
+  }
+
+
+  size_t InstanceInfoIndex::GetSize()
+  {
+    boost::mutex::scoped_lock lock(mutex_);
+    return index_.GetSize();
+  }
+
+
+  size_t InstanceInfoIndex::GetHitCount()
+  {
+    boost::mutex::scoped_lock lock(mutex_);
+    return hitCount_;
+  }
+
+
+  size_t InstanceInfoIndex::GetMissCount()
+  {
+    boost::mutex::scoped_lock lock(mutex_);
+    return missCount_;
+  }
+}
@@ -0,0 +1,78 @@
+/**
+ * Transfers accelerator plugin for Orthanc
+ * Copyright (C) 2018-2023 Osimis S.A., Belgium
+ * Copyright (C) 2024-2026 Orthanc Team SRL, Belgium
+ * Copyright (C) 2021-2026 Sebastien Jodogne, ICTEAM UCLouvain, Belgium
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU Affero General Public License
+ * as published by the Free Software Foundation, either version 3 of
+ * the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Affero General Public License for more details.
+ * 
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ **/
+
+
+
+
+#pragma once
+
+#include "DicomInstanceInfo.h"
+
+#include <Cache/LeastRecentlyUsedIndex.h>
+
+#include <boost/thread/mutex.hpp>
+
+namespace OrthancPlugins
+{
+  /**
+   * Bounded index of the size and MD5 of the DICOM instances, which
+   * allows to schedule transfers without reading the DICOM files. If
+   * Orthanc does not store the MD5 of the attachments, the index can
+   * also hold the size alone, which is enough to decide how to read
+   * an instance.
+   **/
+  class InstanceInfoIndex : public boost::noncopyable
+  {
+  private:
+    typedef Orthanc::LeastRecentlyUsedIndex<std::string, DicomInstanceInfo>  Index;
+
+    boost::mutex  mutex_;
+    Index         index_;
+    size_t        maxSize_;
+    size_t        hitCount_;
+    size_t        missCount_;
+
+    void RegisterInternal(const DicomInstanceInfo& info);
+
+  public:
+    explicit InstanceInfoIndex(size_t maxSize);
+
+    void Register(const DicomInstanceInfo& info);
+
+    // Does nothing if the MD5 of the instance is already known
+    void RegisterSize(const std::string& instanceId,
+                      size_t size);
+
+    void Forget(const std::string& instanceId);
+
+    // Only succeeds if both the size and the MD5 are known
+    bool Lookup(DicomInstanceInfo& target,
+                const std::string& instanceId);
+
+    bool LookupSize(size_t& size,
+                    const std::string& instanceId);
+
+    size_t GetSize();
+
+    size_t GetHitCount();
+
+    size_t GetMissCount();
+  };
+}
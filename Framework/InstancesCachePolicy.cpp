@@ -0,0 +1,363 @@
+/**
+ * Transfers accelerator plugin for Orthanc
+ * Copyright (C) 2018-2023 Osimis S.A., Belgium
+ * Copyright (C) 2024-2026 Orthanc Team SRL, Belgium
+ * Copyright (C) 2021-2026 Sebastien Jodogne, ICTEAM UCLouvain, Belgium
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU Affero General Public License
+ * as published by the Free Software Foundation, either version 3 of
+ * the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Affero General Public License for more details.
+ * 
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ **/
+
+
+
+
+#include "InstancesCachePolicy.h"
+
+#include <OrthancException.h>
+
+#include <algorithm>
+#include <boost/functional/hash.hpp>
+#include <cassert>
+
+
+// Number of distinct instances whose accesses are considered as
+// belonging to the current burst
+static const size_t BURST_WINDOW = 8;
+
+
+namespace OrthancPlugins
+{
+  IInstancesCachePolicy* IInstancesCachePolicy::Create(CachePolicy policy)
+  {
+    switch (policy)
+    {
+      case CachePolicy_LRU:
+        return new SegmentedLruPolicy(false);
+
+      case CachePolicy_SLRU:
+        return new SegmentedLruPolicy(true);
+
+      case CachePolicy_TinyLFU:
+        return new TinyLfuPolicy;
+
+      default:
+        throw Orthanc::OrthancException(Orthanc::ErrorCode_ParameterOutOfRange);
+    }
+  }
+
+
+  void SegmentedLruPolicy::Demote()
+  {
+    // Move the oldest protected instances back to the probation segment
+    while (protectedSize_ > protectedCapacity_ &&
+           !protected_.empty())
+    {
+      std::string instanceId = protected_.back();
+      protected_.pop_back();
+
+      Entries::iterator entry = entries_.find(instanceId);
+      assert(entry != entries_.end() &&
+             entry->second.protected_);
+
+      probation_.push_front(instanceId);
+      entry->second.protected_ = false;
+      entry->second.position_ = probation_.begin();
+
+      assert(protectedSize_ >= entry->second.size_);
+      protectedSize_ -= entry->second.size_;
+    }
+  }
+
+
+  size_t SegmentedLruPolicy::GetEntrySize(const std::string& instanceId) const
+  {
+    Entries::const_iterator entry = entries_.find(instanceId);
+
+    if (entry == entries_.end())
+    {
+      throw Orthanc::OrthancException(Orthanc::ErrorCode_InexistentItem);
+    }
+    else
+    {
+      return entry->second.size_;
+    }
+  }
+
+
+  void SegmentedLruPolicy::ListVictims(std::vector<std::string>& victims,
+                                       size_t toFree) const
+  {
+    victims.clear();
+
+    size_t freed = 0;
+
+    for (Queue::const_reverse_iterator it = probation_.rbegin();
+         it != probation_.rend() && freed < toFree; ++it)
+    {
+      victims.push_back(*it);
+      freed += GetEntrySize(*it);
+    }
+
+    for (Queue::const_reverse_iterator it = protected_.rbegin();
+         it != protected_.rend() && freed < toFree; ++it)
+    {
+      victims.push_back(*it);
+      freed += GetEntrySize(*it);
+    }
+  }
+
+
+  SegmentedLruPolicy::SegmentedLruPolicy(bool segmented) :
+    segmented_(segmented),
+    protectedSize_(0),
+    protectedCapacity_(0)
+  {
+  }
+
+
+  bool SegmentedLruPolicy::IsBurst(const std::string& instanceId) const
+  {
+    for (RecentAccesses::const_iterator it = recentAccesses_.begin(); it != recentAccesses_.end(); ++it)
+    {
+      if (it->first == instanceId)
+      {
+        return it->second;
+      }
+    }
+
+    return false;
+  }
+
+
+  void SegmentedLruPolicy::RecordAccess(const std::string& instanceId)
+  {
+    for (RecentAccesses::iterator it = recentAccesses_.begin(); it != recentAccesses_.end(); ++it)
+    {
+      if (it->first == instanceId)
+      {
+        it->second = true;
+        return;
+      }
+    }
+
+    recentAccesses_.push_front(std::make_pair(instanceId, false));
+
+    if (recentAccesses_.size() > BURST_WINDOW)
+    {
+      recentAccesses_.pop_back();
+    }
+  }
+
+
+  void SegmentedLruPolicy::Touch(const std::string& instanceId)
+  {
+    Entries::iterator entry = entries_.find(instanceId);
+
+    if (entry == entries_.end())
+    {
+      throw Orthanc::OrthancException(Orthanc::ErrorCode_InexistentItem);
+    }
+
+    if (entry->second.protected_)
+    {
+      protected_.splice(protected_.begin(), protected_, entry->second.position_);
+    }
+    else if (segmented_ &&
+             !IsBurst(instanceId))
+    {
+      // Second access: Promote the instance to the protected segment
+      probation_.erase(entry->second.position_);
+      protected_.push_front(instanceId);
+      entry->second.protected_ = true;
+      entry->second.position_ = protected_.begin();
+      protectedSize_ += entry->second.size_;
+      Demote();
+    }
+    else
+    {
+      probation_.splice(probation_.begin(), probation_, entry->second.position_);
+    }
+  }
+
+
+  void SegmentedLruPolicy::Add(const std::string& instanceId,
+                               size_t size)
+  {
+    if (entries_.find(instanceId) != entries_.end())
+    {
+      throw Orthanc::OrthancException(Orthanc::ErrorCode_BadSequenceOfCalls);
+    }
+
+    probation_.push_front(instanceId);
+
+    Entry& entry = entries_[instanceId];
+    entry.size_ = size;
+    entry.protected_ = false;
+    entry.position_ = probation_.begin();
+  }
+
+
+  void SegmentedLruPolicy::Remove(const std::string& instanceId)
+  {
+    Entries::iterator entry = entries_.find(instanceId);
+
+    if (entry == entries_.end())
+    {
+      throw Orthanc::OrthancException(Orthanc::ErrorCode_InexistentItem);
+    }
+
+    if (entry->second.protected_)
+    {
+      protected_.erase(entry->second.position_);
+      assert(protectedSize_ >= entry->second.size_);
+      protectedSize_ -= entry->second.size_;
+    }
+    else
+    {
+      probation_.erase(entry->second.position_);
+    }
+
+    entries_.erase(entry);
+  }
+
+
+  const std::string& SegmentedLruPolicy::GetVictim() const
+  {
+    if (!probation_.empty())
+    {
+      return probation_.back();
+    }
+    else if (!protected_.empty())
+    {
+      return protected_.back();
+    }
+    else
+    {
+      throw Orthanc::OrthancException(Orthanc::ErrorCode_BadSequenceOfCalls);
+    }
+  }
+
+
+  void SegmentedLruPolicy::SetCapacity(size_t capacity)
+  {
+    // 80% of the capacity is reserved for the protected segment
+    protectedCapacity_ = (segmented_ ? capacity / 5 * 4 : 0);
+    Demote();
+  }
+
+
+  size_t TinyLfuPolicy::GetCounterIndex(const std::string& instanceId,
+                                        size_t row) const
+  {
+    size_t seed = row;
+    boost::hash_combine(seed, instanceId);
+    return row * width_ + seed % width_;
+  }
+
+
+  TinyLfuPolicy::TinyLfuPolicy(size_t width) :
+    SegmentedLruPolicy(true),
+    width_(width),
+    additions_(0),
+    resetPeriod_(10 * width)
+  {
+    if (width == 0)
+    {
+      throw Orthanc::OrthancException(Orthanc::ErrorCode_ParameterOutOfRange);
+    }
+
+    counters_.resize(DEPTH * width, 0);
+  }
+
+
+  unsigned int TinyLfuPolicy::EstimateFrequency(const std::string& instanceId) const
+  {
+    unsigned int frequency = 15;
+
+    for (size_t row = 0; row < DEPTH; row++)
+    {
+      frequency = std::min(frequency, static_cast<unsigned int>(counters_[GetCounterIndex(instanceId, row)]));
+    }
+
+    return frequency;
+  }
+
+
+  void TinyLfuPolicy::RecordAccess(const std::string& instanceId)
+  {
+    SegmentedLruPolicy::RecordAccess(instanceId);
+
+    if (IsBurst(instanceId))
+    {
+      return;
+    }
+
+    for (size_t row = 0; row < DEPTH; row++)
+    {
+      uint8_t& counter = counters_[GetCounterIndex(instanceId, row)];
+      if (counter < 15)
+      {
+        counter++;
+      }
+    }
+
+    additions_++;
+
+    if (additions_ == resetPeriod_)
+    {
+      // Aging: Halve all the counters, so that the old accesses are
+      // progressively forgotten
+      for (size_t i = 0; i < counters_.size(); i++)
+      {
+        counters_[i] /= 2;
+      }
+
+      additions_ = 0;
+    }
+  }
+
+
+  bool TinyLfuPolicy::Admit(const std::string& instanceId,
+                            size_t size,
+                            size_t toFree)
+  {
+    std::vector<std::string> victims;
+    ListVictims(victims, toFree);
+
+    if (victims.empty())
+    {
+      return true;  // Enough room in the cache
+    }
+
+    if (IsBurst(instanceId))
+    {
+      // The instance has just been rejected, and is requested again
+      // for its next chunk: Rejecting it again would read it once
+      // more from the storage for each of its chunks
+      return true;
+    }
+
+    // Compare the frequency of the candidate with the average
+    // frequency of the bytes to be evicted
+    uint64_t victimsSize = 0;
+    uint64_t victimsWeight = 0;
+
+    for (size_t i = 0; i < victims.size(); i++)
+    {
+      victimsSize += GetEntrySize(victims[i]);
+      victimsWeight += static_cast<uint64_t>(EstimateFrequency(victims[i])) * GetEntrySize(victims[i]);
+    }
+
+    return static_cast<uint64_t>(EstimateFrequency(instanceId)) * victimsSize > victimsWeight;
+  }
+}
@@ -0,0 +1,207 @@
+/**
+ * Transfers accelerator plugin for Orthanc
+ * Copyright (C) 2018-2023 Osimis S.A., Belgium
+ * Copyright (C) 2024-2026 Orthanc Team SRL, Belgium
+ * Copyright (C) 2021-2026 Sebastien Jodogne, ICTEAM UCLouvain, Belgium
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU Affero General Public License
+ * as published by the Free Software Foundation, either version 3 of
+ * the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Affero General Public License for more details.
+ * 
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ **/
+
+
+
+
+#pragma once
+
+#include "TransferToolbox.h"
+
+#include <Compatibility.h>
+
+#include <boost/noncopyable.hpp>
+#include <deque>
+#include <list>
+#include <map>
+#include <vector>
+
+namespace OrthancPlugins
+{
+  /**
+   * Policy that decides which instances enter one shard of the
+   * instances cache, and in which order they are evicted. The
+   * policies are not thread-safe, the shard is in charge of locking.
+   **/
+  class IInstancesCachePolicy : public boost::noncopyable
+  {
+  public:
+    virtual ~IInstancesCachePolicy()
+    {
+    }
+
+    // Called on each lookup of an instance, whether it is a hit or a miss
+    virtual void RecordAccess(const std::string& instanceId) = 0;
+
+    // Called when a lookup hits an instance of the cache
+    virtual void Touch(const std::string& instanceId) = 0;
+
+    // Decides whether a new instance should enter the cache, knowing
+    // that "toFree" bytes must be evicted to make room for it
+    virtual bool Admit(const std::string& instanceId,
+                       size_t size,
+                       size_t toFree) = 0;
+
+    virtual void Add(const std::string& instanceId,
+                     size_t size) = 0;
+
+    virtual void Remove(const std::string& instanceId) = 0;
+
+    virtual bool Contains(const std::string& instanceId) const = 0;
+
+    virtual size_t GetSize() const = 0;
+
+    // Returns the instance that must be evicted first
+    virtual const std::string& GetVictim() const = 0;
+
+    virtual void SetCapacity(size_t capacity) = 0;
+
+    static IInstancesCachePolicy* Create(CachePolicy policy);
+  };
+
+
+  /**
+   * Segmented LRU: Instances enter a "probation" segment, and are
+   * promoted to a "protected" segment on their second access (that
+   * does not belong to the same burst as the first access). The
+   * victims are taken from the probation segment first, which
+   * prevents one-time accesses (for instance, a large whole-slide
+   * image) from flushing the instances that are repeatedly accessed.
+   * If "segmented" is false, this is a plain LRU policy.
+   **/
+  class SegmentedLruPolicy : public IInstancesCachePolicy
+  {
+  private:
+    typedef std::list<std::string>  Queue;  // The front is the most recent
+
+    struct Entry
+    {
+      size_t           size_;
+      bool             protected_;
+      Queue::iterator  position_;
+    };
+
+    typedef std::map<std::string, Entry>  Entries;
+
+    // The distinct instances that were recently accessed, the front is
+    // the most recent. The flag tells whether the instance was accessed
+    // again since it entered the window.
+    typedef std::deque<std::pair<std::string, bool> >  RecentAccesses;
+
+    bool     segmented_;
+    Entries  entries_;
+    Queue    probation_;
+    Queue    protected_;
+    size_t   protectedSize_;
+    size_t   protectedCapacity_;
+    RecentAccesses  recentAccesses_;
+
+    void Demote();
+
+  protected:
+    size_t GetEntrySize(const std::string& instanceId) const;
+
+    // Tells whether the last recorded access to this instance belongs
+    // to the same burst as a previous access to it. The chunks of one
+    // instance are requested in a row, which must not be mistaken for
+    // repeated uses of this instance. The state is tracked for each
+    // instance, as the accesses to other instances can be recorded
+    // between "RecordAccess()" and "Admit()".
+    bool IsBurst(const std::string& instanceId) const;
+
+    // Lists the instances to be evicted, in eviction order, until
+    // "toFree" bytes are released
+    void ListVictims(std::vector<std::string>& victims,
+                     size_t toFree) const;
+
+  public:
+    explicit SegmentedLruPolicy(bool segmented);
+
+    virtual void RecordAccess(const std::string& instanceId) ORTHANC_OVERRIDE;
+
+    virtual void Touch(const std::string& instanceId) ORTHANC_OVERRIDE;
+
+    virtual bool Admit(const std::string& instanceId,
+                       size_t size,
+                       size_t toFree) ORTHANC_OVERRIDE
+    {
+      return true;
+    }
+
+    virtual void Add(const std::string& instanceId,
+                     size_t size) ORTHANC_OVERRIDE;
+
+    virtual void Remove(const std::string& instanceId) ORTHANC_OVERRIDE;
+
+    virtual bool Contains(const std::string& instanceId) const ORTHANC_OVERRIDE
+    {
+      return entries_.find(instanceId) != entries_.end();
+    }
+
+    virtual size_t GetSize() const ORTHANC_OVERRIDE
+    {
+      return entries_.size();
+    }
+
+    virtual const std::string& GetVictim() const ORTHANC_OVERRIDE;
+
+    virtual void SetCapacity(size_t capacity) ORTHANC_OVERRIDE;
+  };
+
+
+  /**
+   * Segmented LRU, whose admission is controlled by the access
+   * frequencies estimated by a count-min sketch ("TinyLFU"). The
+   * frequencies are weighted by the sizes: A new instance is only
+   * admitted if its frequency exceeds the average frequency of the
+   * bytes it would evict. An instance that is requested again within
+   * the same burst (i.e. for its next chunks) is admitted, as
+   * rejecting it once more would read it again for each chunk. As a
+   * consequence, the instances that are split across several chunks
+   * are read twice on their first access, then flush the cache anyway:
+   * This policy improves the hit ratio of the instances that fit in
+   * one chunk, but reads more bytes than "SLRU" if large instances
+   * are frequently transferred.
+   **/
+  class TinyLfuPolicy : public SegmentedLruPolicy
+  {
+  private:
+    static const size_t DEPTH = 4;
+
+    std::vector<uint8_t>  counters_;   // DEPTH rows of "width_" counters, saturating at 15
+    size_t                width_;
+    size_t                additions_;
+    size_t                resetPeriod_;
+
+    size_t GetCounterIndex(const std::string& instanceId,
+                           size_t row) const;
+
+  public:
+    explicit TinyLfuPolicy(size_t width = 4096);
+
+    unsigned int EstimateFrequency(const std::string& instanceId) const;
+
+    virtual void RecordAccess(const std::string& instanceId) ORTHANC_OVERRIDE;
+
+    virtual bool Admit(const std::string& instanceId,
+                       size_t size,
+                       size_t toFree) ORTHANC_OVERRIDE;
+  };
+}
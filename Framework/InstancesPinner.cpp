@@ -0,0 +1,330 @@
+/**
+ * Transfers accelerator plugin for Orthanc
+ * Copyright (C) 2018-2023 Osimis S.A., Belgium
+ * Copyright (C) 2024-2026 Orthanc Team SRL, Belgium
+ * Copyright (C) 2021-2026 Sebastien Jodogne, ICTEAM UCLouvain, Belgium
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU Affero General Public License
+ * as published by the Free Software Foundation, either version 3 of
+ * the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Affero General Public License for more details.
+ * 
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ **/
+
+
+
+
+
+#include "InstancesPinner.h"
+
+#include <Logging.h>
+#include <OrthancException.h>
+
+#include <algorithm>
+
+
+namespace OrthancPlugins
+{
+  InstancesPinner::BucketGuard::BucketGuard(InstancesPinner& pinner,
+                                            const TransferBucket& bucket) :
+    pinner_(pinner),
+    bucket_(bucket),
+    acquired_(false)
+  {
+  }
+
+
+  InstancesPinner::BucketGuard::~BucketGuard()
+  {
+    if (acquired_)
+    {
+      try
+      {
+        pinner_.ReleaseBucket(bucket_);
+      }
+      catch (Orthanc::OrthancException& e)
+      {
+        LOG(ERROR) << "Cannot unpin the instances of a bucket: " << e.What();
+      }
+    }
+  }
+
+
+  bool InstancesPinner::BucketGuard::Acquire(unsigned int timeoutSeconds)
+  {
+    if (acquired_)
+    {
+      throw Orthanc::OrthancException(Orthanc::ErrorCode_BadSequenceOfCalls);
+    }
+
+    acquired_ = pinner_.AcquireBucket(bucket_, timeoutSeconds);
+    return acquired_;
+  }
+
+
+  InstancesPinner::InstancesPinner(OrthancInstancesCache& cache) :
+    cache_(cache)
+  {
+  }
+
+
+  InstancesPinner::InstancesPinner(OrthancInstancesCache& cache,
+                                   const std::vector<TransferBucket>& buckets) :
+    cache_(cache)
+  {
+    for (size_t i = 0; i < buckets.size(); i++)
+    {
+      for (size_t j = 0; j < buckets[i].GetChunksCount(); j++)
+      {
+        instances_[buckets[i].GetChunkCompactId(j)].remaining_ += buckets[i].GetChunkSize(j);
+      }
+    }
+  }
+
+
+  InstancesPinner::~InstancesPinner()
+  {
+    // No other thread can be pinning, as they all hold a reference to this object
+    for (Instances::const_iterator it = instances_.begin(); it != instances_.end(); ++it)
+    {
+      if (it->second.state_ == PinState_Pinned)
+      {
+        cache_.Unpin(it->first.ToString());
+      }
+    }
+  }
+
+
+  void InstancesPinner::AddInstances(const std::vector<DicomInstanceInfo>& instances)
+  {
+    boost::mutex::scoped_lock lock(mutex_);
+
+    for (size_t i = 0; i < instances.size(); i++)
+    {
+      // The instances that are already known are not sent twice
+      Instances::iterator found = instances_.find(instances[i].GetCompactId());
+      if (found == instances_.end())
+      {
+        instances_[instances[i].GetCompactId()].remaining_ = instances[i].GetSize();
+      }
+    }
+  }
+
+
+  bool InstancesPinner::PinInternal(const std::set<CompactIdentifier>& instances,
+                                    unsigned int timeoutSeconds)
+  {
+    std::vector<CompactIdentifier> reserved;
+
+    {
+      boost::mutex::scoped_lock lock(mutex_);
+
+      for (;;)
+      {
+        bool inFlight = false;
+
+        for (std::set<CompactIdentifier>::const_iterator it = instances.begin(); it != instances.end(); ++it)
+        {
+          Instances::const_iterator found = instances_.find(*it);
+
+          if (found == instances_.end())
+          {
+            throw Orthanc::OrthancException(Orthanc::ErrorCode_BadSequenceOfCalls);
+          }
+          else if (found->second.state_ == PinState_Pinning)
+          {
+            inFlight = true;
+          }
+        }
+
+        if (inFlight)
+        {
+          // Wait for the other thread, whose pin might be refused
+          pinningDone_.wait(lock);
+        }
+        else
+        {
+          break;
+        }
+      }
+
+      for (std::set<CompactIdentifier>::const_iterator it = instances.begin(); it != instances.end(); ++it)
+      {
+        Instance& instance = instances_[*it];
+
+        if (instance.state_ == PinState_Unpinned &&
+            instance.remaining_ > 0)
+        {
+          instance.state_ = PinState_Pinning;
+          reserved.push_back(*it);
+        }
+      }
+    }
+
+    if (reserved.empty())
+    {
+      return true;
+    }
+
+    std::vector<std::string> toPin(reserved.size());
+
+    for (size_t i = 0; i < reserved.size(); i++)
+    {
+      toPin[i] = reserved[i].ToString();
+    }
+
+    // The lock must not be held while waiting for the other buckets
+    // of this transfer to release their instances
+    bool success;
+
+    try
+    {
+      success = cache_.Pin(toPin, timeoutSeconds);
+    }
+    catch (Orthanc::OrthancException&)
+    {
+      boost::mutex::scoped_lock lock(mutex_);
+
+      for (size_t i = 0; i < reserved.size(); i++)
+      {
+        instances_[reserved[i]].state_ = PinState_Unpinned;
+      }
+
+      pinningDone_.notify_all();
+      throw;
+    }
+
+    std::vector<std::string> toUnpin;
+
+    {
+      boost::mutex::scoped_lock lock(mutex_);
+
+      for (size_t i = 0; i < reserved.size(); i++)
+      {
+        Instance& instance = instances_[reserved[i]];
+
+        if (!success)
+        {
+          instance.state_ = PinState_Unpinned;
+        }
+        else if (instance.remaining_ == 0)
+        {
+          // All the bytes were sent while waiting for the budget
+          instance.state_ = PinState_Unpinned;
+          toUnpin.push_back(toPin[i]);
+        }
+        else
+        {
+          instance.state_ = PinState_Pinned;
+        }
+      }
+
+      pinningDone_.notify_all();
+    }
+
+    for (size_t i = 0; i < toUnpin.size(); i++)
+    {
+      cache_.Unpin(toUnpin[i]);
+    }
+
+    return success;
+  }
+
+
+  bool InstancesPinner::PinInstance(const std::string& instanceId)
+  {
+    const CompactIdentifier compactId(instanceId);
+
+    {
+      boost::mutex::scoped_lock lock(mutex_);
+
+      Instances::const_iterator found = instances_.find(compactId);
+      if (found == instances_.end() ||
+          found->second.remaining_ == 0)
+      {
+        return false;
+      }
+    }
+
+    std::set<CompactIdentifier> instances;
+    instances.insert(compactId);
+
+    return PinInternal(instances, 0);
+  }
+
+
+  bool InstancesPinner::AcquireBucket(const TransferBucket& bucket,
+                                      unsigned int timeoutSeconds)
+  {
+    std::set<CompactIdentifier> instances;
+
+    for (size_t i = 0; i < bucket.GetChunksCount(); i++)
+    {
+      instances.insert(bucket.GetChunkCompactId(i));
+    }
+
+    return PinInternal(instances, timeoutSeconds);
+  }
+
+
+  void InstancesPinner::ReleaseBucket(const TransferBucket& bucket)
+  {
+    std::vector<std::string> toUnpin;
+
+    {
+      boost::mutex::scoped_lock lock(mutex_);
+
+      for (size_t i = 0; i < bucket.GetChunksCount(); i++)
+      {
+        Instances::iterator found = instances_.find(bucket.GetChunkCompactId(i));
+
+        if (found == instances_.end())
+        {
+          throw Orthanc::OrthancException(Orthanc::ErrorCode_BadSequenceOfCalls);
+        }
+
+        // A chunk can be sent twice if its first query has failed
+        Instance& instance = found->second;
+        instance.remaining_ -= std::min(instance.remaining_, bucket.GetChunkSize(i));
+
+        if (instance.remaining_ == 0 &&
+            instance.state_ == PinState_Pinned)
+        {
+          // No bucket of this transfer needs this instance anymore
+          instance.state_ = PinState_Unpinned;
+          toUnpin.push_back(found->first.ToString());
+        }
+      }
+    }
+
+    for (size_t i = 0; i < toUnpin.size(); i++)
+    {
+      cache_.Unpin(toUnpin[i]);
+    }
+  }
+
+
+  size_t InstancesPinner::GetPinnedInstancesCount()
+  {
+    boost::mutex::scoped_lock lock(mutex_);
+
+    size_t count = 0;
+
+    for (Instances::const_iterator it = instances_.begin(); it != instances_.end(); ++it)
+    {
+      if (it->second.state_ == PinState_Pinned)
+      {
+        count++;
+      }
+    }
+
+    return count;
+  }
+}
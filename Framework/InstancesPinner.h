@@ -0,0 +1,123 @@
+/**
+ * Transfers accelerator plugin for Orthanc
+ * Copyright (C) 2018-2023 Osimis S.A., Belgium
+ * Copyright (C) 2024-2026 Orthanc Team SRL, Belgium
+ * Copyright (C) 2021-2026 Sebastien Jodogne, ICTEAM UCLouvain, Belgium
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU Affero General Public License
+ * as published by the Free Software Foundation, either version 3 of
+ * the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Affero General Public License for more details.
+ * 
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ **/
+
+
+
+
+#pragma once
+
+#include "OrthancInstancesCache.h"
+
+#include <set>
+
+namespace OrthancPlugins
+{
+  /**
+   * Pins the instances of one transfer in the cache, from the moment
+   * their first bucket is prefetched or read, until all their bytes
+   * have been sent. This prevents the instances that are split across
+   * several buckets from being evicted, then read again, because of
+   * the other transfers. The pins never exceed the budget of the
+   * cache: Acquiring a bucket fails if they cannot be granted in time.
+   **/
+  class InstancesPinner : public boost::noncopyable
+  {
+  private:
+    enum PinState
+    {
+      PinState_Unpinned,
+      PinState_Pinning,  // Another thread is waiting for the budget of the cache
+      PinState_Pinned
+    };
+
+    struct Instance
+    {
+      size_t    remaining_;  // Number of bytes of the instance that are still to be sent
+      PinState  state_;
+
+      Instance() :
+        remaining_(0),
+        state_(PinState_Unpinned)
+      {
+      }
+    };
+
+    typedef std::map<CompactIdentifier, Instance>  Instances;
+
+    OrthancInstancesCache&     cache_;
+    boost::mutex               mutex_;
+    boost::condition_variable  pinningDone_;
+    Instances                  instances_;
+
+    bool PinInternal(const std::set<CompactIdentifier>& instances,
+                     unsigned int timeoutSeconds);
+
+  public:
+    // Releases the pins of one bucket once destroyed, if they were acquired
+    class BucketGuard : public boost::noncopyable
+    {
+    private:
+      InstancesPinner&       pinner_;
+      const TransferBucket&  bucket_;
+      bool                   acquired_;
+
+    public:
+      BucketGuard(InstancesPinner& pinner,
+                  const TransferBucket& bucket);
+
+      ~BucketGuard();
+
+      bool Acquire(unsigned int timeoutSeconds);
+    };
+
+    explicit InstancesPinner(OrthancInstancesCache& cache);
+
+    InstancesPinner(OrthancInstancesCache& cache,
+                    const std::vector<TransferBucket>& buckets);
+
+    // Unpins the instances whose bytes were not all sent (for
+    // instance, if the transfer has failed)
+    ~InstancesPinner();
+
+    // Registers instances that will be sent by the buckets of the peer
+    void AddInstances(const std::vector<DicomInstanceInfo>& instances);
+
+    /**
+     * Pins an instance before it is prefetched, without waiting for
+     * the budget of the cache. Returns "false" if the instance is
+     * unknown, already sent, or if the budget is exhausted.
+     **/
+    bool PinInstance(const std::string& instanceId);
+
+    /**
+     * Pins the instances of one bucket. Waits for the pins that are
+     * in flight in other threads, then for the budget of the cache,
+     * at most for "timeoutSeconds". Returns "false" (and pins nothing
+     * new) if the budget is still exhausted after this delay.
+     **/
+    bool AcquireBucket(const TransferBucket& bucket,
+                       unsigned int timeoutSeconds);
+
+    // Unpins the instances whose bytes have all been sent
+    void ReleaseBucket(const TransferBucket& bucket);
+
+    size_t GetPinnedInstancesCount();
+  };
+}
@@ -0,0 +1,449 @@
+/**
+ * Transfers accelerator plugin for Orthanc
+ * Copyright (C) 2018-2023 Osimis S.A., Belgium
+ * Copyright (C) 2024-2026 Orthanc Team SRL, Belgium
+ * Copyright (C) 2021-2026 Sebastien Jodogne, ICTEAM UCLouvain, Belgium
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU Affero General Public License
+ * as published by the Free Software Foundation, either version 3 of
+ * the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Affero General Public License for more details.
+ * 
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ **/
+
+
+
+#include "InstancesPrefetcher.h"
+
+#include <Logging.h>
+#include <OrthancException.h>
+
+#include <boost/weak_ptr.hpp>
+#include <set>
+
+
+namespace OrthancPlugins
+{
+  // Plans that are not accessed during this delay are considered as
+  // abandoned (e.g. a pull transfer that was canceled by the peer)
+  static const unsigned int PLAN_EXPIRATION_SECONDS = 600;
+
+  // Maximum number of simultaneous plans, the oldest plan is
+  // discarded if this limit is exceeded
+  static const size_t MAX_PLANS = 64;
+
+
+  class InstancesPrefetcher::Plan : public boost::noncopyable
+  {
+  private:
+    typedef std::map<std::string, size_t>  Positions;
+
+    std::vector<std::string>          instances_;
+    Positions                         positions_;
+    size_t                            cursor_;     // Number of instances that are considered as accessed
+    size_t                            next_;       // Position of the next instance to be prefetched
+    boost::posix_time::ptime          lastActivity_;
+    bool                              hasPinner_;
+    boost::weak_ptr<InstancesPinner>  pinner_;
+
+  public:
+    Plan(const std::vector<std::string>& instances,
+         const boost::shared_ptr<InstancesPinner>& pinner) :
+      cursor_(0),
+      next_(0),
+      lastActivity_(boost::posix_time::microsec_clock::universal_time()),
+      hasPinner_(pinner.get() != NULL),
+      pinner_(pinner)
+    {
+      Append(instances);
+    }
+
+    void Append(const std::vector<std::string>& instances)
+    {
+      instances_.reserve(instances_.size() + instances.size());
+
+      for (size_t i = 0; i < instances.size(); i++)
+      {
+        if (positions_.find(instances[i]) == positions_.end())
+        {
+          positions_[instances[i]] = instances_.size();
+          instances_.push_back(instances[i]);
+        }
+      }
+    }
+
+    bool IsDone() const
+    {
+      return cursor_ >= instances_.size();
+    }
+
+    const boost::posix_time::ptime& GetLastActivity() const
+    {
+      return lastActivity_;
+    }
+
+    bool NotifyAccess(const std::string& instanceId,
+                      const boost::posix_time::ptime& now)
+    {
+      Positions::const_iterator found = positions_.find(instanceId);
+
+      if (found == positions_.end())
+      {
+        return false;
+      }
+      else
+      {
+        // Several workers read the buckets in parallel: The window
+        // follows the most advanced of them
+        cursor_ = std::max(cursor_, found->second + 1);
+        next_ = std::max(next_, cursor_);
+        lastActivity_ = now;
+        return true;
+      }
+    }
+
+    bool DequeueInstance(std::string& instanceId,
+                         boost::shared_ptr<InstancesPinner>& pinner,
+                         size_t depth)
+    {
+      if (next_ < instances_.size() &&
+          next_ < cursor_ + depth)
+      {
+        pinner = pinner_.lock();
+
+        if (hasPinner_ &&
+            pinner.get() == NULL)
+        {
+          return false;  // The transfer is over
+        }
+
+        instanceId = instances_[next_];
+        next_++;
+        return true;
+      }
+      else
+      {
+        return false;
+      }
+    }
+  };
+
+
+  void InstancesPrefetcher::Worker(InstancesPrefetcher* that)
+  {
+    Orthanc::Logging::SetCurrentThreadName("TF-PREFETCH");
+
+    std::string instanceId;
+    boost::shared_ptr<InstancesPinner> pinner;
+
+    while (that->DequeueInstance(instanceId, pinner))
+    {
+      try
+      {
+        if (pinner.get() != NULL &&
+            !pinner->PinInstance(instanceId))
+        {
+          // Once read, the instance could be evicted before its bucket is sent
+          LOG(INFO) << "Not prefetching instance " << instanceId << ", as it cannot be pinned";
+        }
+        else
+        {
+          that->cache_.Prefetch(instanceId);
+        }
+      }
+      catch (Orthanc::OrthancException& e)
+      {
+        // Not a fatal error, the transfer will report it if the
+        // instance cannot be read when it is really needed
+        LOG(INFO) << "Cannot prefetch instance " << instanceId << ": " << e.What();
+      }
+      catch (...)
+      {
+        LOG(INFO) << "Cannot prefetch instance " << instanceId;
+      }
+
+      // Do not extend the lifetime of the pinner beyond its transfer
+      pinner.reset();
+    }
+  }
+
+
+  bool InstancesPrefetcher::DequeueInstance(std::string& instanceId,
+                                            boost::shared_ptr<InstancesPinner>& pinner)
+  {
+    boost::mutex::scoped_lock lock(mutex_);
+
+    for (;;)
+    {
+      if (!continue_)
+      {
+        return false;
+      }
+
+      // Serve the plans in a round-robin fashion, so that one large
+      // transfer cannot starve the others
+      Plans::iterator plan = plans_.upper_bound(roundRobin_);
+
+      for (size_t i = 0; i < plans_.size(); i++)
+      {
+        if (plan == plans_.end())
+        {
+          plan = plans_.begin();
+        }
+
+        if (plan->second->DequeueInstance(instanceId, pinner, depth_))
+        {
+          roundRobin_ = plan->first;
+          return true;
+        }
+
+        ++plan;
+      }
+
+      planChanged_.wait(lock);
+    }
+  }
+
+
+  void InstancesPrefetcher::RemovePlanInternal(Plans::iterator plan)
+  {
+    assert(plan != plans_.end() &&
+           plan->second != NULL);
+    delete plan->second;
+    plans_.erase(plan);
+  }
+
+
+  void InstancesPrefetcher::RemoveExpiredPlans(const boost::posix_time::ptime& now)
+  {
+    Plans::iterator plan = plans_.begin();
+
+    while (plan != plans_.end())
+    {
+      Plans::iterator current = plan++;
+
+      if ((now - current->second->GetLastActivity()).total_seconds() > PLAN_EXPIRATION_SECONDS)
+      {
+        RemovePlanInternal(current);
+      }
+    }
+  }
+
+
+  InstancesPrefetcher::InstancesPrefetcher(OrthancInstancesCache& cache,
+                                           size_t threadsCount,
+                                           size_t depth) :
+    cache_(cache),
+    depth_(depth),
+    continue_(true),
+    nextPlanId_(1),
+    roundRobin_(0)
+  {
+    if (threadsCount != 0 &&
+        depth == 0)
+    {
+      throw Orthanc::OrthancException(Orthanc::ErrorCode_ParameterOutOfRange);
+    }
+
+    workers_.resize(threadsCount);
+
+    for (size_t i = 0; i < threadsCount; i++)
+    {
+      workers_[i] = new boost::thread(Worker, this);
+    }
+  }
+
+
+  InstancesPrefetcher::~InstancesPrefetcher()
+  {
+    {
+      boost::mutex::scoped_lock lock(mutex_);
+      continue_ = false;
+      planChanged_.notify_all();
+    }
+
+    for (size_t i = 0; i < workers_.size(); i++)
+    {
+      if (workers_[i] != NULL)
+      {
+        if (workers_[i]->joinable())
+        {
+          workers_[i]->join();
+        }
+
+        delete workers_[i];
+      }
+    }
+
+    for (Plans::iterator it = plans_.begin(); it != plans_.end(); ++it)
+    {
+      assert(it->second != NULL);
+      delete it->second;
+    }
+  }
+
+
+  size_t InstancesPrefetcher::AddPlan(const std::vector<std::string>& instances,
+                                      const boost::shared_ptr<InstancesPinner>& pinner)
+  {
+    if (!IsEnabled() ||
+        instances.empty())
+    {
+      return 0;
+    }
+
+    boost::mutex::scoped_lock lock(mutex_);
+
+    RemoveExpiredPlans(boost::posix_time::microsec_clock::universal_time());
+
+    while (plans_.size() >= MAX_PLANS)
+    {
+      RemovePlanInternal(plans_.begin());
+    }
+
+    size_t planId = nextPlanId_++;
+    plans_[planId] = new Plan(instances, pinner);
+
+    planChanged_.notify_all();
+
+    return planId;
+  }
+
+
+  bool InstancesPrefetcher::ExtendPlan(size_t planId,
+                                       const std::vector<std::string>& instances)
+  {
+    boost::mutex::scoped_lock lock(mutex_);
+
+    Plans::iterator found = plans_.find(planId);
+    if (found == plans_.end())
+    {
+      return false;
+    }
+    else
+    {
+      found->second->Append(instances);
+      planChanged_.notify_all();
+      return true;
+    }
+  }
+
+
+  void InstancesPrefetcher::RemovePlan(size_t planId)
+  {
+    boost::mutex::scoped_lock lock(mutex_);
+
+    Plans::iterator found = plans_.find(planId);
+    if (found != plans_.end())
+    {
+      RemovePlanInternal(found);
+    }
+  }
+
+
+  void InstancesPrefetcher::NotifyAccess(const std::string& instanceId)
+  {
+    if (!IsEnabled())
+    {
+      return;
+    }
+
+    boost::mutex::scoped_lock lock(mutex_);
+
+    const boost::posix_time::ptime now = boost::posix_time::microsec_clock::universal_time();
+
+    bool changed = false;
+
+    Plans::iterator plan = plans_.begin();
+    while (plan != plans_.end())
+    {
+      Plans::iterator current = plan++;
+
+      if (current->second->NotifyAccess(instanceId, now))
+      {
+        changed = true;
+
+        if (current->second->IsDone())
+        {
+          RemovePlanInternal(current);
+        }
+      }
+    }
+
+    if (changed)
+    {
+      planChanged_.notify_all();
+    }
+  }
+
+
+  void InstancesPrefetcher::NotifyAccess(const TransferBucket& bucket)
+  {
+    for (size_t i = 0; i < bucket.GetChunksCount(); i++)
+    {
+      NotifyAccess(bucket.GetChunkInstanceId(i));
+    }
+  }
+
+
+  size_t InstancesPrefetcher::GetPlansCount()
+  {
+    boost::mutex::scoped_lock lock(mutex_);
+    return plans_.size();
+  }
+
+
+  void InstancesPrefetcher::ListInstances(std::vector<std::string>& target,
+                                          const std::vector<TransferBucket>& buckets)
+  {
+    target.clear();
+
+    std::set<CompactIdentifier> seen;
+
+    for (size_t i = 0; i < buckets.size(); i++)
+    {
+      for (size_t j = 0; j < buckets[i].GetChunksCount(); j++)
+      {
+        if (seen.insert(buckets[i].GetChunkCompactId(j)).second)
+        {
+          target.push_back(buckets[i].GetChunkInstanceId(j));
+        }
+      }
+    }
+  }
+
+
+  void InstancesPrefetcher::ListPullInstances(std::vector<std::string>& target,
+                                              const TransferScheduler& scheduler,
+                                              size_t bucketSize,
+                                              BucketPacking packing)
+  {
+    if (bucketSize == 0)
+    {
+      std::vector<DicomInstanceInfo> instances;
+      scheduler.ListInstances(instances);
+
+      target.clear();
+      target.reserve(instances.size());
+
+      for (size_t i = 0; i < instances.size(); i++)
+      {
+        target.push_back(instances[i].GetId());
+      }
+    }
+    else
+    {
+      // Same thresholds as in "PullJob"
+      std::vector<TransferBucket> buckets;
+      scheduler.ComputePullBuckets(buckets, bucketSize, 2 * bucketSize, "", BucketCompression_None, packing);
+      ListInstances(target, buckets);
+    }
+  }
+}
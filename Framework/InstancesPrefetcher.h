@@ -0,0 +1,130 @@
+/**
+ * Transfers accelerator plugin for Orthanc
+ * Copyright (C) 2018-2023 Osimis S.A., Belgium
+ * Copyright (C) 2024-2026 Orthanc Team SRL, Belgium
+ * Copyright (C) 2021-2026 Sebastien Jodogne, ICTEAM UCLouvain, Belgium
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU Affero General Public License
+ * as published by the Free Software Foundation, either version 3 of
+ * the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Affero General Public License for more details.
+ * 
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ **/
+
+
+
+#pragma once
+
+#include "InstancesPinner.h"
+#include "OrthancInstancesCache.h"
+#include "TransferScheduler.h"
+
+#include <boost/date_time/posix_time/posix_time.hpp>
+#include <boost/thread.hpp>
+#include <boost/thread/condition_variable.hpp>
+
+namespace OrthancPlugins
+{
+  /**
+   * Read-ahead of the instances of the active transfers. Each
+   * transfer registers its "plan", i.e. the ordered list of the
+   * instances it will read. A pool of threads keeps loading the next
+   * instances of each plan into the cache, a few positions ahead of
+   * the last instance that was accessed by the transfer, so that the
+   * workers sending the buckets find them already in memory.
+   **/
+  class InstancesPrefetcher : public boost::noncopyable
+  {
+  private:
+    class Plan;
+
+    typedef std::map<size_t, Plan*>  Plans;
+
+    OrthancInstancesCache&        cache_;
+    size_t                        depth_;
+    boost::mutex                  mutex_;
+    boost::condition_variable     planChanged_;
+    bool                          continue_;
+    Plans                         plans_;
+    size_t                        nextPlanId_;
+    size_t                        roundRobin_;
+    std::vector<boost::thread*>   workers_;
+
+    static void Worker(InstancesPrefetcher* that);
+
+    bool DequeueInstance(std::string& instanceId,
+                         boost::shared_ptr<InstancesPinner>& pinner);
+
+    void RemovePlanInternal(Plans::iterator plan);
+
+    void RemoveExpiredPlans(const boost::posix_time::ptime& now);
+
+  public:
+    // If "threadsCount" is zero, the prefetching is disabled
+    InstancesPrefetcher(OrthancInstancesCache& cache,
+                        size_t threadsCount,
+                        size_t depth);
+
+    ~InstancesPrefetcher();
+
+    bool IsEnabled() const
+    {
+      return !workers_.empty();
+    }
+
+    size_t GetDepth() const
+    {
+      return depth_;
+    }
+
+    /**
+     * Registers the instances that a transfer is about to read, in
+     * the order of their access. Returns the identifier of the plan,
+     * or zero if the prefetching is disabled. The plan is
+     * automatically discarded once all its instances have been
+     * accessed, or after some time without access. If a pinner is
+     * provided, the instances are pinned before being prefetched, and
+     * are not prefetched if the budget of the pins is exhausted (as
+     * they could be evicted before being read). The pinner is not
+     * owned by the plan, which stops once the pinner is destroyed.
+     **/
+    size_t AddPlan(const std::vector<std::string>& instances,
+                   const boost::shared_ptr<InstancesPinner>& pinner = boost::shared_ptr<InstancesPinner>());
+
+    // Appends instances at the end of a plan, as they become known.
+    // Returns "false" if the plan has been discarded in the meantime.
+    bool ExtendPlan(size_t planId,
+                    const std::vector<std::string>& instances);
+
+    void RemovePlan(size_t planId);
+
+    // Signals that a transfer is reading this instance, which moves
+    // the read-ahead window of the plans that contain it
+    void NotifyAccess(const std::string& instanceId);
+
+    void NotifyAccess(const TransferBucket& bucket);
+
+    size_t GetPlansCount();
+
+    // Lists the instances of the buckets, in the order of their
+    // first access
+    static void ListInstances(std::vector<std::string>& target,
+                              const std::vector<TransferBucket>& buckets);
+
+    // Lists the instances in the order of the buckets that a pulling
+    // peer will request, given its packing and its size of buckets.
+    // If "bucketSize" is zero (the peer has not announced them), the
+    // order of the scheduler is used.
+    static void ListPullInstances(std::vector<std::string>& target,
+                                  const TransferScheduler& scheduler,
+                                  size_t bucketSize,
+                                  BucketPacking packing);
+  };
+}
@@ -0,0 +1,154 @@
+/**
+ * Transfers accelerator plugin for Orthanc
+ * Copyright (C) 2018-2023 Osimis S.A., Belgium
+ * Copyright (C) 2024-2026 Orthanc Team SRL, Belgium
+ * Copyright (C) 2021-2026 Sebastien Jodogne, ICTEAM UCLouvain, Belgium
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU Affero General Public License
+ * as published by the Free Software Foundation, either version 3 of
+ * the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Affero General Public License for more details.
+ * 
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ **/
+
+
+
+
+
+#include "MappedFile.h"
+
+#include <OrthancException.h>
+
+#if defined(_WIN32)
+#  include <windows.h>
+#else
+#  include <fcntl.h>
+#  include <sys/mman.h>
+#  include <sys/stat.h>
+#  include <unistd.h>
+#endif
+
+
+namespace OrthancPlugins
+{
+#if defined(_WIN32)
+  MappedFile::MappedFile(const std::string& path) :
+    data_(NULL),
+    size_(0),
+    file_(INVALID_HANDLE_VALUE),
+    mapping_(NULL)
+  {
+    // "FILE_SHARE_DELETE" allows the disk cache to remove the file
+    // while it is mapped
+    HANDLE file = ::CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_DELETE,
+                                NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (file == INVALID_HANDLE_VALUE)
+    {
+      throw Orthanc::OrthancException(Orthanc::ErrorCode_InexistentFile, "Cannot open file: " + path);
+    }
+
+    file_ = file;
+
+    LARGE_INTEGER size;
+    if (!::GetFileSizeEx(file, &size))
+    {
+      ::CloseHandle(file);
+      throw Orthanc::OrthancException(Orthanc::ErrorCode_CorruptedFile, "Cannot get the size of file: " + path);
+    }
+
+    size_ = static_cast<size_t>(size.QuadPart);
+
+    if (size_ != 0)
+    {
+      HANDLE mapping = ::CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+      if (mapping == NULL)
+      {
+        ::CloseHandle(file);
+        throw Orthanc::OrthancException(Orthanc::ErrorCode_NotEnoughMemory, "Cannot map file: " + path);
+      }
+
+      mapping_ = mapping;
+      data_ = ::MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+
+      if (data_ == NULL)
+      {
+        ::CloseHandle(mapping);
+        ::CloseHandle(file);
+        throw Orthanc::OrthancException(Orthanc::ErrorCode_NotEnoughMemory, "Cannot map file: " + path);
+      }
+    }
+  }
+
+
+  MappedFile::~MappedFile()
+  {
+    if (data_ != NULL)
+    {
+      ::UnmapViewOfFile(data_);
+    }
+
+    if (mapping_ != NULL)
+    {
+      ::CloseHandle(reinterpret_cast<HANDLE>(mapping_));
+    }
+
+    if (file_ != INVALID_HANDLE_VALUE)
+    {
+      ::CloseHandle(reinterpret_cast<HANDLE>(file_));
+    }
+  }
+
+#else
+
+  MappedFile::MappedFile(const std::string& path) :
+    data_(NULL),
+    size_(0)
+  {
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0)
+    {
+      throw Orthanc::OrthancException(Orthanc::ErrorCode_InexistentFile, "Cannot open file: " + path);
+    }
+
+    struct stat s;
+    if (::fstat(fd, &s) != 0)
+    {
+      ::close(fd);
+      throw Orthanc::OrthancException(Orthanc::ErrorCode_CorruptedFile, "Cannot get the size of file: " + path);
+    }
+
+    size_ = static_cast<size_t>(s.st_size);
+
+    if (size_ != 0)
+    {
+      void* data = ::mmap(NULL, size_, PROT_READ, MAP_SHARED, fd, 0);
+      if (data == MAP_FAILED)
+      {
+        ::close(fd);
+        throw Orthanc::OrthancException(Orthanc::ErrorCode_NotEnoughMemory, "Cannot map file: " + path);
+      }
+
+      data_ = data;
+    }
+
+    // The mapping remains valid once the file descriptor is closed
+    ::close(fd);
+  }
+
+
+  MappedFile::~MappedFile()
+  {
+    if (data_ != NULL)
+    {
+      ::munmap(data_, size_);
+    }
+  }
+#endif
+}
@@ -0,0 +1,63 @@
+/**
+ * Transfers accelerator plugin for Orthanc
+ * Copyright (C) 2018-2023 Osimis S.A., Belgium
+ * Copyright (C) 2024-2026 Orthanc Team SRL, Belgium
+ * Copyright (C) 2021-2026 Sebastien Jodogne, ICTEAM UCLouvain, Belgium
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU Affero General Public License
+ * as published by the Free Software Foundation, either version 3 of
+ * the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Affero General Public License for more details.
+ * 
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ **/
+
+
+
+
+#pragma once
+
+#include <boost/noncopyable.hpp>
+#include <string>
+
+namespace OrthancPlugins
+{
+  /**
+   * Read-only mapping of a whole file into the memory. The mapping
+   * remains valid after the file is removed from the filesystem (on
+   * POSIX systems), which allows the disk cache to evict a file that
+   * is still being read.
+   **/
+  class MappedFile : public boost::noncopyable
+  {
+  private:
+    void*   data_;
+    size_t  size_;
+
+#if defined(_WIN32)
+    void*   file_;      // HANDLE
+    void*   mapping_;   // HANDLE
+#endif
+
+  public:
+    explicit MappedFile(const std::string& path);
+
+    ~MappedFile();
+
+    const void* GetData() const
+    {
+      return data_;
+    }
+
+    size_t GetSize() const
+    {
+      return size_;
+    }
+  };
+}
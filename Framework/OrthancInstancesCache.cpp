@@ -21,170 +21,1195 @@
 
 #include "OrthancInstancesCache.h"
 
+
+#include "../Resources/Orthanc/Plugins/OrthancPluginCppWrapper.h"
+
 #include <Compatibility.h>  // For std::unique_ptr
 #include <Logging.h>
 
-namespace OrthancPlugins
-{
-  void OrthancInstancesCache::CacheAccessor::CheckValid() const
+#include <algorithm>
+#include <boost/functional/hash.hpp>
+#include <boost/lexical_cast.hpp>
+#include <boost/thread/condition_variable.hpp>
+#include <set>
+
+static const size_t MAX_INDEXED_INSTANCES = 100000;
+
+
+// The pages of a large instance are cached under a key that cannot
+// collide with an Orthanc identifier, and that is still a valid file
+// name for the disk cache
+static std::string GetPagesPrefix(const std::string& instanceId)
+{
+  return instanceId + "-page";
+}
+
+
+static std::string GetPageKey(const std::string& instanceId,
+                              size_t pageOffset)
+{
+  return GetPagesPrefix(instanceId) + boost::lexical_cast<std::string>(pageOffset);
+}
+
+
+// Tells whether the key is the one of the instance, or of its pages
+static bool IsKeyOfInstance(const std::string& key,
+                            const std::string& instanceId)
+{
+  const std::string prefix = GetPagesPrefix(instanceId);
+  return (key == instanceId ||
+          key.compare(0, prefix.size(), prefix) == 0);
+}
+
+
+namespace OrthancPlugins
+{
+  class OrthancInstancesCache::Shard : public boost::noncopyable
+  {
+  private:
+    typedef std::map<std::string, boost::shared_ptr<SourceDicomInstance> >  Content;
+
+    // Instance that is currently being loaded by one thread, and that
+    // other threads are waiting for
+    struct PendingLoad
+    {
+      bool                                    done_;
+      Orthanc::ErrorCode                      error_;
+      boost::shared_ptr<SourceDicomInstance>  instance_;
+      bool                                    prefetch_;  // Started by the prefetcher
+      bool                                    claimed_;   // Some thread is waiting for it
+      bool                                    invalidated_;  // The result must not be cached
+
+      explicit PendingLoad(bool prefetch) :
+        done_(false),
+        error_(Orthanc::ErrorCode_Success),
+        prefetch_(prefetch),
+        claimed_(false),
+        invalidated_(false)
+      {
+      }
+    };
+
+    typedef std::map<std::string, boost::shared_ptr<PendingLoad> >  PendingLoads;
+
+    // Pinned instance, that is still needed by some bucket of a
+    // transfer. Pinned instances are withdrawn from the policy, which
+    // prevents their eviction.
+    struct PinnedInstance
+    {
+      unsigned int  count_;
+      size_t        size_;
+    };
+
+    typedef std::map<std::string, PinnedInstance>  Pins;
+
+    mutable boost::mutex       mutex_;
+    boost::condition_variable  loadFinished_;
+    std::unique_ptr<IInstancesCachePolicy>  policy_;
+    Content                    content_;
+    PendingLoads               pendingLoads_;
+    std::set<std::string>      prefetched_;   // Prefetched instances that are not accessed yet
+    Pins                       pins_;
+    std::vector<boost::shared_ptr<SourceDicomInstance> >  evicted_;  // To be demoted to the disk cache
+    size_t                     memorySize_;
+    size_t                     maxMemorySize_;
+    size_t                     hitCount_;
+    size_t                     missCount_;
+    size_t                     mergedLoadsCount_;
+    size_t                     rejectedCount_;
+    size_t                     prefetchCount_;
+    size_t                     prefetchHitCount_;
+    size_t                     wastedPrefetchCount_;
+
+    // The mutex must be locked!
+    void CheckInvariants() const
+    {
+#ifndef NDEBUG
+      size_t s = 0;
+      size_t pinned = 0;
+
+      for (Content::const_iterator it = content_.begin();
+           it != content_.end(); ++it)
+      {
+        assert(it->second.get() != NULL);
+        s += it->second->GetInfo().GetSize();
+
+        if (pins_.find(it->first) == pins_.end())
+        {
+          assert(policy_->Contains(it->first));
+        }
+        else
+        {
+          assert(!policy_->Contains(it->first));
+          pinned++;
+        }
+      }
+
+      assert(s == memorySize_);
+      assert(content_.size() == policy_->GetSize() + pinned);
+
+      if (memorySize_ > maxMemorySize_ &&
+          pinned == 0)
+      {
+        // It is only allowed to overtake the max memory size if the
+        // shard contains a single, large DICOM instance, or if some
+        // instances are pinned
+        assert(policy_->GetSize() == 1 &&
+               content_.size() == 1 &&
+               memorySize_ == (content_.begin())->second->GetInfo().GetSize());
+      }
+#endif
+    }
+
+    // The mutex must be locked!
+    void FinishPendingLoad(const std::string& instanceId,
+                           const boost::shared_ptr<SourceDicomInstance>& instance,
+                           Orthanc::ErrorCode error)
+    {
+      PendingLoads::iterator found = pendingLoads_.find(instanceId);
+
+      if (found != pendingLoads_.end())
+      {
+        assert(found->second.get() != NULL);
+        found->second->done_ = true;
+        found->second->error_ = error;
+        found->second->instance_ = instance;
+        pendingLoads_.erase(found);
+
+        loadFinished_.notify_all();
+      }
+    }
+
+    // The mutex must be locked!
+    size_t RemoveOldestInternal()
+    {
+      assert(policy_->GetSize() > 0);
+
+      std::string oldest = policy_->GetVictim();
+      policy_->Remove(oldest);
+
+      Content::iterator instance = content_.find(oldest);
+      assert(instance != content_.end() &&
+             instance->second.get() != NULL);
+
+      if (prefetched_.erase(oldest) > 0)
+      {
+        // This instance was prefetched, but never accessed
+        wastedPrefetchCount_++;
+      }
+
+      // The instance is only released from the memory once all the
+      // threads that are reading from it have released it
+      size_t size = instance->second->GetInfo().GetSize();
+      memorySize_ -= size;
+      evicted_.push_back(instance->second);
+      content_.erase(instance);
+
+      return size;
+    }
+
+  public:
+    explicit Shard(CachePolicy policy) :
+      policy_(IInstancesCachePolicy::Create(policy)),
+      memorySize_(0),
+      maxMemorySize_(0),
+      hitCount_(0),
+      missCount_(0),
+      mergedLoadsCount_(0),
+      rejectedCount_(0),
+      prefetchCount_(0),
+      prefetchHitCount_(0),
+      wastedPrefetchCount_(0)
+    {
+    }
+
+    /**
+     * Returns "true" if the instance is available, either because it
+     * is part of the cache, or because it has just been loaded by
+     * another thread that was already loading it. Returns "false" if
+     * the instance is unavailable: In this case, the caller becomes
+     * responsible for loading it, then for calling either "Store()"
+     * or "AbortLoad()".
+     **/
+    bool Lookup(boost::shared_ptr<SourceDicomInstance>& target,
+                const std::string& instanceId)
+    {
+      boost::mutex::scoped_lock lock(mutex_);
+
+      policy_->RecordAccess(instanceId);
+
+      Content::const_iterator found = content_.find(instanceId);
+
+      if (found != content_.end())
+      {
+        if (policy_->Contains(instanceId))  // Pinned instances are not part of the policy
+        {
+          policy_->Touch(instanceId);
+        }
+
+        if (prefetched_.erase(instanceId) > 0)
+        {
+          prefetchHitCount_++;
+        }
+
+        assert(found->second.get() != NULL);
+        target = found->second;
+        hitCount_++;
+        return true;
+      }
+
+      PendingLoads::const_iterator pending = pendingLoads_.find(instanceId);
+
+      if (pending == pendingLoads_.end())
+      {
+        // Nobody is loading this instance, the caller must load it
+        pendingLoads_[instanceId].reset(new PendingLoad(false));
+        return false;
+      }
+
+      // Another thread is loading this instance, wait for it instead
+      // of reading the same DICOM file once again
+      mergedLoadsCount_++;
+
+      boost::shared_ptr<PendingLoad> load = pending->second;
+      assert(load.get() != NULL);
+
+      if (load->prefetch_ &&
+          !load->claimed_)
+      {
+        // The prefetcher has started reading this instance ahead of time
+        prefetchHitCount_++;
+      }
+
+      load->claimed_ = true;
+
+      while (!load->done_)
+      {
+        loadFinished_.wait(lock);
+      }
+
+      if (load->error_ != Orthanc::ErrorCode_Success)
+      {
+        throw Orthanc::OrthancException(load->error_);
+      }
+
+      assert(load->instance_.get() != NULL);
+      target = load->instance_;
+      return true;
+    }
+
+    /**
+     * Returns "true" iff the instance is neither part of the cache,
+     * nor being loaded. In this case, the caller becomes responsible
+     * for loading it, then for calling "Store()" or "AbortLoad()".
+     * Contrarily to "Lookup()", this is not considered as an access.
+     **/
+    bool ReservePrefetch(const std::string& instanceId)
+    {
+      boost::mutex::scoped_lock lock(mutex_);
+
+      if (content_.find(instanceId) != content_.end() ||
+          pendingLoads_.find(instanceId) != pendingLoads_.end())
+      {
+        return false;
+      }
+      else
+      {
+        pendingLoads_[instanceId].reset(new PendingLoad(true));
+        prefetchCount_++;
+        return true;
+      }
+    }
+
+    void AbortLoad(const std::string& instanceId,
+                   Orthanc::ErrorCode error)
+    {
+      boost::mutex::scoped_lock lock(mutex_);
+      FinishPendingLoad(instanceId, boost::shared_ptr<SourceDicomInstance>(), error);
+    }
+
+    void Store(size_t& added /* out */,
+               size_t& removed /* out */,
+               size_t& removedInstances /* out */,
+               const std::string& instanceId,
+               const boost::shared_ptr<SourceDicomInstance>& instance)
+    {
+      if (instance.get() == NULL)
+      {
+        throw Orthanc::OrthancException(Orthanc::ErrorCode_NullPointer);
+      }
+
+      added = 0;
+      removed = 0;
+      removedInstances = 0;
+
+      boost::mutex::scoped_lock lock(mutex_);
+
+      // Check whether this is a prefetch, and whether somebody is
+      // already waiting for it
+      bool isPrefetch = false;
+      bool prefetch = false;
+      bool invalidated = false;
+
+      PendingLoads::const_iterator pending = pendingLoads_.find(instanceId);
+      if (pending != pendingLoads_.end())
+      {
+        isPrefetch = pending->second->prefetch_;
+        prefetch = (pending->second->prefetch_ &&
+                    !pending->second->claimed_);
+        invalidated = pending->second->invalidated_;
+      }
+
+      // Wake up the threads that are waiting for this instance
+      FinishPendingLoad(instanceId, instance, Orthanc::ErrorCode_Success);
+
+      if (invalidated)
+      {
+        // The instance was deleted or modified during its load: It is
+        // served to the threads that were waiting for it, but not cached
+        return;
+      }
+
+      const size_t size = instance->GetInfo().GetSize();
+      const bool pinned = (pins_.find(instanceId) != pins_.end());
+
+      if (content_.find(instanceId) != content_.end())
+      {
+        // This instance has been read by another thread since the cache
+        // lookup, give up
+        if (!pinned)
+        {
+          policy_->Touch(instanceId);
+        }
+      }
+      else
+      {
+        if (!isPrefetch)
+        {
+          // The prefetches are not triggered by an access
+          missCount_++;
+        }
+
+        // Pinned instances are always admitted, as some bucket still needs them
+        if (!pinned &&
+            !policy_->Admit(instanceId, size, memorySize_ + size > maxMemorySize_ ?
+                            memorySize_ + size - maxMemorySize_ : 0))
+        {
+          // The instance is served to the caller, but not cached
+          rejectedCount_++;
+
+          if (prefetch)
+          {
+            wastedPrefetchCount_++;
+          }
+          
+          return;
+        }
+        
+        // Make room in the shard for the new instance
+        while (policy_->GetSize() > 0 &&
+               memorySize_ + size > maxMemorySize_)
+        {
+          removed += RemoveOldestInternal();
+          removedInstances++;
+        }
+
+        if (!pinned)
+        {
+          policy_->Add(instanceId, size);
+        }
+
+        content_[instanceId] = instance;
+
+        if (prefetch)
+        {
+          prefetched_.insert(instanceId);
+        }
+
+        added = size;
+        memorySize_ += added;
+
+        CheckInvariants();
+      }
+    }
+
+    bool RemoveOldest(size_t& removed /* out */,
+                      const std::string& keep)
+    {
+      boost::mutex::scoped_lock lock(mutex_);
+
+      if (policy_->GetSize() == 0 ||
+          policy_->GetVictim() == keep)
+      {
+        return false;
+      }
+      else
+      {
+        removed = RemoveOldestInternal();
+        CheckInvariants();
+        return true;
+      }
+    }
+
+    void SetMaxMemorySize(size_t& removed /* out */,
+                          size_t& removedInstances /* out */,
+                          size_t size)
+    {
+      removed = 0;
+      removedInstances = 0;
+
+      boost::mutex::scoped_lock lock(mutex_);
+
+      while (memorySize_ > size &&
+             policy_->GetSize() > 0)
+      {
+        removed += RemoveOldestInternal();
+        removedInstances++;
+      }
+
+      maxMemorySize_ = size;
+      policy_->SetCapacity(size);
+      CheckInvariants();
+    }
+
+    // Removes the instance and its pages from the shard, without
+    // demoting them to the disk cache. The pins are kept, but the
+    // loads in progress are not cached once they complete.
+    void Invalidate(size_t& removed /* out */,
+                    size_t& removedInstances /* out */,
+                    const std::string& instanceId)
+    {
+      removed = 0;
+      removedInstances = 0;
+
+      boost::mutex::scoped_lock lock(mutex_);
+
+      // The keys of the instance and of its pages are contiguous
+      std::vector<std::string> keys;
+
+      for (Content::const_iterator it = content_.lower_bound(instanceId);
+           it != content_.end() && it->first.compare(0, instanceId.size(), instanceId) == 0; ++it)
+      {
+        if (IsKeyOfInstance(it->first, instanceId))
+        {
+          keys.push_back(it->first);
+        }
+      }
+
+      for (size_t i = 0; i < keys.size(); i++)
+      {
+        Content::iterator found = content_.find(keys[i]);
+        assert(found != content_.end() &&
+               found->second.get() != NULL);
+
+        if (policy_->Contains(keys[i]))  // Pinned instances are not part of the policy
+        {
+          policy_->Remove(keys[i]);
+        }
+
+        prefetched_.erase(keys[i]);
+
+        const size_t size = found->second->GetInfo().GetSize();
+        assert(memorySize_ >= size);
+        memorySize_ -= size;
+        removed += size;
+        removedInstances++;
+        content_.erase(found);
+      }
+
+      for (PendingLoads::iterator it = pendingLoads_.lower_bound(instanceId);
+           it != pendingLoads_.end() && it->first.compare(0, instanceId.size(), instanceId) == 0; ++it)
+      {
+        if (IsKeyOfInstance(it->first, instanceId))
+        {
+          it->second->invalidated_ = true;
+        }
+      }
+
+      std::vector<boost::shared_ptr<SourceDicomInstance> > evicted;
+      evicted.reserve(evicted_.size());
+
+      for (size_t i = 0; i < evicted_.size(); i++)
+      {
+        if (!IsKeyOfInstance(evicted_[i]->GetInfo().GetId(), instanceId))
+        {
+          evicted.push_back(evicted_[i]);
+        }
+      }
+
+      evicted_.swap(evicted);
+
+      CheckInvariants();
+    }
+
+    bool IsPinned(const std::string& instanceId)
+    {
+      boost::mutex::scoped_lock lock(mutex_);
+      return (pins_.find(instanceId) != pins_.end());
+    }
+
+    // Returns "true" iff the instance was not pinned before
+    bool Pin(const std::string& instanceId,
+             size_t size)
+    {
+      boost::mutex::scoped_lock lock(mutex_);
+
+      Pins::iterator found = pins_.find(instanceId);
+
+      if (found != pins_.end())
+      {
+        found->second.count_++;
+        return false;
+      }
+
+      PinnedInstance& pin = pins_[instanceId];
+      pin.count_ = 1;
+      pin.size_ = size;
+
+      if (policy_->Contains(instanceId))
+      {
+        // The instance is already cached: It cannot be evicted anymore
+        policy_->Remove(instanceId);
+      }
+
+      CheckInvariants();
+      return true;
+    }
+
+    // Returns "true" iff the instance is not pinned anymore. In this
+    // case, it is given back to the policy, and the shard is shrunk
+    // if the pinned instances have made it overtake its budget.
+    bool Unpin(size_t& unpinnedSize /* out */,
+               size_t& removed /* out */,
+               size_t& removedInstances /* out */,
+               const std::string& instanceId)
+    {
+      unpinnedSize = 0;
+      removed = 0;
+      removedInstances = 0;
+
+      boost::mutex::scoped_lock lock(mutex_);
+
+      Pins::iterator found = pins_.find(instanceId);
+
+      if (found == pins_.end())
+      {
+        throw Orthanc::OrthancException(Orthanc::ErrorCode_BadSequenceOfCalls);
+      }
+
+      assert(found->second.count_ > 0);
+      found->second.count_--;
+
+      if (found->second.count_ > 0)
+      {
+        return false;
+      }
+
+      unpinnedSize = found->second.size_;
+      pins_.erase(found);
+
+      Content::const_iterator instance = content_.find(instanceId);
+      if (instance != content_.end())
+      {
+        assert(instance->second.get() != NULL);
+        policy_->Add(instanceId, instance->second->GetInfo().GetSize());
+
+        while (memorySize_ > maxMemorySize_ &&
+               policy_->GetSize() > 1)
+        {
+          removed += RemoveOldestInternal();
+          removedInstances++;
+        }
+      }
+
+      CheckInvariants();
+      return true;
+    }
+
+    void TakeEvicted(std::vector<boost::shared_ptr<SourceDicomInstance> >& target)
+    {
+      boost::mutex::scoped_lock lock(mutex_);
+      target.swap(evicted_);
+      evicted_.clear();
+    }
+
+    size_t GetHitCount() const
+    {
+      boost::mutex::scoped_lock lock(mutex_);
+      return hitCount_;
+    }
+
+    size_t GetMissCount() const
+    {
+      boost::mutex::scoped_lock lock(mutex_);
+      return missCount_;
+    }
+
+    size_t GetMergedLoadsCount() const
+    {
+      boost::mutex::scoped_lock lock(mutex_);
+      return mergedLoadsCount_;
+    }
+
+    size_t GetRejectedCount() const
+    {
+      boost::mutex::scoped_lock lock(mutex_);
+      return rejectedCount_;
+    }
+
+    void GetPrefetchStatistics(size_t& prefetchCount,
+                               size_t& prefetchHitCount,
+                               size_t& wastedPrefetchCount) const
+    {
+      boost::mutex::scoped_lock lock(mutex_);
+      prefetchCount = prefetchCount_;
+      prefetchHitCount = prefetchHitCount_;
+      wastedPrefetchCount = wastedPrefetchCount_;
+    }
+  };
+
+
+  OrthancInstancesCache::Shard& OrthancInstancesCache::GetShard(const std::string& instanceId) const
+  {
+    assert(!shards_.empty());
+    
+    size_t index = boost::hash_value(instanceId) % shards_.size();
+    assert(shards_[index] != NULL);
+
+    return *shards_[index];
+  }
+
+
+  void OrthancInstancesCache::UpdateGlobalSize(size_t added,
+                                               size_t removed,
+                                               size_t addedInstances,
+                                               size_t removedInstances)
+  {
+    boost::mutex::scoped_lock lock(mutex_);
+
+    assert(memorySize_ + added >= removed &&
+           instancesCount_ + addedInstances >= removedInstances);
+
+    memorySize_ = memorySize_ + added - removed;
+    instancesCount_ = instancesCount_ + addedInstances - removedInstances;
+  }
+
+
+  void OrthancInstancesCache::ApplyGlobalBudget(const std::string& justStored)
+  {
+    // Evict the oldest instances of the shards in a round-robin
+    // fashion, until the global budget is respected. Only one shard
+    // is locked at once, which prevents deadlocks.
+    size_t failures = 0;
+
+    while (failures < shards_.size())
+    {
+      Shard* victim = NULL;
+
+      {
+        boost::mutex::scoped_lock lock(mutex_);
+
+        if (memorySize_ <= maxMemorySize_ ||
+            instancesCount_ <= 1)
+        {
+          return;
+        }
+
+        victim = shards_[nextVictim_];
+        nextVictim_ = (nextVictim_ + 1) % shards_.size();
+      }
+
+      size_t removed;
+
+      assert(victim != NULL);
+      if (victim->RemoveOldest(removed, justStored))
+      {
+        UpdateGlobalSize(0, removed, 0, 1);
+        DemoteEvicted(*victim);
+        failures = 0;
+      }
+      else
+      {
+        failures++;
+      }
+    }
+  }
+
+
+  void OrthancInstancesCache::DemoteEvicted(Shard& shard)
+  {
+    std::vector<boost::shared_ptr<SourceDicomInstance> > evicted;
+    shard.TakeEvicted(evicted);
+
+    if (disk_.get() != NULL)
+    {
+      for (size_t i = 0; i < evicted.size(); i++)
+      {
+        assert(evicted[i].get() != NULL);
+        disk_->Store(*evicted[i]);
+      }
+    }
+  }
+
+
+  boost::shared_ptr<SourceDicomInstance> OrthancInstancesCache::Acquire(const std::string& instanceId)
+  {
+    Shard& shard = GetShard(instanceId);
+
+    boost::shared_ptr<SourceDicomInstance> instance;
+
+    // Check whether the instance is part of the cache
+    if (shard.Lookup(instance, instanceId))
+    {
+      assert(instance.get() != NULL);
+      return instance;
+    }
+
+    // The instance was not in the cache, and no other thread is
+    // loading it: Load it without holding any lock
+    return LoadAndStore(shard, instanceId, instanceId, 0, 0);
+  }
+
+
+  boost::shared_ptr<SourceDicomInstance> OrthancInstancesCache::AcquirePage(const std::string& instanceId,
+                                                                            size_t pageOffset,
+                                                                            size_t pageSize)
+  {
+    const std::string key = GetPageKey(instanceId, pageOffset);
+    Shard& shard = GetShard(key);
+
+    boost::shared_ptr<SourceDicomInstance> page;
+
+    if (shard.Lookup(page, key))
+    {
+      assert(page.get() != NULL);
+      return page;
+    }
+
+    return LoadAndStore(shard, key, instanceId, pageOffset, pageSize);
+  }
+
+
+  bool OrthancInstancesCache::LookupInstanceSize(size_t& size,
+                                                 const std::string& instanceId)
   {
-    if (instance_ == NULL)
+    std::string md5;
+
+    if (infoIndex_.LookupSize(size, instanceId))
     {
-      throw Orthanc::OrthancException(Orthanc::ErrorCode_BadSequenceOfCalls);
+      return true;
+    }
+    else if (LookupAttachmentInfo(size, md5, instanceId))
+    {
+      // The size is indexed even if Orthanc does not store the MD5, so
+      // that the next chunks of this instance need no REST call
+      if (md5.empty())
+      {
+        infoIndex_.RegisterSize(instanceId, size);
+      }
+      else
+      {
+        infoIndex_.Register(DicomInstanceInfo(instanceId, size, md5));
+      }
+
+      return true;
+    }
+    else
+    {
+      return false;
     }
   }
-      
 
-  OrthancInstancesCache::CacheAccessor::CacheAccessor(OrthancInstancesCache& cache,
-                                                      const std::string& instanceId) :
-    lock_(cache.mutex_),
-    instance_(NULL)
+
+  bool OrthancInstancesCache::IsRangeRead(size_t& instanceSize,
+                                          const std::string& instanceId)
   {
-    cache.CheckInvariants();
-      
-    if (cache.index_.Contains(instanceId))
+    if (rangeReadThreshold_ == 0)
     {
-      // Move the instance at the end of the LRU recycling
-      cache.index_.MakeMostRecent(instanceId);
-        
-      Content::const_iterator instance = cache.content_.find(instanceId);
-      assert(instance != cache.content_.end() &&
-             instance->first == instanceId &&
-             instance->second != NULL);
+      return false;
+    }
+
+    {
+      boost::mutex::scoped_lock lock(mutex_);
+      if (!rangeReadSupported_)
+      {
+        return false;
+      }
+    }
+
+    // Never read the DICOM file to get its size: If the size is
+    // unknown, the instance is read as a whole
+    if (!LookupInstanceSize(instanceSize, instanceId))
+    {
+      return false;
+    }
+
+    return instanceSize > rangeReadThreshold_;
+  }
 
-      instance_ = instance->second;
 
+  boost::shared_ptr<SourceDicomInstance> OrthancInstancesCache::LoadAndStore(Shard& shard,
+                                                                             const std::string& key,
+                                                                             const std::string& instanceId,
+                                                                             size_t pageOffset,
+                                                                             size_t pageSize)
+  {
+    boost::shared_ptr<SourceDicomInstance> instance;
+
+    try
+    {
+      if (disk_.get() != NULL)
+      {
+        instance.reset(disk_->Lookup(key));
+
+        if (instance.get() != NULL &&
+            pageSize == 0 &&
+            !IsUpToDate(instance->GetInfo()))
+        {
+          // The instance was deleted or stored again since it was
+          // written to the disk. The pages only rely on "Invalidate()".
+          disk_->Remove(key);
+          instance.reset();
+        }
+      }
+
+      if (instance.get() == NULL)
+      {
+        if (pageSize == 0)
+        {
+          instance.reset(LoadInstance(instanceId));
+        }
+        else
+        {
+          instance.reset(LoadRange(key, instanceId, pageOffset, pageSize));
+        }
+      }
+
+      if (instance.get() == NULL)
       {
-        boost::mutex::scoped_lock lock(cache.cacheStatsMutex_);
-        ++cache.cacheHitCount_;
+        throw Orthanc::OrthancException(Orthanc::ErrorCode_NullPointer);
       }
     }
+    catch (Orthanc::OrthancException& e)
+    {
+      shard.AbortLoad(key, e.GetErrorCode());
+      throw;
+    }
+    catch (...)
+    {
+      shard.AbortLoad(key, Orthanc::ErrorCode_InternalError);
+      throw;
+    }
+
+    if (pageSize == 0)
+    {
+      infoIndex_.Register(instance->GetInfo());
+    }
+    else if (instance->GetInfo().GetSize() != pageSize)
+    {
+      shard.AbortLoad(key, Orthanc::ErrorCode_CorruptedFile);
+      throw Orthanc::OrthancException(Orthanc::ErrorCode_CorruptedFile);
+    }
+
+    // Store the just-loaded DICOM instance (or page) into the cache
+    size_t added, removed, removedInstances;
+    shard.Store(added, removed, removedInstances, key, instance);
+
+    UpdateGlobalSize(added, removed, (added > 0 ? 1 : 0), removedInstances);
+    DemoteEvicted(shard);
+    ApplyGlobalBudget(key);
+
+    if (pageSize == 0 &&
+        listener_ != NULL)
+    {
+      listener_->SignalInstanceLoaded(instanceId, instance->GetBuffer(), instance->GetInfo().GetSize());
+    }
+
+    return instance;
   }
 
 
-  const DicomInstanceInfo& OrthancInstancesCache::CacheAccessor::GetInfo() const
+  bool OrthancInstancesCache::IsUpToDate(const DicomInstanceInfo& info)
   {
-    CheckValid();
-    return instance_->GetInfo();
+    size_t size;
+    std::string md5;
+
+    return (LookupAttachmentInfo(size, md5, info.GetId()) &&
+            size == info.GetSize() &&
+            (md5.empty() || md5 == info.GetMD5()));
   }
 
 
-  void OrthancInstancesCache::CacheAccessor::GetChunk(std::string& chunk,
-                                                      std::string& md5,
-                                                      size_t offset,
-                                                      size_t size)
+  void OrthancInstancesCache::Invalidate(const std::string& instanceId)
   {
-    CheckValid();
-    return instance_->GetChunk(chunk, md5, offset, size);
+    // The pages of the instance can be spread over all the shards
+    for (size_t i = 0; i < shards_.size(); i++)
+    {
+      size_t removed, removedInstances;
+      shards_[i]->Invalidate(removed, removedInstances, instanceId);
+      UpdateGlobalSize(0, removed, 0, removedInstances);
+    }
+
+    infoIndex_.Forget(instanceId);
+
+    if (disk_.get() != NULL)
+    {
+      disk_->Remove(instanceId);
+      disk_->RemoveByPrefix(GetPagesPrefix(instanceId));
+    }
   }
 
 
-  void OrthancInstancesCache::CheckInvariants()
+  bool OrthancInstancesCache::Pin(const std::vector<std::string>& instances,
+                                  unsigned int timeoutSeconds)
   {
-#ifndef NDEBUG  
-    size_t s = 0;
+    // The sizes are available from the index once the transfer is scheduled
+    std::vector<size_t> sizes(instances.size());
 
-    assert(content_.size() == index_.GetSize());
-      
-    for (Content::const_iterator it = content_.begin();
-         it != content_.end(); ++it)
+    for (size_t i = 0; i < instances.size(); i++)
     {
-      assert(it->second != NULL);
-      s += it->second->GetInfo().GetSize();
+      std::string md5;  // Ignored
 
-      assert(index_.Contains(it->first));
+      if (IsRangeRead(sizes[i], instances[i]))
+      {
+        // The pages of large instances are not pinned, as they are
+        // never cached as a whole
+        sizes[i] = 0;
+      }
+      else if (!LookupInstanceSize(sizes[i], instances[i]))
+      {
+        GetInstanceInfo(sizes[i], md5, instances[i]);
+      }
     }
 
-    assert(s == memorySize_);
-      
-    if (memorySize_ > maxMemorySize_)
+    const boost::system_time timeout = (boost::get_system_time() +
+                                        boost::posix_time::seconds(timeoutSeconds));
+
+    // The shards are pinned while holding the global mutex, so that
+    // the concurrent calls cannot pin past the budget
+    boost::mutex::scoped_lock lock(mutex_);
+
+    for (;;)
+    {
+      // The instances that are already pinned need no more bytes
+      size_t missing = 0;
+
+      for (size_t i = 0; i < instances.size(); i++)
+      {
+        if (!GetShard(instances[i]).IsPinned(instances[i]))
+        {
+          missing += sizes[i];
+        }
+      }
+
+      // The first pin is always granted, which prevents a bucket that
+      // is larger than the budget from waiting forever
+      if (missing == 0 ||
+          pinnedSize_ == 0 ||
+          pinnedSize_ + missing <= maxMemorySize_ / 2)
+      {
+        break;
+      }
+
+      if (!unpinned_.timed_wait(lock, timeout))
+      {
+        LOG(INFO) << "Too many bytes are pinned in the cache of the transfers accelerator ("
+                  << ConvertToMegabytes(pinnedSize_) << " MB), cannot pin "
+                  << instances.size() << " instance(s)";
+        return false;
+      }
+    }
+
+    for (size_t i = 0; i < instances.size(); i++)
     {
-      // It is only allowed to overtake the max memory size if the
-      // cache contains a single, large DICOM instance
-      assert(index_.GetSize() == 1 &&
-             content_.size() == 1 &&
-             memorySize_ == (content_.begin())->second->GetInfo().GetSize());
+      if (GetShard(instances[i]).Pin(instances[i], sizes[i]))
+      {
+        pinnedSize_ += sizes[i];
+      }
     }
-#endif
+
+    return true;
+  }
+
+
+  void OrthancInstancesCache::Unpin(const std::string& instanceId)
+  {
+    size_t unpinnedSize, removed, removedInstances;
+
+    Shard& shard = GetShard(instanceId);
+
+    if (shard.Unpin(unpinnedSize, removed, removedInstances, instanceId))
+    {
+      {
+        boost::mutex::scoped_lock lock(mutex_);
+        assert(pinnedSize_ >= unpinnedSize);
+        pinnedSize_ -= unpinnedSize;
+        unpinned_.notify_all();
+      }
+
+      UpdateGlobalSize(0, removed, 0, removedInstances);
+      DemoteEvicted(shard);
+      ApplyGlobalBudget("");
+    }
+  }
+
+
+  size_t OrthancInstancesCache::GetPinnedSize()
+  {
+    boost::mutex::scoped_lock lock(mutex_);
+    return pinnedSize_;
   }
 
 
-  void OrthancInstancesCache::RemoveOldest()
+  void OrthancInstancesCache::Prefetch(const std::string& instanceId)
   {
-    CheckInvariants();
+    size_t instanceSize;
+    if (IsRangeRead(instanceSize, instanceId))
+    {
+      // Prefetching a large instance as a whole would defeat the
+      // range reads, its pages are only read once they are needed
+      return;
+    }
 
-    assert(!index_.IsEmpty());
+    Shard& shard = GetShard(instanceId);
 
-    std::string oldest = index_.RemoveOldest();
+    if (shard.ReservePrefetch(instanceId))
+    {
+      LoadAndStore(shard, instanceId, instanceId, 0, 0);
+    }
+  }
 
-    Content::iterator instance = content_.find(oldest);
-    assert(instance != content_.end() &&
-           instance->second != NULL);
 
-    memorySize_ -= instance->second->GetInfo().GetSize();
-    delete instance->second;
-    content_.erase(instance);
+  SourceDicomInstance* OrthancInstancesCache::LoadInstance(const std::string& instanceId)
+  {
+    return new SourceDicomInstance(instanceId);
   }
 
 
-  void OrthancInstancesCache::Store(const std::string& instanceId,
-                                    std::unique_ptr<SourceDicomInstance>& instance)
+  SourceDicomInstance* OrthancInstancesCache::LoadRange(const std::string& key,
+                                                        const std::string& instanceId,
+                                                        size_t offset,
+                                                        size_t size)
   {
-    if (instance.get() == NULL)
+    if (size == 0)
     {
-      throw Orthanc::OrthancException(Orthanc::ErrorCode_NullPointer);
+      throw Orthanc::OrthancException(Orthanc::ErrorCode_ParameterOutOfRange);
     }
-      
-    if (index_.Contains(instanceId))
+
+    LOG(INFO) << "Transfers accelerator reading " << size << " bytes at offset "
+              << offset << " of DICOM instance: " << instanceId;
+
+    HttpHeaders headers;
+    headers["Range"] = ("bytes=" + boost::lexical_cast<std::string>(offset) + "-" +
+                        boost::lexical_cast<std::string>(offset + size - 1));
+
+    MemoryBuffer buffer;
+    if (!buffer.RestApiGet("/instances/" + instanceId + "/attachments/dicom/data", headers, false))
     {
-      // This instance has been read by another thread since the cache
-      // lookup, give up
-      index_.MakeMostRecent(instanceId);
-      return;
+      throw Orthanc::OrthancException(Orthanc::ErrorCode_UnknownResource);
     }
-    else
+
+    if (buffer.GetSize() == size)
+    {
+      OrthancPluginMemoryBuffer content = buffer.Release();
+      return new SourceDicomInstance(DicomInstanceInfo(key, size, ""), content);
+    }
+    else if (buffer.GetSize() > offset &&
+             buffer.GetSize() - offset >= size)
     {
-      // Make room in the cache for the new instance
-      while (!index_.IsEmpty() &&
-             memorySize_ + instance->GetInfo().GetSize() > maxMemorySize_)
+      // This version of the Orthanc core has ignored the "Range"
+      // header and has sent the whole file: Fall back to whole reads
       {
-        RemoveOldest();
+        boost::mutex::scoped_lock lock(mutex_);
+
+        if (rangeReadSupported_)
+        {
+          LOG(WARNING) << "The Orthanc core does not support HTTP range requests, "
+                       << "the transfers accelerator will read the large instances as a whole";
+          rangeReadSupported_ = false;
+        }
       }
 
-      CheckInvariants();
+      return new SourceDicomInstance(key, std::string(reinterpret_cast<const char*>(buffer.GetData()) + offset, size));
+    }
+    else
+    {
+      throw Orthanc::OrthancException(Orthanc::ErrorCode_NetworkProtocol,
+                                      "Bad range read from DICOM instance: " + instanceId);
+    }
+  }
+
+
+  bool OrthancInstancesCache::LookupAttachmentInfo(size_t& size,
+                                                   std::string& md5,
+                                                   const std::string& instanceId)
+  {
+    static const char* const UNCOMPRESSED_SIZE = "UncompressedSize";
+    static const char* const UNCOMPRESSED_MD5 = "UncompressedMD5";
 
-      index_.AddOrMakeMostRecent(instanceId);
-      memorySize_ += instance->GetInfo().GetSize();
-      content_[instanceId] = instance.release();
+    Json::Value info;
+    if (RestApiGet(info, "/instances/" + instanceId + "/attachments/dicom/info", false) &&
+        info.type() == Json::objectValue &&
+        info.isMember(UNCOMPRESSED_SIZE) &&
+        info[UNCOMPRESSED_SIZE].isIntegral())
+    {
+      size = static_cast<size_t>(info[UNCOMPRESSED_SIZE].asUInt64());
 
+      // Empty if "StoreMD5ForAttachments" is false
+      if (info.isMember(UNCOMPRESSED_MD5) &&
+          info[UNCOMPRESSED_MD5].type() == Json::stringValue)
+      {
+        md5 = info[UNCOMPRESSED_MD5].asString();
+      }
+      else
       {
-        boost::mutex::scoped_lock lock(cacheStatsMutex_);
-        ++cacheMissCount_;
+        md5.clear();
       }
 
-      CheckInvariants();
+      return true;
+    }
+    else
+    {
+      return false;
     }
   }
     
 
-  OrthancInstancesCache::OrthancInstancesCache() :
+  OrthancInstancesCache::OrthancInstancesCache(size_t shardsCount,
+                                               CachePolicy policy) :
     memorySize_(0),
-    maxMemorySize_(512 * MB),  // 512 MB by default
-    cacheHitCount_(0),
-    cacheMissCount_(0)
+    maxMemorySize_(0),
+    instancesCount_(0),
+    nextVictim_(0),
+    pinnedSize_(0),
+    infoIndex_(MAX_INDEXED_INSTANCES),
+    rangeReadThreshold_(0),
+    pageSize_(4 * MB),
+    rangeReadSupported_(true),
+    listener_(NULL)
   {
+    if (shardsCount == 0)
+    {
+      throw Orthanc::OrthancException(Orthanc::ErrorCode_ParameterOutOfRange);
+    }
+
+    shards_.resize(shardsCount);
+
+    for (size_t i = 0; i < shardsCount; i++)
+    {
+      shards_[i] = new Shard(policy);
+    }
+
+    SetMaxMemorySize(512 * MB);  // 512 MB by default
   }
     
 
   OrthancInstancesCache::~OrthancInstancesCache()
   {
-    CheckInvariants();
-      
-    for (Content::iterator it = content_.begin();
-         it != content_.end(); ++it)
+    for (size_t i = 0; i < shards_.size(); i++)
     {
-      assert(it->second != NULL);
-      delete it->second;
+      assert(shards_[i] != NULL);
+      delete shards_[i];
     }
   }
   
@@ -209,16 +1234,74 @@ namespace OrthancPlugins
     {
       throw Orthanc::OrthancException(Orthanc::ErrorCode_ParameterOutOfRange);
     }
+
+    {
+      boost::mutex::scoped_lock lock(mutex_);
+      maxMemorySize_ = size;
+    }
+
+    // Each shard is allowed to use twice its fair share of the global
+    // budget, in order to absorb the imbalance between the shards
+    size_t shardSize = size;
+    if (shards_.size() > 2)
+    {
+      shardSize = 2 * (size / shards_.size());
+    }
     
-    boost::mutex::scoped_lock lock(mutex_);
+    for (size_t i = 0; i < shards_.size(); i++)
+    {
+      size_t removed, removedInstances;
+      shards_[i]->SetMaxMemorySize(removed, removedInstances, shardSize);
+      UpdateGlobalSize(0, removed, 0, removedInstances);
+      DemoteEvicted(*shards_[i]);
+    }
+
+    ApplyGlobalBudget("");
+  }
+
+
+  void OrthancInstancesCache::SetDiskCache(DiskInstancesCache* disk)
+  {
+    if (disk == NULL)
+    {
+      throw Orthanc::OrthancException(Orthanc::ErrorCode_NullPointer);
+    }
+
+    disk_.reset(disk);
+  }
+
+
+  void OrthancInstancesCache::SetRangeReads(size_t threshold,
+                                            size_t pageSize)
+  {
+    if (threshold != 0 &&
+        pageSize == 0)
+    {
+      throw Orthanc::OrthancException(Orthanc::ErrorCode_ParameterOutOfRange);
+    }
+
+    rangeReadThreshold_ = threshold;
+    pageSize_ = pageSize;
+  }
+
 
-    while (memorySize_ > size)
+  DiskInstancesCache& OrthancInstancesCache::GetDiskCache() const
+  {
+    if (disk_.get() == NULL)
+    {
+      throw Orthanc::OrthancException(Orthanc::ErrorCode_BadSequenceOfCalls);
+    }
+    else
     {
-      RemoveOldest();
+      return *disk_;
     }
+  }
 
-    maxMemorySize_ = size;
-    CheckInvariants();      
+
+  size_t OrthancInstancesCache::GetInstancesCount()
+  {
+    boost::mutex::scoped_lock lock(mutex_);
+    return instancesCount_;
   }
 
 
@@ -226,67 +1309,157 @@ namespace OrthancPlugins
                                               std::string& md5,
                                               const std::string& instanceId)
   {
-    // Check whether the instance is part of the cache
+    DicomInstanceInfo info;
+
+    if (infoIndex_.Lookup(info, instanceId))
     {
-      CacheAccessor accessor(*this, instanceId);
-      if (accessor.IsValid())
-      {
-        size = accessor.GetInfo().GetSize();
-        md5 = accessor.GetInfo().GetMD5();
-        return;
-      }
+      size = info.GetSize();
+      md5 = info.GetMD5();
     }
-      
-    // The instance was not in the cache, load it
-    std::unique_ptr<SourceDicomInstance> instance(new SourceDicomInstance(instanceId));
-    size = instance->GetInfo().GetSize();
-    md5 = instance->GetInfo().GetMD5();
-
-    // Store the just-loaded DICOM instance into the cache
+    else if (LookupAttachmentInfo(size, md5, instanceId) &&
+             !md5.empty())
     {
-      boost::mutex::scoped_lock lock(mutex_);
-      Store(instanceId, instance);
+      infoIndex_.Register(DicomInstanceInfo(instanceId, size, md5));
+    }
+    else
+    {
+      // Last resort: Read the DICOM file, which also stores it in the
+      // cache and in the index. This is the case if Orthanc does not
+      // store the MD5 of the attachments.
+      boost::shared_ptr<SourceDicomInstance> instance = Acquire(instanceId);
+      size = instance->GetInfo().GetSize();
+      md5 = instance->GetInfo().GetMD5();
     }
   }
       
     
-  void OrthancInstancesCache::GetChunk(std::string& chunk,
-                                       std::string& md5,
+  bool OrthancInstancesCache::IsInstanceStored(const DicomInstanceInfo& instance)
+  {
+    size_t size;
+    std::string md5;
+
+    return (!instance.GetMD5().empty() &&
+            LookupAttachmentInfo(size, md5, instance.GetId()) &&
+            size == instance.GetSize() &&
+            md5 == instance.GetMD5());
+  }
+
+
+  void OrthancInstancesCache::AddChunk(BucketContent& target,
                                        const std::string& instanceId,
                                        size_t offset,
                                        size_t size)
   {
-    // Check whether the instance is part of the cache
+    size_t instanceSize;
+
+    if (IsRangeRead(instanceSize, instanceId))
     {
-      CacheAccessor accessor(*this, instanceId);
-      if (accessor.IsValid())
+      if (offset > instanceSize ||
+          size > instanceSize - offset)
       {
-        // keeping this log for future (see TODO) LOG(INFO) << "++++ Chunk for " << instanceId << " is in cache";
-        accessor.GetChunk(chunk, md5, offset, size);
-        return;
+        throw Orthanc::OrthancException(Orthanc::ErrorCode_ParameterOutOfRange);
       }
-    }
-      
-    // The instance was not in the cache, load it
-    std::unique_ptr<SourceDicomInstance> instance(new SourceDicomInstance(instanceId));
-    instance->GetChunk(chunk, md5, offset, size);
 
-    // Store the just-loaded DICOM instance into the cache
+      // Only read the pages that overlap the chunk
+      while (size > 0)
+      {
+        const size_t pageOffset = (offset / pageSize_) * pageSize_;
+        const size_t pageSize = std::min(pageSize_, instanceSize - pageOffset);
+        const size_t count = std::min(size, pageOffset + pageSize - offset);
+
+        target.AddSlice(AcquirePage(instanceId, pageOffset, pageSize), offset - pageOffset, count);
+
+        offset += count;
+        size -= count;
+      }
+    }
+    else
     {
-      // keeping this log for future (see TODO) LOG(ERROR) << "---- Chunk for " << instanceId << " not in cache -> adding it";
-      boost::mutex::scoped_lock lock(mutex_);
-      Store(instanceId, instance);
+      // The slice shares the ownership of the instance, which keeps it
+      // alive even if it gets evicted from the cache in the meantime
+      target.AddSlice(Acquire(instanceId), offset, size);
     }
   }    
 
 
-  void OrthancInstancesCache::GetChunk(std::string& chunk,
-                                       std::string& md5,
-                                       const TransferBucket& bucket,
-                                       size_t chunkIndex)
+  void OrthancInstancesCache::ReadBucket(BucketContent& target,
+                                         const TransferBucket& bucket)
+  {
+    for (size_t i = 0; i < bucket.GetChunksCount(); i++)
+    {
+      AddChunk(target, bucket.GetChunkInstanceId(i),
+               bucket.GetChunkOffset(i), bucket.GetChunkSize(i));
+    }
+  }
+
+
+  size_t OrthancInstancesCache::GetCacheHitCount() const
+  {
+    size_t count = 0;
+
+    for (size_t i = 0; i < shards_.size(); i++)
+    {
+      count += shards_[i]->GetHitCount();
+    }
+
+    return count;
+  }
+
+
+  size_t OrthancInstancesCache::GetCacheMissCount() const
+  {
+    size_t count = 0;
+
+    for (size_t i = 0; i < shards_.size(); i++)
+    {
+      count += shards_[i]->GetMissCount();
+    }
+
+    return count;
+  }
+
+
+  size_t OrthancInstancesCache::GetMergedLoadsCount() const
+  {
+    size_t count = 0;
+
+    for (size_t i = 0; i < shards_.size(); i++)
+    {
+      count += shards_[i]->GetMergedLoadsCount();
+    }
+
+    return count;
+  }
+
+
+  size_t OrthancInstancesCache::GetRejectedCount() const
+  {
+    size_t count = 0;
+
+    for (size_t i = 0; i < shards_.size(); i++)
+    {
+      count += shards_[i]->GetRejectedCount();
+    }
+
+    return count;
+  }
+
+
+  void OrthancInstancesCache::GetPrefetchStatistics(size_t& prefetchCount,
+                                                    size_t& prefetchHitCount,
+                                                    size_t& wastedPrefetchCount) const
   {
-    GetChunk(chunk, md5, bucket.GetChunkInstanceId(chunkIndex),
-             bucket.GetChunkOffset(chunkIndex),
-             bucket.GetChunkSize(chunkIndex));
+    prefetchCount = 0;
+    prefetchHitCount = 0;
+    wastedPrefetchCount = 0;
+
+    for (size_t i = 0; i < shards_.size(); i++)
+    {
+      size_t a, b, c;
+      shards_[i]->GetPrefetchStatistics(a, b, c);
+      prefetchCount += a;
+      prefetchHitCount += b;
+      wastedPrefetchCount += c;
+    }
   }
 }
@@ -21,104 +21,271 @@
 
 #pragma once
 
+#include "BucketContent.h"
+#include "DiskInstancesCache.h"
+#include "InstanceInfoIndex.h"
+#include "InstancesCachePolicy.h"
 #include "SourceDicomInstance.h"
 #include "TransferBucket.h"
 
-#include <Cache/LeastRecentlyUsedIndex.h>
 #include <Compatibility.h>  // For std::unique_ptr
 
+#include <boost/shared_ptr.hpp>
+#include <boost/thread/condition_variable.hpp>
 #include <boost/thread/mutex.hpp>
 
 namespace OrthancPlugins
 {
+  /**
+   * Memory cache of the source DICOM instances. The cache is split
+   * into several shards that are selected by hashing the identifier
+   * of the instances. Each shard has its own mutex, its own LRU index
+   * and its own memory budget, which prevents the HTTP threads from
+   * being serialized on a single mutex. The sum of the sizes of all
+   * the shards is additionally bounded by a global memory budget.
+   *
+   * If several threads simultaneously miss the same instance, only
+   * the first one loads it from the Orthanc core, while the other
+   * threads wait for this load to complete ("single-flight").
+   *
+   * The admission and eviction within each shard is delegated to a
+   * configurable policy (cf. "IInstancesCachePolicy").
+   *
+   * The instances that are still needed by the pending buckets of a
+   * transfer can be pinned, which prevents their eviction. As the
+   * pinned instances can make the cache overtake its budget, the
+   * threads that pin new instances wait while too many bytes are
+   * already pinned (backpressure).
+   *
+   * Optionally, the instances that are evicted from the memory are
+   * demoted to a second cache tier on the local disk (cf.
+   * "DiskInstancesCache"), which is looked up before reading the
+   * instances from the Orthanc core.
+   *
+   * The instances that are larger than a threshold are never read as
+   * a whole: Only the fixed-size pages that contain the requested
+   * bytes are read from the Orthanc core (using HTTP "Range"
+   * requests), and each page is cached as a separate entry. This
+   * bounds the memory that is used by very large instances.
+   **/
   class OrthancInstancesCache : public boost::noncopyable
   {
-  private:
-    class CacheAccessor : public boost::noncopyable
+  public:
+    // Notified of each whole instance that is read from the Orthanc
+    // core, by the thread that has read it (e.g. to sample the DICOM
+    // headers). The pages of the large instances are not notified.
+    class IInstanceListener : public boost::noncopyable
     {
-    private:
-      boost::mutex::scoped_lock  lock_;
-      SourceDicomInstance       *instance_;
-
-      void CheckValid() const;
-      
     public:
-      CacheAccessor(OrthancInstancesCache& cache,
-                    const std::string& instanceId);
-
-      bool IsValid() const
+      virtual ~IInstanceListener()
       {
-        return instance_ != NULL;
       }
 
-      const DicomInstanceInfo& GetInfo() const;
-
-      void GetChunk(std::string& chunk,
-                    std::string& md5,
-                    size_t offset,
-                    size_t size);
+      virtual void SignalInstanceLoaded(const std::string& instanceId,
+                                        const void* dicom,
+                                        size_t size) = 0;
     };
 
-    
-    typedef Orthanc::LeastRecentlyUsedIndex<std::string>  Index;
-    typedef std::map<std::string, SourceDicomInstance*>   Content;
+  private:
+    class Shard;
 
-    boost::mutex   mutex_;
-    Index          index_;
-    Content        content_;
-    size_t         memorySize_;
-    size_t         maxMemorySize_;
-    boost::mutex   cacheStatsMutex_;
-    size_t         cacheHitCount_;
-    size_t         cacheMissCount_;
+    std::vector<Shard*>  shards_;
+    boost::mutex         mutex_;          // Protects the global memory budget
+    size_t               memorySize_;
+    size_t               maxMemorySize_;
+    size_t               instancesCount_;
+    size_t               nextVictim_;     // Round-robin over the shards for global eviction
+    size_t               pinnedSize_;
+    boost::condition_variable  unpinned_;
+    InstanceInfoIndex    infoIndex_;
+    std::unique_ptr<DiskInstancesCache>  disk_;
+    size_t               rangeReadThreshold_;  // Zero if range reads are disabled
+    size_t               pageSize_;
+    bool                 rangeReadSupported_;  // Protected by "mutex_"
+    IInstanceListener*   listener_;            // Not owned, can be NULL
 
+    Shard& GetShard(const std::string& instanceId) const;
 
-    // The mutex must be locked!
-    void CheckInvariants();
-    
-    // The mutex must be locked!
-    void RemoveOldest();
+    void UpdateGlobalSize(size_t added,
+                          size_t removed,
+                          size_t addedInstances,
+                          size_t removedInstances);
 
-    // The mutex must be locked!
-    void Store(const std::string& instanceId,
-               std::unique_ptr<SourceDicomInstance>& instance);
-    
+    // The mutex of the shards must *not* be locked by the caller
+    void ApplyGlobalBudget(const std::string& justStored);
+
+    boost::shared_ptr<SourceDicomInstance> Acquire(const std::string& instanceId);
+
+    boost::shared_ptr<SourceDicomInstance> AcquirePage(const std::string& instanceId,
+                                                       size_t pageOffset,
+                                                       size_t pageSize);
+
+    // Reads the size of the instance from the index, or else from the
+    // information about its attachment, but never from the DICOM file
+    bool LookupInstanceSize(size_t& size,
+                            const std::string& instanceId);
+
+    // Tells whether the instance must be read page by page, in which
+    // case its size is also returned
+    bool IsRangeRead(size_t& instanceSize,
+                     const std::string& instanceId);
+
+    // Moves the instances that were evicted from the shard to the
+    // disk cache. The mutex of the shard must *not* be locked.
+    void DemoteEvicted(Shard& shard);
+
+    // The load of "key" must have been reserved in the shard. If
+    // "pageSize" is zero, the whole instance is loaded, otherwise
+    // only the page that starts at "pageOffset".
+    boost::shared_ptr<SourceDicomInstance> LoadAndStore(Shard& shard,
+                                                        const std::string& key,
+                                                        const std::string& instanceId,
+                                                        size_t pageOffset,
+                                                        size_t pageSize);
+
+    // Checks an instance read from the disk cache against the
+    // attachment information that is stored by Orthanc
+    bool IsUpToDate(const DicomInstanceInfo& info);
+
+  protected:
+    // Loads one DICOM instance from the Orthanc core. Can be
+    // overridden for testing purposes.
+    virtual SourceDicomInstance* LoadInstance(const std::string& instanceId);
+
+    // Loads a range of bytes of one DICOM instance from the Orthanc
+    // core, as an object that is identified by "key". Can be
+    // overridden for testing purposes.
+    virtual SourceDicomInstance* LoadRange(const std::string& key,
+                                           const std::string& instanceId,
+                                           size_t offset,
+                                           size_t size);
+
+    // Reads the size and MD5 of the DICOM attachment, as stored by the
+    // Orthanc core. Returns "false" if the attachment is unknown. The
+    // MD5 is empty if it is not stored by Orthanc (if the option
+    // "StoreMD5ForAttachments" is false), but the size is still valid.
+    virtual bool LookupAttachmentInfo(size_t& size,
+                                      std::string& md5,
+                                      const std::string& instanceId);
 
   public:
-    OrthancInstancesCache();
+    explicit OrthancInstancesCache(size_t shardsCount = 16,
+                                   CachePolicy policy = CachePolicy_LRU);
+
+    virtual ~OrthancInstancesCache();
 
-    ~OrthancInstancesCache();
+    size_t GetShardsCount() const
+    {
+      return shards_.size();
+    }
 
     size_t GetMemorySize();
 
     size_t GetMaxMemorySize();
 
     void SetMaxMemorySize(size_t size);
-    
+
+    size_t GetInstancesCount();
+
+    InstanceInfoIndex& GetInfoIndex()
+    {
+      return infoIndex_;
+    }
+
+    // Takes the ownership of the disk cache. Must be called before
+    // the cache is used by other threads.
+    void SetDiskCache(DiskInstancesCache* disk);
+
+    bool HasDiskCache() const
+    {
+      return disk_.get() != NULL;
+    }
+
+    DiskInstancesCache& GetDiskCache() const;
+
+    // The listener must outlive the cache, or be removed by giving
+    // NULL. Must be called before the cache is used by other threads.
+    void SetInstanceListener(IInstanceListener* listener)
+    {
+      listener_ = listener;
+    }
+
+    // The instances that are larger than "threshold" bytes are read
+    // by pages of "pageSize" bytes (zero disables the range reads).
+    // Must be called before the cache is used by other threads.
+    void SetRangeReads(size_t threshold,
+                       size_t pageSize);
+
+    size_t GetRangeReadThreshold() const
+    {
+      return rangeReadThreshold_;
+    }
+
+    size_t GetPageSize() const
+    {
+      return pageSize_;
+    }
+
+    // Only reads the DICOM file if its size and MD5 are neither in
+    // the index, nor in the attachment information
     void GetInstanceInfo(size_t& size,
                          std::string& md5,
                          const std::string& instanceId);
+
+    // Tells whether Orthanc already stores the instance with the same
+    // content. The index is not used, as it does not know about the
+    // deleted instances. Returns "false" if the MD5 of the attachments
+    // is not stored by Orthanc ("StoreMD5ForAttachments" option).
+    bool IsInstanceStored(const DicomInstanceInfo& instance);
     
-    void GetChunk(std::string& chunk,
-                  std::string& md5,
+    // Forgets everything that is known about the instance, as it was
+    // deleted or stored again (possibly with another content)
+    void Invalidate(const std::string& instanceId);
+
+    // Appends a slice of one instance to the bucket, without copying it
+    void AddChunk(BucketContent& target,
                   const std::string& instanceId,
                   size_t offset,
                   size_t size);
 
-    void GetChunk(std::string& chunk,
-                  std::string& md5,
-                  const TransferBucket& bucket,
-                  size_t chunkIndex);
+    void ReadBucket(BucketContent& target,
+                    const TransferBucket& bucket);
 
-    size_t GetCacheHitCount() const
-    {
-      return cacheHitCount_;
-    }
+    /**
+     * Prevents the eviction of the given instances, until "Unpin()" is
+     * called as many times as "Pin()". If pinning the instances would
+     * make the pinned bytes exceed half of the cache budget, waits for
+     * other instances to be unpinned, at most for "timeoutSeconds".
+     * Returns "false" if the budget is still exceeded after this delay,
+     * in which case none of the instances is pinned. A timeout of zero
+     * never waits.
+     **/
+    bool Pin(const std::vector<std::string>& instances,
+             unsigned int timeoutSeconds);
 
-    size_t GetCacheMissCount() const
-    {
-      return cacheMissCount_;
-    }
+    void Unpin(const std::string& instanceId);
+
+    size_t GetPinnedSize();
+
+    // Loads the instance into the cache, if it is neither cached nor
+    // being loaded, in anticipation of its access by another thread
+    void Prefetch(const std::string& instanceId);
+
+    size_t GetCacheHitCount() const;
+
+    size_t GetCacheMissCount() const;
+
+    // Number of cache misses that have waited for the same instance
+    // to be loaded by another thread, instead of loading it again
+    size_t GetMergedLoadsCount() const;
+
+    // Number of loaded instances that the policy has refused to cache
+    size_t GetRejectedCount() const;
 
+    // A prefetch is wasted if the instance leaves the cache (or is not
+    // admitted into the cache) before being accessed
+    void GetPrefetchStatistics(size_t& prefetchCount,
+                               size_t& prefetchHitCount,
+                               size_t& wastedPrefetchCount) const;
   };
 }
@@ -0,0 +1,358 @@
+/**
+ * Transfers accelerator plugin for Orthanc
+ * Copyright (C) 2018-2023 Osimis S.A., Belgium
+ * Copyright (C) 2024-2026 Orthanc Team SRL, Belgium
+ * Copyright (C) 2021-2026 Sebastien Jodogne, ICTEAM UCLouvain, Belgium
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU Affero General Public License
+ * as published by the Free Software Foundation, either version 3 of
+ * the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Affero General Public License for more details.
+ * 
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ **/
+
+
+#include "ActiveLookups.h"
+
+#include <Compatibility.h>  // For std::unique_ptr
+#include <Logging.h>
+
+#include <boost/lexical_cast.hpp>
+
+
+namespace OrthancPlugins
+{
+  // Maximum number of instances that are answered in one page
+  static const size_t MAX_PAGE_SIZE = 1000;
+
+  // Maximum time a HTTP thread serving a bucket waits for the other
+  // buckets to release their pinned instances, before serving the
+  // bucket without pinning its instances
+  static const unsigned int PIN_TIMEOUT_SECONDS = 10;
+
+  // The pins of a lookup whose buckets are not requested during this
+  // delay are released (e.g. the peer already had the instances)
+  static const unsigned int PINS_EXPIRATION_SECONDS = 60;
+
+
+  class ActiveLookups::Lookup : public boost::noncopyable
+  {
+  private:
+    ResourcesExpander                           expander_;
+    std::unique_ptr<ResourcesExpander::Runner>  runner_;  // Must be declared after "expander_"
+    boost::mutex                                planMutex_;
+    size_t                                      planId_;
+    size_t                                      bucketSize_;
+    BucketPacking                               packing_;
+    boost::shared_ptr<InstancesPinner>          pinner_;
+
+  public:
+    Lookup(OrthancInstancesCache& cache,
+           const Json::Value& resources,
+           size_t threadsCount,
+           size_t bucketSize,
+           BucketPacking packing) :
+      expander_(cache, resources),
+      planId_(0),
+      bucketSize_(bucketSize),
+      packing_(packing),
+      pinner_(new InstancesPinner(cache))
+    {
+      runner_.reset(new ResourcesExpander::Runner(expander_, threadsCount));
+    }
+
+    ResourcesExpander& GetExpander()
+    {
+      return expander_;
+    }
+
+    const boost::shared_ptr<InstancesPinner>& GetPinner() const
+    {
+      return pinner_;
+    }
+
+    // The pulling peer plans the buckets of each page as soon as it
+    // receives it: Read their instances ahead of its requests for
+    // chunks, in the order of these buckets
+    void ExtendPlan(InstancesPrefetcher& prefetcher,
+                    const std::vector<DicomInstanceInfo>& page)
+    {
+      pinner_->AddInstances(page);
+
+      TransferScheduler scheduler;
+
+      for (size_t i = 0; i < page.size(); i++)
+      {
+        scheduler.AddInstance(page[i]);
+      }
+
+      std::vector<std::string> instances;
+      InstancesPrefetcher::ListPullInstances(instances, scheduler, bucketSize_, packing_);
+
+      boost::mutex::scoped_lock lock(planMutex_);
+
+      if (planId_ == 0 ||
+          !prefetcher.ExtendPlan(planId_, instances))
+      {
+        planId_ = prefetcher.AddPlan(instances, pinner_);
+      }
+    }
+  };
+
+
+  boost::shared_ptr<ActiveLookups::Lookup> ActiveLookups::GetLookup(const std::string& lookupUuid)
+  {
+    boost::mutex::scoped_lock lock(mutex_);
+
+    Content::iterator found = content_.find(lookupUuid);
+    if (found == content_.end())
+    {
+      throw Orthanc::OrthancException(Orthanc::ErrorCode_UnknownResource);
+    }
+    else
+    {
+      index_.MakeMostRecent(lookupUuid);
+
+      // The pins must not expire while the peer is reading the pages
+      if (pinnersIndex_.Contains(lookupUuid))
+      {
+        pinnersIndex_.MakeMostRecent(lookupUuid, boost::posix_time::microsec_clock::universal_time());
+      }
+
+      return found->second;
+    }
+  }
+
+
+  boost::shared_ptr<InstancesPinner> ActiveLookups::GetPinner(const std::string& lookupUuid)
+  {
+    // The expired pinners are only destroyed once the mutex is
+    // released, as this unpins their instances
+    std::vector<boost::shared_ptr<InstancesPinner> > expired;
+
+    boost::mutex::scoped_lock lock(mutex_);
+
+    const boost::posix_time::ptime now = boost::posix_time::microsec_clock::universal_time();
+    RemoveExpiredPinners(expired, now);
+
+    Pinners::const_iterator found = pinners_.find(lookupUuid);
+    if (found == pinners_.end())
+    {
+      return boost::shared_ptr<InstancesPinner>();
+    }
+    else
+    {
+      pinnersIndex_.MakeMostRecent(lookupUuid, now);
+      return found->second;
+    }
+  }
+
+
+  void ActiveLookups::RemoveExpiredPinners(std::vector<boost::shared_ptr<InstancesPinner> >& removed,
+                                           const boost::posix_time::ptime& now)
+  {
+    while (!pinnersIndex_.IsEmpty() &&
+           (pinnersIndex_.GetSize() > maxSize_ ||
+            (now - pinnersIndex_.GetOldestPayload()).total_seconds() > PINS_EXPIRATION_SECONDS))
+    {
+      Pinners::iterator found = pinners_.find(pinnersIndex_.RemoveOldest());
+      assert(found != pinners_.end());
+
+      removed.push_back(found->second);
+      pinners_.erase(found);
+    }
+  }
+
+
+  ActiveLookups::BucketPins::BucketPins(ActiveLookups& lookups,
+                                        const std::string& lookupUuid,
+                                        const TransferBucket& bucket) :
+    bucket_(bucket)
+  {
+    if (!lookupUuid.empty())
+    {
+      pinner_ = lookups.GetPinner(lookupUuid);
+    }
+
+    if (pinner_.get() != NULL)
+    {
+      try
+      {
+        if (!pinner_->AcquireBucket(bucket_, PIN_TIMEOUT_SECONDS))
+        {
+          // The peer cannot be asked to come back later: Serve the
+          // bucket, but without pinning past the budget of the cache
+          LOG(INFO) << "Serving a bucket of lookup " << lookupUuid << " without pinning its instances";
+        }
+      }
+      catch (Orthanc::OrthancException& e)
+      {
+        // For instance, the bucket contains instances from another lookup
+        LOG(INFO) << "Cannot pin the instances of a bucket of lookup " << lookupUuid << ": " << e.What();
+        pinner_.reset();
+      }
+    }
+  }
+
+
+  ActiveLookups::BucketPins::~BucketPins()
+  {
+    if (pinner_.get() != NULL)
+    {
+      try
+      {
+        // The bytes are considered as served even if the bucket could
+        // not be pinned, as the peer will not request them again
+        pinner_->ReleaseBucket(bucket_);
+      }
+      catch (Orthanc::OrthancException& e)
+      {
+        LOG(ERROR) << "Cannot unpin the instances of a bucket: " << e.What();
+      }
+    }
+  }
+
+
+  ActiveLookups::ActiveLookups(OrthancInstancesCache& cache,
+                               InstancesPrefetcher& prefetcher,
+                               size_t maxSize,
+                               size_t threadsCount) :
+    cache_(cache),
+    prefetcher_(prefetcher),
+    maxSize_(maxSize),
+    threadsCount_(threadsCount)
+  {
+    if (maxSize == 0 ||
+        threadsCount == 0)
+    {
+      throw Orthanc::OrthancException(Orthanc::ErrorCode_ParameterOutOfRange);
+    }
+  }
+
+
+  std::string ActiveLookups::CreateLookup(const Json::Value& resources,
+                                          size_t bucketSize,
+                                          BucketPacking packing)
+  {
+    boost::shared_ptr<Lookup> lookup(new Lookup(cache_, resources, threadsCount_, bucketSize, packing));
+
+    std::string uuid = Orthanc::Toolbox::GenerateUuid();
+
+    // The lookup that is dropped, if any, is only destroyed once the
+    // mutex is released, as this waits for its threads to stop
+    boost::shared_ptr<Lookup> oldest;
+    std::vector<boost::shared_ptr<InstancesPinner> > expired;
+
+    {
+      boost::mutex::scoped_lock lock(mutex_);
+
+      const boost::posix_time::ptime now = boost::posix_time::microsec_clock::universal_time();
+      RemoveExpiredPinners(expired, now);
+
+      // Drop the oldest active lookup, if not enough place
+      if (content_.size() == maxSize_)
+      {
+        const std::string oldestUuid = index_.RemoveOldest();
+
+        Content::iterator found = content_.find(oldestUuid);
+        assert(found != content_.end());
+
+        oldest = found->second;
+        content_.erase(found);
+
+        LOG(WARNING) << "An inactive lookup of instances to be pulled has been discarded: " << oldestUuid;
+      }
+
+      index_.Add(uuid);
+      content_[uuid] = lookup;
+
+      pinnersIndex_.Add(uuid, now);
+      pinners_[uuid] = lookup->GetPinner();
+    }
+
+    return uuid;
+  }
+
+
+  void ActiveLookups::GetPage(Json::Value& target,
+                              const std::string& lookupUuid,
+                              size_t since,
+                              unsigned int timeoutMS)
+  {
+    boost::shared_ptr<Lookup> lookup = GetLookup(lookupUuid);
+
+    std::vector<DicomInstanceInfo> instances;
+    ResourcesExpander::Status status = lookup->GetExpander().WaitLookedUpInstances(
+      instances, since, MAX_PAGE_SIZE, timeoutMS);
+
+    target = Json::objectValue;
+    target[KEY_INSTANCES] = Json::arrayValue;
+
+    for (size_t i = 0; i < instances.size(); i++)
+    {
+      Json::Value instance;
+      instances[i].Serialize(instance);
+      target[KEY_INSTANCES].append(instance);
+    }
+
+    if (!instances.empty())
+    {
+      lookup->ExtendPlan(prefetcher_, instances);
+    }
+
+    bool done = false;
+
+    if (status != ResourcesExpander::Status_Running)
+    {
+      TransferScheduler scheduler;
+      lookup->GetExpander().FillScheduler(scheduler);  // Throws if the lookup has failed
+
+      if (since + instances.size() == scheduler.GetInstancesCount())
+      {
+        done = true;
+
+        std::vector<DicomInstanceInfo> ordered;
+        scheduler.ListInstances(ordered);
+
+        target[KEY_ORDER] = Json::arrayValue;
+
+        for (size_t i = 0; i < ordered.size(); i++)
+        {
+          target[KEY_ORDER].append(ordered[i].GetId());
+        }
+
+        target["CountInstances"] = static_cast<uint32_t>(scheduler.GetInstancesCount());
+        target["TotalSize"] = boost::lexical_cast<std::string>(scheduler.GetTotalSize());
+      }
+    }
+
+    target[KEY_DONE] = done;
+  }
+
+
+  void ActiveLookups::Remove(const std::string& lookupUuid)
+  {
+    boost::shared_ptr<Lookup> lookup;
+
+    {
+      boost::mutex::scoped_lock lock(mutex_);
+
+      Content::iterator found = content_.find(lookupUuid);
+      if (found == content_.end())
+      {
+        throw Orthanc::OrthancException(Orthanc::ErrorCode_UnknownResource);
+      }
+
+      lookup = found->second;
+      content_.erase(found);
+      index_.Invalidate(lookupUuid);
+    }
+  }
+}
@@ -0,0 +1,119 @@
+/**
+ * Transfers accelerator plugin for Orthanc
+ * Copyright (C) 2018-2023 Osimis S.A., Belgium
+ * Copyright (C) 2024-2026 Orthanc Team SRL, Belgium
+ * Copyright (C) 2021-2026 Sebastien Jodogne, ICTEAM UCLouvain, Belgium
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU Affero General Public License
+ * as published by the Free Software Foundation, either version 3 of
+ * the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Affero General Public License for more details.
+ * 
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ **/
+
+
+#pragma once
+
+#include "../InstancesPrefetcher.h"
+#include "../ResourcesExpander.h"
+
+#include <Cache/LeastRecentlyUsedIndex.h>
+
+#include <boost/date_time/posix_time/posix_time.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/thread/mutex.hpp>
+
+namespace OrthancPlugins
+{
+  /**
+   * Lookups of the instances to be pulled by a peer, whose results
+   * are served by pages as soon as the first instances are known,
+   * which lets the peer start downloading the buckets while the
+   * remaining resources are still being expanded.
+   **/
+  class ActiveLookups : public boost::noncopyable
+  {
+  private:
+    class Lookup;
+    
+    typedef Orthanc::LeastRecentlyUsedIndex<std::string>     Index;
+    typedef std::map<std::string, boost::shared_ptr<Lookup> >  Content;
+
+    // The pins outlive their lookup, as the peer only starts pulling
+    // the last buckets once it has received the last page
+    typedef Orthanc::LeastRecentlyUsedIndex<std::string, boost::posix_time::ptime>  PinnersIndex;
+    typedef std::map<std::string, boost::shared_ptr<InstancesPinner> >  Pinners;
+
+    OrthancInstancesCache&  cache_;
+    InstancesPrefetcher&    prefetcher_;
+    boost::mutex            mutex_;
+    Content                 content_;
+    Index                   index_;
+    Pinners                 pinners_;
+    PinnersIndex            pinnersIndex_;
+    size_t                  maxSize_;
+    size_t                  threadsCount_;
+
+    boost::shared_ptr<Lookup> GetLookup(const std::string& lookupUuid);
+
+    boost::shared_ptr<InstancesPinner> GetPinner(const std::string& lookupUuid);
+
+    void RemoveExpiredPinners(std::vector<boost::shared_ptr<InstancesPinner> >& removed,
+                              const boost::posix_time::ptime& now);
+
+  public:
+    /**
+     * Pins the instances of a bucket that is served to the peer that
+     * pulls the given lookup, until the bucket has been answered. The
+     * instances are unpinned once all their bytes have been served.
+     * Nothing is pinned if the lookup is unknown (e.g. a peer running
+     * an older version of the plugin does not announce it).
+     **/
+    class BucketPins : public boost::noncopyable
+    {
+    private:
+      boost::shared_ptr<InstancesPinner>  pinner_;
+      const TransferBucket&               bucket_;
+
+    public:
+      BucketPins(ActiveLookups& lookups,
+                 const std::string& lookupUuid,
+                 const TransferBucket& bucket);
+
+      ~BucketPins();
+    };
+
+    ActiveLookups(OrthancInstancesCache& cache,
+                  InstancesPrefetcher& prefetcher,
+                  size_t maxSize,
+                  size_t threadsCount);
+
+    // The size of the buckets and their packing are those announced
+    // by the pulling peer, which give the order of the read-ahead of
+    // the instances ("bucketSize" is zero if unknown)
+    std::string CreateLookup(const Json::Value& resources,
+                             size_t bucketSize,
+                             BucketPacking packing);
+
+    /**
+     * Answers the instances that follow the "since" first instances
+     * of the lookup, waiting at most "timeoutMS" milliseconds for
+     * them to be known. Once all the instances have been answered,
+     * the page is marked as the last one, and contains the final
+     * order of the instances. Throws the error of the lookup, if any.
+     **/
+    void GetPage(Json::Value& target,
+                 const std::string& lookupUuid,
+                 size_t since,
+                 unsigned int timeoutMS);
+
+    void Remove(const std::string& lookupUuid);
+  };
+}
@@ -21,31 +21,106 @@
 
 #include "BucketPullQuery.h"
 
+#include <boost/lexical_cast.hpp>
+
 
 namespace OrthancPlugins
 {
   BucketPullQuery::BucketPullQuery(DownloadArea& area,
                                    const TransferBucket& bucket,
                                    const std::string& peer,
-                                   BucketCompression compression) :
+                                   BucketCompression compression,
+                                   bool post,
+                                   CompressionLevelController* controller,
+                                   uint32_t dictionary,
+                                   const std::string& lookup) :
     area_(area),
     bucket_(bucket),
     peer_(peer),
-    compression_(compression)
+    compression_(compression),
+    post_(post),
+    controller_(controller),
+    level_(0),
+    dictionary_(dictionary),
+    lookup_(lookup)
   {
-    bucket_.ComputePullUri(uri_, compression_);
+    if (post_)
+    {
+      uri_ = URI_CHUNKS;
+    }
+    else if (dictionary_ != 0 ||
+             !lookup_.empty())
+    {
+      throw Orthanc::OrthancException(Orthanc::ErrorCode_ParameterOutOfRange);
+    }
+    else
+    {
+      bucket_.ComputePullUri(uri_, compression_);
+    }
   }
 
 
   void BucketPullQuery::ReadBody(std::string& body) const
   {
-    throw Orthanc::OrthancException(Orthanc::ErrorCode_InternalError);
+    if (post_)
+    {
+      // If the level is not adapted, the peer uses its own default level
+      if (controller_ != NULL &&
+          CompressionLevelController::IsAdaptive())
+      {
+        level_ = controller_->GetLevel();
+      }
+      else
+      {
+        level_ = 0;
+      }
+
+      bucket_.ComputePullBody(body, compression_, level_, dictionary_);
+    }
+    else
+    {
+      throw Orthanc::OrthancException(Orthanc::ErrorCode_InternalError);
+    }
   }
 
   
   void BucketPullQuery::HandleAnswer(const void* answer,
-                                     size_t size)
+                                     size_t size,
+                                     const std::map<std::string, std::string>& answerHeaders)
   {
-    area_.WriteBucket(bucket_, answer, size, compression_);
+    // The peers with an older version of the plugin don't send the
+    // digest of the bucket
+    std::map<std::string, std::string>::const_iterator md5 = answerHeaders.find(HEADER_KEY_BUCKET_MD5);
+
+    if (md5 == answerHeaders.end())
+    {
+      area_.WriteBucket(bucket_, answer, size, compression_);
+    }
+    else
+    {
+      area_.WriteBucket(bucket_, answer, size, compression_, md5->second);
+    }
+
+    std::map<std::string, std::string>::const_iterator elapsed = answerHeaders.find(HEADER_KEY_COMPRESSION_TIME);
+
+    if (controller_ != NULL &&
+        level_ != 0 &&
+        elapsed != answerHeaders.end())
+    {
+      uint64_t microseconds;
+
+      try
+      {
+        microseconds = boost::lexical_cast<uint64_t>(elapsed->second);
+      }
+      catch (boost::bad_lexical_cast&)
+      {
+        // This information is only a hint
+        return;
+      }
+
+      controller_->RecordBucket(level_, bucket_.GetTotalSize(), size,
+                                static_cast<double>(microseconds) / 1000000.0);
+    }
   }
 }
@@ -21,6 +21,7 @@
 
 #pragma once
 
+#include "../CompressionLevelController.h"
 #include "../HttpQueries/IHttpQuery.h"
 #include "../DownloadArea.h"
 
@@ -36,16 +37,36 @@ namespace OrthancPlugins
     std::string        peer_;
     std::string        uri_;
     BucketCompression  compression_;
+    bool               post_;
+    CompressionLevelController*  controller_;  // Owned by the pull job, can be NULL
+    mutable int        level_;  // Level requested by "ReadBody()", 0 for the default
+    uint32_t           dictionary_;  // ID of the zstd dictionary, 0 if none
+    std::string        lookup_;      // Lookup of the instances on the peer, for "POST" only
 
   public:
+    // If "post" is true, the bucket is described in the body of a
+    // "POST" request, which requires a peer that supports it. The
+    // compression level can only be chosen in this case, as the peer
+    // then reports the time it spent in the compression. The same
+    // holds for the zstd dictionary, that must be known by the peer,
+    // and for the lookup, that lets the peer pin the instances.
     BucketPullQuery(DownloadArea& area,
                     const TransferBucket& bucket,
                     const std::string& peer,
-                    BucketCompression compression);
+                    BucketCompression compression,
+                    bool post,
+                    CompressionLevelController* controller,
+                    uint32_t dictionary,
+                    const std::string& lookup);
+
+    const TransferBucket& GetBucket() const
+    {
+      return bucket_;
+    }
 
     virtual Orthanc::HttpMethod GetMethod() const ORTHANC_OVERRIDE
     {
-      return Orthanc::HttpMethod_Get;
+      return (post_ ? Orthanc::HttpMethod_Post : Orthanc::HttpMethod_Get);
     }
 
     virtual const std::string& GetPeer() const ORTHANC_OVERRIDE
@@ -60,11 +81,26 @@ namespace OrthancPlugins
 
     virtual void ReadBody(std::string& body) const ORTHANC_OVERRIDE;
 
+    virtual size_t GetUncompressedSize() const ORTHANC_OVERRIDE
+    {
+      return bucket_.GetTotalSize();
+    }
+
     virtual void HandleAnswer(const void* answer,
-                              size_t size) ORTHANC_OVERRIDE;
+                              size_t size,
+                              const std::map<std::string, std::string>& answerHeaders) ORTHANC_OVERRIDE;
     
     virtual void GetHttpHeaders(std::map<std::string, std::string>& headers) const ORTHANC_OVERRIDE
     {
+      if (post_)
+      {
+        headers["Content-Type"] = "application/json";
+
+        if (!lookup_.empty())
+        {
+          headers[HEADER_KEY_LOOKUP] = lookup_;
+        }
+      }
     }
   };
 }
@@ -22,12 +22,16 @@
 #include "PullJob.h"
 
 #include "BucketPullQuery.h"
+#include "../CompressionDictionaries.h"
 #include "../HttpQueries/HttpQueriesRunner.h"
 #include "../TransferScheduler.h"
 
 #include <Compatibility.h>  // For std::unique_ptr
 #include <Logging.h>
 
+#include <boost/lexical_cast.hpp>
+#include <set>
+
 
 namespace OrthancPlugins
 {
@@ -57,14 +61,335 @@ namespace OrthancPlugins
   };
 
 
-  class PullJob::PullBucketsState : public IState
+  // Removes the instances that Orthanc already stores with the same
+  // content, which are appended to "skipped"
+  static void SkipStoredInstances(std::vector<DicomInstanceInfo>& instances,
+                                  std::vector<DicomInstanceInfo>& skipped,
+                                  size_t& skippedSize,
+                                  OrthancInstancesCache& cache)
+  {
+    std::vector<DicomInstanceInfo> missing;
+    missing.reserve(instances.size());
+
+    for (size_t i = 0; i < instances.size(); i++)
+    {
+      if (cache.IsInstanceStored(instances[i]))
+      {
+        skipped.push_back(instances[i]);
+        skippedSize += instances[i].GetSize();
+      }
+      else
+      {
+        missing.push_back(instances[i]);
+      }
+    }
+
+    instances.swap(missing);
+  }
+
+
+  class PullJob::PullBucketsState :
+    public IState,
+    private HttpQueriesQueue::IPlanner
   {
   private:
     const PullJob&                    job_;
     JobInfo&                          info_;
+    std::unique_ptr<CompressionLevelController>  controller_;  // Must be declared before "queue_"
     HttpQueriesQueue                  queue_;
     std::unique_ptr<DownloadArea>       area_;
     std::unique_ptr<HttpQueriesRunner>  runner_;
+    std::vector<DicomInstanceInfo>    instances_;
+    std::string                       baseUrl_;     // Empty if the buckets are not sent in the URL
+    size_t                            bucketSize_;
+    std::string                       lookupUri_;   // Empty once all the instances are known
+    std::string                       lookupId_;    // Announced in the "POST" queries, for the peer to pin the instances
+    bool                              postChunks_;
+    BucketCompression                 compression_; // Negotiated with the peer
+    uint32_t                          dictionary_;  // Negotiated with the peer, 0 if none
+    CompressionDictionaries::DictionaryPtr  negotiated_;  // Kept in the registry until the end of the transfer
+    std::vector<DicomInstanceInfo>    skipped_;     // Already stored by Orthanc
+    size_t                            skippedSize_;
+
+    BucketPullQuery* CreateQuery(const TransferBucket& bucket) const
+    {
+      return new BucketPullQuery(*area_, bucket, job_.query_.GetPeer(), compression_, postChunks_, controller_.get(), dictionary_, lookupId_);
+    }
+
+    void EnqueueBuckets(std::vector<IHttpQuery*>& target,
+                        const TransferScheduler& scheduler) const
+    {
+      std::vector<TransferBucket> buckets;
+      scheduler.ComputePullBuckets(buckets, bucketSize_, 2 * bucketSize_,
+                                   baseUrl_, compression_, job_.bucketPacking_);
+
+      target.reserve(target.size() + buckets.size());
+
+      for (size_t i = 0; i < buckets.size(); i++)
+      {
+        target.push_back(CreateQuery(buckets[i]));
+      }
+    }
+
+    virtual void Replan(std::vector<IHttpQuery*>& target,
+                        const std::vector<const IHttpQuery*>& pending) ORTHANC_OVERRIDE
+    {
+      std::vector<const TransferBucket*> buckets(pending.size());
+
+      // Number of bytes of each instance that are not downloaded yet
+      std::map<CompactIdentifier, size_t> remaining;
+
+      for (size_t i = 0; i < pending.size(); i++)
+      {
+        const BucketPullQuery* query = dynamic_cast<const BucketPullQuery*>(pending[i]);
+        if (query == NULL)
+        {
+          throw Orthanc::OrthancException(Orthanc::ErrorCode_InternalError);
+        }
+
+        buckets[i] = &query->GetBucket();
+
+        for (size_t j = 0; j < buckets[i]->GetChunksCount(); j++)
+        {
+          remaining[buckets[i]->GetChunkCompactId(j)] += buckets[i]->GetChunkSize(j);
+        }
+      }
+
+      // The instances that are partially downloaded cannot be
+      // re-planned, as well as the other instances that share a
+      // bucket with them: Those buckets are kept unchanged
+      std::set<CompactIdentifier> locked;
+
+      for (size_t i = 0; i < instances_.size(); i++)
+      {
+        std::map<CompactIdentifier, size_t>::const_iterator found = remaining.find(instances_[i].GetCompactId());
+        if (found != remaining.end() &&
+            found->second != instances_[i].GetSize())
+        {
+          locked.insert(instances_[i].GetCompactId());
+        }
+      }
+
+      std::vector<bool> kept(buckets.size(), false);
+
+      bool changed = !locked.empty();
+      while (changed)
+      {
+        changed = false;
+
+        for (size_t i = 0; i < buckets.size(); i++)
+        {
+          if (!kept[i])
+          {
+            for (size_t j = 0; j < buckets[i]->GetChunksCount(); j++)
+            {
+              if (locked.find(buckets[i]->GetChunkCompactId(j)) != locked.end())
+              {
+                kept[i] = true;
+                break;
+              }
+            }
+
+            if (kept[i])
+            {
+              for (size_t j = 0; j < buckets[i]->GetChunksCount(); j++)
+              {
+                locked.insert(buckets[i]->GetChunkCompactId(j));
+              }
+
+              changed = true;
+            }
+          }
+        }
+      }
+
+      for (size_t i = 0; i < buckets.size(); i++)
+      {
+        if (kept[i])
+        {
+          target.push_back(CreateQuery(*buckets[i]));
+        }
+      }
+
+      // The list of instances is in the order of the original
+      // scheduler, which preserves the locality of the buckets
+      TransferScheduler scheduler;
+
+      for (size_t i = 0; i < instances_.size(); i++)
+      {
+        if (remaining.find(instances_[i].GetCompactId()) != remaining.end() &&
+            locked.find(instances_[i].GetCompactId()) == locked.end())
+        {
+          scheduler.AddInstance(instances_[i]);
+        }
+      }
+
+      if (scheduler.GetInstancesCount() != 0)
+      {
+        EnqueueBuckets(target, scheduler);
+      }
+    }
+
+    void AdaptBucketSize()
+    {
+      if (job_.estimator_.IsAdaptive())
+      {
+        const size_t size = job_.estimator_.ComputeBucketSize(job_.query_.GetPeer(), bucketSize_);
+
+        // Hysteresis, so that the noise of the measurements does not
+        // continuously re-plan the transfer
+        if (size >= 2 * bucketSize_ ||
+            2 * size <= bucketSize_)
+        {
+          LOG(INFO) << "Resizing the pending buckets of the pull transfer from peer \""
+                    << job_.query_.GetPeer() << "\" from " << (bucketSize_ / 1024)
+                    << "KB to " << (size / 1024) << "KB";
+          bucketSize_ = size;
+          queue_.ReplanPendingQueries(*this);
+        }
+      }
+    }
+
+    bool ReconcileLookup(const Json::Value& order)
+    {
+      if (order.type() != Json::arrayValue ||
+          order.size() != instances_.size() + skipped_.size())
+      {
+        return false;
+      }
+
+      std::map<std::string, size_t> positions;
+
+      for (size_t i = 0; i < instances_.size(); i++)
+      {
+        positions[instances_[i].GetId()] = i;
+      }
+
+      std::set<std::string> skipped;
+
+      for (size_t i = 0; i < skipped_.size(); i++)
+      {
+        skipped.insert(skipped_[i].GetId());
+      }
+
+      std::vector<DicomInstanceInfo> ordered;
+      ordered.reserve(instances_.size());
+
+      for (Json::Value::ArrayIndex i = 0; i < order.size(); i++)
+      {
+        if (order[i].type() != Json::stringValue)
+        {
+          return false;
+        }
+
+        std::map<std::string, size_t>::const_iterator found = positions.find(order[i].asString());
+
+        if (found != positions.end())
+        {
+          ordered.push_back(instances_[found->second]);
+        }
+        else if (skipped.find(order[i].asString()) == skipped.end())
+        {
+          return false;
+        }
+      }
+
+      if (ordered.size() != instances_.size())
+      {
+        return false;
+      }
+
+      instances_.swap(ordered);
+
+      // The buckets that are not downloaded yet were planned page by
+      // page: Plan them again, in the final order of the instances
+      queue_.ReplanPendingQueries(*this);
+
+      return true;
+    }
+
+    // Reads the next page of the lookup, and schedules the buckets of
+    // its instances while the next pages are computed by the peer
+    bool FetchLookupPage()
+    {
+      std::map<std::string, std::string> headers;
+      job_.query_.GetHttpHeaders(headers);
+
+      const size_t since = instances_.size() + skipped_.size();
+      const std::string uri = lookupUri_ + "/" + boost::lexical_cast<std::string>(since);
+
+      Json::Value page;
+      if (!DoGetPeer(page, job_.peers_, job_.peerIndex_, uri, job_.maxHttpRetries_, headers))
+      {
+        LOG(ERROR) << "Cannot retrieve the list of instances to pull from peer \"" 
+                   << job_.query_.GetPeer() << "\"";
+        return false;
+      }
+
+      if (page.type() != Json::objectValue ||
+          !page.isMember(KEY_INSTANCES) ||
+          !page.isMember(KEY_DONE) ||
+          page[KEY_INSTANCES].type() != Json::arrayValue ||
+          page[KEY_DONE].type() != Json::booleanValue)
+      {
+        LOG(ERROR) << "Bad network protocol from peer: " << job_.query_.GetPeer();
+        return false;
+      }
+
+      std::vector<DicomInstanceInfo> instances;
+      instances.reserve(page[KEY_INSTANCES].size());
+
+      for (Json::Value::ArrayIndex i = 0; i < page[KEY_INSTANCES].size(); i++)
+      {
+        instances.push_back(DicomInstanceInfo(page[KEY_INSTANCES][i]));
+      }
+
+      SkipStoredInstances(instances, skipped_, skippedSize_, job_.cache_);
+
+      info_.SetContent("SkippedInstances", static_cast<unsigned int>(skipped_.size()));
+      info_.SetContent("SkippedSizeMB", ConvertToMegabytes(skippedSize_));
+
+      if (!instances.empty())
+      {
+        area_->AddInstances(instances);
+        instances_.insert(instances_.end(), instances.begin(), instances.end());
+
+        TransferScheduler scheduler;
+
+        for (size_t i = 0; i < instances.size(); i++)
+        {
+          scheduler.AddInstance(instances[i]);
+        }
+
+        std::vector<IHttpQuery*> queries;
+        EnqueueBuckets(queries, scheduler);
+
+        for (size_t i = 0; i < queries.size(); i++)
+        {
+          queue_.Enqueue(queries[i]);
+        }
+
+        info_.SetContent("TotalInstances", static_cast<unsigned int>(instances_.size()));
+        info_.SetContent("TotalSizeMB", ConvertToMegabytes(area_->GetTotalSize()));
+      }
+
+      if (page[KEY_DONE].asBool())
+      {
+        if (!ReconcileLookup(page[KEY_ORDER]))
+        {
+          LOG(ERROR) << "Bad network protocol from peer: " << job_.query_.GetPeer();
+          return false;
+        }
+
+        // Release the resources of the lookup on the peer
+        DoDeletePeer(job_.peers_, job_.peerIndex_, lookupUri_, 0, headers);
+
+        lookupUri_.clear();
+        queue_.SetIncomplete(false);
+      }
+
+      return true;
+    }
 
     void UpdateInfo()
     {
@@ -75,6 +400,12 @@ namespace OrthancPlugins
       info_.SetContent("DownloadedSizeMB", ConvertToMegabytes(downloadedSize));
       info_.SetContent("CompletedHttpQueries", static_cast<unsigned int>(completedQueriesCount));
 
+      if (postChunks_)
+      {
+        // The level of the peer is unknown if the buckets are in the URL
+        info_.SetContent("CompressionLevel", controller_->GetLevel());
+      }
+
       if (runner_.get() != NULL)
       {
         float speed;
@@ -89,26 +420,63 @@ namespace OrthancPlugins
     }
 
   public:
+    // If "lookupUri" is not empty, the instances are not known yet,
+    // and are read by pages from this URI on the peer. The peers that
+    // support the paginated lookup also accept the buckets in the body
+    // of a "POST" request: The size of their buckets is then not
+    // limited by the length of the URL.
     PullBucketsState(const PullJob&  job,
                      JobInfo& info,
-                     const TransferScheduler& scheduler) :
+                     const TransferScheduler& scheduler,
+                     const std::string& lookupUri,
+                     BucketCompression compression,
+                     uint32_t dictionary) :
       job_(job),
       info_(info),
-      area_(new DownloadArea(scheduler))
+      controller_(new CompressionLevelController(job.estimator_, job.query_.GetPeer(), compression)),
+      area_(new DownloadArea(scheduler)),
+      bucketSize_(job.estimator_.ComputeBucketSize(job.query_.GetPeer(), job.targetBucketSize_)),
+      lookupUri_(lookupUri),
+      postChunks_(!lookupUri.empty()),
+      compression_(compression),
+      dictionary_(dictionary),
+      skippedSize_(0)
     {
-      const std::string baseUrl = job.peers_.GetPeerUrl(job.query_.GetPeer());
+      if (!postChunks_)
+      {
+        baseUrl_ = job.peers_.GetPeerUrl(job.query_.GetPeer());
+      }
+      else
+      {
+        // The URI of the lookup ends with its identifier
+        lookupId_ = lookupUri_.substr(lookupUri_.rfind('/') + 1);
+      }
 
-      std::vector<TransferBucket> buckets;
-      scheduler.ComputePullBuckets(buckets, job.targetBucketSize_, 2 * job.targetBucketSize_,
-                                   baseUrl, job.query_.GetCompression());
-      area_.reset(new DownloadArea(scheduler));
+      if (dictionary_ != 0)
+      {
+        negotiated_ = CompressionDictionaries::Lookup(dictionary_);
+
+        if (negotiated_.get() == NULL)
+        {
+          LOG(WARNING) << "Compression dictionary " << dictionary_ << " was forgotten, "
+                       << "not using it with peer \"" << job.query_.GetPeer() << "\"";
+          dictionary_ = 0;
+        }
+      }
+
+      scheduler.ListInstances(instances_);
+
+      std::vector<IHttpQuery*> queries;
+      EnqueueBuckets(queries, scheduler);
 
       queue_.SetMaxRetries(job.maxHttpRetries_);
-      queue_.Reserve(buckets.size());
+      queue_.SetBandwidthDelayEstimator(job.estimator_);
+      queue_.SetIncomplete(!lookupUri_.empty());
+      queue_.Reserve(queries.size());
         
-      for (size_t i = 0; i < buckets.size(); i++)
+      for (size_t i = 0; i < queries.size(); i++)
       {
-        queue_.Enqueue(new BucketPullQuery(*area_, buckets[i], job.query_.GetPeer(), job.query_.GetCompression()));
+        queue_.Enqueue(queries[i]);
       }
 
       info_.SetContent("TotalInstances", static_cast<unsigned int>(scheduler.GetInstancesCount()));
@@ -122,8 +490,25 @@ namespace OrthancPlugins
       {
         runner_.reset(new HttpQueriesRunner(queue_, job_.threadsCount_, "TF-PULL-"));
       }
+      else
+      {
+        AdaptBucketSize();
+      }
 
-      HttpQueriesQueue::Status status = queue_.WaitComplete(200);
+      unsigned int timeout = 200;
+
+      if (!lookupUri_.empty())
+      {
+        if (!FetchLookupPage())
+        {
+          return StateUpdate::Failure();
+        }
+
+        // The peer has already waited for the instances of the page
+        timeout = 0;
+      }
+
+      HttpQueriesQueue::Status status = queue_.WaitComplete(timeout);
 
       UpdateInfo();
 
@@ -157,6 +542,21 @@ namespace OrthancPlugins
     const PullJob&  job_;
     JobInfo&        info_;
 
+    bool CheckOriginator(const std::string& originator) const
+    {
+      if (job_.query_.HasOriginator() &&
+          job_.query_.GetOriginator() != originator)
+      {
+        LOG(ERROR) << "Invalid originator, check out the \"" << KEY_REMOTE_SELF
+                   << "\" configuration option of peer: " << job_.query_.GetPeer();
+        return false;
+      }
+      else
+      {
+        return true;
+      }
+    }
+
   public:
     LookupInstancesState(const PullJob& job,
                          JobInfo& info) :
@@ -181,8 +581,54 @@ namespace OrthancPlugins
       std::map<std::string, std::string> headers;
       job_.query_.GetHttpHeaders(headers);
 
+      const BucketCompression compression = NegotiateBucketCompression(
+        job_.peers_, job_.peerIndex_, job_.query_.GetCompression(), headers);
+      info_.SetContent("Compression", EnumerationToString(compression));
+
       headers["Content-Type"] = "application/json";
 
+      // Lets the peer read the instances ahead in the order of our buckets
+      headers[HEADER_KEY_BUCKET_PACKING] = EnumerationToString(job_.bucketPacking_);
+      headers[HEADER_KEY_BUCKET_SIZE] = boost::lexical_cast<std::string>(
+        job_.estimator_.ComputeBucketSize(job_.query_.GetPeer(), job_.targetBucketSize_));
+
+      // Try first the paginated lookup, in which the peer answers
+      // the instances as soon as they are known. The peers with an
+      // older version of the plugin only support the full lookup.
+      if (DoPostPeer(answer, job_.peers_, job_.peerIndex_, URI_LOOKUPS, lookup, 0, headers))
+      {
+        if (answer.type() != Json::objectValue ||
+            !answer.isMember(KEY_PATH) ||
+            !answer.isMember(KEY_ORIGINATOR_UUID) ||
+            answer[KEY_PATH].type() != Json::stringValue ||
+            answer[KEY_ORIGINATOR_UUID].type() != Json::stringValue)
+        {
+          LOG(ERROR) << "Bad network protocol from peer: " << job_.query_.GetPeer();
+          return StateUpdate::Failure();
+        }
+
+        if (!CheckOriginator(answer[KEY_ORIGINATOR_UUID].asString()))
+        {
+          return StateUpdate::Failure();
+        }
+
+        // The dictionary of the peer is downloaded if needed. It is
+        // only requested in the body of the "POST" queries.
+        const uint32_t dictionary = NegotiateCompressionDictionary(
+          job_.peers_, job_.peerIndex_, compression, false /* pull */, headers);
+
+        if (dictionary != 0)
+        {
+          info_.SetContent("CompressionDictionary", dictionary);
+        }
+
+        TransferScheduler  empty;
+        return StateUpdate::Next(new PullBucketsState(job_, info_, empty, answer[KEY_PATH].asString(), compression, dictionary));
+      }
+
+      LOG(INFO) << "Peer \"" << job_.query_.GetPeer() << "\" does not support the paginated "
+                << "lookup of the instances, waiting for the full list of instances";
+
       if (!DoPostPeer(answer, job_.peers_, job_.peerIndex_, URI_LOOKUP, lookup, job_.maxHttpRetries_, headers))
       {
         LOG(ERROR) << "Cannot retrieve the list of instances to pull from peer \"" 
@@ -201,20 +647,31 @@ namespace OrthancPlugins
         return StateUpdate::Failure();
       }
 
-      if (job_.query_.HasOriginator() &&
-          job_.query_.GetOriginator() != answer[KEY_ORIGINATOR_UUID].asString())
+      if (!CheckOriginator(answer[KEY_ORIGINATOR_UUID].asString()))
       {
-        LOG(ERROR) << "Invalid originator, check out the \"" << KEY_REMOTE_SELF
-                   << "\" configuration option of peer: " << job_.query_.GetPeer();
         return StateUpdate::Failure();
       }
 
-      TransferScheduler  scheduler;
+      std::vector<DicomInstanceInfo> instances;
+      instances.reserve(answer[KEY_INSTANCES].size());
 
       for (Json::Value::ArrayIndex i = 0; i < answer[KEY_INSTANCES].size(); i++)
       {
-        DicomInstanceInfo instance(answer[KEY_INSTANCES][i]);
-        scheduler.AddInstance(instance);
+        instances.push_back(DicomInstanceInfo(answer[KEY_INSTANCES][i]));
+      }
+
+      std::vector<DicomInstanceInfo> skipped;
+      size_t skippedSize = 0;
+      SkipStoredInstances(instances, skipped, skippedSize, job_.cache_);
+
+      info_.SetContent("SkippedInstances", static_cast<unsigned int>(skipped.size()));
+      info_.SetContent("SkippedSizeMB", ConvertToMegabytes(skippedSize));
+
+      TransferScheduler  scheduler;
+
+      for (size_t i = 0; i < instances.size(); i++)
+      {
+        scheduler.AddInstance(instances[i]);
       }
 
       if (scheduler.GetInstancesCount() == 0)
@@ -224,7 +681,7 @@ namespace OrthancPlugins
       }
       else
       {
-        return StateUpdate::Next(new PullBucketsState(job_, info_, scheduler));
+        return StateUpdate::Next(new PullBucketsState(job_, info_, scheduler, "", compression, 0));
       }
     }
 
@@ -241,13 +698,19 @@ namespace OrthancPlugins
     
     
   PullJob::PullJob(const TransferQuery& query,
+                   OrthancInstancesCache& cache,
+                   BandwidthDelayEstimator& estimator,
                    size_t threadsCount,
                    size_t targetBucketSize,
+                   BucketPacking bucketPacking,
                    unsigned int maxHttpRetries) :
     StatefulOrthancJob(JOB_TYPE_PULL),
     query_(query),
+    cache_(cache),
+    estimator_(estimator),
     threadsCount_(threadsCount),
     targetBucketSize_(targetBucketSize),
+    bucketPacking_(bucketPacking),
     maxHttpRetries_(maxHttpRetries)
   {
     if (!peers_.LookupName(peerIndex_, query_.GetPeer()))
@@ -21,6 +21,8 @@
 
 #pragma once
 
+#include "../HttpQueries/BandwidthDelayEstimator.h"
+#include "../OrthancInstancesCache.h"
 #include "../StatefulOrthancJob.h"
 #include "../TransferQuery.h"
 
@@ -34,20 +36,26 @@ namespace OrthancPlugins
     class PullBucketsState;
     class CommitState;
 
-    TransferQuery  query_;
-    size_t         threadsCount_;
-    size_t         targetBucketSize_;
-    OrthancPeers   peers_;
-    size_t         peerIndex_;
-    unsigned int   maxHttpRetries_;
+    TransferQuery             query_;
+    OrthancInstancesCache&    cache_;
+    BandwidthDelayEstimator&  estimator_;
+    size_t                    threadsCount_;
+    size_t                    targetBucketSize_;
+    BucketPacking             bucketPacking_;
+    OrthancPeers              peers_;
+    size_t                    peerIndex_;
+    unsigned int              maxHttpRetries_;
 
   protected:
     virtual StateUpdate* CreateInitialState(JobInfo& info) ORTHANC_OVERRIDE;
     
   public:
     PullJob(const TransferQuery& query,
+            OrthancInstancesCache& cache,
+            BandwidthDelayEstimator& estimator,
             size_t threadsCount,
             size_t targetBucketSize,
+            BucketPacking bucketPacking,
             unsigned int maxHttpRetries);
   };
 }
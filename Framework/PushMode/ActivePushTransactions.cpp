@@ -39,6 +39,7 @@ namespace OrthancPlugins
     DownloadArea                 area_;
     std::vector<TransferBucket>  buckets_;
     BucketCompression            compression_;
+    CompressionDictionaries::DictionaryPtr  dictionary_;  // Only referenced, the frames identify their dictionary
 
 #if ORTHANC_FRAMEWORK_VERSION_IS_ABOVE(1, 12, 11)
     Orthanc::ElapsedTimer          lifeSpanTimer_;
@@ -49,10 +50,12 @@ namespace OrthancPlugins
   public:
     Transaction(const std::vector<DicomInstanceInfo>& instances,
                 const std::vector<TransferBucket>& buckets,
-                BucketCompression compression) :
+                BucketCompression compression,
+                const CompressionDictionaries::DictionaryPtr& dictionary) :
       area_(instances),
       buckets_(buckets),
-      compression_(compression)
+      compression_(compression),
+      dictionary_(dictionary)
     {
     }
 
@@ -80,9 +83,10 @@ namespace OrthancPlugins
 
     void Store(size_t bucketIndex,
                const void* data,
-               size_t size)
+               size_t size,
+               const std::string& md5)
     {
-      area_.WriteBucket(GetBucket(bucketIndex), data, size, compression_);
+      area_.WriteBucket(GetBucket(bucketIndex), data, size, compression_, md5);
     }
 
     uint64_t GetLifespanMs()
@@ -164,10 +168,11 @@ namespace OrthancPlugins
   
   std::string ActivePushTransactions::CreateTransaction(const std::vector<DicomInstanceInfo>& instances,
                                                         const std::vector<TransferBucket>& buckets,
-                                                        BucketCompression compression)
+                                                        BucketCompression compression,
+                                                        const CompressionDictionaries::DictionaryPtr& dictionary)
   {
     std::string uuid = Orthanc::Toolbox::GenerateUuid();
-    std::unique_ptr<Transaction> tmp(new Transaction(instances, buckets, compression));
+    std::unique_ptr<Transaction> tmp(new Transaction(instances, buckets, compression, dictionary));
 
     LOG(INFO) << "Creating transaction to receive " << instances.size()
               << " instances (" << ConvertToMegabytes(tmp->GetDownloadArea().GetTotalSize())
@@ -206,7 +211,8 @@ namespace OrthancPlugins
   void ActivePushTransactions::Store(const std::string& transactionUuid,
                                      size_t bucketIndex,
                                      const void* data,
-                                     size_t size)
+                                     size_t size,
+                                     const std::string& md5)
   {
     boost::mutex::scoped_lock  lock(mutex_);
 
@@ -220,6 +226,6 @@ namespace OrthancPlugins
 
     index_.MakeMostRecent(transactionUuid);
       
-    found->second->Store(bucketIndex, data, size);
+    found->second->Store(bucketIndex, data, size, md5);
   }
 }
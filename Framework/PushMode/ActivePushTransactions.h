@@ -21,6 +21,7 @@
 
 #pragma once
 
+#include "../CompressionDictionaries.h"
 #include "../TransferBucket.h"
 
 #include <Cache/LeastRecentlyUsedIndex.h>
@@ -67,14 +68,19 @@ namespace OrthancPlugins
     
     void ListTransactions(std::vector<std::string>& target);
 
+    // The dictionary, that can be NULL, is kept in the registry as
+    // long as the transaction is active
     std::string CreateTransaction(const std::vector<DicomInstanceInfo>& instances,
                                   const std::vector<TransferBucket>& buckets,
-                                  BucketCompression compression);
+                                  BucketCompression compression,
+                                  const CompressionDictionaries::DictionaryPtr& dictionary);
 
+    // "md5" is empty if the sender has an older version of the plugin
     void Store(const std::string& transactionUuid,
                size_t bucketIndex,
                const void* data,
-               size_t size);
+               size_t size,
+               const std::string& md5);
 
     void Commit(const std::string& transactionUuid)
     {
@@ -21,8 +21,7 @@
 
 #include "BucketPushQuery.h"
 
-#include <ChunkedBuffer.h>
-#include <Compression/GzipCompressor.h>
+#include <Toolbox.h>
 
 #include <boost/lexical_cast.hpp>
 
@@ -30,58 +29,85 @@
 namespace OrthancPlugins
 {
   BucketPushQuery::BucketPushQuery(OrthancInstancesCache& cache,
+                                   CompressedBucketsCache& compressedCache,
+                                   InstancesPrefetcher& prefetcher,
+                                   InstancesPinner& pinner,
                                    const TransferBucket& bucket,
                                    const std::string& peer,
                                    const std::string& transactionUri,
                                    size_t bucketIndex,
-                                   BucketCompression compression,
-                                   const std::map<std::string, std::string>& headers) :
+                                   CompressionLevelController& controller,
+                                   CompressionDictionaries::Dictionary* dictionary,
+                                   const std::map<std::string, std::string>& headers,
+                                   unsigned int pinTimeout) :
     cache_(cache),
+    compressedCache_(compressedCache),
+    prefetcher_(prefetcher),
+    pinner_(pinner),
     bucket_(bucket),
     peer_(peer),
     uri_(transactionUri + "/" + boost::lexical_cast<std::string>(bucketIndex)),
-    compression_(compression),
-    headers_(headers)
+    controller_(controller),
+    dictionary_(dictionary),
+    headers_(headers),
+    pinTimeout_(pinTimeout)
   {
   }
 
 
-  void BucketPushQuery::ReadBody(std::string& body) const
+  bool BucketPushQuery::Prepare()
   {
-    Orthanc::ChunkedBuffer buffer;
+    std::unique_ptr<InstancesPinner::BucketGuard> pins(new InstancesPinner::BucketGuard(pinner_, bucket_));
 
-    for (size_t j = 0; j < bucket_.GetChunksCount(); j++)
+    if (pins->Acquire(pinTimeout_))
+    {
+      pins_.reset(pins.release());
+      return true;
+    }
+    else
     {
-      std::string chunk;
-      std::string md5;  // unused
-      cache_.GetChunk(chunk, md5, bucket_, j);
-      buffer.AddChunk(chunk);
+      return false;
     }
+  }
 
-    switch (compression_)
+
+  void BucketPushQuery::ReadBody(std::string& body) const
+  {
+    // The instances stay pinned until the bucket is sent. The pins
+    // are released if the bucket cannot be read or compressed.
+    std::unique_ptr<InstancesPinner::BucketGuard> pins(pins_.release());
+
+    // Move the read-ahead window before reading, so that the next
+    // instances are loaded while this bucket is being sent
+    prefetcher_.NotifyAccess(bucket_);
+
+    BucketContent content;
+    cache_.ReadBucket(content, bucket_);
+
+    // The payload is reused if this bucket was already compressed,
+    // e.g. if this query is retried or if another transfer sends the
+    // same instances. The time spent in the compression tells whether
+    // the level of the next buckets must be lowered or raised.
+    const int level = controller_.GetLevel();
+    CompressedBucketsCache::PayloadPtr payload = compressedCache_.Compress(content, controller_.GetCompression(), level, dictionary_);
+    body = payload->GetData();
+
+    controller_.RecordBucket(level, content.GetSize(), body.size(), payload->GetCompressionTime());
+
+    // Allows the receiver to reject a corrupted bucket, that will
+    // then be sent again
+    if (!payload->LookupMD5(md5_))
     {
-      case BucketCompression_None:
-        buffer.Flatten(body);
-        break;
-
-      case BucketCompression_Gzip:
-      {
-        std::string raw;
-        buffer.Flatten(raw);
-            
-        Orthanc::GzipCompressor compressor;
-        Orthanc::IBufferCompressor::Compress(body, compressor, raw);
-        break;
-      }
-
-      default:
-        throw Orthanc::OrthancException(Orthanc::ErrorCode_ParameterOutOfRange);
+      Orthanc::Toolbox::ComputeMD5(md5_, body);
     }
+
+    pins_.reset(pins.release());
   }
 
   
   void BucketPushQuery::HandleAnswer(const void* answer,
-                                     size_t size)
+                                     size_t size,
+                                     const std::map<std::string, std::string>& answerHeaders)
   {
     throw Orthanc::OrthancException(Orthanc::ErrorCode_InternalError);
   }
@@ -21,7 +21,11 @@
 
 #pragma once
 
+#include "../CompressedBucketsCache.h"
+#include "../CompressionLevelController.h"
 #include "../HttpQueries/IHttpQuery.h"
+#include "../InstancesPinner.h"
+#include "../InstancesPrefetcher.h"
 #include "../OrthancInstancesCache.h"
 
 namespace OrthancPlugins
@@ -30,20 +34,32 @@ namespace OrthancPlugins
   {
   private:
     OrthancInstancesCache&  cache_;
-    TransferBucket          bucket_;
+    CompressedBucketsCache& compressedCache_;
+    InstancesPrefetcher&    prefetcher_;
+    InstancesPinner&        pinner_;
+    const TransferBucket&   bucket_;  // Owned by the push job
     std::string             peer_;
     std::string             uri_;
-    BucketCompression       compression_;
+    CompressionLevelController&  controller_;  // Owned by the push job
+    CompressionDictionaries::Dictionary*  dictionary_;  // Owned by the push job, can be NULL
     std::map<std::string, std::string> headers_;
+    unsigned int            pinTimeout_;
+    mutable std::string     md5_;     // Digest of the body, set by "ReadBody()"
+    mutable std::unique_ptr<InstancesPinner::BucketGuard>  pins_;  // Held until the bucket is sent
 
   public:
     BucketPushQuery(OrthancInstancesCache& cache,
+                    CompressedBucketsCache& compressedCache,
+                    InstancesPrefetcher& prefetcher,
+                    InstancesPinner& pinner,
                     const TransferBucket& bucket,
                     const std::string& peer,
                     const std::string& transactionUri,
                     size_t bucketIndex,
-                    BucketCompression compression,
-                    const std::map<std::string, std::string>& headers);
+                    CompressionLevelController& controller,
+                    CompressionDictionaries::Dictionary* dictionary,
+                    const std::map<std::string, std::string>& headers,
+                    unsigned int pinTimeout);
 
     virtual Orthanc::HttpMethod GetMethod() const ORTHANC_OVERRIDE
     {
@@ -60,14 +76,41 @@ namespace OrthancPlugins
       return uri_;
     }
 
+    // Pins the instances of the bucket, waiting at most "pinTimeout"
+    // seconds for the other buckets to release theirs
+    virtual bool Prepare() ORTHANC_OVERRIDE;
+
     virtual void ReadBody(std::string& body) const ORTHANC_OVERRIDE;
 
+    virtual size_t GetUncompressedSize() const ORTHANC_OVERRIDE
+    {
+      return bucket_.GetTotalSize();
+    }
+
     virtual void HandleAnswer(const void* answer,
-                              size_t size) ORTHANC_OVERRIDE;
+                              size_t size,
+                              const std::map<std::string, std::string>& answerHeaders) ORTHANC_OVERRIDE;
 
+    virtual void NotifyCompleted(bool success) ORTHANC_OVERRIDE
+    {
+      // The other buckets of this transfer can now evict the instances
+      pins_.reset();
+    }
+
+    virtual bool IsCorruptedAnswer(uint16_t httpStatus) const ORTHANC_OVERRIDE
+    {
+      return httpStatus == HTTP_STATUS_CORRUPTED_BUCKET;
+    }
+
+    // "HttpQueriesQueue" always reads the body before the headers
     virtual void GetHttpHeaders(std::map<std::string, std::string>& headers) const ORTHANC_OVERRIDE
     {
       headers = headers_;
+
+      if (!md5_.empty())
+      {
+        headers[HEADER_KEY_BUCKET_MD5] = md5_;
+      }
     }
   };
 }
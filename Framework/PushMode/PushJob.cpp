@@ -23,14 +23,23 @@
 
 #include "BucketPushQuery.h"
 #include "../HttpQueries/HttpQueriesRunner.h"
+#include "../ResourcesExpander.h"
+#include "../TransferManifest.h"
 #include "../TransferScheduler.h"
 
 #include <boost/algorithm/string.hpp> // For boost::iequals and boost::split
+#include <boost/lexical_cast.hpp>
 #include <Compatibility.h> // For std::unique_ptr
 #include <Logging.h>
+#include <set>
 
 namespace OrthancPlugins
 {
+  // Maximum time a HTTP thread waits for other buckets to release
+  // their pinned instances, before moving its bucket to the end of
+  // the queue
+  static const unsigned int PIN_TIMEOUT_SECONDS = 10;
+
 
   /**
    * This is a helper function to extract cookie name and value into a single
@@ -175,8 +184,13 @@ namespace OrthancPlugins
     const PushJob&                     job_;
     JobInfo&                           info_;
     std::string                        transactionUri_;
+    std::vector<TransferBucket>        buckets_;  // Must be declared before "queue_"
+    boost::shared_ptr<InstancesPinner> pinner_;   // Must be declared before "queue_"
+    CompressionLevelController         controller_;  // Must be declared before "queue_"
+    CompressionDictionaries::DictionaryPtr  dictionary_;  // Must be declared before "queue_"
     HttpQueriesQueue                   queue_;
     std::unique_ptr<HttpQueriesRunner> runner_;
+    size_t                             prefetchPlan_;
     /**
      * Stores any cookies to be sent in the http request. These
      * cookies are obtained from the response headers of the
@@ -192,6 +206,7 @@ namespace OrthancPlugins
 
       info_.SetContent("UploadedSizeMB", ConvertToMegabytes(uploadedSize));
       info_.SetContent("CompletedHttpQueries", static_cast<unsigned int>(completedQueriesCount));
+      info_.SetContent("CompressionLevel", controller_.GetLevel());
 
       if (runner_.get() != NULL)
       {
@@ -210,13 +225,22 @@ namespace OrthancPlugins
     PushBucketsState(const PushJob&  job,
                      JobInfo& info,
                      const std::string& transactionUri,
-                     const std::vector<TransferBucket>& buckets,
+                     std::vector<TransferBucket>& buckets /* out */,
+                     BucketCompression compression,
+                     uint32_t dictionary,
                      const std::string& cookieHeader) : 
       job_(job),
       info_(info),
       transactionUri_(transactionUri),
+      pinner_(new InstancesPinner(job.cache_, buckets)),
+      controller_(job.estimator_, job.query_.GetPeer(), compression),
+      dictionary_(dictionary == 0 ? CompressionDictionaries::DictionaryPtr() : CompressionDictionaries::Lookup(dictionary)),
+      prefetchPlan_(0),
       cookieHeader_(cookieHeader)
     {
+      // The queries refer to the buckets, that are not copied
+      buckets_.swap(buckets);
+
       std::map<std::string, std::string> headers;
       job_.query_.GetHttpHeaders(headers);
 
@@ -227,16 +251,27 @@ namespace OrthancPlugins
       }
 
       queue_.SetMaxRetries(job.maxHttpRetries_);
-      queue_.Reserve(buckets.size());
+      queue_.SetBandwidthDelayEstimator(job.estimator_);
+      queue_.Reserve(buckets_.size());
         
-      for (size_t i = 0; i < buckets.size(); i++)
+      for (size_t i = 0; i < buckets_.size(); i++)
       {
-        queue_.Enqueue(new BucketPushQuery(job.cache_, buckets[i], job.query_.GetPeer(),
-                                           transactionUri_, i, job.query_.GetCompression(), headers));
+        queue_.Enqueue(new BucketPushQuery(job.cache_, job.compressedCache_, job.prefetcher_, *pinner_, buckets_[i], job.query_.GetPeer(),
+                                           transactionUri_, i, controller_, dictionary_.get(), headers, PIN_TIMEOUT_SECONDS));
       }
 
+      // The buckets are sent in their order of creation
+      std::vector<std::string> instances;
+      InstancesPrefetcher::ListInstances(instances, buckets_);
+      prefetchPlan_ = job.prefetcher_.AddPlan(instances, pinner_);
+
       UpdateInfo();
     }
+
+    virtual ~PushBucketsState()
+    {
+      job_.prefetcher_.RemovePlan(prefetchPlan_);
+    }
       
     virtual StateUpdate* Step()
     {
@@ -278,30 +313,34 @@ namespace OrthancPlugins
   class PushJob::CreateTransactionState : public IState
   {
   private:
-    const PushJob&                job_;
-    JobInfo&                      info_;
-    std::string                   createTransaction_;
-    std::vector<TransferBucket>   buckets_;
+    const PushJob&                  job_;
+    JobInfo&                        info_;
+    std::vector<DicomInstanceInfo>  instances_;
+    std::vector<TransferBucket>     buckets_;
+    BucketCompression               compression_;
+    uint32_t                        dictionary_;
+    std::string                     binaryManifest_;
 
   public:
     CreateTransactionState(const PushJob& job,
-                           JobInfo& info) :
+                           JobInfo& info,
+                           const TransferScheduler& scheduler,
+                           BucketCompression compression,
+                           uint32_t dictionary) :
       job_(job),
-      info_(info)
+      info_(info),
+      compression_(compression),
+      dictionary_(dictionary)
     {
-      TransferScheduler scheduler;
-      scheduler.ParseListOfResources(job_.cache_, job_.query_.GetResources());
+      // The buckets are fixed once the transaction is created, they
+      // can only be adapted to the link when the job starts
+      const size_t bucketSize = job_.estimator_.ComputeBucketSize(job_.query_.GetPeer(), job_.targetBucketSize_);
 
-      Json::Value push;      
-      scheduler.FormatPushTransaction(push, buckets_,
-                                      job.targetBucketSize_, 2 * job.targetBucketSize_,
-                                      job_.query_.GetCompression());
+      scheduler.ComputePushBuckets(buckets_, bucketSize, 2 * bucketSize, job.bucketPacking_);
+      scheduler.ListInstances(instances_);
 
-      Orthanc::Toolbox::WriteFastJson(createTransaction_, push);
+      WriteBinaryManifest(binaryManifest_, instances_, buckets_, compression_);
 
-      info_.SetContent("Resources", job_.query_.GetResources());
-      info_.SetContent("Peer", job_.query_.GetPeer());
-      info_.SetContent("Compression", EnumerationToString(job_.query_.GetCompression()));
       info_.SetContent("TotalInstances", static_cast<unsigned int>(scheduler.GetInstancesCount()));
       info_.SetContent("TotalSizeMB", ConvertToMegabytes(scheduler.GetTotalSize()));
     }
@@ -313,15 +352,38 @@ namespace OrthancPlugins
       std::map<std::string, std::string> answerHeaders;
       job_.query_.GetHttpHeaders(headers);
 
-      headers["Content-Type"] = "application/json";
+      // Try first the binary manifest. The peers with an older
+      // version of the plugin only understand the JSON manifest.
+      headers["Content-Type"] = MIME_BINARY_MANIFEST;
 
-      if (!DoPostPeer(answer, answerHeaders, job_.peers_, job_.peerIndex_, URI_PUSH, createTransaction_, job_.maxHttpRetries_, headers, job_.commitTimeout_))
+      // Prevents the peer from forgetting the dictionary before the
+      // end of the transaction
+      if (dictionary_ != 0)
       {
-        LOG(ERROR) << "Cannot create a push transaction to peer \"" 
-                   << job_.query_.GetPeer()
-                   << "\" (check that it has the transfers accelerator plugin installed)";
-        return StateUpdate::Failure();
-      } 
+        headers[HEADER_KEY_DICTIONARY] = boost::lexical_cast<std::string>(dictionary_);
+      }
+
+      if (!DoPostPeer(answer, answerHeaders, job_.peers_, job_.peerIndex_, URI_PUSH, binaryManifest_, 0, headers, job_.commitTimeout_))
+      {
+        LOG(INFO) << "Peer \"" << job_.query_.GetPeer() << "\" does not support the binary "
+                  << "manifest of the push transactions, sending the JSON manifest";
+
+        Json::Value manifest;
+        WriteJsonManifest(manifest, instances_, buckets_, compression_);
+
+        std::string body;
+        Orthanc::Toolbox::WriteFastJson(body, manifest);
+
+        headers["Content-Type"] = "application/json";
+
+        if (!DoPostPeer(answer, answerHeaders, job_.peers_, job_.peerIndex_, URI_PUSH, body, job_.maxHttpRetries_, headers, job_.commitTimeout_))
+        {
+          LOG(ERROR) << "Cannot create a push transaction to peer \"" 
+                     << job_.query_.GetPeer()
+                     << "\" (check that it has the transfers accelerator plugin installed)";
+          return StateUpdate::Failure();
+        }
+      }
 
       if (answer.type() != Json::objectValue ||
           !answer.isMember(KEY_PATH) ||
@@ -359,32 +421,205 @@ namespace OrthancPlugins
        */
       std::string cookieHeader = ExtractCookiesFromHeaders(answerHeaders);
 
-      return StateUpdate::Next(new PushBucketsState(job_, info_, transactionUri, buckets_, cookieHeader));
+      return StateUpdate::Next(new PushBucketsState(job_, info_, transactionUri, buckets_, compression_, dictionary_, cookieHeader));
+    }
+
+    virtual void Stop(OrthancPluginJobStopReason reason)
+    {
+    }
+  };
+
+
+  class PushJob::ExpandResourcesState : public IState
+  {
+  private:
+    const PushJob&                        job_;
+    JobInfo&                              info_;
+    ResourcesExpander                     expander_;
+    std::unique_ptr<ResourcesExpander::Runner>  runner_;
+
+    void UpdateInfo()
+    {
+      size_t expandedResources, lookedUpInstances, pendingTasks;
+      expander_.GetStatistics(expandedResources, lookedUpInstances, pendingTasks);
+
+      info_.SetContent("ExpandedResources", static_cast<unsigned int>(expandedResources));
+      info_.SetContent("LookedUpInstances", static_cast<unsigned int>(lookedUpInstances));
+    }
+
+    // Asks the receiving peer which instances it already stores with
+    // the same content, and only adds the other ones to "target".
+    // The peers with an older version of the plugin receive all the
+    // instances.
+    void SkipStoredInstances(TransferScheduler& target,
+                             const TransferScheduler& source,
+                             BucketCompression compression)
+    {
+      std::vector<DicomInstanceInfo> instances;
+      source.ListInstances(instances);
+
+      std::set<size_t> stored;
+
+      if (!instances.empty())
+      {
+        std::string body;
+        WriteBinaryManifest(body, instances, std::vector<TransferBucket>(), compression);
+
+        std::map<std::string, std::string> headers;
+        job_.query_.GetHttpHeaders(headers);
+        headers["Content-Type"] = MIME_BINARY_MANIFEST;
+
+        Json::Value answer;
+        if (DoPostPeer(answer, job_.peers_, job_.peerIndex_, URI_STORED, body, 0, headers, job_.commitTimeout_) &&
+            answer.type() == Json::objectValue &&
+            answer.isMember(KEY_STORED) &&
+            answer[KEY_STORED].type() == Json::arrayValue)
+        {
+          for (Json::Value::ArrayIndex i = 0; i < answer[KEY_STORED].size(); i++)
+          {
+            const Json::Value& index = answer[KEY_STORED][i];
+            if (index.isUInt() &&
+                index.asUInt() < instances.size())
+            {
+              stored.insert(index.asUInt());
+            }
+          }
+        }
+        else
+        {
+          LOG(INFO) << "Peer \"" << job_.query_.GetPeer() << "\" cannot tell which instances "
+                    << "it already stores, all the instances will be sent";
+        }
+      }
+
+      size_t skippedSize = 0;
+
+      for (size_t i = 0; i < instances.size(); i++)
+      {
+        if (stored.find(i) == stored.end())
+        {
+          target.AddInstance(instances[i]);
+        }
+        else
+        {
+          skippedSize += instances[i].GetSize();
+        }
+      }
+
+      info_.SetContent("SkippedInstances", static_cast<unsigned int>(stored.size()));
+      info_.SetContent("SkippedSizeMB", ConvertToMegabytes(skippedSize));
+    }
+
+  public:
+    ExpandResourcesState(const PushJob& job,
+                         JobInfo& info) :
+      job_(job),
+      info_(info),
+      expander_(job.cache_, job.query_.GetResources())
+    {
+      info_.SetContent("Resources", job_.query_.GetResources());
+      info_.SetContent("Peer", job_.query_.GetPeer());
+      info_.SetContent("Compression", EnumerationToString(job_.query_.GetCompression()));
+      UpdateInfo();
+    }
+
+    virtual StateUpdate* Step()
+    {
+      if (runner_.get() == NULL)
+      {
+        runner_.reset(new ResourcesExpander::Runner(expander_, job_.threadsCount_));
+      }
+
+      ResourcesExpander::Status status = expander_.WaitComplete(200);
+
+      UpdateInfo();
+
+      switch (status)
+      {
+        case ResourcesExpander::Status_Running:
+          return StateUpdate::Continue();
+
+        case ResourcesExpander::Status_Success:
+        {
+          runner_.reset();
+
+          TransferScheduler expanded;
+          expander_.FillScheduler(expanded);
+
+          std::map<std::string, std::string> headers;
+          job_.query_.GetHttpHeaders(headers);
+
+          const BucketCompression compression = NegotiateBucketCompression(
+            job_.peers_, job_.peerIndex_, job_.query_.GetCompression(), headers);
+          info_.SetContent("Compression", EnumerationToString(compression));
+
+          TransferScheduler scheduler;
+          SkipStoredInstances(scheduler, expanded, compression);
+
+          if (scheduler.GetInstancesCount() == 0 &&
+              expanded.GetInstancesCount() != 0)
+          {
+            LOG(INFO) << "All the instances are already stored by peer \"" << job_.query_.GetPeer() << "\"";
+            return StateUpdate::Success();
+          }
+          else
+          {
+            // The dictionary is uploaded to the peer if needed, before
+            // the transaction is created
+            const uint32_t dictionary = NegotiateCompressionDictionary(
+              job_.peers_, job_.peerIndex_, compression, true /* push */, headers);
+
+            if (dictionary != 0)
+            {
+              info_.SetContent("CompressionDictionary", dictionary);
+            }
+
+            return StateUpdate::Next(new CreateTransactionState(job_, info_, scheduler, compression, dictionary));
+          }
+        }
+
+        case ResourcesExpander::Status_Failure:
+          LOG(ERROR) << "Cannot list the instances to be pushed to peer \"" << job_.query_.GetPeer() << "\"";
+          return StateUpdate::Failure();
+
+        default:
+          throw Orthanc::OrthancException(Orthanc::ErrorCode_InternalError);
+      }
     }
 
     virtual void Stop(OrthancPluginJobStopReason reason)
     {
+      // Cancel the running expansion threads
+      runner_.reset();
     }
   };
 
 
   StatefulOrthancJob::StateUpdate* PushJob::CreateInitialState(JobInfo& info)
   {
-    return StateUpdate::Next(new CreateTransactionState(*this, info));
+    return StateUpdate::Next(new ExpandResourcesState(*this, info));
   }
     
     
   PushJob::PushJob(const TransferQuery& query,
                    OrthancInstancesCache& cache,
+                   CompressedBucketsCache& compressedCache,
+                   InstancesPrefetcher& prefetcher,
+                   BandwidthDelayEstimator& estimator,
                    size_t threadsCount,
                    size_t targetBucketSize,
+                   BucketPacking bucketPacking,
                    unsigned int maxHttpRetries,
                    unsigned int commitTimeout) :
     StatefulOrthancJob(JOB_TYPE_PUSH),
     cache_(cache),
+    compressedCache_(compressedCache),
+    prefetcher_(prefetcher),
+    estimator_(estimator),
     query_(query),
     threadsCount_(threadsCount),
     targetBucketSize_(targetBucketSize),
+    bucketPacking_(bucketPacking),
     maxHttpRetries_(maxHttpRetries),
     commitTimeout_(commitTimeout)
   {
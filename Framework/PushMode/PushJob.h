@@ -21,6 +21,9 @@
 
 #pragma once
 
+#include "../CompressedBucketsCache.h"
+#include "../HttpQueries/BandwidthDelayEstimator.h"
+#include "../InstancesPrefetcher.h"
 #include "../OrthancInstancesCache.h"
 #include "../StatefulOrthancJob.h"
 #include "../TransferQuery.h"
@@ -30,14 +33,19 @@ namespace OrthancPlugins
   class PushJob : public StatefulOrthancJob
   {
   private:
+    class ExpandResourcesState;
     class CreateTransactionState;    
     class PushBucketsState;
     class FinalState;
 
     OrthancInstancesCache&   cache_;
+    CompressedBucketsCache&  compressedCache_;
+    InstancesPrefetcher&     prefetcher_;
+    BandwidthDelayEstimator& estimator_;
     TransferQuery            query_;
     size_t                   threadsCount_;
     size_t                   targetBucketSize_;
+    BucketPacking            bucketPacking_;
     OrthancPeers             peers_;
     size_t                   peerIndex_;
     unsigned int             maxHttpRetries_;
@@ -49,8 +57,12 @@ namespace OrthancPlugins
   public:
     PushJob(const TransferQuery& query,
             OrthancInstancesCache& cache,
+            CompressedBucketsCache& compressedCache,
+            InstancesPrefetcher& prefetcher,
+            BandwidthDelayEstimator& estimator,
             size_t threadsCount,
             size_t targetBucketSize,
+            BucketPacking bucketPacking,
             unsigned int maxHttpRetries,
             unsigned int commitTimeout);
   };
@@ -0,0 +1,558 @@
+/**
+ * Transfers accelerator plugin for Orthanc
+ * Copyright (C) 2018-2023 Osimis S.A., Belgium
+ * Copyright (C) 2024-2026 Orthanc Team SRL, Belgium
+ * Copyright (C) 2021-2026 Sebastien Jodogne, ICTEAM UCLouvain, Belgium
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU Affero General Public License
+ * as published by the Free Software Foundation, either version 3 of
+ * the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Affero General Public License for more details.
+ * 
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ **/
+
+
+#include "ResourcesExpander.h"
+
+#include "../Resources/Orthanc/Plugins/OrthancPluginCppWrapper.h"
+
+#include <Logging.h>
+#include <OrthancException.h>
+
+#include <algorithm>
+
+
+namespace OrthancPlugins
+{
+  static const char* const KEY_INDEX_IN_SERIES = "IndexInSeries";
+  static const char* const KEY_SERIES = "Series";
+  static const char* const KEY_STUDIES = "Studies";
+
+
+  namespace
+  {
+    // Instance of a series, sorted by index in the series. The
+    // instances whose index is unknown are put at the end of the series.
+    struct SeriesInstance
+    {
+      bool         hasIndex_;
+      uint64_t     index_;
+      std::string  id_;
+
+      bool operator< (const SeriesInstance& other) const
+      {
+        if (hasIndex_ != other.hasIndex_)
+        {
+          return hasIndex_;
+        }
+        else
+        {
+          return index_ < other.index_;
+        }
+      }
+    };
+  }
+
+
+  static void ParseSeriesInstances(std::vector<std::string>& target,
+                                   const Json::Value& instances)
+  {
+    if (instances.type() != Json::arrayValue)
+    {
+      throw Orthanc::OrthancException(Orthanc::ErrorCode_InternalError);
+    }
+
+    std::vector<SeriesInstance> sorted;
+    sorted.reserve(instances.size());
+
+    for (Json::Value::ArrayIndex i = 0; i < instances.size(); i++)
+    {
+      if (instances[i].type() != Json::objectValue ||
+          !instances[i].isMember(KEY_ID) ||
+          instances[i][KEY_ID].type() != Json::stringValue)
+      {
+        throw Orthanc::OrthancException(Orthanc::ErrorCode_InternalError);
+      }
+
+      SeriesInstance instance;
+      instance.id_ = instances[i][KEY_ID].asString();
+      instance.hasIndex_ = (instances[i].isMember(KEY_INDEX_IN_SERIES) &&
+                            instances[i][KEY_INDEX_IN_SERIES].isIntegral());
+      instance.index_ = (instance.hasIndex_ ? instances[i][KEY_INDEX_IN_SERIES].asUInt64() : 0);
+      sorted.push_back(instance);
+    }
+
+    std::stable_sort(sorted.begin(), sorted.end());
+
+    target.resize(sorted.size());
+    for (size_t i = 0; i < sorted.size(); i++)
+    {
+      target[i] = sorted[i].id_;
+    }
+  }
+
+
+  static Orthanc::ResourceType GetChildLevel(Orthanc::ResourceType level)
+  {
+    switch (level)
+    {
+      case Orthanc::ResourceType_Patient:
+        return Orthanc::ResourceType_Study;
+
+      case Orthanc::ResourceType_Study:
+        return Orthanc::ResourceType_Series;
+
+      case Orthanc::ResourceType_Series:
+        return Orthanc::ResourceType_Instance;
+
+      default:
+        throw Orthanc::OrthancException(Orthanc::ErrorCode_ParameterOutOfRange);
+    }
+  }
+
+
+  void ResourcesExpander::Runner::Worker(ResourcesExpander* expander)
+  {
+    Orthanc::Logging::SetCurrentThreadName("TF-EXPAND");
+
+    while (expander->ExecuteOneTask())
+    {
+    }
+  }
+
+
+  ResourcesExpander::Runner::Runner(ResourcesExpander& expander,
+                                    size_t threadsCount) :
+    expander_(expander)
+  {
+    if (threadsCount == 0)
+    {
+      throw Orthanc::OrthancException(Orthanc::ErrorCode_ParameterOutOfRange);
+    }
+
+    workers_.resize(threadsCount);
+
+    for (size_t i = 0; i < threadsCount; i++)
+    {
+      workers_[i] = new boost::thread(Worker, &expander_);
+    }
+  }
+
+
+  ResourcesExpander::Runner::~Runner()
+  {
+    expander_.SetInterrupted(true);
+
+    for (size_t i = 0; i < workers_.size(); i++)
+    {
+      if (workers_[i] != NULL)
+      {
+        if (workers_[i]->joinable())
+        {
+          workers_[i]->join();
+        }
+
+        delete workers_[i];
+      }
+    }
+
+    expander_.SetInterrupted(false);
+  }
+
+
+  void ResourcesExpander::ScheduleInternal(Orthanc::ResourceType level,
+                                           const std::string& id)
+  {
+    // Deduplicate the resources, e.g. if a study is requested
+    // together with its patient
+    if (scheduled_.insert(id).second)
+    {
+      Task task;
+      task.level_ = level;
+      task.id_ = id;
+      tasks_.push_back(task);
+      taskAvailable_.notify_one();
+    }
+  }
+
+
+  ResourcesExpander::Status ResourcesExpander::GetStatusInternal() const
+  {
+    if (isFailure_)
+    {
+      return Status_Failure;
+    }
+    else if (tasks_.empty() &&
+             runningTasks_ == 0)
+    {
+      return Status_Success;
+    }
+    else
+    {
+      return Status_Running;
+    }
+  }
+
+
+  bool ResourcesExpander::LookupResource(Json::Value& target,
+                                         const std::string& uri)
+  {
+    return RestApiGet(target, uri, false);
+  }
+
+
+  void ResourcesExpander::ExpandResource(std::vector<std::string>& children,
+                                         Orthanc::ResourceType level,
+                                         const std::string& id)
+  {
+    std::string uri;
+    const char* key = NULL;
+
+    switch (level)
+    {
+      case Orthanc::ResourceType_Patient:
+        uri = "/patients/" + id;
+        key = KEY_STUDIES;
+        break;
+
+      case Orthanc::ResourceType_Study:
+        uri = "/studies/" + id;
+        key = KEY_SERIES;
+        break;
+
+      case Orthanc::ResourceType_Series:
+        uri = "/series/" + id + "/instances";
+        break;
+
+      default:
+        throw Orthanc::OrthancException(Orthanc::ErrorCode_ParameterOutOfRange);
+    }
+
+    Json::Value resource;
+
+    if (!LookupResource(resource, uri))
+    {
+      std::string s = Orthanc::EnumerationToString(level);
+      Orthanc::Toolbox::ToLowerCase(s);
+      LOG(WARNING) << "Missing " << s << ": " << id;
+      throw Orthanc::OrthancException(Orthanc::ErrorCode_UnknownResource);
+    }
+
+    if (key == NULL)
+    {
+      ParseSeriesInstances(children, resource);
+    }
+    else
+    {
+      if (resource.type() != Json::objectValue ||
+          !resource.isMember(key) ||
+          resource[key].type() != Json::arrayValue)
+      {
+        throw Orthanc::OrthancException(Orthanc::ErrorCode_InternalError);
+      }
+
+      const Json::Value& ids = resource[key];
+
+      children.resize(ids.size());
+
+      for (Json::Value::ArrayIndex i = 0; i < ids.size(); i++)
+      {
+        if (ids[i].type() != Json::stringValue)
+        {
+          throw Orthanc::OrthancException(Orthanc::ErrorCode_InternalError);
+        }
+
+        children[i] = ids[i].asString();
+      }
+    }
+  }
+
+
+  void ResourcesExpander::AddToScheduler(TransferScheduler& scheduler,
+                                         Orthanc::ResourceType level,
+                                         const std::string& id) const
+  {
+    if (level == Orthanc::ResourceType_Instance)
+    {
+      Instances::const_iterator found = instances_.find(id);
+      if (found == instances_.end())
+      {
+        throw Orthanc::OrthancException(Orthanc::ErrorCode_InternalError);
+      }
+
+      scheduler.AddInstance(found->second);
+    }
+    else
+    {
+      Children::const_iterator found = children_.find(id);
+      if (found == children_.end())
+      {
+        throw Orthanc::OrthancException(Orthanc::ErrorCode_InternalError);
+      }
+
+      const Orthanc::ResourceType childLevel = GetChildLevel(level);
+
+      for (size_t i = 0; i < found->second.size(); i++)
+      {
+        AddToScheduler(scheduler, childLevel, found->second[i]);
+      }
+    }
+  }
+
+
+  ResourcesExpander::ResourcesExpander(OrthancInstancesCache& cache,
+                                       const Json::Value& resources) :
+    cache_(cache),
+    runningTasks_(0),
+    isInterrupted_(false),
+    isFailure_(false),
+    error_(Orthanc::ErrorCode_Success)
+  {
+    if (resources.type() != Json::arrayValue)
+    {
+      throw Orthanc::OrthancException(Orthanc::ErrorCode_BadFileFormat);
+    }
+
+    resources_.reserve(resources.size());
+
+    for (Json::Value::ArrayIndex i = 0; i < resources.size(); i++)
+    {
+      if (resources[i].type() != Json::objectValue ||
+          !resources[i].isMember(KEY_LEVEL) ||
+          !resources[i].isMember(KEY_ID) ||
+          resources[i][KEY_LEVEL].type() != Json::stringValue ||
+          resources[i][KEY_ID].type() != Json::stringValue)
+      {
+        throw Orthanc::OrthancException(Orthanc::ErrorCode_BadFileFormat);
+      }
+
+      Task resource;
+      resource.level_ = Orthanc::StringToResourceType(resources[i][KEY_LEVEL].asCString());
+      resource.id_ = resources[i][KEY_ID].asString();
+
+      switch (resource.level_)
+      {
+        case Orthanc::ResourceType_Patient:
+        case Orthanc::ResourceType_Study:
+        case Orthanc::ResourceType_Series:
+        case Orthanc::ResourceType_Instance:
+          break;
+
+        default:
+          throw Orthanc::OrthancException(Orthanc::ErrorCode_ParameterOutOfRange);
+      }
+
+      resources_.push_back(resource);
+      ScheduleInternal(resource.level_, resource.id_);
+    }
+  }
+
+
+  bool ResourcesExpander::ExecuteOneTask()
+  {
+    Task task;
+
+    {
+      boost::mutex::scoped_lock lock(mutex_);
+
+      for (;;)
+      {
+        if (isFailure_ ||
+            isInterrupted_)
+        {
+          return false;
+        }
+        else if (!tasks_.empty())
+        {
+          task = tasks_.front();
+          tasks_.pop_front();
+          runningTasks_++;
+          break;
+        }
+        else if (runningTasks_ == 0)
+        {
+          return false;  // The expansion is complete
+        }
+        else
+        {
+          // Another worker might schedule the children of its resource
+          taskAvailable_.wait(lock);
+        }
+      }
+    }
+
+    bool success = false;
+    Orthanc::ErrorCode error = Orthanc::ErrorCode_InternalError;
+    std::vector<std::string> children;
+    size_t size = 0;
+    std::string md5;
+
+    try
+    {
+      if (task.level_ == Orthanc::ResourceType_Instance)
+      {
+        cache_.GetInstanceInfo(size, md5, task.id_);
+      }
+      else
+      {
+        ExpandResource(children, task.level_, task.id_);
+      }
+
+      success = true;
+    }
+    catch (Orthanc::OrthancException& e)
+    {
+      LOG(ERROR) << "Cannot expand resource " << task.id_ << ": " << e.What();
+      error = e.GetErrorCode();
+    }
+    catch (...)
+    {
+      LOG(ERROR) << "Cannot expand resource " << task.id_;
+    }
+
+    boost::mutex::scoped_lock lock(mutex_);
+
+    assert(runningTasks_ > 0);
+    runningTasks_--;
+
+    if (!success)
+    {
+      if (!isFailure_)
+      {
+        isFailure_ = true;
+        error_ = error;
+      }
+    }
+    else if (task.level_ == Orthanc::ResourceType_Instance)
+    {
+      instances_[task.id_] = DicomInstanceInfo(task.id_, size, md5);
+      lookedUp_.push_back(task.id_);
+      instanceAvailable_.notify_all();
+    }
+    else
+    {
+      const Orthanc::ResourceType childLevel = GetChildLevel(task.level_);
+
+      for (size_t i = 0; i < children.size(); i++)
+      {
+        ScheduleInternal(childLevel, children[i]);
+      }
+
+      children_[task.id_].swap(children);
+    }
+
+    if (GetStatusInternal() != Status_Running)
+    {
+      taskAvailable_.notify_all();
+      completed_.notify_all();
+      instanceAvailable_.notify_all();
+    }
+
+    return true;
+  }
+
+
+  void ResourcesExpander::SetInterrupted(bool interrupted)
+  {
+    boost::mutex::scoped_lock lock(mutex_);
+    isInterrupted_ = interrupted;
+
+    if (interrupted)
+    {
+      taskAvailable_.notify_all();
+    }
+  }
+
+
+  ResourcesExpander::Status ResourcesExpander::WaitComplete(unsigned int timeoutMS)
+  {
+    boost::mutex::scoped_lock lock(mutex_);
+
+    Status status = GetStatusInternal();
+
+    if (status == Status_Running)
+    {
+      completed_.timed_wait(lock, boost::posix_time::milliseconds(timeoutMS));
+      return GetStatusInternal();
+    }
+    else
+    {
+      return status;
+    }
+  }
+
+
+  void ResourcesExpander::WaitComplete()
+  {
+    boost::mutex::scoped_lock lock(mutex_);
+
+    while (GetStatusInternal() == Status_Running)
+    {
+      completed_.timed_wait(lock, boost::posix_time::milliseconds(200));
+    }
+  }
+
+
+  ResourcesExpander::Status ResourcesExpander::WaitLookedUpInstances(std::vector<DicomInstanceInfo>& target,
+                                                                     size_t since,
+                                                                     size_t maxCount,
+                                                                     unsigned int timeoutMS)
+  {
+    boost::mutex::scoped_lock lock(mutex_);
+
+    if (lookedUp_.size() <= since &&
+        GetStatusInternal() == Status_Running)
+    {
+      instanceAvailable_.timed_wait(lock, boost::posix_time::milliseconds(timeoutMS));
+    }
+
+    for (size_t i = since; i < lookedUp_.size() && i < since + maxCount; i++)
+    {
+      Instances::const_iterator found = instances_.find(lookedUp_[i]);
+      assert(found != instances_.end());
+      target.push_back(found->second);
+    }
+
+    return GetStatusInternal();
+  }
+
+
+  void ResourcesExpander::GetStatistics(size_t& expandedResources,
+                                        size_t& lookedUpInstances,
+                                        size_t& pendingTasks)
+  {
+    boost::mutex::scoped_lock lock(mutex_);
+    expandedResources = children_.size();
+    lookedUpInstances = instances_.size();
+    pendingTasks = tasks_.size() + runningTasks_;
+  }
+
+
+  void ResourcesExpander::FillScheduler(TransferScheduler& scheduler)
+  {
+    boost::mutex::scoped_lock lock(mutex_);
+
+    switch (GetStatusInternal())
+    {
+      case Status_Success:
+        for (size_t i = 0; i < resources_.size(); i++)
+        {
+          AddToScheduler(scheduler, resources_[i].level_, resources_[i].id_);
+        }
+        break;
+
+      case Status_Failure:
+        throw Orthanc::OrthancException(error_);
+
+      default:
+        throw Orthanc::OrthancException(Orthanc::ErrorCode_BadSequenceOfCalls);
+    }
+  }
+}
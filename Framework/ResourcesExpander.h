@@ -0,0 +1,147 @@
+/**
+ * Transfers accelerator plugin for Orthanc
+ * Copyright (C) 2018-2023 Osimis S.A., Belgium
+ * Copyright (C) 2024-2026 Orthanc Team SRL, Belgium
+ * Copyright (C) 2021-2026 Sebastien Jodogne, ICTEAM UCLouvain, Belgium
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU Affero General Public License
+ * as published by the Free Software Foundation, either version 3 of
+ * the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Affero General Public License for more details.
+ * 
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ **/
+
+
+#pragma once
+
+#include "TransferScheduler.h"
+
+#include <boost/thread.hpp>
+#include <deque>
+#include <set>
+
+
+namespace OrthancPlugins
+{
+  /**
+   * Expands a list of patients, studies, series and instances into
+   * the list of their instances, and retrieves the size and the MD5
+   * of each instance. The REST calls to the Orthanc core and the
+   * lookups in the cache are run by a pool of threads (cf. class
+   * "Runner"), and each resource or instance is only handled once,
+   * even if it is requested several times. The instances are then
+   * added to the scheduler in the order of the DICOM hierarchy, as if
+   * the resources had been walked sequentially.
+   **/
+  class ResourcesExpander : public boost::noncopyable
+  {
+  public:
+    enum Status
+    {
+      Status_Running,
+      Status_Success,
+      Status_Failure
+    };
+
+    class Runner : public boost::noncopyable
+    {
+    private:
+      ResourcesExpander&           expander_;
+      std::vector<boost::thread*>  workers_;
+
+      static void Worker(ResourcesExpander* expander);
+
+    public:
+      Runner(ResourcesExpander& expander,
+             size_t threadsCount);
+
+      ~Runner();
+    };
+
+  private:
+    struct Task
+    {
+      Orthanc::ResourceType  level_;
+      std::string            id_;
+    };
+
+    typedef std::map<std::string, std::vector<std::string> >  Children;
+    typedef std::map<std::string, DicomInstanceInfo>          Instances;
+
+    OrthancInstancesCache&      cache_;
+    std::vector<Task>           resources_;
+
+    boost::mutex                mutex_;
+    boost::condition_variable   taskAvailable_;
+    boost::condition_variable   completed_;
+    boost::condition_variable   instanceAvailable_;
+    std::deque<Task>            tasks_;
+    std::set<std::string>       scheduled_;
+    size_t                      runningTasks_;
+    bool                        isInterrupted_;
+    bool                        isFailure_;
+    Orthanc::ErrorCode          error_;
+    Children                    children_;   // Orthanc identifiers never collide between levels
+    Instances                   instances_;
+    std::vector<std::string>    lookedUp_;   // Instances in the order of their lookups
+
+    void ScheduleInternal(Orthanc::ResourceType level,
+                          const std::string& id);
+
+    Status GetStatusInternal() const;
+
+    // Makes the workers exit as soon as possible, the expansion can
+    // be resumed by a new runner (e.g. if the job is paused)
+    void SetInterrupted(bool interrupted);
+
+    void ExpandResource(std::vector<std::string>& children,
+                        Orthanc::ResourceType level,
+                        const std::string& id);
+
+    void AddToScheduler(TransferScheduler& scheduler,
+                        Orthanc::ResourceType level,
+                        const std::string& id) const;
+
+  protected:
+    // Can be overridden by the unit tests, to run without the Orthanc core
+    virtual bool LookupResource(Json::Value& target,
+                                const std::string& uri);
+
+  public:
+    ResourcesExpander(OrthancInstancesCache& cache,
+                      const Json::Value& resources);
+
+    virtual ~ResourcesExpander()
+    {
+    }
+
+    // Returns "false" if there is no more task to execute
+    bool ExecuteOneTask();
+
+    Status WaitComplete(unsigned int timeoutMS);
+
+    void WaitComplete();
+
+    // Waits until some instance after the "since" first looked up
+    // instances is known, or until the expansion is over, then
+    // appends at most "maxCount" of these instances to "target"
+    Status WaitLookedUpInstances(std::vector<DicomInstanceInfo>& target,
+                                 size_t since,
+                                 size_t maxCount,
+                                 unsigned int timeoutMS);
+
+    void GetStatistics(size_t& expandedResources,
+                       size_t& lookedUpInstances,
+                       size_t& pendingTasks);
+
+    // Throws the error that stopped the expansion, if any
+    void FillScheduler(TransferScheduler& scheduler);
+  };
+}
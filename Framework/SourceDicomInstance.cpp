@@ -41,33 +41,97 @@ namespace OrthancPlugins
     buffer_ = buffer.Release();
   }
 
-  
-  SourceDicomInstance::~SourceDicomInstance()
+
+  SourceDicomInstance::SourceDicomInstance(const std::string& instanceId,
+                                           const std::string& content) :
+    content_(content)
   {
-    OrthancPluginFreeMemoryBuffer(OrthancPlugins::GetGlobalContext(), &buffer_);
+    buffer_.data = NULL;
+    buffer_.size = 0;
+
+    std::string md5;
+    Orthanc::Toolbox::ComputeMD5(md5, content_);
+
+    info_.reset(new DicomInstanceInfo(instanceId, content_.size(), md5));
   }
 
 
-  const DicomInstanceInfo& SourceDicomInstance::GetInfo() const
+
+  SourceDicomInstance::SourceDicomInstance(const DicomInstanceInfo& info,
+                                           MappedFile* file) :
+    file_(file)
   {
-    assert(info_.get() != NULL);
-    return *info_;
+    buffer_.data = NULL;
+    buffer_.size = 0;
+
+    if (file == NULL)
+    {
+      throw Orthanc::OrthancException(Orthanc::ErrorCode_NullPointer);
+    }
+
+    if (file->GetSize() != info.GetSize())
+    {
+      throw Orthanc::OrthancException(Orthanc::ErrorCode_CorruptedFile);
+    }
+
+    info_.reset(new DicomInstanceInfo(info));
   }
 
 
-  void SourceDicomInstance::GetChunk(std::string& target /* out */,
-                                     std::string& md5 /* out */,
-                                     size_t offset,
-                                     size_t size) const
+  SourceDicomInstance::SourceDicomInstance(const DicomInstanceInfo& info,
+                                           OrthancPluginMemoryBuffer& buffer) :
+    buffer_(buffer)
   {
-    if (offset + size > buffer_.size)
+    buffer.data = NULL;
+    buffer.size = 0;
+
+    if (buffer_.size != info.GetSize())
     {
-      throw Orthanc::OrthancException(Orthanc::ErrorCode_ParameterOutOfRange);
+      if (buffer_.data != NULL)
+      {
+        OrthancPluginFreeMemoryBuffer(OrthancPlugins::GetGlobalContext(), &buffer_);
+      }
+
+      throw Orthanc::OrthancException(Orthanc::ErrorCode_CorruptedFile);
     }
 
-    const char* start = reinterpret_cast<const char*>(buffer_.data) + offset;
-    target.assign(start, start + size);
+    info_.reset(new DicomInstanceInfo(info));
+  }
 
-    Orthanc::Toolbox::ComputeMD5(md5, start, size);
+  
+  SourceDicomInstance::~SourceDicomInstance()
+  {
+    if (buffer_.data != NULL)
+    {
+      OrthancPluginFreeMemoryBuffer(OrthancPlugins::GetGlobalContext(), &buffer_);
+    }
+  }
+
+
+  const void* SourceDicomInstance::GetBuffer() const
+  {
+    if (buffer_.data != NULL)
+    {
+      return buffer_.data;
+    }
+    else if (file_.get() != NULL)
+    {
+      return file_->GetData();
+    }
+    else if (content_.empty())
+    {
+      return NULL;
+    }
+    else
+    {
+      return content_.c_str();
+    }
+  }
+
+
+  const DicomInstanceInfo& SourceDicomInstance::GetInfo() const
+  {
+    assert(info_.get() != NULL);
+    return *info_;
   }
 }
@@ -22,6 +22,7 @@
 #pragma once
 
 #include "DicomInstanceInfo.h"
+#include "MappedFile.h"
 
 #include <Compatibility.h>  // For std::unique_ptr
 
@@ -35,24 +36,34 @@ namespace OrthancPlugins
   class SourceDicomInstance : public boost::noncopyable
   {
   private:
-    OrthancPluginMemoryBuffer         buffer_;
+    OrthancPluginMemoryBuffer           buffer_;
+    std::string                         content_;  // Only used if not read from Orthanc
+    std::unique_ptr<MappedFile>         file_;     // Only used if read from the disk cache
     std::unique_ptr<DicomInstanceInfo>  info_;
 
   public:
     explicit SourceDicomInstance(const std::string& instanceId);
 
+    // Constructor for DICOM instances that are not stored by the
+    // Orthanc core (notably used by the unit tests)
+    SourceDicomInstance(const std::string& instanceId,
+                        const std::string& content);
+
+    // Constructor for DICOM instances that are read from the disk
+    // cache, whose information is already known. Takes the ownership
+    // of the file.
+    SourceDicomInstance(const DicomInstanceInfo& info,
+                        MappedFile* file);
+
+    // Constructor for a range of bytes of a DICOM instance, as read
+    // from the Orthanc core. Takes the ownership of the buffer.
+    SourceDicomInstance(const DicomInstanceInfo& info,
+                        OrthancPluginMemoryBuffer& buffer);
+
     ~SourceDicomInstance();
 
-    const void* GetBuffer() const
-    {
-      return buffer_.data;
-    }
+    const void* GetBuffer() const;
 
     const DicomInstanceInfo& GetInfo() const;
-
-    void GetChunk(std::string& target /* out */,
-                  std::string& md5 /* out */,
-                  size_t offset,
-                  size_t size) const;
   };
 }
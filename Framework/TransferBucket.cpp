@@ -23,9 +23,11 @@
 
 #include <Logging.h>
 #include <OrthancException.h>
+#include <Toolbox.h>
 
 #include <cassert>
 #include <boost/lexical_cast.hpp>
+#include <string.h>
 
 
 namespace OrthancPlugins
@@ -65,7 +67,7 @@ namespace OrthancPlugins
         try
         {
           Chunk chunk;
-          chunk.instanceId_ = serialized[i][KEY_ID].asString();
+          chunk.instanceId_ = CompactIdentifier(serialized[i][KEY_ID].asString());
           chunk.offset_ = boost::lexical_cast<size_t>(serialized[i][KEY_OFFSET].asString());
           chunk.size_ = boost::lexical_cast<size_t>(serialized[i][KEY_SIZE].asString());
 
@@ -88,7 +90,7 @@ namespace OrthancPlugins
     for (size_t i = 0; i < chunks_.size(); i++)
     {
       Json::Value item = Json::objectValue;
-      item[KEY_ID] = chunks_[i].instanceId_;
+      item[KEY_ID] = chunks_[i].instanceId_.ToString();
       item[KEY_OFFSET] = boost::lexical_cast<std::string>(chunks_[i].offset_);
       item[KEY_SIZE] = boost::lexical_cast<std::string>(chunks_[i].size_);
       target.append(item);
@@ -139,7 +141,7 @@ namespace OrthancPlugins
     }
 
     Chunk chunk;
-    chunk.instanceId_ = instance.GetId();
+    chunk.instanceId_ = instance.GetCompactId();
     chunk.offset_ = chunkOffset;
     chunk.size_ = chunkSize;
 
@@ -148,7 +150,20 @@ namespace OrthancPlugins
   }
     
 
-  const std::string& TransferBucket::GetChunkInstanceId(size_t index) const
+  std::string TransferBucket::GetChunkInstanceId(size_t index) const
+  {
+    if (index >= chunks_.size())
+    {
+      throw Orthanc::OrthancException(Orthanc::ErrorCode_ParameterOutOfRange);
+    }
+    else
+    {
+      return chunks_[index].instanceId_.ToString();
+    }
+  }
+
+
+  const CompactIdentifier& TransferBucket::GetChunkCompactId(size_t index) const
   {
     if (index >= chunks_.size())
     {
@@ -209,11 +224,40 @@ namespace OrthancPlugins
         uri += ".";
       }
 
-      uri += chunks_[i].instanceId_;
+      uri += chunks_[i].instanceId_.ToString();
 
       assert(i == 0 || chunks_[i].offset_ == 0);
     }
 
+    AppendPullUriArguments(uri, compression);
+  }
+
+
+  size_t TransferBucket::GetPullUriLength(BucketCompression compression) const
+  {
+    if (chunks_.empty())
+    {
+      throw Orthanc::OrthancException(Orthanc::ErrorCode_InternalError);
+    }
+
+    // The identifiers, separated by dots
+    size_t length = strlen(URI_CHUNKS) + 1 + (chunks_.size() - 1);
+
+    for (size_t i = 0; i < chunks_.size(); i++)
+    {
+      length += chunks_[i].instanceId_.GetLength();
+    }
+
+    std::string arguments;
+    AppendPullUriArguments(arguments, compression);
+
+    return length + arguments.size();
+  }
+
+
+  void TransferBucket::AppendPullUriArguments(std::string& uri,
+                                              BucketCompression compression) const
+  {
     uri += ("?offset=" + boost::lexical_cast<std::string>(chunks_[0].offset_) +
             "&size=" + boost::lexical_cast<std::string>(totalSize_));
 
@@ -227,8 +271,44 @@ namespace OrthancPlugins
         uri += "&compression=gzip";
         break;
 
+      case BucketCompression_Zstd:
+        uri += "&compression=zstd";
+        break;
+
+      case BucketCompression_Auto:
+        uri += "&compression=auto";
+        break;
+
       default:
         throw Orthanc::OrthancException(Orthanc::ErrorCode_ParameterOutOfRange);
     }
   }
+
+
+  void TransferBucket::ComputePullBody(std::string& body,
+                                       BucketCompression compression,
+                                       int level,
+                                       uint32_t dictionary) const
+  {
+    if (chunks_.empty())
+    {
+      throw Orthanc::OrthancException(Orthanc::ErrorCode_InternalError);
+    }
+
+    Json::Value request = Json::objectValue;
+    Serialize(request[KEY_CHUNKS]);
+    request[KEY_COMPRESSION] = EnumerationToString(compression);
+
+    if (level != 0)
+    {
+      request[KEY_COMPRESSION_LEVEL] = level;
+    }
+
+    if (dictionary != 0)
+    {
+      request[KEY_DICTIONARY] = dictionary;
+    }
+
+    Orthanc::Toolbox::WriteFastJson(body, request);
+  }
 }
@@ -31,15 +31,18 @@ namespace OrthancPlugins
   private:
     struct Chunk
     {
-      std::string  instanceId_;
-      size_t       offset_;
-      size_t       size_;
+      CompactIdentifier  instanceId_;
+      size_t             offset_;
+      size_t             size_;
     };
 
     std::vector<Chunk>  chunks_;
     size_t              totalSize_;
     bool                extensible_;
 
+    void AppendPullUriArguments(std::string& uri,
+                                BucketCompression compression) const;
+
   public:
     TransferBucket();
 
@@ -68,7 +71,11 @@ namespace OrthancPlugins
                   size_t chunkOffset,
                   size_t chunkSize);
     
-    const std::string& GetChunkInstanceId(size_t index) const;
+    std::string GetChunkInstanceId(size_t index) const;
+
+    // Avoids converting the identifier back to a string, in the loops
+    // that only compare the instances
+    const CompactIdentifier& GetChunkCompactId(size_t index) const;
 
     size_t GetChunkOffset(size_t index) const;
 
@@ -76,5 +83,24 @@ namespace OrthancPlugins
 
     void ComputePullUri(std::string& uri,
                         BucketCompression compression) const;
+
+    // Length of "ComputePullUri()", which is checked each time a small
+    // instance is grouped into the bucket
+    size_t GetPullUriLength(BucketCompression compression) const;
+
+    // Body of a "POST" request to "/transfers/chunks", which is not
+    // limited by the length of the URL
+    void ComputePullBody(std::string& body,
+                         BucketCompression compression) const
+    {
+      ComputePullBody(body, compression, 0, 0);
+    }
+
+    // A "level" of zero lets the peer choose the compression level. A
+    // "dictionary" of zero disables the zstd dictionaries.
+    void ComputePullBody(std::string& body,
+                         BucketCompression compression,
+                         int level,
+                         uint32_t dictionary) const;
   };
 }
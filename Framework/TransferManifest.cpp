@@ -0,0 +1,390 @@
+/**
+ * Transfers accelerator plugin for Orthanc
+ * Copyright (C) 2018-2023 Osimis S.A., Belgium
+ * Copyright (C) 2024-2026 Orthanc Team SRL, Belgium
+ * Copyright (C) 2021-2026 Sebastien Jodogne, ICTEAM UCLouvain, Belgium
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU Affero General Public License
+ * as published by the Free Software Foundation, either version 3 of
+ * the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Affero General Public License for more details.
+ * 
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ **/
+
+
+
+#include "TransferManifest.h"
+
+#include <Logging.h>
+#include <OrthancException.h>
+
+#include <boost/noncopyable.hpp>
+#include <map>
+
+
+namespace OrthancPlugins
+{
+  // The first bytes of a binary manifest, followed by its version
+  static const char BINARY_MANIFEST_MAGIC[] = { 'O', 'T', 'M', 'F' };
+  static const uint8_t BINARY_MANIFEST_VERSION = 1;
+
+
+  static void WriteVarint(std::string& target,
+                          uint64_t value)
+  {
+    while (value >= 0x80)
+    {
+      target.push_back(static_cast<char>((value & 0x7f) | 0x80));
+      value >>= 7;
+    }
+
+    target.push_back(static_cast<char>(value));
+  }
+
+
+  static void WriteString(std::string& target,
+                          const std::string& value)
+  {
+    WriteVarint(target, value.size());
+    target.append(value);
+  }
+
+
+  namespace
+  {
+    class BinaryReader : public boost::noncopyable
+    {
+    private:
+      const uint8_t*  current_;
+      const uint8_t*  end_;
+
+    public:
+      BinaryReader(const void* data,
+                   size_t size) :
+        current_(reinterpret_cast<const uint8_t*>(data)),
+        end_(reinterpret_cast<const uint8_t*>(data) + size)
+      {
+      }
+
+      bool IsEnd() const
+      {
+        return current_ == end_;
+      }
+
+      uint8_t ReadByte()
+      {
+        if (current_ == end_)
+        {
+          throw Orthanc::OrthancException(Orthanc::ErrorCode_BadFileFormat);
+        }
+        else
+        {
+          return *(current_++);
+        }
+      }
+
+      uint64_t ReadVarint()
+      {
+        uint64_t value = 0;
+
+        for (unsigned int shift = 0; shift < 64; shift += 7)
+        {
+          const uint8_t byte = ReadByte();
+          value |= static_cast<uint64_t>(byte & 0x7f) << shift;
+
+          if ((byte & 0x80) == 0)
+          {
+            return value;
+          }
+        }
+
+        throw Orthanc::OrthancException(Orthanc::ErrorCode_BadFileFormat);
+      }
+
+      size_t ReadSize()
+      {
+        const uint64_t value = ReadVarint();
+
+        if (static_cast<uint64_t>(static_cast<size_t>(value)) != value)
+        {
+          throw Orthanc::OrthancException(Orthanc::ErrorCode_BadFileFormat);
+        }
+        else
+        {
+          return static_cast<size_t>(value);
+        }
+      }
+
+      // Prevents a corrupted count from reserving a huge amount of
+      // memory: Each item takes at least one byte
+      size_t ReadCount()
+      {
+        const size_t count = ReadSize();
+
+        if (count > static_cast<size_t>(end_ - current_))
+        {
+          throw Orthanc::OrthancException(Orthanc::ErrorCode_BadFileFormat);
+        }
+        else
+        {
+          return count;
+        }
+      }
+
+      void ReadString(std::string& target)
+      {
+        const size_t size = ReadSize();
+
+        if (size > static_cast<size_t>(end_ - current_))
+        {
+          throw Orthanc::OrthancException(Orthanc::ErrorCode_BadFileFormat);
+        }
+        else
+        {
+          target.assign(reinterpret_cast<const char*>(current_), size);
+          current_ += size;
+        }
+      }
+    };
+  }
+
+
+  void WriteJsonManifest(Json::Value& target,
+                         const std::vector<DicomInstanceInfo>& instances,
+                         const std::vector<TransferBucket>& buckets,
+                         BucketCompression compression)
+  {
+    target = Json::objectValue;
+
+    Json::Value tmp = Json::arrayValue;
+
+    for (size_t i = 0; i < instances.size(); i++)
+    {
+      Json::Value item;
+      instances[i].Serialize(item);
+      tmp.append(item);
+    }
+
+    target[KEY_INSTANCES] = tmp;
+
+    tmp = Json::arrayValue;
+
+    for (size_t i = 0; i < buckets.size(); i++)
+    {
+      Json::Value item;
+      buckets[i].Serialize(item);
+      tmp.append(item);
+    }
+
+    target[KEY_BUCKETS] = tmp;
+    target[KEY_COMPRESSION] = EnumerationToString(compression);
+  }
+
+
+  void ReadJsonManifest(std::vector<DicomInstanceInfo>& instances,
+                        std::vector<TransferBucket>& buckets,
+                        BucketCompression& compression,
+                        const Json::Value& manifest)
+  {
+    if (manifest.type() != Json::objectValue ||
+        !manifest.isMember(KEY_BUCKETS) ||
+        !manifest.isMember(KEY_COMPRESSION) ||
+        !manifest.isMember(KEY_INSTANCES) ||
+        manifest[KEY_BUCKETS].type() != Json::arrayValue ||
+        manifest[KEY_COMPRESSION].type() != Json::stringValue ||
+        manifest[KEY_INSTANCES].type() != Json::arrayValue)
+    {
+      throw Orthanc::OrthancException(Orthanc::ErrorCode_BadFileFormat);
+    }
+
+    instances.clear();
+    instances.reserve(manifest[KEY_INSTANCES].size());
+
+    for (Json::Value::ArrayIndex i = 0; i < manifest[KEY_INSTANCES].size(); i++)
+    {
+      instances.push_back(DicomInstanceInfo(manifest[KEY_INSTANCES][i]));
+    }
+
+    buckets.clear();
+    buckets.reserve(manifest[KEY_BUCKETS].size());
+
+    for (Json::Value::ArrayIndex i = 0; i < manifest[KEY_BUCKETS].size(); i++)
+    {
+      buckets.push_back(TransferBucket(manifest[KEY_BUCKETS][i]));
+    }
+
+    compression = StringToBucketCompression(manifest[KEY_COMPRESSION].asString());
+  }
+
+
+  void WriteBinaryManifest(std::string& target,
+                           const std::vector<DicomInstanceInfo>& instances,
+                           const std::vector<TransferBucket>& buckets,
+                           BucketCompression compression)
+  {
+    target.clear();
+    target.append(BINARY_MANIFEST_MAGIC, sizeof(BINARY_MANIFEST_MAGIC));
+    target.push_back(static_cast<char>(BINARY_MANIFEST_VERSION));
+
+    switch (compression)
+    {
+      case BucketCompression_None:
+        WriteVarint(target, 0);
+        break;
+
+      case BucketCompression_Gzip:
+        WriteVarint(target, 1);
+        break;
+
+      case BucketCompression_Zstd:
+        WriteVarint(target, 2);
+        break;
+
+      case BucketCompression_Auto:
+        WriteVarint(target, 3);
+        break;
+
+      default:
+        throw Orthanc::OrthancException(Orthanc::ErrorCode_ParameterOutOfRange);
+    }
+
+    std::map<CompactIdentifier, size_t> indices;
+
+    WriteVarint(target, instances.size());
+
+    for (size_t i = 0; i < instances.size(); i++)
+    {
+      const std::string id = instances[i].GetId();
+
+      if (!indices.insert(std::make_pair(instances[i].GetCompactId(), i)).second)
+      {
+        LOG(ERROR) << "Instance listed twice in a transfer: " << id;
+        throw Orthanc::OrthancException(Orthanc::ErrorCode_ParameterOutOfRange);
+      }
+
+      WriteString(target, id);
+      WriteVarint(target, instances[i].GetSize());
+      WriteString(target, instances[i].GetMD5());
+    }
+
+    WriteVarint(target, buckets.size());
+
+    for (size_t i = 0; i < buckets.size(); i++)
+    {
+      WriteVarint(target, buckets[i].GetChunksCount());
+
+      for (size_t j = 0; j < buckets[i].GetChunksCount(); j++)
+      {
+        std::map<CompactIdentifier, size_t>::const_iterator found =
+          indices.find(buckets[i].GetChunkCompactId(j));
+
+        if (found == indices.end())
+        {
+          LOG(ERROR) << "Bucket referring to an instance that is not part of the transfer: "
+                     << buckets[i].GetChunkInstanceId(j);
+          throw Orthanc::OrthancException(Orthanc::ErrorCode_ParameterOutOfRange);
+        }
+
+        WriteVarint(target, found->second);
+        WriteVarint(target, buckets[i].GetChunkOffset(j));
+        WriteVarint(target, buckets[i].GetChunkSize(j));
+      }
+    }
+  }
+
+
+  void ReadBinaryManifest(std::vector<DicomInstanceInfo>& instances,
+                          std::vector<TransferBucket>& buckets,
+                          BucketCompression& compression,
+                          const void* manifest,
+                          size_t size)
+  {
+    BinaryReader reader(manifest, size);
+
+    for (size_t i = 0; i < sizeof(BINARY_MANIFEST_MAGIC); i++)
+    {
+      if (reader.ReadByte() != static_cast<uint8_t>(BINARY_MANIFEST_MAGIC[i]))
+      {
+        throw Orthanc::OrthancException(Orthanc::ErrorCode_BadFileFormat);
+      }
+    }
+
+    const uint8_t version = reader.ReadByte();
+    if (version != BINARY_MANIFEST_VERSION)
+    {
+      LOG(ERROR) << "Unsupported version of the binary manifest: " << static_cast<unsigned int>(version);
+      throw Orthanc::OrthancException(Orthanc::ErrorCode_NotImplemented);
+    }
+
+    switch (reader.ReadVarint())
+    {
+      case 0:
+        compression = BucketCompression_None;
+        break;
+
+      case 1:
+        compression = BucketCompression_Gzip;
+        break;
+
+      case 2:
+        compression = BucketCompression_Zstd;
+        break;
+
+      case 3:
+        compression = BucketCompression_Auto;
+        break;
+
+      default:
+        throw Orthanc::OrthancException(Orthanc::ErrorCode_BadFileFormat);
+    }
+
+    instances.clear();
+    instances.resize(reader.ReadCount());
+
+    for (size_t i = 0; i < instances.size(); i++)
+    {
+      std::string id, md5;
+      reader.ReadString(id);
+      const size_t instanceSize = reader.ReadSize();
+      reader.ReadString(md5);
+
+      instances[i] = DicomInstanceInfo(id, instanceSize, md5);
+    }
+
+    buckets.clear();
+    buckets.resize(reader.ReadCount());
+
+    for (size_t i = 0; i < buckets.size(); i++)
+    {
+      const size_t chunksCount = reader.ReadCount();
+      buckets[i].Reserve(chunksCount);
+
+      for (size_t j = 0; j < chunksCount; j++)
+      {
+        const size_t index = reader.ReadSize();
+        const size_t offset = reader.ReadSize();
+        const size_t chunkSize = reader.ReadSize();
+
+        if (index >= instances.size())
+        {
+          throw Orthanc::OrthancException(Orthanc::ErrorCode_BadFileFormat);
+        }
+
+        // Checks the consistency of the chunks with the instances
+        buckets[i].AddChunk(instances[index], offset, chunkSize);
+      }
+    }
+
+    if (!reader.IsEnd())
+    {
+      throw Orthanc::OrthancException(Orthanc::ErrorCode_BadFileFormat);
+    }
+  }
+}
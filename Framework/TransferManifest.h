@@ -0,0 +1,59 @@
+/**
+ * Transfers accelerator plugin for Orthanc
+ * Copyright (C) 2018-2023 Osimis S.A., Belgium
+ * Copyright (C) 2024-2026 Orthanc Team SRL, Belgium
+ * Copyright (C) 2021-2026 Sebastien Jodogne, ICTEAM UCLouvain, Belgium
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU Affero General Public License
+ * as published by the Free Software Foundation, either version 3 of
+ * the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Affero General Public License for more details.
+ * 
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ **/
+
+
+
+#pragma once
+
+#include "TransferBucket.h"
+
+#include <vector>
+
+namespace OrthancPlugins
+{
+  /**
+   * The manifest of a push transaction lists the instances to be
+   * sent and the buckets. The JSON manifest is understood by all the
+   * versions of the plugin. The binary manifest is much more compact:
+   * The identifiers of the instances are only written once in a
+   * table, and the chunks of the buckets refer to them by their index
+   * in this table, all the integers being varint-encoded.
+   **/
+  void WriteJsonManifest(Json::Value& target,
+                         const std::vector<DicomInstanceInfo>& instances,
+                         const std::vector<TransferBucket>& buckets,
+                         BucketCompression compression);
+
+  void ReadJsonManifest(std::vector<DicomInstanceInfo>& instances,
+                        std::vector<TransferBucket>& buckets,
+                        BucketCompression& compression,
+                        const Json::Value& manifest);
+
+  void WriteBinaryManifest(std::string& target,
+                           const std::vector<DicomInstanceInfo>& instances,
+                           const std::vector<TransferBucket>& buckets,
+                           BucketCompression compression);
+
+  void ReadBinaryManifest(std::vector<DicomInstanceInfo>& instances,
+                          std::vector<TransferBucket>& buckets,
+                          BucketCompression& compression,
+                          const void* manifest,
+                          size_t size);
+}
@@ -21,11 +21,15 @@
 
 #include "TransferScheduler.h"
 
+#include "ResourcesExpander.h"
+#include "TransferManifest.h"
 #include "../Resources/Orthanc/Plugins/OrthancPluginCppWrapper.h"
 
 #include <Logging.h>
 #include <OrthancException.h>
 
+#include <algorithm>
+
 
 namespace OrthancPlugins
 {
@@ -34,51 +38,164 @@ namespace OrthancPlugins
                                       const std::string& id)
   {
     Json::Value resource;
+    resource[KEY_LEVEL] = Orthanc::EnumerationToString(level);
+    resource[KEY_ID] = id;
+
+    Json::Value resources = Json::arrayValue;
+    resources.append(resource);
+
+    ParseListOfResources(cache, resources, 1);
+  }
+
 
-    std::string base;
-    switch (level)
+  void TransferScheduler::ListOrderedInstances(std::vector<const DicomInstanceInfo*>& target,
+                                               BucketPacking packing) const
+  {
+    target.resize(instances_.size());
+
+    switch (packing)
     {
-      case Orthanc::ResourceType_Patient:
-        base = "patients";
-        break;
+      case BucketPacking_Identifier:
+      case BucketPacking_Balanced:
+      {
+        size_t pos = 0;
+        for (Instances::const_iterator it = instances_.begin();
+             it != instances_.end(); ++it, pos++)
+        {
+          target[pos] = &it->second.info_;
+        }
 
-      case Orthanc::ResourceType_Study:
-        base = "studies";
         break;
+      }
+
+      case BucketPacking_Locality:
+      {
+        for (Instances::const_iterator it = instances_.begin();
+             it != instances_.end(); ++it)
+        {
+          assert(it->second.rank_ < target.size());
+          target[it->second.rank_] = &it->second.info_;
+        }
 
-      case Orthanc::ResourceType_Series:
-        base = "series";
         break;
+      }
 
       default:
         throw Orthanc::OrthancException(Orthanc::ErrorCode_ParameterOutOfRange);
     }
+  }
+
+
+  static bool IsPullUriTooLong(const TransferBucket& bucket,
+                               const std::string& baseUrl,  /* empty in push mode */
+                               BucketCompression compression)
+  {
+    // Grouping the small instances, preventing the download URL from
+    // getting too long: "If you keep URLs under 2000 characters,
+    // they'll work in virtually any combination of client and server
+    // software." https://stackoverflow.com/a/417184/881731
 
-    if (RestApiGet(resource, "/" + base + "/" + id + "/instances", false))
+    static const size_t MAX_URL_LENGTH = 2000 - 44 /* size of an Orthanc identifier (SHA-1) */;
+
+    if (baseUrl.empty())
     {
-      if (resource.type() != Json::arrayValue)
-      {
-        throw Orthanc::OrthancException(Orthanc::ErrorCode_InternalError);
-      }
+      return false;
+    }
+    else
+    {
+      return (baseUrl.size() + bucket.GetPullUriLength(compression) >= MAX_URL_LENGTH);
+    }
+  }
+
+
+  // Appends a small instance to the bucket that is being grouped,
+  // and moves this bucket to "target" once it is full
+  static void GroupInstance(std::vector<TransferBucket>& target,
+                            TransferBucket& bucket,
+                            const DicomInstanceInfo& instance,
+                            size_t groupThreshold,
+                            const std::string& baseUrl,
+                            BucketCompression compression)
+  {
+    bucket.AddChunk(instance, 0, instance.GetSize());
+        
+    if (bucket.GetTotalSize() >= groupThreshold ||
+        IsPullUriTooLong(bucket, baseUrl, compression))
+    {
+      target.push_back(bucket);
+      bucket.Clear();
+    }
+  }
+
+
+  static bool IsLargerInstance(const DicomInstanceInfo* a,
+                               const DicomInstanceInfo* b)
+  {
+    return a->GetSize() > b->GetSize();
+  }
+
+
+  static bool IsLargerBucket(const TransferBucket& a,
+                             const TransferBucket& b)
+  {
+    return a.GetTotalSize() > b.GetTotalSize();
+  }
+
+
+  // First-fit decreasing bin packing of the small instances into
+  // buckets of at most "capacity" bytes, which fills the buckets more
+  // evenly than the greedy grouping (that leaves a runt at the end)
+  static void PackFirstFitDecreasing(std::vector<TransferBucket>& target,
+                                     const std::list<const DicomInstanceInfo*>& instances,
+                                     size_t capacity,
+                                     const std::string& baseUrl,
+                                     BucketCompression compression)
+  {
+    std::vector<const DicomInstanceInfo*> sorted(instances.begin(), instances.end());
+    std::stable_sort(sorted.begin(), sorted.end(), IsLargerInstance);
+
+    std::vector<TransferBucket> bins;
+    std::vector<bool> closed;  // Bins whose URL cannot grow anymore
 
-      for (Json::Value::ArrayIndex i = 0; i < resource.size(); i++)
+    for (size_t i = 0; i < sorted.size(); i++)
+    {
+      const DicomInstanceInfo& instance = *sorted[i];
+      bool packed = false;
+
+      for (size_t j = 0; j < bins.size() && !packed; j++)
       {
-        if (resource[i].type() != Json::objectValue ||
-            !resource[i].isMember(KEY_ID) ||
-            resource[i][KEY_ID].type() != Json::stringValue)
+        if (!closed[j] &&
+            bins[j].GetTotalSize() + instance.GetSize() <= capacity)
         {
-          throw Orthanc::OrthancException(Orthanc::ErrorCode_InternalError);
+          TransferBucket candidate = bins[j];
+          candidate.AddChunk(instance, 0, instance.GetSize());
+
+          if (IsPullUriTooLong(candidate, baseUrl, compression))
+          {
+            closed[j] = true;
+          }
+          else
+          {
+            bins[j] = candidate;
+            packed = true;
+          }
         }
+      }
 
-        AddInstance(cache, resource[i][KEY_ID].asString());
+      if (!packed)
+      {
+        bins.push_back(TransferBucket());
+        bins.back().AddChunk(instance, 0, instance.GetSize());
+        closed.push_back(false);
       }
     }
-    else
+
+    for (size_t i = 0; i < bins.size(); i++)
     {
-      std::string s = Orthanc::EnumerationToString(level);
-      Orthanc::Toolbox::ToLowerCase(s);
-      LOG(WARNING) << "Missing " << s << ": " << id;
-      throw Orthanc::OrthancException(Orthanc::ErrorCode_UnknownResource);
+      if (bins[i].GetChunksCount() > 0)
+      {
+        target.push_back(bins[i]);
+      }
     }
   }
 
@@ -87,7 +204,8 @@ namespace OrthancPlugins
                                                  size_t groupThreshold,
                                                  size_t separateThreshold,
                                                  const std::string& baseUrl,  /* only needed in pull mode */
-                                                 BucketCompression compression /* only needed in pull mode */) const
+                                                 BucketCompression compression, /* only needed in pull mode */
+                                                 BucketPacking packing) const
   {
     if (groupThreshold > separateThreshold ||
         separateThreshold == 0)  // (*)
@@ -97,22 +215,37 @@ namespace OrthancPlugins
 
     target.clear();
 
-    std::list<std::string>  toGroup_;
+    std::vector<const DicomInstanceInfo*> instances;
+    ListOrderedInstances(instances, packing);
 
-    for (Instances::const_iterator it = instances_.begin();
-         it != instances_.end(); ++it)
+    // With the locality-aware packing, the small instances are grouped
+    // as they come, so that the buckets follow the order of the series
+    // (a series is only scattered by its large instances). Otherwise,
+    // they are grouped once all the large instances are scheduled.
+    std::list<const DicomInstanceInfo*>  toGroup;
+    TransferBucket group;
+
+    for (size_t pos = 0; pos < instances.size(); pos++)
     {
-      size_t size = it->second.GetSize();
+      const DicomInstanceInfo& instance = *instances[pos];
+      size_t size = instance.GetSize();
 
       if (size < groupThreshold)
       {
-        toGroup_.push_back(it->first);
+        if (packing == BucketPacking_Locality)
+        {
+          GroupInstance(target, group, instance, groupThreshold, baseUrl, compression);
+        }
+        else
+        {
+          toGroup.push_back(&instance);
+        }
       }
       else if (size < separateThreshold)
       {
         // Send the whole instance as it is
         TransferBucket bucket;
-        bucket.AddChunk(it->second, 0, size);
+        bucket.AddChunk(instance, 0, size);
         target.push_back(bucket);
       }
       else
@@ -142,11 +275,11 @@ namespace OrthancPlugins
           {
             // The last chunk must contain all the remaining bytes
             // of the instance (correction of rounding effects)
-            bucket.AddChunk(it->second, offset, size - offset);
+            bucket.AddChunk(instance, offset, size - offset);
           }
           else
           {
-            bucket.AddChunk(it->second, offset, chunkSize);
+            bucket.AddChunk(instance, offset, chunkSize);
           }
 
           target.push_back(bucket);
@@ -154,46 +287,28 @@ namespace OrthancPlugins
       }
     }
 
-    // Grouping the remaining small instances, preventing the
-    // download URL from getting too long: "If you keep URLs under
-    // 2000 characters, they'll work in virtually any combination of
-    // client and server software."
-    // https://stackoverflow.com/a/417184/881731
-
-    static const size_t MAX_URL_LENGTH = 2000 - 44 /* size of an Orthanc identifier (SHA-1) */;
-
-    TransferBucket bucket;
+    if (packing == BucketPacking_Balanced)
+    {
+      PackFirstFitDecreasing(target, toGroup, separateThreshold, baseUrl, compression);
 
-    for (std::list<std::string>::const_iterator it = toGroup_.begin();
-         it != toGroup_.end(); ++it)
+      // Largest processing time first: The smallest buckets are sent
+      // at the end of the job, which shortens its tail if the buckets
+      // are processed by several threads
+      std::stable_sort(target.begin(), target.end(), IsLargerBucket);
+    }
+    else
     {
-      Instances::const_iterator instance = instances_.find(*it);
-      assert(instance != instances_.end());
-        
-      bucket.AddChunk(instance->second, 0, instance->second.GetSize());
-        
-      bool full = (bucket.GetTotalSize() >= groupThreshold);
-        
-      if (!full && !baseUrl.empty())
+      for (std::list<const DicomInstanceInfo*>::const_iterator it = toGroup.begin();
+           it != toGroup.end(); ++it)
       {
-        std::string uri;
-        bucket.ComputePullUri(uri, compression);
-
-        std::string url = baseUrl + uri;
-        full = (url.length() >= MAX_URL_LENGTH);
+        GroupInstance(target, group, **it, groupThreshold, baseUrl, compression);
       }
 
-      if (full)
+      if (group.GetChunksCount() > 0)
       {
-        target.push_back(bucket);
-        bucket.Clear();
+        target.push_back(group);
       }
     }
-
-    if (bucket.GetChunksCount() > 0)
-    {
-      target.push_back(bucket);
-    }
   }
 
 
@@ -210,68 +325,49 @@ namespace OrthancPlugins
 
   void TransferScheduler::AddInstance(const DicomInstanceInfo& info)
   {
-    instances_[info.GetId()] = info;
+    Instances::iterator found = instances_.find(info.GetCompactId());
+
+    if (found == instances_.end())
+    {
+      Instance instance;
+      instance.info_ = info;
+      instance.rank_ = instances_.size();
+      instances_[info.GetCompactId()] = instance;
+    }
+    else
+    {
+      found->second.info_ = info;
+    }
   }
 
     
   void TransferScheduler::ParseListOfResources(OrthancInstancesCache& cache, 
-                                               const Json::Value& resources)
+                                               const Json::Value& resources,
+                                               size_t threadsCount)
   {
-    if (resources.type() != Json::arrayValue)
-    {
-      throw Orthanc::OrthancException(Orthanc::ErrorCode_BadFileFormat);
-    }
+    ResourcesExpander expander(cache, resources);
 
-    for (Json::Value::ArrayIndex i = 0; i < resources.size(); i++)
     {
-      if (resources[i].type() != Json::objectValue ||
-          !resources[i].isMember(KEY_LEVEL) ||
-          !resources[i].isMember(KEY_ID) ||
-          resources[i][KEY_LEVEL].type() != Json::stringValue ||
-          resources[i][KEY_ID].type() != Json::stringValue)
-      {
-        throw Orthanc::OrthancException(Orthanc::ErrorCode_BadFileFormat);
-      }
-      else
-      {
-        Orthanc::ResourceType level = Orthanc::StringToResourceType(resources[i][KEY_LEVEL].asCString());
-
-        switch (level)
-        {
-          case Orthanc::ResourceType_Patient:
-            AddPatient(cache, resources[i][KEY_ID].asString());
-            break;
-
-          case Orthanc::ResourceType_Study:
-            AddStudy(cache, resources[i][KEY_ID].asString());
-            break;
-
-          case Orthanc::ResourceType_Series:
-            AddSeries(cache, resources[i][KEY_ID].asString());
-            break;
-
-          case Orthanc::ResourceType_Instance:
-            AddInstance(cache, resources[i][KEY_ID].asString());
-            break;
-
-          default:
-            throw Orthanc::OrthancException(Orthanc::ErrorCode_ParameterOutOfRange);
-        }
-      }
+      ResourcesExpander::Runner runner(expander, threadsCount);
+      expander.WaitComplete();
     }
+
+    expander.FillScheduler(*this);
   }
 
     
   void TransferScheduler::ListInstances(std::vector<DicomInstanceInfo>& target) const
   {
+    std::vector<const DicomInstanceInfo*> instances;
+    ListOrderedInstances(instances, BucketPacking_Locality);
+
     target.clear();
-    target.reserve(instances_.size());
+    target.reserve(instances.size());
 
-    for (Instances::const_iterator it = instances_.begin();
-         it != instances_.end(); ++it)
+    for (size_t i = 0; i < instances.size(); i++)
     {
-      assert(it->first == it->second.GetId());
-      target.push_back(it->second);
+      assert(instances[i] != NULL);
+      target.push_back(*instances[i]);
     }
   }
 
@@ -283,7 +379,7 @@ namespace OrthancPlugins
     for (Instances::const_iterator it = instances_.begin();
          it != instances_.end(); ++it)
     {
-      size += it->second.GetSize();
+      size += it->second.info_.GetSize();
     }
 
     return size;
@@ -294,9 +390,19 @@ namespace OrthancPlugins
                                              size_t groupThreshold,
                                              size_t separateThreshold,
                                              const std::string& baseUrl,
-                                             BucketCompression compression) const
+                                             BucketCompression compression,
+                                             BucketPacking packing) const
+  {
+    ComputeBucketsInternal(target, groupThreshold, separateThreshold, baseUrl, compression, packing);
+  }
+
+
+  void TransferScheduler::ComputePushBuckets(std::vector<TransferBucket>& target,
+                                             size_t groupThreshold,
+                                             size_t separateThreshold,
+                                             BucketPacking packing) const
   {
-    ComputeBucketsInternal(target, groupThreshold, separateThreshold, baseUrl, compression);
+    ComputeBucketsInternal(target, groupThreshold, separateThreshold, "", BucketCompression_None, packing);
   }
 
 
@@ -304,47 +410,20 @@ namespace OrthancPlugins
                                                 std::vector<TransferBucket>& buckets,
                                                 size_t groupThreshold,
                                                 size_t separateThreshold,
-                                                BucketCompression compression) const
+                                                BucketCompression compression,
+                                                BucketPacking packing) const
   {
-    ComputeBucketsInternal(buckets, groupThreshold, separateThreshold, "", BucketCompression_None);
+    ComputePushBuckets(buckets, groupThreshold, separateThreshold, packing);
 
-    target = Json::objectValue;
+    std::vector<DicomInstanceInfo> instances;
+    instances.reserve(instances_.size());
 
-    Json::Value tmp = Json::arrayValue;
-      
     for (Instances::const_iterator it = instances_.begin();
          it != instances_.end(); ++it)
     {
-      Json::Value item;
-      it->second.Serialize(item);
-      tmp.append(item);
-    }
-
-    target[KEY_INSTANCES] = tmp;
-
-    tmp = Json::arrayValue;
-
-    for (size_t i = 0; i < buckets.size(); i++)
-    {
-      Json::Value item;
-      buckets[i].Serialize(item);
-      tmp.append(item);
+      instances.push_back(it->second.info_);
     }
 
-    target[KEY_BUCKETS] = tmp;
-
-    switch (compression)
-    {
-      case BucketCompression_Gzip: 
-        target[KEY_COMPRESSION] = "gzip";
-        break;
-
-      case BucketCompression_None: 
-        target[KEY_COMPRESSION] = "none";
-        break;
-
-      default:
-        throw Orthanc::OrthancException(Orthanc::ErrorCode_ParameterOutOfRange);
-    }
+    WriteJsonManifest(target, instances, buckets, compression);
   }
 }
@@ -26,6 +26,12 @@
 
 namespace OrthancPlugins
 {
+  /**
+   * The instances are ranked in the order they are added. The
+   * patients, studies and series are walked down the DICOM hierarchy,
+   * and the instances of each series are added by increasing index in
+   * the series, so that the ranks follow the locality of the data.
+   **/
   class TransferScheduler : public boost::noncopyable
   {
   private:
@@ -33,13 +39,23 @@ namespace OrthancPlugins
                      Orthanc::ResourceType level,
                      const std::string& id);
 
+    void ListOrderedInstances(std::vector<const DicomInstanceInfo*>& target,
+                              BucketPacking packing) const;
+
     void ComputeBucketsInternal(std::vector<TransferBucket>& target,
                                 size_t groupThreshold,
                                 size_t separateThreshold,
                                 const std::string& baseUrl,  /* only needed in pull mode */
-                                BucketCompression compression /* only needed in pull mode */) const;
+                                BucketCompression compression, /* only needed in pull mode */
+                                BucketPacking packing) const;
+
+    struct Instance
+    {
+      DicomInstanceInfo  info_;
+      size_t             rank_;
+    };
 
-    typedef std::map<std::string, DicomInstanceInfo>   Instances;
+    typedef std::map<CompactIdentifier, Instance>   Instances;
 
     Instances    instances_;
 
@@ -68,9 +84,13 @@ namespace OrthancPlugins
 
     void AddInstance(const DicomInstanceInfo& info);
 
+    // The resources are expanded by a pool of threads, cf. class
+    // "ResourcesExpander"
     void ParseListOfResources(OrthancInstancesCache& cache, 
-                              const Json::Value& resources);
+                              const Json::Value& resources,
+                              size_t threadsCount);
 
+    // Lists the instances by increasing rank
     void ListInstances(std::vector<DicomInstanceInfo>& target) const;
 
     size_t GetInstancesCount() const
@@ -80,16 +100,25 @@ namespace OrthancPlugins
 
     size_t GetTotalSize() const;
 
+    // If "baseUrl" is empty, the buckets are not limited by the
+    // length of their URL (cf. "TransferBucket::ComputePullBody()")
     void ComputePullBuckets(std::vector<TransferBucket>& target,
                             size_t groupThreshold,
                             size_t separateThreshold,
                             const std::string& baseUrl,
-                            BucketCompression compression) const;
+                            BucketCompression compression,
+                            BucketPacking packing) const;
+
+    void ComputePushBuckets(std::vector<TransferBucket>& target,
+                            size_t groupThreshold,
+                            size_t separateThreshold,
+                            BucketPacking packing) const;
 
     void FormatPushTransaction(Json::Value& target,
                                std::vector<TransferBucket>& buckets,
                                size_t groupThreshold,
                                size_t separateThreshold,
-                               BucketCompression compression) const;
+                               BucketCompression compression,
+                               BucketPacking packing) const;
   };
 }
@@ -21,12 +21,16 @@
 
 #include "TransferToolbox.h"
 
+#include "CompressionDictionaries.h"
+
 #include "../Resources/Orthanc/Plugins/OrthancPluginCppWrapper.h"
 
 #include <CompatibilityMath.h>
 #include <Logging.h>
 #include <OrthancException.h>
+#include <Toolbox.h>
 
+#include <boost/lexical_cast.hpp>
 #include <boost/thread/thread.hpp>
 
 
@@ -56,9 +60,17 @@ namespace OrthancPlugins
     {
       return BucketCompression_None;
     }
+    else if (value == "zstd")
+    {
+      return BucketCompression_Zstd;
+    }
+    else if (value == "auto")
+    {
+      return BucketCompression_Auto;
+    }
     else
     {
-      LOG(ERROR) << "Valid compression methods are \"gzip\" and \"none\", but found: " << value;
+      LOG(ERROR) << "Valid compression methods are \"gzip\", \"zstd\", \"auto\" and \"none\", but found: " << value;
       throw Orthanc::OrthancException(Orthanc::ErrorCode_ParameterOutOfRange);
     }
   }
@@ -73,6 +85,133 @@ namespace OrthancPlugins
 
       case BucketCompression_None:
         return "none";
+
+      case BucketCompression_Zstd:
+        return "zstd";
+
+      case BucketCompression_Auto:
+        return "auto";
+
+      default:
+        throw Orthanc::OrthancException(Orthanc::ErrorCode_ParameterOutOfRange);
+    }
+  }
+
+
+  bool IsBucketCompressionSupported(BucketCompression compression)
+  {
+    switch (compression)
+    {
+      case BucketCompression_None:
+      case BucketCompression_Gzip:
+        return true;
+
+      case BucketCompression_Zstd:
+      case BucketCompression_Auto:  // The compressed parts use zstd
+        return (ORTHANC_TRANSFERS_ENABLE_ZSTD == 1);
+
+      default:
+        return false;
+    }
+  }
+
+
+  void ListSupportedBucketCompressions(Json::Value& target)
+  {
+    static const BucketCompression compressions[] = {
+      BucketCompression_None,
+      BucketCompression_Gzip,
+      BucketCompression_Zstd,
+      BucketCompression_Auto
+    };
+
+    target = Json::arrayValue;
+
+    for (size_t i = 0; i < sizeof(compressions) / sizeof(BucketCompression); i++)
+    {
+      if (IsBucketCompressionSupported(compressions[i]))
+      {
+        target.append(EnumerationToString(compressions[i]));
+      }
+    }
+  }
+
+
+  BucketPacking StringToBucketPacking(const std::string& value)
+  {
+    if (value == "Identifier")
+    {
+      return BucketPacking_Identifier;
+    }
+    else if (value == "Locality")
+    {
+      return BucketPacking_Locality;
+    }
+    else if (value == "Balanced")
+    {
+      return BucketPacking_Balanced;
+    }
+    else
+    {
+      LOG(ERROR) << "Valid bucket packings are \"Identifier\", \"Locality\" and \"Balanced\", but found: " << value;
+      throw Orthanc::OrthancException(Orthanc::ErrorCode_ParameterOutOfRange);
+    }
+  }
+
+
+  const char* EnumerationToString(BucketPacking packing)
+  {
+    switch (packing)
+    {
+      case BucketPacking_Identifier:
+        return "Identifier";
+
+      case BucketPacking_Locality:
+        return "Locality";
+
+      case BucketPacking_Balanced:
+        return "Balanced";
+
+      default:
+        throw Orthanc::OrthancException(Orthanc::ErrorCode_ParameterOutOfRange);
+    }
+  }
+
+
+  CachePolicy StringToCachePolicy(const std::string& value)
+  {
+    if (value == "LRU")
+    {
+      return CachePolicy_LRU;
+    }
+    else if (value == "SLRU")
+    {
+      return CachePolicy_SLRU;
+    }
+    else if (value == "TinyLFU")
+    {
+      return CachePolicy_TinyLFU;
+    }
+    else
+    {
+      LOG(ERROR) << "Valid cache policies are \"LRU\", \"SLRU\" and \"TinyLFU\", but found: " << value;
+      throw Orthanc::OrthancException(Orthanc::ErrorCode_ParameterOutOfRange);
+    }
+  }
+
+
+  const char* EnumerationToString(CachePolicy policy)
+  {
+    switch (policy)
+    {
+      case CachePolicy_LRU:
+        return "LRU";
+
+      case CachePolicy_SLRU:
+        return "SLRU";
+
+      case CachePolicy_TinyLFU:
+        return "TinyLFU";
         
       default:
         throw Orthanc::OrthancException(Orthanc::ErrorCode_ParameterOutOfRange);
@@ -196,6 +335,211 @@ namespace OrthancPlugins
   }
 
 
+  bool DoGetPeer(Json::Value& answer,
+                 const OrthancPeers& peers,
+                 size_t peerIndex,
+                 const std::string& uri,
+                 unsigned int maxRetries,
+                 const std::map<std::string, std::string>& headers)
+  {
+    unsigned int retry = 0;
+
+    for (;;)
+    {
+      try
+      {
+        if (peers.DoGet(answer, peerIndex, uri, headers))
+        {
+          return true;
+        }
+      }
+      catch (Orthanc::OrthancException&)
+      {
+      }
+      
+      if (retry >= maxRetries)
+      {
+        return false;
+      }
+      else
+      {
+        // Wait 1 second before retrying
+        boost::this_thread::sleep(boost::posix_time::seconds(1));
+        retry++;
+      }
+    }
+  }
+
+
+  BucketCompression NegotiateBucketCompression(const OrthancPeers& peers,
+                                               size_t peerIndex,
+                                               BucketCompression requested,
+                                               const std::map<std::string, std::string>& headers)
+  {
+    if (requested == BucketCompression_None ||
+        requested == BucketCompression_Gzip)
+    {
+      // Supported by all the versions of the plugin
+      return requested;
+    }
+
+    if (!IsBucketCompressionSupported(requested))
+    {
+      LOG(WARNING) << "This build of the transfers accelerator doesn't support the \""
+                   << EnumerationToString(requested) << "\" compression, using \"gzip\" instead";
+      return BucketCompression_Gzip;
+    }
+
+    // The route is not available in older versions of the plugin
+    Json::Value answer;
+    if (DoGetPeer(answer, peers, peerIndex, URI_COMPRESSIONS, 0, headers) &&
+        answer.type() == Json::arrayValue)
+    {
+      for (Json::Value::ArrayIndex i = 0; i < answer.size(); i++)
+      {
+        if (answer[i].type() == Json::stringValue &&
+            answer[i].asString() == EnumerationToString(requested))
+        {
+          return requested;
+        }
+      }
+    }
+
+    LOG(INFO) << "Peer \"" << peers.GetPeerName(peerIndex) << "\" doesn't support the \""
+              << EnumerationToString(requested) << "\" compression, using \"gzip\" instead";
+    return BucketCompression_Gzip;
+  }
+
+
+  static bool LookupDictionaryId(uint32_t& target,
+                                 const Json::Value& value)
+  {
+    if (value.isUInt() &&
+        value.asUInt() != 0)
+    {
+      target = value.asUInt();
+      return true;
+    }
+    else
+    {
+      return false;
+    }
+  }
+
+
+  uint32_t NegotiateCompressionDictionary(const OrthancPeers& peers,
+                                          size_t peerIndex,
+                                          BucketCompression compression,
+                                          bool push,
+                                          const std::map<std::string, std::string>& headers)
+  {
+    if ((compression != BucketCompression_Zstd &&
+         compression != BucketCompression_Auto) ||
+        !CompressionDictionaries::IsSupported() ||
+        !CompressionDictionaries::IsEnabled())
+    {
+      return 0;
+    }
+
+    CompressionDictionaries::DictionaryPtr current;
+    if (push)
+    {
+      current = CompressionDictionaries::GetCurrent();
+      if (current.get() == NULL)
+      {
+        return 0;  // Not enough samples to train a dictionary yet
+      }
+    }
+
+    // The route is not available in older versions of the plugin
+    Json::Value answer;
+    if (!DoGetPeer(answer, peers, peerIndex, URI_DICTIONARIES, 0, headers) ||
+        answer.type() != Json::objectValue)
+    {
+      return 0;
+    }
+
+    try
+    {
+      if (push)
+      {
+        if (answer.isMember(KEY_DICTIONARIES) &&
+            answer[KEY_DICTIONARIES].type() == Json::arrayValue)
+        {
+          for (Json::Value::ArrayIndex i = 0; i < answer[KEY_DICTIONARIES].size(); i++)
+          {
+            uint32_t id;
+            if (LookupDictionaryId(id, answer[KEY_DICTIONARIES][i]) &&
+                id == current->GetId())
+            {
+              return id;  // The peer already has the dictionary
+            }
+          }
+        }
+
+        Json::Value body;
+        std::string encoded;
+        Orthanc::Toolbox::EncodeBase64(encoded, current->GetContent());
+        body[KEY_CONTENT] = encoded;
+
+        Json::Value uploaded;
+        uint32_t id;
+        if (DoPostPeer(uploaded, peers, peerIndex, URI_DICTIONARIES, body.toStyledString(), 0, headers) &&
+            uploaded.type() == Json::objectValue &&
+            uploaded.isMember(KEY_ID) &&
+            LookupDictionaryId(id, uploaded[KEY_ID]) &&
+            id == current->GetId())
+        {
+          LOG(INFO) << "Compression dictionary " << id << " uploaded to peer \""
+                    << peers.GetPeerName(peerIndex) << "\"";
+          return id;
+        }
+      }
+      else
+      {
+        uint32_t id;
+        if (!answer.isMember(KEY_CURRENT) ||
+            !LookupDictionaryId(id, answer[KEY_CURRENT]))
+        {
+          return 0;  // The peer has not trained a dictionary yet
+        }
+
+        if (CompressionDictionaries::Lookup(id).get() != NULL)
+        {
+          return id;
+        }
+
+        Json::Value downloaded;
+        if (DoGetPeer(downloaded, peers, peerIndex, std::string(URI_DICTIONARIES) + "/" +
+                      boost::lexical_cast<std::string>(id), 0, headers) &&
+            downloaded.type() == Json::objectValue &&
+            downloaded.isMember(KEY_CONTENT) &&
+            downloaded[KEY_CONTENT].type() == Json::stringValue)
+        {
+          std::string content;
+          Orthanc::Toolbox::DecodeBase64(content, downloaded[KEY_CONTENT].asString());
+
+          if (CompressionDictionaries::Register(content)->GetId() == id)
+          {
+            LOG(INFO) << "Compression dictionary " << id << " downloaded from peer \""
+                      << peers.GetPeerName(peerIndex) << "\"";
+            return id;
+          }
+        }
+      }
+    }
+    catch (Orthanc::OrthancException& e)
+    {
+      LOG(WARNING) << "Cannot exchange the compression dictionary with peer \""
+                   << peers.GetPeerName(peerIndex) << "\": " << e.What();
+    }
+
+    LOG(INFO) << "Not using a compression dictionary with peer \""
+              << peers.GetPeerName(peerIndex) << "\"";
+    return 0;
+  }
+
+
   bool DoDeletePeer(const OrthancPeers& peers,
                     size_t peerIndex,
                     const std::string& uri,
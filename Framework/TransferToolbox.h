@@ -21,6 +21,10 @@
 
 #pragma once
 
+#if !defined(ORTHANC_TRANSFERS_ENABLE_ZSTD)
+#  error The macro ORTHANC_TRANSFERS_ENABLE_ZSTD must be defined
+#endif
+
 #include <stdint.h>
 #include <string>
 #include <json/value.h>
@@ -34,11 +38,19 @@ static const char* const JOB_TYPE_PUSH = "PushTransfer";
 static const char* const PLUGIN_NAME = "transfers";
 
 static const char* const KEY_BUCKETS = "Buckets";
+static const char* const KEY_CHUNKS = "Chunks";
 static const char* const KEY_COMPRESSION = "Compression";
+static const char* const KEY_COMPRESSION_LEVEL = "CompressionLevel";
+static const char* const KEY_CONTENT = "Content";
+static const char* const KEY_CURRENT = "Current";
+static const char* const KEY_DICTIONARIES = "Dictionaries";
+static const char* const KEY_DICTIONARY = "Dictionary";
+static const char* const KEY_DONE = "Done";
 static const char* const KEY_ID = "ID";
 static const char* const KEY_INSTANCES = "Instances";
 static const char* const KEY_LEVEL = "Level";
 static const char* const KEY_OFFSET = "Offset";
+static const char* const KEY_ORDER = "Order";
 static const char* const KEY_ORIGINATOR_UUID = "Originator";
 static const char* const KEY_PATH = "Path";
 static const char* const KEY_PEER = "Peer";
@@ -48,19 +60,37 @@ static const char* const KEY_REMOTE_JOB = "RemoteJob";
 static const char* const KEY_REMOTE_SELF = "RemoteSelf";
 static const char* const KEY_RESOURCES = "Resources";
 static const char* const KEY_SIZE = "Size";
+static const char* const KEY_STORED = "Stored";
 static const char* const KEY_URL = "URL";
 static const char* const KEY_SENDER_TRANSFER_ID = "SenderTransferID";
 
 static const char* const URI_CHUNKS = "/transfers/chunks";
+static const char* const URI_COMPRESSIONS = "/transfers/compressions";
+static const char* const URI_DICTIONARIES = "/transfers/dictionaries";
 static const char* const URI_JOBS = "/jobs";
 static const char* const URI_LOOKUP = "/transfers/lookup";
+static const char* const URI_LOOKUPS = "/transfers/lookups";
 static const char* const URI_PEERS = "/transfers/peers";
 static const char* const URI_PLUGINS = "/plugins";
 static const char* const URI_PULL = "/transfers/pull";
 static const char* const URI_PUSH = "/transfers/push";
 static const char* const URI_SEND = "/transfers/send";
+static const char* const URI_STORED = "/transfers/stored";
 
+static const char* const HEADER_KEY_BUCKET_MD5 = "transfers-bucket-md5";
+static const char* const HEADER_KEY_COMPRESSION_TIME = "transfers-compression-time";  // In microseconds
 static const char* const HEADER_KEY_SENDER_TRANSFER_ID = "sender-transfer-id";
+static const char* const HEADER_KEY_BUCKET_PACKING = "transfers-bucket-packing";
+static const char* const HEADER_KEY_BUCKET_SIZE = "transfers-bucket-size";  // In bytes
+static const char* const HEADER_KEY_LOOKUP = "transfers-lookup";  // Lookup of the pulled instances
+static const char* const HEADER_KEY_DICTIONARY = "transfers-dictionary";  // Negotiated for the push transaction
+
+// Answer of the receiver of a pushed bucket whose MD5 does not match,
+// which tells the sender to send it again
+static const uint16_t HTTP_STATUS_CORRUPTED_BUCKET = 422;
+
+static const char* const MIME_BINARY_MANIFEST = "application/x-orthanc-transfers-manifest";
+static const char* const MIME_AUTO_BUCKET = "application/x-orthanc-transfers-bucket";
   
 namespace OrthancPlugins
 {
@@ -69,7 +99,23 @@ namespace OrthancPlugins
   enum BucketCompression
   {
     BucketCompression_None,
-    BucketCompression_Gzip
+    BucketCompression_Gzip,
+    BucketCompression_Zstd,   // Only available if built with "ENABLE_ZSTD"
+    BucketCompression_Auto    // Parts are either raw or zstd, depending on their content (needs "ENABLE_ZSTD")
+  };
+
+  enum BucketPacking
+  {
+    BucketPacking_Identifier,  // Small instances are grouped by order of their Orthanc identifiers
+    BucketPacking_Locality,    // Small instances are grouped by order of patient, study and series
+    BucketPacking_Balanced     // First-fit decreasing grouping, the largest buckets are sent first
+  };
+
+  enum CachePolicy
+  {
+    CachePolicy_LRU,
+    CachePolicy_SLRU,     // Segmented LRU
+    CachePolicy_TinyLFU   // Segmented LRU with frequency-based admission
   };
 
   unsigned int ConvertToMegabytes(uint64_t value);
@@ -80,6 +126,21 @@ namespace OrthancPlugins
 
   const char* EnumerationToString(BucketCompression compression);
 
+  // Tells whether this build of the plugin can compress and
+  // uncompress buckets with the given method
+  bool IsBucketCompressionSupported(BucketCompression compression);
+
+  // Lists the compression methods that are supported by this build
+  void ListSupportedBucketCompressions(Json::Value& target);
+
+  BucketPacking StringToBucketPacking(const std::string& value);
+
+  const char* EnumerationToString(BucketPacking packing);
+
+  CachePolicy StringToCachePolicy(const std::string& value);
+
+  const char* EnumerationToString(CachePolicy policy);
+
   bool DoPostPeer(Json::Value& answer,
                   const OrthancPeers& peers,
                   size_t peerIndex,
@@ -115,6 +176,32 @@ namespace OrthancPlugins
                   unsigned int maxRetries,
                   const std::map<std::string, std::string>& headers);
 
+  bool DoGetPeer(Json::Value& answer,
+                 const OrthancPeers& peers,
+                 size_t peerIndex,
+                 const std::string& uri,
+                 unsigned int maxRetries,
+                 const std::map<std::string, std::string>& headers);
+
+  // Returns the compression method to be used with a peer: If the
+  // requested method is not supported by both sides (e.g. the peer
+  // runs an older version of the plugin), it is replaced by gzip
+  BucketCompression NegotiateBucketCompression(const OrthancPeers& peers,
+                                               size_t peerIndex,
+                                               BucketCompression requested,
+                                               const std::map<std::string, std::string>& headers);
+
+  // Returns the ID of the zstd dictionary to be used with a peer, or
+  // zero if no dictionary is to be used. In push mode, the current
+  // local dictionary is uploaded to the peer if it doesn't have it
+  // yet. In pull mode, the current dictionary of the peer is
+  // downloaded if it is unknown locally.
+  uint32_t NegotiateCompressionDictionary(const OrthancPeers& peers,
+                                          size_t peerIndex,
+                                          BucketCompression compression,
+                                          bool push,
+                                          const std::map<std::string, std::string>& headers);
+
   bool DoDeletePeer(const OrthancPeers& peers,
                     size_t peerIndex,
                     const std::string& uri,
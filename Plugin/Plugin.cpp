@@ -19,19 +19,21 @@
  **/
 
 #include "PluginContext.h"
+#include "../Framework/CompressionLevelController.h"
 #include "../Framework/HttpQueries/DetectTransferPlugin.h"
 #include "../Framework/PullMode/PullJob.h"
 #include "../Framework/PushMode/PushJob.h"
+#include "../Framework/TransferManifest.h"
 #include "../Framework/TransferScheduler.h"
 
 #include <EmbeddedResources.h>
 
 #include <Compatibility.h>  // For std::unique_ptr
-#include <ChunkedBuffer.h>
-#include <Compression/GzipCompressor.h>
 #include <Logging.h>
 #include <Toolbox.h>
 
+#include <boost/algorithm/string/predicate.hpp>
+
 
 static bool DisplayPerformanceWarning()
 {
@@ -65,6 +67,109 @@ static size_t ReadSizeArgument(const OrthancPluginHttpRequest* request,
 }
 
 
+// If "digest" is true, the MD5 of the answer is sent as an HTTP
+// header, so that the receiver can reject a bucket that was corrupted
+// during the transfer
+static void AnswerBucketBuffer(OrthancPluginRestOutput* output,
+                               const void* data,
+                               size_t size,
+                               const char* mimeType,
+                               bool digest)
+{
+  if (digest)
+  {
+    std::string md5;
+    Orthanc::Toolbox::ComputeMD5(md5, data, size);
+    OrthancPluginSetHttpHeader(OrthancPlugins::GetGlobalContext(), output, HEADER_KEY_BUCKET_MD5, md5.c_str());
+  }
+
+  OrthancPluginAnswerBuffer(OrthancPlugins::GetGlobalContext(), output, data, size, mimeType);
+}
+
+
+// Compresses the bucket, or reuses its payload from the cache, and
+// sends the time spent in the compression as an HTTP header if
+// "digest" is true, which allows the receiver to adapt the compression
+// level to the bottleneck of the transfer. For a cached payload, this
+// is the time of its original compression, i.e. the cost of the level.
+static void AnswerCompressedBucket(OrthancPluginRestOutput* output,
+                                   const OrthancPlugins::BucketContent& content,
+                                   OrthancPlugins::BucketCompression compression,
+                                   int level,
+                                   OrthancPlugins::CompressionDictionaries::Dictionary* dictionary,
+                                   const char* mimeType,
+                                   bool digest)
+{
+  OrthancPlugins::CompressedBucketsCache::PayloadPtr payload =
+    OrthancPlugins::PluginContext::GetInstance().GetCompressedCache().Compress(content, compression, level, dictionary);
+
+  const std::string& data = payload->GetData();
+
+  if (digest)
+  {
+    const std::string elapsed = boost::lexical_cast<std::string>(
+      static_cast<int64_t>(payload->GetCompressionTime() * 1000000.0));
+    OrthancPluginSetHttpHeader(OrthancPlugins::GetGlobalContext(), output, HEADER_KEY_COMPRESSION_TIME, elapsed.c_str());
+
+    // The MD5 of the cached payloads was computed once for all
+    std::string md5;
+    if (payload->LookupMD5(md5))
+    {
+      OrthancPluginSetHttpHeader(OrthancPlugins::GetGlobalContext(), output, HEADER_KEY_BUCKET_MD5, md5.c_str());
+      OrthancPluginAnswerBuffer(OrthancPlugins::GetGlobalContext(), output, data.c_str(), data.size(), mimeType);
+      return;
+    }
+  }
+
+  AnswerBucketBuffer(output, data.c_str(), data.size(), mimeType, digest);
+}
+
+
+static void AnswerBucketContent(OrthancPluginRestOutput* output,
+                                const OrthancPlugins::BucketContent& content,
+                                OrthancPlugins::BucketCompression compression,
+                                int level,
+                                OrthancPlugins::CompressionDictionaries::Dictionary* dictionary,
+                                bool digest)
+{
+  switch (compression)
+  {
+    case OrthancPlugins::BucketCompression_None:
+    {
+      if (content.GetSlicesCount() == 1)
+      {
+        // The bucket lies within a single instance: Answer directly
+        // from the cache, without any copy
+        const OrthancPlugins::BucketContent::Slice& slice = content.GetSlice(0);
+        AnswerBucketBuffer(output, slice.GetData(), slice.GetSize(), "application/octet-stream", digest);
+      }
+      else
+      {
+        std::string chunk;
+        content.Flatten(chunk);
+        AnswerBucketBuffer(output, chunk.c_str(), chunk.size(), "application/octet-stream", digest);
+      }
+      break;
+    }
+
+    case OrthancPlugins::BucketCompression_Gzip:
+      AnswerCompressedBucket(output, content, compression, level, dictionary, "application/gzip", digest);
+      break;
+
+    case OrthancPlugins::BucketCompression_Zstd:
+      AnswerCompressedBucket(output, content, compression, level, dictionary, "application/zstd", digest);
+      break;
+
+    case OrthancPlugins::BucketCompression_Auto:
+      AnswerCompressedBucket(output, content, compression, level, dictionary, MIME_AUTO_BUCKET, digest);
+      break;
+
+    default:
+      throw Orthanc::OrthancException(Orthanc::ErrorCode_InternalError);
+  }
+}
+
+
 void ServeChunks(OrthancPluginRestOutput* output,
                  const char* url,
                  const OrthancPluginHttpRequest* request)
@@ -112,10 +217,10 @@ void ServeChunks(OrthancPluginRestOutput* output,
   // Limit the number of clients
   Orthanc::Semaphore::Locker lock(context.GetSemaphore());
 
-  Orthanc::ChunkedBuffer buffer;
+  OrthancPlugins::BucketContent content;
 
   for (size_t i = 0; i < instances.size() && (requestedSize == 0 ||
-                                              buffer.GetNumBytes() < requestedSize); i++)
+                                              content.GetSize() < requestedSize); i++)
   {
     size_t instanceSize;
 
@@ -138,7 +243,7 @@ void ServeChunks(OrthancPluginRestOutput* output,
       }
       else
       {
-        toRead = requestedSize - buffer.GetNumBytes();
+        toRead = requestedSize - content.GetSize();
 
         if (toRead > instanceSize - offset)
         {
@@ -146,48 +251,17 @@ void ServeChunks(OrthancPluginRestOutput* output,
         }
       }
 
-      std::string chunk;
-
-      {
-        std::string md5;  // Ignored
-        context.GetCache().GetChunk(chunk, md5, instances[i], offset, toRead);
-      }
-        
-      buffer.AddChunk(chunk);
+      context.GetPrefetcher().NotifyAccess(instances[i]);
+      context.GetCache().AddChunk(content, instances[i], offset, toRead);
       offset = 0;
 
       assert(requestedSize == 0 ||
-             buffer.GetNumBytes() <= requestedSize);
+             content.GetSize() <= requestedSize);
     }
   }
 
-  std::string chunk;
-  buffer.Flatten(chunk);
-  
-
-  switch (compression)
-  {
-    case OrthancPlugins::BucketCompression_None:
-    {
-      OrthancPluginAnswerBuffer(OrthancPlugins::GetGlobalContext(), output, chunk.c_str(),
-                                chunk.size(), "application/octet-stream");
-      break;
-    }
-
-    case OrthancPlugins::BucketCompression_Gzip:
-    {
-      std::string compressed;
-      Orthanc::GzipCompressor gzip;
-      //gzip.SetCompressionLevel(9);
-      Orthanc::IBufferCompressor::Compress(compressed, gzip, chunk);
-      OrthancPluginAnswerBuffer(OrthancPlugins::GetGlobalContext(), output, compressed.c_str(),
-                                compressed.size(), "application/gzip");
-      break;
-    }
-
-    default:
-      throw Orthanc::OrthancException(Orthanc::ErrorCode_InternalError);
-  }
+  // The answer headers are not available for GET queries
+  AnswerBucketContent(output, content, compression, 0, NULL, false);
 }
 
 
@@ -212,6 +286,132 @@ static bool ParsePostBody(Json::Value& body,
 }
 
 
+void ServeChunksBody(OrthancPluginRestOutput* output,
+                     const char* url,
+                     const OrthancPluginHttpRequest* request)
+{
+  OrthancPlugins::PluginContext& context = OrthancPlugins::PluginContext::GetInstance();
+
+  Json::Value body;
+  if (!ParsePostBody(body, output, request))
+  {
+    return;
+  }
+
+  if (body.type() != Json::objectValue ||
+      !body.isMember(KEY_CHUNKS) ||
+      !body.isMember(KEY_COMPRESSION) ||
+      body[KEY_COMPRESSION].type() != Json::stringValue)
+  {
+    throw Orthanc::OrthancException(Orthanc::ErrorCode_BadFileFormat);
+  }
+
+  const OrthancPlugins::TransferBucket bucket(body[KEY_CHUNKS]);
+  const OrthancPlugins::BucketCompression compression =
+    OrthancPlugins::StringToBucketCompression(body[KEY_COMPRESSION].asString());
+
+  // The level is chosen by the receiver, if it adapts it to the
+  // bottleneck of the transfer
+  int level = 0;
+  if (body.isMember(KEY_COMPRESSION_LEVEL))
+  {
+    if (!body[KEY_COMPRESSION_LEVEL].isInt())
+    {
+      throw Orthanc::OrthancException(Orthanc::ErrorCode_BadFileFormat);
+    }
+
+    level = OrthancPlugins::CompressionLevelController::ClampLevel(compression, body[KEY_COMPRESSION_LEVEL].asInt());
+  }
+
+  // The dictionary was exchanged when the transfer was negotiated
+  OrthancPlugins::CompressionDictionaries::DictionaryPtr dictionary;
+  if (body.isMember(KEY_DICTIONARY))
+  {
+    if (!body[KEY_DICTIONARY].isUInt())
+    {
+      throw Orthanc::OrthancException(Orthanc::ErrorCode_BadFileFormat);
+    }
+
+    const uint32_t id = body[KEY_DICTIONARY].asUInt();
+    dictionary = OrthancPlugins::CompressionDictionaries::Lookup(id);
+
+    if (dictionary.get() == NULL)
+    {
+      throw Orthanc::OrthancException(Orthanc::ErrorCode_UnknownResource,
+                                      "Unknown compression dictionary: " + boost::lexical_cast<std::string>(id));
+    }
+  }
+
+  // The peer announces the lookup of its instances, whose pins are
+  // held until all the chunks of each instance have been served
+  std::string lookup;
+  for (uint32_t i = 0; i < request->headersCount; i++)
+  {
+    if (std::string(request->headersKeys[i]) == HEADER_KEY_LOOKUP)
+    {
+      lookup = request->headersValues[i];
+    }
+  }
+
+  // Limit the number of clients
+  Orthanc::Semaphore::Locker lock(context.GetSemaphore());
+
+  OrthancPlugins::ActiveLookups::BucketPins pins(context.GetActiveLookups(), lookup, bucket);
+
+  context.GetPrefetcher().NotifyAccess(bucket);
+
+  OrthancPlugins::BucketContent content;
+  context.GetCache().ReadBucket(content, bucket);
+
+  AnswerBucketContent(output, content, compression, level, dictionary.get(), true);
+}
+
+
+// The pulling peers announce the size and the packing of their
+// buckets, so that the instances are read ahead in the order of the
+// buckets. The peers with an older version of the plugin don't, in
+// which case "bucketSize" is set to zero. This is only a hint for the
+// read-ahead, hence the values that cannot be parsed are ignored.
+static void GetPullPlanning(size_t& bucketSize,
+                            OrthancPlugins::BucketPacking& packing,
+                            const OrthancPluginHttpRequest* request)
+{
+  bucketSize = 0;
+  packing = OrthancPlugins::BucketPacking_Locality;
+
+  std::string size, packingName;
+  for (uint32_t i = 0; i < request->headersCount; i++)
+  {
+    if (std::string(request->headersKeys[i]) == HEADER_KEY_BUCKET_SIZE)
+    {
+      size = request->headersValues[i];
+    }
+    else if (std::string(request->headersKeys[i]) == HEADER_KEY_BUCKET_PACKING)
+    {
+      packingName = request->headersValues[i];
+    }
+  }
+
+  if (!size.empty() &&
+      !packingName.empty())
+  {
+    try
+    {
+      packing = OrthancPlugins::StringToBucketPacking(packingName);
+      bucketSize = boost::lexical_cast<size_t>(size);
+    }
+    catch (Orthanc::OrthancException&)
+    {
+      bucketSize = 0;
+    }
+    catch (boost::bad_lexical_cast&)
+    {
+      bucketSize = 0;
+    }
+  }
+}
+
+
 void LookupInstances(OrthancPluginRestOutput* output,
                      const char* url,
                      const OrthancPluginHttpRequest* request)
@@ -225,7 +425,7 @@ void LookupInstances(OrthancPluginRestOutput* output,
   }
   
   OrthancPlugins::TransferScheduler scheduler;
-  scheduler.ParseListOfResources(context.GetCache(), resources);
+  scheduler.ParseListOfResources(context.GetCache(), resources, context.GetThreadsCount());
 
   Json::Value answer = Json::objectValue;
   answer[KEY_INSTANCES] = Json::arrayValue;
@@ -243,6 +443,16 @@ void LookupInstances(OrthancPluginRestOutput* output,
     instances[i].Serialize(instance);
     answer[KEY_INSTANCES].append(instance);
   }
+
+  // The pulling peer is about to download the buckets of these
+  // instances: Read them ahead of its requests for chunks
+  size_t bucketSize;
+  OrthancPlugins::BucketPacking packing;
+  GetPullPlanning(bucketSize, packing, request);
+
+  std::vector<std::string> plan;
+  OrthancPlugins::InstancesPrefetcher::ListPullInstances(plan, scheduler, bucketSize, packing);
+  context.GetPrefetcher().AddPlan(plan);
   
   std::string s;
   Orthanc::Toolbox::WriteFastJson(s, answer);  
@@ -251,6 +461,97 @@ void LookupInstances(OrthancPluginRestOutput* output,
 
 
 
+void CreateLookup(OrthancPluginRestOutput* output,
+                  const char* url,
+                  const OrthancPluginHttpRequest* request)
+{
+  OrthancPlugins::PluginContext& context = OrthancPlugins::PluginContext::GetInstance();
+  
+  Json::Value resources;
+  if (!ParsePostBody(resources, output, request))
+  {
+    return;
+  }
+
+  size_t bucketSize;
+  OrthancPlugins::BucketPacking packing;
+  GetPullPlanning(bucketSize, packing, request);
+
+  std::string id = context.GetActiveLookups().CreateLookup(resources, bucketSize, packing);
+
+  Json::Value result = Json::objectValue;
+  result[KEY_ID] = id;
+  result[KEY_PATH] = std::string(URI_LOOKUPS) + "/" + id;
+  result[KEY_ORIGINATOR_UUID] = context.GetPluginUuid();
+
+  std::string s = result.toStyledString();
+  OrthancPluginAnswerBuffer(OrthancPlugins::GetGlobalContext(), output, s.c_str(), s.size(), "application/json");
+}
+
+
+void ServeLookupPage(OrthancPluginRestOutput* output,
+                     const char* url,
+                     const OrthancPluginHttpRequest* request)
+{
+  // Time during which the request waits for new instances, so that
+  // the pulling peer does not have to poll in a tight loop
+  static const unsigned int PAGE_TIMEOUT_MS = 1000;
+
+  OrthancPlugins::PluginContext& context = OrthancPlugins::PluginContext::GetInstance();
+  
+  if (request->method != OrthancPluginHttpMethod_Get)
+  {
+    OrthancPluginSendMethodNotAllowed(OrthancPlugins::GetGlobalContext(), output, "GET");
+    return;
+  }
+
+  assert(request->groupsCount == 2);
+  std::string lookup(request->groups[0]);
+  std::string since(request->groups[1]);
+
+  size_t position;
+  
+  try
+  {
+    position = boost::lexical_cast<size_t>(since);
+  }
+  catch (boost::bad_lexical_cast&)
+  {
+    throw Orthanc::OrthancException(Orthanc::ErrorCode_UnknownResource);
+  }
+
+  Json::Value answer;
+  context.GetActiveLookups().GetPage(answer, lookup, position, PAGE_TIMEOUT_MS);
+
+  std::string s;
+  Orthanc::Toolbox::WriteFastJson(s, answer);  
+  OrthancPluginAnswerBuffer(OrthancPlugins::GetGlobalContext(), output, s.c_str(), s.size(), "application/json");
+}
+
+
+void DeleteLookup(OrthancPluginRestOutput* output,
+                  const char* url,
+                  const OrthancPluginHttpRequest* request)
+{
+  OrthancPlugins::PluginContext& context = OrthancPlugins::PluginContext::GetInstance();
+  
+  if (request->method != OrthancPluginHttpMethod_Delete)
+  {
+    OrthancPluginSendMethodNotAllowed(OrthancPlugins::GetGlobalContext(), output, "DELETE");
+    return;
+  }
+
+  assert(request->groupsCount == 1);
+  std::string lookup(request->groups[0]);
+
+  context.GetActiveLookups().Remove(lookup);
+
+  std::string s = "{}";
+  OrthancPluginAnswerBuffer(OrthancPlugins::GetGlobalContext(), output, s.c_str(), s.size(), "application/json");
+}
+
+
+
 static void SubmitJob(OrthancPluginRestOutput* output,
                       OrthancPlugins::OrthancJob* job,
                       int priority)
@@ -271,7 +572,7 @@ void SchedulePull(OrthancPluginRestOutput* output,
                   const char* url,
                   const OrthancPluginHttpRequest* request)
 {
-  const OrthancPlugins::PluginContext& context = OrthancPlugins::PluginContext::GetInstance();
+  OrthancPlugins::PluginContext& context = OrthancPlugins::PluginContext::GetInstance();
   
   Json::Value body;
   if (!ParsePostBody(body, output, request))
@@ -281,60 +582,88 @@ void SchedulePull(OrthancPluginRestOutput* output,
 
   OrthancPlugins::TransferQuery query(body);
 
-  SubmitJob(output, new OrthancPlugins::PullJob(query, context.GetThreadsCount(),
+  SubmitJob(output, new OrthancPlugins::PullJob(query, context.GetCache(),
+                                                context.GetBandwidthDelayEstimator(),
+                                                context.GetThreadsCount(),
                                                 context.GetTargetBucketSize(),
+                                                context.GetBucketPacking(),
                                                 context.GetMaxHttpRetries()),
             query.GetPriority());
 }
 
 
 
+static bool HasContentType(const OrthancPluginHttpRequest* request,
+                           const std::string& mime)
+{
+  for (uint32_t i = 0; i < request->headersCount; i++)
+  {
+    // The keys of the HTTP headers are converted to lower case by Orthanc
+    if (std::string(request->headersKeys[i]) == "content-type")
+    {
+      return boost::starts_with(std::string(request->headersValues[i]), mime);
+    }
+  }
+
+  return false;
+}
+
+
 void CreatePush(OrthancPluginRestOutput* output,
                 const char* url,
                 const OrthancPluginHttpRequest* request)
 {
   OrthancPlugins::PluginContext& context = OrthancPlugins::PluginContext::GetInstance();
-  
-  Json::Value query;
-  if (!ParsePostBody(query, output, request))
+
+  std::vector<OrthancPlugins::DicomInstanceInfo> instances;
+  std::vector<OrthancPlugins::TransferBucket> buckets;
+  OrthancPlugins::BucketCompression compression;
+
+  if (request->method == OrthancPluginHttpMethod_Post &&
+      HasContentType(request, MIME_BINARY_MANIFEST))
   {
-    return;
+    OrthancPlugins::ReadBinaryManifest(instances, buckets, compression, request->body, request->bodySize);
   }
-  
-  if (query.type() != Json::objectValue ||
-      !query.isMember(KEY_BUCKETS) ||
-      !query.isMember(KEY_COMPRESSION) ||
-      !query.isMember(KEY_INSTANCES) ||
-      query[KEY_BUCKETS].type() != Json::arrayValue ||
-      query[KEY_COMPRESSION].type() != Json::stringValue ||
-      query[KEY_INSTANCES].type() != Json::arrayValue)
+  else
   {
-    throw Orthanc::OrthancException(Orthanc::ErrorCode_BadFileFormat);
-  }
+    Json::Value query;
+    if (!ParsePostBody(query, output, request))
+    {
+      return;
+    }
 
-  std::vector<OrthancPlugins::DicomInstanceInfo> instances;
-  instances.reserve(query[KEY_INSTANCES].size());
-  
-  for (Json::Value::ArrayIndex i = 0; i < query[KEY_INSTANCES].size(); i++)
-  {
-    OrthancPlugins::DicomInstanceInfo instance(query[KEY_INSTANCES][i]);
-    instances.push_back(instance);
+    OrthancPlugins::ReadJsonManifest(instances, buckets, compression, query);
   }
 
-  std::vector<OrthancPlugins::TransferBucket> buckets;
-  buckets.reserve(query[KEY_BUCKETS].size());
-  
-  for (Json::Value::ArrayIndex i = 0; i < query[KEY_BUCKETS].size(); i++)
+  // The dictionary that was uploaded by the peer for this transaction
+  OrthancPlugins::CompressionDictionaries::DictionaryPtr dictionary;
+  for (uint32_t i = 0; i < request->headersCount; i++)
   {
-    OrthancPlugins::TransferBucket bucket(query[KEY_BUCKETS][i]);
-    buckets.push_back(bucket);
+    if (std::string(request->headersKeys[i]) == HEADER_KEY_DICTIONARY)
+    {
+      uint32_t id;
+
+      try
+      {
+        id = boost::lexical_cast<uint32_t>(request->headersValues[i]);
+      }
+      catch (boost::bad_lexical_cast&)
+      {
+        throw Orthanc::OrthancException(Orthanc::ErrorCode_BadFileFormat);
+      }
+
+      dictionary = OrthancPlugins::CompressionDictionaries::Lookup(id);
+
+      if (dictionary.get() == NULL)
+      {
+        throw Orthanc::OrthancException(Orthanc::ErrorCode_UnknownResource,
+                                        "Unknown compression dictionary: " + boost::lexical_cast<std::string>(id));
+      }
+    }
   }
 
-  OrthancPlugins::BucketCompression compression =
-    OrthancPlugins::StringToBucketCompression(query[KEY_COMPRESSION].asString());
-                                              
   std::string id = context.GetActivePushTransactions().CreateTransaction
-    (instances, buckets, compression);
+    (instances, buckets, compression, dictionary);
   
   Json::Value result = Json::objectValue;
   result[KEY_ID] = id;
@@ -345,6 +674,42 @@ void CreatePush(OrthancPluginRestOutput* output,
 }
 
 
+// Tells the pushing peer which instances are already stored with the
+// same content, and thus don't need to be sent again
+void FilterStoredInstances(OrthancPluginRestOutput* output,
+                           const char* url,
+                           const OrthancPluginHttpRequest* request)
+{
+  OrthancPlugins::PluginContext& context = OrthancPlugins::PluginContext::GetInstance();
+
+  if (request->method != OrthancPluginHttpMethod_Post)
+  {
+    OrthancPluginSendMethodNotAllowed(OrthancPlugins::GetGlobalContext(), output, "POST");
+    return;
+  }
+
+  std::vector<OrthancPlugins::DicomInstanceInfo> instances;
+  std::vector<OrthancPlugins::TransferBucket> buckets;  // Ignored
+  OrthancPlugins::BucketCompression compression;        // Ignored
+  OrthancPlugins::ReadBinaryManifest(instances, buckets, compression, request->body, request->bodySize);
+
+  Json::Value answer = Json::objectValue;
+  answer[KEY_STORED] = Json::arrayValue;
+
+  for (size_t i = 0; i < instances.size(); i++)
+  {
+    if (context.GetCache().IsInstanceStored(instances[i]))
+    {
+      answer[KEY_STORED].append(static_cast<uint32_t>(i));
+    }
+  }
+
+  std::string s;
+  Orthanc::Toolbox::WriteFastJson(s, answer);
+  OrthancPluginAnswerBuffer(OrthancPlugins::GetGlobalContext(), output, s.c_str(), s.size(), "application/json");
+}
+
+
 void StorePush(OrthancPluginRestOutput* output,
                const char* url,
                const OrthancPluginHttpRequest* request)
@@ -372,8 +737,37 @@ void StorePush(OrthancPluginRestOutput* output,
     throw Orthanc::OrthancException(Orthanc::ErrorCode_UnknownResource);
   }
 
-  context.GetActivePushTransactions().Store
-    (transaction, chunkIndex, request->body, request->bodySize);
+  // The senders with an older version of the plugin don't send the
+  // digest of the bucket
+  std::string md5;
+  for (uint32_t i = 0; i < request->headersCount; i++)
+  {
+    if (std::string(request->headersKeys[i]) == HEADER_KEY_BUCKET_MD5)
+    {
+      md5 = request->headersValues[i];
+    }
+  }
+
+  try
+  {
+    context.GetActivePushTransactions().Store
+      (transaction, chunkIndex, request->body, request->bodySize, md5);
+  }
+  catch (Orthanc::OrthancException& e)
+  {
+    if (e.GetErrorCode() == Orthanc::ErrorCode_CorruptedFile)
+    {
+      // Distinguishes the corrupted buckets from the other errors, so
+      // that the sender retries them even if its "MaxHttpRetries" is 0
+      LOG(WARNING) << "Received a corrupted bucket in push transaction " << transaction << ": " << e.What();
+      OrthancPluginSendHttpStatusCode(OrthancPlugins::GetGlobalContext(), output, HTTP_STATUS_CORRUPTED_BUCKET);
+      return;
+    }
+    else
+    {
+      throw;
+    }
+  }
 
   std::string s = "{}";
   OrthancPluginAnswerBuffer(OrthancPlugins::GetGlobalContext(), output, s.c_str(), s.size(), "application/json");
@@ -489,15 +883,69 @@ void ScheduleSend(OrthancPluginRestOutput* output,
   }
   else
   {
-    SubmitJob(output, new OrthancPlugins::PushJob(query, context.GetCache(),
+    SubmitJob(output, new OrthancPlugins::PushJob(query, context.GetCache(), context.GetCompressedCache(), context.GetPrefetcher(),
+                                                  context.GetBandwidthDelayEstimator(),
                                                   context.GetThreadsCount(),
                                                   context.GetTargetBucketSize(),
+                                                  context.GetBucketPacking(),
                                                   context.GetMaxHttpRetries(),
                                                   context.GetPeerCommitTimeout()),
               query.GetPriority());
   }
 }
 
+static OrthancPluginErrorCode OnStoredInstance(const OrthancPluginDicomInstance* instance,
+                                               const char* instanceId)
+{
+  try
+  {
+    OrthancPlugins::PluginContext& context = OrthancPlugins::PluginContext::GetInstance();
+
+    // The instance might have been stored again with another content
+    context.InvalidateInstance(instanceId);
+
+    // By default, the index is filled lazily from the attachment
+    // information, which avoids hashing every ingested instance
+    if (context.IsIndexStoredInstances())
+    {
+      int64_t size = OrthancPluginGetInstanceSize(OrthancPlugins::GetGlobalContext(), instance);
+      const void* data = OrthancPluginGetInstanceData(OrthancPlugins::GetGlobalContext(), instance);
+
+      if (size > 0 &&
+          data != NULL)
+      {
+        std::string md5;
+        Orthanc::Toolbox::ComputeMD5(md5, data, static_cast<size_t>(size));
+
+        context.GetCache().GetInfoIndex().Register(
+          OrthancPlugins::DicomInstanceInfo(instanceId, static_cast<size_t>(size), md5));
+      }
+    }
+  }
+  catch (Orthanc::OrthancException& e)
+  {
+    // Not a fatal error, the instance will be read during the lookup
+    LOG(WARNING) << "Cannot index the stored instance " << instanceId << ": " << e.What();
+  }
+
+  return OrthancPluginErrorCode_Success;
+}
+
+
+static OrthancPluginErrorCode OnChange(OrthancPluginChangeType changeType,
+                                       OrthancPluginResourceType resourceType,
+                                       const char* resourceId)
+{
+  if (changeType == OrthancPluginChangeType_Deleted &&
+      resourceType == OrthancPluginResourceType_Instance)
+  {
+    OrthancPlugins::PluginContext::GetInstance().InvalidateInstance(resourceId);
+  }
+
+  return OrthancPluginErrorCode_Success;
+}
+
+
 void RefreshMetricsCallback()
 {
   OrthancPlugins::PluginContext& context = OrthancPlugins::PluginContext::GetInstance();
@@ -517,6 +965,90 @@ void RefreshMetricsCallback()
                                       static_cast<int64_t>(context.GetCache().GetCacheMissCount()),
                                       OrthancPluginMetricsType_Default);
 
+  OrthancPluginSetMetricsIntegerValue(OrthancPlugins::GetGlobalContext(), 
+                                      "orthanc_transfers_cache_merged_loads_count", 
+                                      static_cast<int64_t>(context.GetCache().GetMergedLoadsCount()),
+                                      OrthancPluginMetricsType_Default);
+
+  OrthancPluginSetMetricsIntegerValue(OrthancPlugins::GetGlobalContext(), 
+                                      "orthanc_transfers_cache_rejected_count", 
+                                      static_cast<int64_t>(context.GetCache().GetRejectedCount()),
+                                      OrthancPluginMetricsType_Default);
+
+  OrthancPluginSetMetricsIntegerValue(OrthancPlugins::GetGlobalContext(), 
+                                      "orthanc_transfers_cache_pinned_size", 
+                                      static_cast<int64_t>(context.GetCache().GetPinnedSize()),
+                                      OrthancPluginMetricsType_Default);
+
+  if (context.GetCache().HasDiskCache())
+  {
+    OrthancPlugins::DiskInstancesCache& disk = context.GetCache().GetDiskCache();
+
+    OrthancPluginSetMetricsIntegerValue(OrthancPlugins::GetGlobalContext(), 
+                                        "orthanc_transfers_disk_cache_size", 
+                                        static_cast<int64_t>(disk.GetSize()),
+                                        OrthancPluginMetricsType_Default);
+
+    OrthancPluginSetMetricsIntegerValue(OrthancPlugins::GetGlobalContext(), 
+                                        "orthanc_transfers_disk_cache_hit_count", 
+                                        static_cast<int64_t>(disk.GetHitCount()),
+                                        OrthancPluginMetricsType_Default);
+
+    OrthancPluginSetMetricsIntegerValue(OrthancPlugins::GetGlobalContext(), 
+                                        "orthanc_transfers_disk_cache_miss_count", 
+                                        static_cast<int64_t>(disk.GetMissCount()),
+                                        OrthancPluginMetricsType_Default);
+  }
+
+  {
+    size_t prefetchCount, prefetchHitCount, wastedPrefetchCount;
+    context.GetCache().GetPrefetchStatistics(prefetchCount, prefetchHitCount, wastedPrefetchCount);
+
+    OrthancPluginSetMetricsIntegerValue(OrthancPlugins::GetGlobalContext(), 
+                                        "orthanc_transfers_prefetch_count", 
+                                        static_cast<int64_t>(prefetchCount),
+                                        OrthancPluginMetricsType_Default);
+
+    OrthancPluginSetMetricsIntegerValue(OrthancPlugins::GetGlobalContext(), 
+                                        "orthanc_transfers_prefetch_hit_count", 
+                                        static_cast<int64_t>(prefetchHitCount),
+                                        OrthancPluginMetricsType_Default);
+
+    OrthancPluginSetMetricsIntegerValue(OrthancPlugins::GetGlobalContext(), 
+                                        "orthanc_transfers_prefetch_wasted_count", 
+                                        static_cast<int64_t>(wastedPrefetchCount),
+                                        OrthancPluginMetricsType_Default);
+  }
+
+  {
+    OrthancPlugins::CompressedBucketsCache& compressed = context.GetCompressedCache();
+
+    OrthancPluginSetMetricsIntegerValue(OrthancPlugins::GetGlobalContext(), 
+                                        "orthanc_transfers_compressed_cache_size", 
+                                        static_cast<int64_t>(compressed.GetSize()),
+                                        OrthancPluginMetricsType_Default);
+
+    OrthancPluginSetMetricsIntegerValue(OrthancPlugins::GetGlobalContext(), 
+                                        "orthanc_transfers_compressed_cache_hit_count", 
+                                        static_cast<int64_t>(compressed.GetHitCount()),
+                                        OrthancPluginMetricsType_Default);
+
+    OrthancPluginSetMetricsIntegerValue(OrthancPlugins::GetGlobalContext(), 
+                                        "orthanc_transfers_compressed_cache_miss_count", 
+                                        static_cast<int64_t>(compressed.GetMissCount()),
+                                        OrthancPluginMetricsType_Default);
+
+    OrthancPluginSetMetricsValue(OrthancPlugins::GetGlobalContext(), 
+                                 "orthanc_transfers_compressed_cache_hit_ratio", 
+                                 static_cast<float>(compressed.GetHitRatio()),
+                                 OrthancPluginMetricsType_Default);
+
+    OrthancPluginSetMetricsIntegerValue(OrthancPlugins::GetGlobalContext(), 
+                                        "orthanc_transfers_compressed_cache_saved_cpu_ms", 
+                                        static_cast<int64_t>(compressed.GetSavedCompressionTime() * 1000.0),
+                                        OrthancPluginMetricsType_Default);
+  }
+
   OrthancPluginSetMetricsIntegerValue(OrthancPlugins::GetGlobalContext(), 
                                       "orthanc_transfers_available_push_count", 
                                       static_cast<int64_t>(context.GetActivePushTransactions().GetAvailablePushTransactions()),
@@ -588,16 +1120,23 @@ OrthancPluginJob* Unserializer(const char* jobType,
       if (type == JOB_TYPE_PULL)
       {
         job.reset(new OrthancPlugins::PullJob(query,
+                                              context.GetCache(),
+                                              context.GetBandwidthDelayEstimator(),
                                               context.GetThreadsCount(),
                                               context.GetTargetBucketSize(),
+                                              context.GetBucketPacking(),
                                               context.GetMaxHttpRetries()));
       }
       else if (type == JOB_TYPE_PUSH)
       {
         job.reset(new OrthancPlugins::PushJob(query,
                                               context.GetCache(),
+                                              context.GetCompressedCache(),
+                                              context.GetPrefetcher(),
+                                              context.GetBandwidthDelayEstimator(),
                                               context.GetThreadsCount(),
                                               context.GetTargetBucketSize(),
+                                              context.GetBucketPacking(),
                                               context.GetMaxHttpRetries(),
                                               context.GetPeerCommitTimeout()));
       }
@@ -631,6 +1170,139 @@ OrthancPluginJob* Unserializer(const char* jobType,
 
 
 
+// Allows the peers to only request the compression methods that are
+// supported by this build of the plugin
+void ServeCompressions(OrthancPluginRestOutput* output,
+                       const char* url,
+                       const OrthancPluginHttpRequest* request)
+{
+  if (request->method != OrthancPluginHttpMethod_Get)
+  {
+    OrthancPluginSendMethodNotAllowed(OrthancPlugins::GetGlobalContext(), output, "GET");
+    return;
+  }
+
+  Json::Value answer;
+  OrthancPlugins::ListSupportedBucketCompressions(answer);
+
+  std::string s;
+  Orthanc::Toolbox::WriteFastJson(s, answer);
+  OrthancPluginAnswerBuffer(OrthancPlugins::GetGlobalContext(), output, s.c_str(), s.size(), "application/json");
+}
+
+
+// Lists the zstd dictionaries that are known to this peer (GET), or
+// registers a dictionary that is uploaded by a pushing peer (POST)
+void ServeDictionaries(OrthancPluginRestOutput* output,
+                       const char* url,
+                       const OrthancPluginHttpRequest* request)
+{
+  // Far above the size of the dictionaries that are trained locally
+  static const size_t MAX_DICTIONARY_SIZE = 1 * MB;
+
+  Json::Value answer = Json::objectValue;
+
+  if (request->method == OrthancPluginHttpMethod_Get)
+  {
+    OrthancPlugins::CompressionDictionaries::DictionaryPtr current =
+      OrthancPlugins::CompressionDictionaries::GetCurrent();
+
+    std::vector<uint32_t> ids;
+    OrthancPlugins::CompressionDictionaries::ListDictionaries(ids);
+
+    answer[KEY_CURRENT] = (current.get() == NULL ? 0 : current->GetId());
+    answer[KEY_DICTIONARIES] = Json::arrayValue;
+
+    for (size_t i = 0; i < ids.size(); i++)
+    {
+      answer[KEY_DICTIONARIES].append(ids[i]);
+    }
+
+    answer["Samples"] = static_cast<unsigned int>(OrthancPlugins::CompressionDictionaries::GetSamplesCount());
+  }
+  else if (request->method == OrthancPluginHttpMethod_Post)
+  {
+    Json::Value body;
+    if (!ParsePostBody(body, output, request))
+    {
+      return;
+    }
+
+    if (body.type() != Json::objectValue ||
+        !body.isMember(KEY_CONTENT) ||
+        body[KEY_CONTENT].type() != Json::stringValue ||
+        body[KEY_CONTENT].asString().size() > MAX_DICTIONARY_SIZE * 4 / 3 + 4)
+    {
+      throw Orthanc::OrthancException(Orthanc::ErrorCode_BadFileFormat);
+    }
+
+    if (!OrthancPlugins::CompressionDictionaries::IsSupported())
+    {
+      throw Orthanc::OrthancException(Orthanc::ErrorCode_NotImplemented,
+                                      "This build of the transfers accelerator doesn't support zstd");
+    }
+
+    std::string content;
+    Orthanc::Toolbox::DecodeBase64(content, body[KEY_CONTENT].asString());
+
+    answer[KEY_ID] = OrthancPlugins::CompressionDictionaries::Register(content)->GetId();
+  }
+  else
+  {
+    OrthancPluginSendMethodNotAllowed(OrthancPlugins::GetGlobalContext(), output, "GET,POST");
+    return;
+  }
+
+  std::string s;
+  Orthanc::Toolbox::WriteFastJson(s, answer);
+  OrthancPluginAnswerBuffer(OrthancPlugins::GetGlobalContext(), output, s.c_str(), s.size(), "application/json");
+}
+
+
+void ServeDictionary(OrthancPluginRestOutput* output,
+                     const char* url,
+                     const OrthancPluginHttpRequest* request)
+{
+  if (request->method != OrthancPluginHttpMethod_Get)
+  {
+    OrthancPluginSendMethodNotAllowed(OrthancPlugins::GetGlobalContext(), output, "GET");
+    return;
+  }
+
+  assert(request->groupsCount == 1);
+
+  uint32_t id;
+
+  try
+  {
+    id = boost::lexical_cast<uint32_t>(request->groups[0]);
+  }
+  catch (boost::bad_lexical_cast&)
+  {
+    throw Orthanc::OrthancException(Orthanc::ErrorCode_UnknownResource);
+  }
+
+  OrthancPlugins::CompressionDictionaries::DictionaryPtr dictionary =
+    OrthancPlugins::CompressionDictionaries::Lookup(id);
+
+  if (dictionary.get() == NULL)
+  {
+    throw Orthanc::OrthancException(Orthanc::ErrorCode_UnknownResource);
+  }
+
+  std::string encoded;
+  Orthanc::Toolbox::EncodeBase64(encoded, dictionary->GetContent());
+
+  Json::Value answer = Json::objectValue;
+  answer[KEY_ID] = id;
+  answer[KEY_CONTENT] = encoded;
+
+  std::string s;
+  Orthanc::Toolbox::WriteFastJson(s, answer);
+  OrthancPluginAnswerBuffer(OrthancPlugins::GetGlobalContext(), output, s.c_str(), s.size(), "application/json");
+}
+
+
 void ServePeers(OrthancPluginRestOutput* output,
                 const char* url,
                 const OrthancPluginHttpRequest* request)
@@ -718,6 +1390,16 @@ extern "C"
       unsigned int peerConnectivityTimeout = 2;
       unsigned int peerCommitTimeout = 600;
       unsigned int commitThreadsCount = 1;
+
+      // The sizes of the options are configured in KB or MB
+      OrthancPlugins::PluginContext::Options options;
+      size_t minBucketSize = options.minBucketSize_ / KB;
+      size_t maxBucketSize = options.maxBucketSize_ / KB;
+      size_t diskCacheSize = options.diskCacheSize_ / MB;
+      size_t rangeReadThreshold = options.rangeReadThreshold_ / MB;
+      size_t rangeReadPageSize = options.rangeReadPageSize_ / KB;
+      size_t compressionBlockSize = options.compressionBlockSize_ / KB;
+      size_t compressedCacheSize = options.compressedCacheSize_ / MB;
     
       {
         OrthancPlugins::OrthancConfiguration config;
@@ -729,12 +1411,35 @@ extern "C"
 
           threadsCount = plugin.GetUnsignedIntegerValue("Threads", threadsCount);
           targetBucketSize = plugin.GetUnsignedIntegerValue("BucketSize", targetBucketSize);
+          options.bucketPacking_ = OrthancPlugins::StringToBucketPacking(
+            plugin.GetStringValue("BucketPacking", OrthancPlugins::EnumerationToString(options.bucketPacking_)));
+          options.adaptiveBucketSize_ = plugin.GetBooleanValue("AdaptiveBucketSize", options.adaptiveBucketSize_);
+          minBucketSize = plugin.GetUnsignedIntegerValue("MinBucketSize", minBucketSize);
+          maxBucketSize = plugin.GetUnsignedIntegerValue("MaxBucketSize", maxBucketSize);
           memoryCacheSize = plugin.GetUnsignedIntegerValue("CacheSize", memoryCacheSize);
           maxPushTransactions = plugin.GetUnsignedIntegerValue("MaxPushTransactions", maxPushTransactions);
           maxHttpRetries = plugin.GetUnsignedIntegerValue("MaxHttpRetries", maxHttpRetries);
           peerConnectivityTimeout = plugin.GetUnsignedIntegerValue("PeerConnectivityTimeout", peerConnectivityTimeout);
           peerCommitTimeout = plugin.GetUnsignedIntegerValue("PeerCommitTimeout", peerCommitTimeout);
           commitThreadsCount = plugin.GetUnsignedIntegerValue("CommitThreadsCount", commitThreadsCount);
+          options.cacheShardsCount_ = plugin.GetUnsignedIntegerValue("CacheShards", options.cacheShardsCount_);
+          options.cachePolicy_ = OrthancPlugins::StringToCachePolicy(
+            plugin.GetStringValue("CachePolicy", OrthancPlugins::EnumerationToString(options.cachePolicy_)));
+          options.prefetchThreadsCount_ = plugin.GetUnsignedIntegerValue("PrefetchThreads", options.prefetchThreadsCount_);
+          options.prefetchDepth_ = plugin.GetUnsignedIntegerValue("PrefetchDepth", options.prefetchDepth_);
+          options.diskCacheFolder_ = plugin.GetStringValue("DiskCacheFolder", options.diskCacheFolder_);
+          diskCacheSize = plugin.GetUnsignedIntegerValue("DiskCacheSize", diskCacheSize);
+          options.diskCachePolicy_ = OrthancPlugins::StringToCachePolicy(
+            plugin.GetStringValue("DiskCachePolicy", OrthancPlugins::EnumerationToString(options.diskCachePolicy_)));
+          rangeReadThreshold = plugin.GetUnsignedIntegerValue("RangeReadThreshold", rangeReadThreshold);
+          rangeReadPageSize = plugin.GetUnsignedIntegerValue("RangeReadPageSize", rangeReadPageSize);
+          options.zstdLevel_ = plugin.GetIntegerValue("ZstdLevel", options.zstdLevel_);
+          options.compressionThreadsCount_ = plugin.GetUnsignedIntegerValue("CompressionThreads", options.compressionThreadsCount_);
+          compressionBlockSize = plugin.GetUnsignedIntegerValue("CompressionBlockSize", compressionBlockSize);
+          options.adaptiveCompressionLevel_ = plugin.GetBooleanValue("AdaptiveCompressionLevel", options.adaptiveCompressionLevel_);
+          compressedCacheSize = plugin.GetUnsignedIntegerValue("CompressedCacheSize", compressedCacheSize);
+          options.compressionDictionaries_ = plugin.GetBooleanValue("CompressionDictionaries", options.compressionDictionaries_);
+          options.indexStoredInstances_ = plugin.GetBooleanValue("IndexStoredInstances", options.indexStoredInstances_);
 
           if (commitThreadsCount == 0)
           {
@@ -748,23 +1453,82 @@ extern "C"
             return -1;
           }
 
+          if (minBucketSize == 0 ||
+              minBucketSize > maxBucketSize)
+          {
+            LOG(ERROR) << "Invalid values for configurations \"Transfers.MinBucketSize\" and \"Transfers.MaxBucketSize\": "
+                       << minBucketSize << " and " << maxBucketSize;
+            return -1;
+          }
+
           if (maxPushTransactions == 0)
           {
             LOG(ERROR) << "Invalid value for configuration \"Transfers.MaxPushTransactions\": " << maxPushTransactions;
             return -1;
           }
+
+          if (options.cacheShardsCount_ == 0)
+          {
+            LOG(ERROR) << "Invalid value for configuration \"Transfers.CacheShards\": " << options.cacheShardsCount_;
+            return -1;
+          }
+
+          if (options.prefetchThreadsCount_ != 0 &&
+              options.prefetchDepth_ == 0)
+          {
+            LOG(ERROR) << "Invalid value for configuration \"Transfers.PrefetchDepth\": " << options.prefetchDepth_;
+            return -1;
+          }
+
+          if (!options.diskCacheFolder_.empty() &&
+              diskCacheSize == 0)
+          {
+            LOG(ERROR) << "Invalid value for configuration \"Transfers.DiskCacheSize\": " << diskCacheSize;
+            return -1;
+          }
+
+          if (rangeReadThreshold != 0 &&
+              rangeReadPageSize == 0)
+          {
+            LOG(ERROR) << "Invalid value for configuration \"Transfers.RangeReadPageSize\": " << rangeReadPageSize;
+            return -1;
+          }
         }
       }
 
+      options.minBucketSize_ = minBucketSize * KB;
+      options.maxBucketSize_ = maxBucketSize * KB;
+      options.diskCacheSize_ = diskCacheSize * MB;
+      options.rangeReadThreshold_ = rangeReadThreshold * MB;
+      options.rangeReadPageSize_ = rangeReadPageSize * KB;
+      options.compressionBlockSize_ = compressionBlockSize * KB;
+      options.compressedCacheSize_ = compressedCacheSize * MB;
+
       OrthancPlugins::PluginContext::Initialize(threadsCount, targetBucketSize * KB, maxPushTransactions,
-                                                memoryCacheSize * MB, maxHttpRetries, peerConnectivityTimeout, peerCommitTimeout, commitThreadsCount);
+                                                memoryCacheSize * MB, maxHttpRetries, peerConnectivityTimeout,
+                                                peerCommitTimeout, commitThreadsCount, options);
     
+      OrthancPluginRegisterOnStoredInstanceCallback(context, OnStoredInstance);
+      OrthancPluginRegisterOnChangeCallback(context, OnChange);
+
       OrthancPlugins::RegisterRestCallback<ServeChunks>
         (std::string(URI_CHUNKS) + "/([.0-9a-f-]+)", true);
 
+      OrthancPlugins::RegisterRestCallback<ServeChunksBody>
+        (URI_CHUNKS, true);
+
       OrthancPlugins::RegisterRestCallback<LookupInstances>
         (URI_LOOKUP, true);
 
+      OrthancPlugins::RegisterRestCallback<CreateLookup>
+        (URI_LOOKUPS, true);
+
+      OrthancPlugins::RegisterRestCallback<ServeLookupPage>
+        (std::string(URI_LOOKUPS) + "/([.0-9a-f-]+)/([0-9]+)", true);
+
+      OrthancPlugins::RegisterRestCallback<DeleteLookup>
+        (std::string(URI_LOOKUPS) + "/([.0-9a-f-]+)", true);
+
       OrthancPlugins::RegisterRestCallback<SchedulePull>
         (URI_PULL, true);
 
@@ -774,6 +1538,15 @@ extern "C"
       OrthancPlugins::RegisterRestCallback<ServePeers>
         (URI_PEERS, true);
 
+      OrthancPlugins::RegisterRestCallback<ServeCompressions>
+        (URI_COMPRESSIONS, true);
+
+      OrthancPlugins::RegisterRestCallback<ServeDictionaries>
+        (URI_DICTIONARIES, true);
+
+      OrthancPlugins::RegisterRestCallback<ServeDictionary>
+        (std::string(URI_DICTIONARIES) + "/([0-9]+)", true);
+
       if (maxPushTransactions != 0)
       {
         // If no push transaction is allowed, their URIs are disabled
@@ -788,6 +1561,9 @@ extern "C"
     
         OrthancPlugins::RegisterRestCallback<DiscardPush>
           (std::string(URI_PUSH) + "/([.0-9a-f-]+)", true);
+
+        OrthancPlugins::RegisterRestCallback<FilterStoredInstances>
+          (URI_STORED, true);
       }
 
       OrthancPluginRegisterJobsUnserializer(context, Unserializer);
@@ -23,10 +23,50 @@
 
 #include <Compatibility.h>  // For std::unique_ptr
 #include <Logging.h>
+#include "../Framework/BlockCompression.h"
+#include "../Framework/CompressionDictionaries.h"
+#include "../Framework/CompressionLevelController.h"
 #include "../Framework/DownloadArea.h"
 
 namespace OrthancPlugins
 {
+  // Maximum number of paginated lookups of instances that are served
+  // at once to the peers that pull from this Orthanc
+  static const size_t MAX_ACTIVE_LOOKUPS = 16;
+
+
+  PluginContext::Options::Options() :
+    cacheShardsCount_(16),
+    cachePolicy_(CachePolicy_LRU),
+    prefetchThreadsCount_(2),
+    prefetchDepth_(4),
+    diskCacheSize_(4096 * MB),
+    diskCachePolicy_(CachePolicy_LRU),
+    rangeReadThreshold_(64 * MB),
+    rangeReadPageSize_(4096 * KB),
+    bucketPacking_(BucketPacking_Locality),
+    adaptiveBucketSize_(true),
+    minBucketSize_(1024 * KB),
+    maxBucketSize_(32768 * KB),
+    zstdLevel_(3),
+    compressionThreadsCount_(4),
+    compressionBlockSize_(1024 * KB),
+    adaptiveCompressionLevel_(true),
+    compressedCacheSize_(128 * MB),
+    compressionDictionaries_(true),
+    indexStoredInstances_(false)
+  {
+  }
+
+
+  void PluginContext::DictionarySampler::SignalInstanceLoaded(const std::string& instanceId,
+                                                              const void* dicom,
+                                                              size_t size)
+  {
+    CompressionDictionaries::AddSample(instanceId, dicom, size);
+  }
+
+
   PluginContext::PluginContext(size_t threadsCount,
                                size_t targetBucketSize,
                                size_t maxPushTransactions,
@@ -34,25 +74,111 @@ namespace OrthancPlugins
                                unsigned int maxHttpRetries,
                                unsigned int peerConnectivityTimeout,
                                unsigned int peerCommitTimeout,
-                               unsigned int commitThreadsCount) :
+                               unsigned int commitThreadsCount,
+                               const Options& options) :
+    cache_(options.cacheShardsCount_, options.cachePolicy_),
+    prefetcher_(cache_, options.prefetchThreadsCount_, options.prefetchDepth_),
+    lookups_(cache_, prefetcher_, MAX_ACTIVE_LOOKUPS, threadsCount),
     pushTransactions_(maxPushTransactions),
+    estimator_(options.adaptiveBucketSize_, options.minBucketSize_, options.maxBucketSize_),
     semaphore_(threadsCount),
+    compressionPool_(options.compressionThreadsCount_),
+    compressedCache_(options.compressedCacheSize_),
     pluginUuid_(Orthanc::Toolbox::GenerateUuid()),
     threadsCount_(threadsCount),
     targetBucketSize_(targetBucketSize),
+    bucketPacking_(options.bucketPacking_),
     maxHttpRetries_(maxHttpRetries),
     peerConnectivityTimeout_(peerConnectivityTimeout),
     peerCommitTimeout_(peerCommitTimeout),
-    commitThreadsCount_(commitThreadsCount)
+    commitThreadsCount_(commitThreadsCount),
+    indexStoredInstances_(options.indexStoredInstances_)
   {
     cache_.SetMaxMemorySize(memoryCacheSize);
+
+    if (!options.diskCacheFolder_.empty())
+    {
+      cache_.SetDiskCache(new DiskInstancesCache(options.diskCacheFolder_, options.diskCacheSize_, options.diskCachePolicy_));
+    }
+
+    cache_.SetRangeReads(options.rangeReadThreshold_, options.rangeReadPageSize_);
     DownloadArea::SetCommitWorkerThreadsCount(commitThreadsCount_);
+    BucketContent::SetZstdLevel(options.zstdLevel_);
+    BlockCompression::Configure(&compressionPool_, options.compressionBlockSize_);
+    CompressionLevelController::SetAdaptive(options.adaptiveCompressionLevel_);
+    CompressionDictionaries::SetEnabled(options.compressionDictionaries_ &&
+                                        CompressionDictionaries::IsSupported());
+
+    if (CompressionDictionaries::IsEnabled())
+    {
+      cache_.SetInstanceListener(&sampler_);
+    }
 
     LOG(INFO) << "Transfers accelerator will use " << threadsCount_ << " thread(s) to run HTTP queries";
     LOG(INFO) << "Transfers accelerator will keep local DICOM files in a memory cache of size: "
-              << OrthancPlugins::ConvertToMegabytes(memoryCacheSize) << " MB";
+              << OrthancPlugins::ConvertToMegabytes(memoryCacheSize) << " MB, split into "
+              << cache_.GetShardsCount() << " shard(s), with the \"" << EnumerationToString(options.cachePolicy_) << "\" policy";
+    LOG(INFO) << "Transfers accelerator will use " << options.prefetchThreadsCount_ << " thread(s) to prefetch up to "
+              << options.prefetchDepth_ << " instance(s) ahead of each transfer";
+
+    if (cache_.HasDiskCache())
+    {
+      LOG(INFO) << "Transfers accelerator will keep the DICOM files evicted from the memory cache in a disk cache of size: "
+                << OrthancPlugins::ConvertToMegabytes(options.diskCacheSize_) << " MB, in folder \"" << options.diskCacheFolder_
+                << "\", with the \"" << EnumerationToString(options.diskCachePolicy_) << "\" policy";
+    }
+
+    if (options.rangeReadThreshold_ != 0)
+    {
+      LOG(INFO) << "Transfers accelerator will read the DICOM files larger than "
+                << OrthancPlugins::ConvertToMegabytes(options.rangeReadThreshold_) << " MB by pages of "
+                << OrthancPlugins::ConvertToKilobytes(options.rangeReadPageSize_) << " KB";
+    }
     LOG(INFO) << "Transfers accelerator will aim at HTTP queries of size: "
-              << OrthancPlugins::ConvertToKilobytes(targetBucketSize_) << " KB";
+              << OrthancPlugins::ConvertToKilobytes(targetBucketSize_) << " KB, packed with the \""
+              << EnumerationToString(bucketPacking_) << "\" order";
+
+    if (options.adaptiveBucketSize_)
+    {
+      LOG(INFO) << "Transfers accelerator will adapt the size of the HTTP queries to the link with each peer, between "
+                << OrthancPlugins::ConvertToKilobytes(options.minBucketSize_) << " KB and "
+                << OrthancPlugins::ConvertToKilobytes(options.maxBucketSize_) << " KB";
+    }
+
+    if (IsBucketCompressionSupported(BucketCompression_Zstd))
+    {
+      LOG(INFO) << "Transfers accelerator will compress the buckets with zstd at level " << options.zstdLevel_;
+    }
+
+    if (options.compressionBlockSize_ != 0)
+    {
+      LOG(INFO) << "Transfers accelerator will compress the buckets by blocks of "
+                << OrthancPlugins::ConvertToKilobytes(options.compressionBlockSize_) << " KB, using "
+                << options.compressionThreadsCount_ << " additional thread(s)";
+    }
+
+    if (options.adaptiveCompressionLevel_)
+    {
+      LOG(INFO) << "Transfers accelerator will adapt the compression level to the bottleneck of each transfer";
+    }
+
+    if (options.compressedCacheSize_ != 0)
+    {
+      LOG(INFO) << "Transfers accelerator will keep the compressed buckets in a memory cache of size: "
+                << OrthancPlugins::ConvertToMegabytes(options.compressedCacheSize_) << " MB";
+    }
+
+    if (CompressionDictionaries::IsEnabled())
+    {
+      LOG(INFO) << "Transfers accelerator will train zstd dictionaries from the headers of the local "
+                << "DICOM files, to compress the buckets made of small instances";
+    }
+
+    if (indexStoredInstances_)
+    {
+      LOG(INFO) << "Transfers accelerator will index the size and MD5 of the DICOM files as soon as they are received";
+    }
+
     LOG(INFO) << "Transfers accelerator will be able to receive up to "
               << maxPushTransactions << " push transaction(s) at once";
     LOG(INFO) << "Transfers accelerator will retry "
@@ -66,6 +192,22 @@ namespace OrthancPlugins
   }
 
 
+  void PluginContext::InvalidateInstance(const std::string& instanceId)
+  {
+    cache_.Invalidate(instanceId);
+    compressedCache_.Invalidate(instanceId);
+  }
+
+
+  PluginContext::~PluginContext()
+  {
+    CompressionDictionaries::WaitForTraining();
+
+    // The compression pool is about to be destroyed
+    BlockCompression::Configure(NULL, 0);
+  }
+
+
   std::unique_ptr<PluginContext>& PluginContext::GetSingleton()
   {
     static std::unique_ptr<PluginContext>  singleton_;
@@ -80,10 +222,12 @@ namespace OrthancPlugins
                                  unsigned int maxHttpRetries,
                                  unsigned int peerConnectivityTimeout,
                                  unsigned int peerCommitTimeout,
-                                 unsigned int commitThreadsCount)
+                                 unsigned int commitThreadsCount,
+                                 const Options& options)
   {
     GetSingleton().reset(new PluginContext(threadsCount, targetBucketSize,
-                                           maxPushTransactions, memoryCacheSize, maxHttpRetries, peerConnectivityTimeout, peerCommitTimeout, commitThreadsCount));
+                                           maxPushTransactions, memoryCacheSize, maxHttpRetries, peerConnectivityTimeout, peerCommitTimeout, commitThreadsCount,
+                                           options));
   }
 
   
@@ -21,7 +21,12 @@
 
 #pragma once
 
+#include "../Framework/CompressedBucketsCache.h"
+#include "../Framework/CompressionThreadPool.h"
+#include "../Framework/HttpQueries/BandwidthDelayEstimator.h"
+#include "../Framework/InstancesPrefetcher.h"
 #include "../Framework/OrthancInstancesCache.h"
+#include "../Framework/PullMode/ActiveLookups.h"
 #include "../Framework/PushMode/ActivePushTransactions.h"
 
 #include <Compatibility.h>  // For std::unique_ptr
@@ -33,20 +38,68 @@ namespace OrthancPlugins
 {
   class PluginContext : public boost::noncopyable
   {
+  public:
+    // Options of the caches, of the bucket sizes and of the
+    // compression. The sizes are in bytes.
+    struct Options
+    {
+      size_t         cacheShardsCount_;
+      CachePolicy    cachePolicy_;
+      size_t         prefetchThreadsCount_;
+      size_t         prefetchDepth_;
+      std::string    diskCacheFolder_;     // Empty to disable the disk cache
+      size_t         diskCacheSize_;
+      CachePolicy    diskCachePolicy_;
+      size_t         rangeReadThreshold_;  // Zero to disable the range reads
+      size_t         rangeReadPageSize_;
+      BucketPacking  bucketPacking_;
+      bool           adaptiveBucketSize_;
+      size_t         minBucketSize_;
+      size_t         maxBucketSize_;
+      int            zstdLevel_;
+      size_t         compressionThreadsCount_;
+      size_t         compressionBlockSize_;  // Zero to disable the compression by blocks
+      bool           adaptiveCompressionLevel_;
+      size_t         compressedCacheSize_;   // Zero to disable the cache of the compressed buckets
+      bool           compressionDictionaries_;
+      bool           indexStoredInstances_;
+
+      // Default values of the configuration
+      Options();
+    };
+
   private:
+    // Samples the headers of the instances that are read by the cache,
+    // to train the compression dictionaries
+    class DictionarySampler : public OrthancInstancesCache::IInstanceListener
+    {
+    public:
+      virtual void SignalInstanceLoaded(const std::string& instanceId,
+                                        const void* dicom,
+                                        size_t size) ORTHANC_OVERRIDE;
+    };
+
     // Runtime structures
+    DictionarySampler        sampler_;     // Must be declared before "cache_"
     OrthancInstancesCache    cache_;
+    InstancesPrefetcher      prefetcher_;  // Must be declared after "cache_"
+    ActiveLookups            lookups_;     // Must be declared after "prefetcher_"
     ActivePushTransactions   pushTransactions_;
+    BandwidthDelayEstimator  estimator_;
     Orthanc::Semaphore       semaphore_;
+    CompressionThreadPool    compressionPool_;
+    CompressedBucketsCache   compressedCache_;
     std::string              pluginUuid_;
 
     // Configuration
     size_t                   threadsCount_;
     size_t                   targetBucketSize_;
+    BucketPacking            bucketPacking_;
     unsigned int             maxHttpRetries_;
     unsigned int             peerConnectivityTimeout_;
     unsigned int             peerCommitTimeout_;
     unsigned int             commitThreadsCount_;
+    bool                     indexStoredInstances_;
   
     PluginContext(size_t threadsCount,
                   size_t targetBucketSize,
@@ -55,21 +108,44 @@ namespace OrthancPlugins
                   unsigned int maxHttpRetries,
                   unsigned int peerConnectivityTimeout,
                   unsigned int peerCommitTimeout,
-                  unsigned int commitThreadsCount);
+                  unsigned int commitThreadsCount,
+                  const Options& options);
 
     static std::unique_ptr<PluginContext>& GetSingleton();
   
   public:
+    ~PluginContext();
+
     OrthancInstancesCache& GetCache()
     {
       return cache_;
     }
 
+    InstancesPrefetcher& GetPrefetcher()
+    {
+      return prefetcher_;
+    }
+
+    ActiveLookups& GetActiveLookups()
+    {
+      return lookups_;
+    }
+
     ActivePushTransactions& GetActivePushTransactions()
     {
       return pushTransactions_;
     }
 
+    BandwidthDelayEstimator& GetBandwidthDelayEstimator()
+    {
+      return estimator_;
+    }
+
+    CompressedBucketsCache& GetCompressedCache()
+    {
+      return compressedCache_;
+    }
+
     Orthanc::Semaphore& GetSemaphore()
     {
       return semaphore_;
@@ -95,6 +171,11 @@ namespace OrthancPlugins
       return targetBucketSize_;
     }
 
+    BucketPacking GetBucketPacking() const
+    {
+      return bucketPacking_;
+    }
+
     unsigned int GetMaxHttpRetries() const
     {
       return maxHttpRetries_;
@@ -110,6 +191,17 @@ namespace OrthancPlugins
       return peerCommitTimeout_;
     }
 
+    // Whether the size and MD5 of the instances are indexed as soon
+    // as they are received, instead of when they are first scheduled
+    bool IsIndexStoredInstances() const
+    {
+      return indexStoredInstances_;
+    }
+
+    // Discards everything that is cached about the instance, as it was
+    // deleted or stored again
+    void InvalidateInstance(const std::string& instanceId);
+
     static void Initialize(size_t threadsCount,
                            size_t targetBucketSize,
                            size_t maxPushTransactions,
@@ -117,7 +209,8 @@ namespace OrthancPlugins
                            unsigned int maxHttpRetries,
                            unsigned int peerConnectivityTimeout,
                            unsigned int peerCommitTimeout,
-                           unsigned int commitThreadsCount);
+                           unsigned int commitThreadsCount,
+                           const Options& options);
   
     static PluginContext& GetInstance();
 
@@ -19,20 +19,258 @@
  **/
 
 
+#include "../Framework/AutoCompression.h"
+#include "../Framework/CompactIdentifier.h"
+#include "../Framework/CompressedBucketsCache.h"
+#include "../Framework/CompressionDictionaries.h"
+#include "../Framework/CompressionLevelController.h"
 #include "../Framework/DownloadArea.h"
+#include "../Framework/HttpQueries/BandwidthDelayEstimator.h"
+#include "../Framework/HttpQueries/HttpQueriesQueue.h"
+#include "../Framework/InstancesPinner.h"
+#include "../Framework/InstancesPrefetcher.h"
+#include "../Framework/PullMode/BucketPullQuery.h"
+#include "../Framework/ResourcesExpander.h"
+#include "../Framework/TransferManifest.h"
 
 #include <Compression/GzipCompressor.h>
 #include <Logging.h>
 #include <OrthancException.h>
 #include <gtest/gtest.h>
 
+#include <SystemToolbox.h>
+
+#include <boost/thread.hpp>
+
+#if defined(__GLIBC__)
+#  include <malloc.h>
+#endif
+
+#if ORTHANC_TRANSFERS_ENABLE_ZSTD == 1
+#  include <zstd.h>
+#endif
+
+
+namespace
+{
+  // Cache whose DICOM instances are generated in memory, instead of
+  // being read from the Orthanc core
+  class InstancesCacheForTests : public OrthancPlugins::OrthancInstancesCache
+  {
+  private:
+    typedef std::map<std::string, std::string>  Content;
+
+    boost::mutex  mutex_;
+    Content       content_;
+    size_t        loadsCount_;
+    size_t        rangeLoadsCount_;
+    uint64_t      loadedBytes_;
+    unsigned int  loadDelay_;  // In milliseconds, to simulate a slow storage
+    bool          hasAttachmentInfo_;
+    bool          hasAttachmentMD5_;   // "StoreMD5ForAttachments" option of Orthanc
+    size_t        attachmentInfoCount_;  // Number of REST calls to the attachment information
+
+  protected:
+    virtual OrthancPlugins::SourceDicomInstance* LoadInstance(const std::string& instanceId) ORTHANC_OVERRIDE
+    {
+      std::string content;
+      unsigned int delay;
+
+      {
+        boost::mutex::scoped_lock lock(mutex_);
+        loadsCount_++;
+        delay = loadDelay_;
+      }
+
+      if (delay != 0)
+      {
+        boost::this_thread::sleep(boost::posix_time::milliseconds(delay));
+      }
+
+      {
+        boost::mutex::scoped_lock lock(mutex_);
+        
+        Content::const_iterator found = content_.find(instanceId);
+        if (found == content_.end())
+        {
+          throw Orthanc::OrthancException(Orthanc::ErrorCode_UnknownResource);
+        }
+
+        content = found->second;
+        loadedBytes_ += content.size();
+      }
+
+      return new OrthancPlugins::SourceDicomInstance(instanceId, content);
+    }
+
+    virtual OrthancPlugins::SourceDicomInstance* LoadRange(const std::string& key,
+                                                           const std::string& instanceId,
+                                                           size_t offset,
+                                                           size_t size) ORTHANC_OVERRIDE
+    {
+      boost::mutex::scoped_lock lock(mutex_);
+
+      Content::const_iterator found = content_.find(instanceId);
+      if (found == content_.end() ||
+          offset + size > found->second.size())
+      {
+        throw Orthanc::OrthancException(Orthanc::ErrorCode_UnknownResource);
+      }
+
+      rangeLoadsCount_++;
+      loadedBytes_ += size;
+
+      return new OrthancPlugins::SourceDicomInstance(key, found->second.substr(offset, size));
+    }
+
+    virtual bool LookupAttachmentInfo(size_t& size,
+                                      std::string& md5,
+                                      const std::string& instanceId) ORTHANC_OVERRIDE
+    {
+      boost::mutex::scoped_lock lock(mutex_);
+
+      attachmentInfoCount_++;
+
+      Content::const_iterator found = content_.find(instanceId);
+      if (hasAttachmentInfo_ &&
+          found != content_.end())
+      {
+        size = found->second.size();
+
+        if (hasAttachmentMD5_)
+        {
+          Orthanc::Toolbox::ComputeMD5(md5, found->second);
+        }
+        else
+        {
+          md5.clear();
+        }
+
+        return true;
+      }
+      else
+      {
+        return false;
+      }
+    }
+
+  public:
+    explicit InstancesCacheForTests(size_t shardsCount,
+                                    OrthancPlugins::CachePolicy policy = OrthancPlugins::CachePolicy_LRU) :
+      OrthancInstancesCache(shardsCount, policy),
+      loadsCount_(0),
+      rangeLoadsCount_(0),
+      loadedBytes_(0),
+      loadDelay_(0),
+      hasAttachmentInfo_(false),
+      hasAttachmentMD5_(true),
+      attachmentInfoCount_(0)
+    {
+    }
+
+    void SetAttachmentInfoAvailable(bool available)
+    {
+      boost::mutex::scoped_lock lock(mutex_);
+      hasAttachmentInfo_ = available;
+    }
+
+    void SetAttachmentMD5Available(bool available)
+    {
+      boost::mutex::scoped_lock lock(mutex_);
+      hasAttachmentMD5_ = available;
+    }
+
+    void SetLoadDelay(unsigned int milliseconds)
+    {
+      boost::mutex::scoped_lock lock(mutex_);
+      loadDelay_ = milliseconds;
+    }
+
+    void AddInstance(const std::string& instanceId,
+                     size_t size)
+    {
+      std::string content;
+      content.resize(size);
+
+      for (size_t i = 0; i < size; i++)
+      {
+        content[i] = static_cast<char>((i * 7 + instanceId.size()) % 256);
+      }
+
+      boost::mutex::scoped_lock lock(mutex_);
+      content_[instanceId] = content;
+    }
+
+    size_t GetLoadsCount()
+    {
+      boost::mutex::scoped_lock lock(mutex_);
+      return loadsCount_;
+    }
+
+    size_t GetRangeLoadsCount()
+    {
+      boost::mutex::scoped_lock lock(mutex_);
+      return rangeLoadsCount_;
+    }
+
+    size_t GetAttachmentInfoCount()
+    {
+      boost::mutex::scoped_lock lock(mutex_);
+      return attachmentInfoCount_;
+    }
+
+    std::string GetContent(const std::string& instanceId)
+    {
+      boost::mutex::scoped_lock lock(mutex_);
+      return content_[instanceId];
+    }
+
+    uint64_t GetLoadedBytes()
+    {
+      boost::mutex::scoped_lock lock(mutex_);
+      return loadedBytes_;
+    }
+
+    // Waits for the background threads to load instances (at most 5 seconds)
+    bool WaitForLoads(size_t loadsCount)
+    {
+      for (unsigned int i = 0; i < 500; i++)
+      {
+        if (GetLoadsCount() >= loadsCount)
+        {
+          return true;
+        }
+
+        boost::this_thread::sleep(boost::posix_time::milliseconds(10));
+      }
+
+      return false;
+    }
+  };
+}
+
 
 TEST(Toolbox, Enumerations)
 {
   using namespace OrthancPlugins;
   ASSERT_EQ(BucketCompression_None, StringToBucketCompression(EnumerationToString(BucketCompression_None)));
   ASSERT_EQ(BucketCompression_Gzip, StringToBucketCompression(EnumerationToString(BucketCompression_Gzip)));
+  ASSERT_EQ(BucketCompression_Zstd, StringToBucketCompression(EnumerationToString(BucketCompression_Zstd)));
+  ASSERT_EQ(BucketCompression_Auto, StringToBucketCompression(EnumerationToString(BucketCompression_Auto)));
   ASSERT_THROW(StringToBucketCompression("None"), Orthanc::OrthancException);
+  ASSERT_TRUE(IsBucketCompressionSupported(BucketCompression_None));
+  ASSERT_TRUE(IsBucketCompressionSupported(BucketCompression_Gzip));
+  ASSERT_EQ(ORTHANC_TRANSFERS_ENABLE_ZSTD == 1, IsBucketCompressionSupported(BucketCompression_Zstd));
+  ASSERT_EQ(ORTHANC_TRANSFERS_ENABLE_ZSTD == 1, IsBucketCompressionSupported(BucketCompression_Auto));
+
+  Json::Value compressions;
+  ListSupportedBucketCompressions(compressions);
+  ASSERT_EQ(Json::arrayValue, compressions.type());
+  ASSERT_EQ(ORTHANC_TRANSFERS_ENABLE_ZSTD == 1 ? 4u : 2u, compressions.size());
+  ASSERT_EQ(BucketPacking_Identifier, StringToBucketPacking(EnumerationToString(BucketPacking_Identifier)));
+  ASSERT_EQ(BucketPacking_Locality, StringToBucketPacking(EnumerationToString(BucketPacking_Locality)));
+  ASSERT_EQ(BucketPacking_Balanced, StringToBucketPacking(EnumerationToString(BucketPacking_Balanced)));
+  ASSERT_THROW(StringToBucketPacking("locality"), Orthanc::OrthancException);
 }
 
 
@@ -48,6 +286,54 @@ TEST(Toolbox, Conversions)
 }
 
 
+TEST(CompactIdentifier, Basic)
+{
+  using namespace OrthancPlugins;
+
+  const std::string values[] = {
+    "",
+    "d1",
+    "6e2c0ec2-5d99c8ca-c1c21443-79bc2b1f-5e1a3c0a",  // Orthanc identifier
+    "6e2c0ec2-5d99c8ca-c1c21443-79bc2b1f-5e1a3c0b",
+    "00000000-00000000-00000000-00000000-00000000",
+    "ffffffff-ffffffff-ffffffff-ffffffff-ffffffff",
+    "6E2C0EC2-5D99C8CA-C1C21443-79BC2B1F-5E1A3C0A",  // Uppercase, kept as such
+    "6e2c0ec2-5d99c8ca-c1c21443-79bc2b1f+5e1a3c0a",  // Bad separator
+    "6e2c0ec2-5d99c8ca-c1c21443-79bc2b1f-5e1a3c0",   // Too short
+    "6e2c0ec2-5d99c8ca-c1c21443-79bc2b1f-5e1a3c0az",
+    "9e107d9d372bb6826bd81d3542a419d6",              // MD5
+    "9e107d9d372bb6826bd81d3542a419d7",
+    "9e107d9d372bb6826bd81d3542a419dg",
+    "9e107d9d-372bb682-6bd81d35-42a419d6"
+  };
+
+  const size_t count = sizeof(values) / sizeof(std::string);
+
+  for (size_t i = 0; i < count; i++)
+  {
+    CompactIdentifier a(values[i]);
+    ASSERT_EQ(values[i], a.ToString());
+    ASSERT_EQ(values[i].size(), a.GetLength());
+    ASSERT_EQ(values[i].empty(), a.IsEmpty());
+
+    CompactIdentifier b = a;
+    ASSERT_EQ(values[i], b.ToString());
+
+    for (size_t j = 0; j < count; j++)
+    {
+      // Consistent with the comparison of the original strings
+      CompactIdentifier c(values[j]);
+      ASSERT_EQ(values[i] == values[j], a == c);
+      ASSERT_EQ(values[i] != values[j], a != c);
+      ASSERT_EQ(values[i] < values[j], a < c);
+    }
+  }
+
+  ASSERT_TRUE(CompactIdentifier().IsEmpty());
+  ASSERT_TRUE(CompactIdentifier() == CompactIdentifier(""));
+}
+
+
 TEST(TransferBucket, Basic)
 {  
   using namespace OrthancPlugins;
@@ -75,23 +361,27 @@ TEST(TransferBucket, Basic)
     ASSERT_EQ(0u, b.GetChunkOffset(0));
     ASSERT_EQ(10u, b.GetChunkSize(0));
     ASSERT_EQ("d2", b.GetChunkInstanceId(1));
+    ASSERT_TRUE(CompactIdentifier("d2") == b.GetChunkCompactId(1));
     ASSERT_EQ(0u, b.GetChunkOffset(1));
     ASSERT_EQ(20u, b.GetChunkSize(1));
     ASSERT_EQ("d3", b.GetChunkInstanceId(2));
     ASSERT_EQ(0u, b.GetChunkOffset(2));
     ASSERT_EQ(30u, b.GetChunkSize(2));
+    ASSERT_THROW(b.GetChunkCompactId(3), Orthanc::OrthancException);
 
     std::string uri;
     b.ComputePullUri(uri, BucketCompression_None);
     ASSERT_EQ("/transfers/chunks/d1.d2.d3?offset=0&size=60&compression=none", uri);
     b.ComputePullUri(uri, BucketCompression_Gzip);
     ASSERT_EQ("/transfers/chunks/d1.d2.d3?offset=0&size=60&compression=gzip", uri);
+    ASSERT_EQ(uri.size(), b.GetPullUriLength(BucketCompression_Gzip));
       
     b.Clear();
     ASSERT_EQ(0u, b.GetTotalSize());
     ASSERT_EQ(0u, b.GetChunksCount());
 
     ASSERT_THROW(b.ComputePullUri(uri, BucketCompression_None), Orthanc::OrthancException);  // Empty
+    ASSERT_THROW(b.GetPullUriLength(BucketCompression_None), Orthanc::OrthancException);
   }
 
   {
@@ -156,6 +446,144 @@ TEST(TransferBucket, Serialization)
     std::string uri;
     b.ComputePullUri(uri, BucketCompression_None);
     ASSERT_EQ("/transfers/chunks/d1.d2.d3?offset=5&size=32&compression=none", uri);
+    ASSERT_EQ(uri.size(), b.GetPullUriLength(BucketCompression_None));
+
+    std::string body;
+    b.ComputePullBody(body, BucketCompression_Gzip);
+
+    Json::Value request;
+    ASSERT_TRUE(Orthanc::Toolbox::ReadJson(request, body));
+    ASSERT_EQ("gzip", request[KEY_COMPRESSION].asString());
+    ASSERT_FALSE(request.isMember(KEY_COMPRESSION_LEVEL));
+    ASSERT_FALSE(request.isMember(KEY_DICTIONARY));
+
+    TransferBucket c(request[KEY_CHUNKS]);
+    c.ComputePullUri(uri, BucketCompression_None);
+    ASSERT_EQ("/transfers/chunks/d1.d2.d3?offset=5&size=32&compression=none", uri);
+    ASSERT_EQ(32u, c.GetTotalSize());
+
+    b.ComputePullBody(body, BucketCompression_Gzip, 9, 0);
+    ASSERT_TRUE(Orthanc::Toolbox::ReadJson(request, body));
+    ASSERT_EQ(9, request[KEY_COMPRESSION_LEVEL].asInt());
+    ASSERT_FALSE(request.isMember(KEY_DICTIONARY));
+
+    b.ComputePullBody(body, BucketCompression_Zstd, 0, 1234);
+    ASSERT_TRUE(Orthanc::Toolbox::ReadJson(request, body));
+    ASSERT_FALSE(request.isMember(KEY_COMPRESSION_LEVEL));
+    ASSERT_EQ(1234u, request[KEY_DICTIONARY].asUInt());
+  }
+
+  {
+    TransferBucket b;
+    std::string body;
+    ASSERT_THROW(b.ComputePullBody(body, BucketCompression_None), Orthanc::OrthancException);  // Empty
+  }
+}
+
+
+TEST(TransferManifest, Basic)
+{  
+  using namespace OrthancPlugins;
+
+  std::vector<DicomInstanceInfo> instances;
+  instances.push_back(DicomInstanceInfo("d1", 10, "md5-1"));
+  instances.push_back(DicomInstanceInfo("d2", 20, ""));
+  instances.push_back(DicomInstanceInfo("d3", 300000, "md5-3"));
+
+  std::vector<TransferBucket> buckets(3);
+  buckets[0].AddChunk(instances[0], 0, 10);
+  buckets[0].AddChunk(instances[1], 0, 20);
+  buckets[0].AddChunk(instances[2], 0, 70);
+  buckets[1].AddChunk(instances[2], 70, 200000);
+  buckets[2].AddChunk(instances[2], 200070, 99930);
+
+  std::string binary;
+  WriteBinaryManifest(binary, instances, buckets, BucketCompression_Gzip);
+
+  Json::Value json;
+  WriteJsonManifest(json, instances, buckets, BucketCompression_Gzip);
+
+  std::string s;
+  Orthanc::Toolbox::WriteFastJson(s, json);
+  ASSERT_LT(binary.size(), s.size());
+
+  for (unsigned int compression = 0; compression < 2; compression++)
+  {
+    const BucketCompression expected = (compression == 0 ? BucketCompression_Zstd : BucketCompression_Auto);
+
+    std::string other;
+    WriteBinaryManifest(other, instances, buckets, expected);
+
+    std::vector<DicomInstanceInfo> i;
+    std::vector<TransferBucket> b;
+    BucketCompression c = BucketCompression_None;
+    ReadBinaryManifest(i, b, c, other.c_str(), other.size());
+    ASSERT_EQ(expected, c);
+  }
+
+  for (unsigned int format = 0; format < 2; format++)
+  {
+    std::vector<DicomInstanceInfo> i;
+    std::vector<TransferBucket> b;
+    BucketCompression c = BucketCompression_None;
+
+    if (format == 0)
+    {
+      ReadBinaryManifest(i, b, c, binary.c_str(), binary.size());
+    }
+    else
+    {
+      ReadJsonManifest(i, b, c, json);
+    }
+
+    ASSERT_EQ(BucketCompression_Gzip, c);
+    ASSERT_EQ(3u, i.size());
+
+    for (size_t j = 0; j < i.size(); j++)
+    {
+      ASSERT_EQ(instances[j].GetId(), i[j].GetId());
+      ASSERT_EQ(instances[j].GetSize(), i[j].GetSize());
+      ASSERT_EQ(instances[j].GetMD5(), i[j].GetMD5());
+    }
+
+    ASSERT_EQ(3u, b.size());
+
+    for (size_t j = 0; j < b.size(); j++)
+    {
+      std::string expected, actual;
+      buckets[j].ComputePullUri(expected, BucketCompression_None);
+      b[j].ComputePullUri(actual, BucketCompression_None);
+      ASSERT_EQ(expected, actual);
+    }
+  }
+
+  {
+    // Truncated or corrupted manifests
+    std::vector<DicomInstanceInfo> i;
+    std::vector<TransferBucket> b;
+    BucketCompression c;
+
+    for (size_t size = 0; size < binary.size(); size++)
+    {
+      ASSERT_THROW(ReadBinaryManifest(i, b, c, binary.c_str(), size), Orthanc::OrthancException);
+    }
+
+    std::string corrupted = binary + "x";
+    ASSERT_THROW(ReadBinaryManifest(i, b, c, corrupted.c_str(), corrupted.size()), Orthanc::OrthancException);
+
+    corrupted = binary;
+    corrupted[4] = 2;  // Unknown version
+    ASSERT_THROW(ReadBinaryManifest(i, b, c, corrupted.c_str(), corrupted.size()), Orthanc::OrthancException);
+
+    corrupted = "{}";
+    ASSERT_THROW(ReadBinaryManifest(i, b, c, corrupted.c_str(), corrupted.size()), Orthanc::OrthancException);
+  }
+
+  {
+    // A bucket cannot refer to an instance that is not in the table
+    std::vector<TransferBucket> b(1);
+    b[0].AddChunk(DicomInstanceInfo("nope", 10, ""), 0, 10);
+    ASSERT_THROW(WriteBinaryManifest(binary, instances, b, BucketCompression_None), Orthanc::OrthancException);
   }
 }
 
@@ -173,11 +601,11 @@ TEST(TransferScheduler, Empty)
   ASSERT_TRUE(i.empty());
 
   std::vector<TransferBucket> b;
-  s.ComputePullBuckets(b, 10, 1000, "http://localhost/", BucketCompression_None);
+  s.ComputePullBuckets(b, 10, 1000, "http://localhost/", BucketCompression_None, BucketPacking_Identifier);
   ASSERT_TRUE(b.empty());
 
   Json::Value v;
-  s.FormatPushTransaction(v, b, 10, 1000, BucketCompression_None);
+  s.FormatPushTransaction(v, b, 10, 1000, BucketCompression_None, BucketPacking_Identifier);
   ASSERT_TRUE(b.empty());
   ASSERT_EQ(Json::objectValue, v.type());
   ASSERT_TRUE(v.isMember("Buckets"));
@@ -210,7 +638,7 @@ TEST(TransferScheduler, Basic)
   ASSERT_EQ(3u, i.size());
 
   std::vector<TransferBucket> b;
-  s.ComputePullBuckets(b, 10, 1000, "http://localhost/", BucketCompression_None);
+  s.ComputePullBuckets(b, 10, 1000, "http://localhost/", BucketCompression_None, BucketPacking_Identifier);
   ASSERT_EQ(3u, b.size());
   ASSERT_EQ(1u, b[0].GetChunksCount());
   ASSERT_EQ("d1", b[0].GetChunkInstanceId(0));
@@ -226,7 +654,7 @@ TEST(TransferScheduler, Basic)
   ASSERT_EQ(10u, b[2].GetChunkSize(0));
 
   Json::Value v;
-  s.FormatPushTransaction(v, b, 10, 1000, BucketCompression_Gzip);
+  s.FormatPushTransaction(v, b, 10, 1000, BucketCompression_Gzip, BucketPacking_Identifier);
   ASSERT_EQ(3u, b.size());
   ASSERT_EQ(3u, v["Buckets"].size());
   ASSERT_EQ("gzip", v["Compression"].asString());
@@ -287,7 +715,7 @@ TEST(TransferScheduler, Grouping)
 
   {
     std::vector<TransferBucket> b;
-    s.ComputePullBuckets(b, 20, 1000, "http://localhost/", BucketCompression_None);
+    s.ComputePullBuckets(b, 20, 1000, "http://localhost/", BucketCompression_None, BucketPacking_Identifier);
     ASSERT_EQ(2u, b.size());
     ASSERT_EQ(2u, b[0].GetChunksCount());
     ASSERT_EQ("d1", b[0].GetChunkInstanceId(0));
@@ -298,7 +726,7 @@ TEST(TransferScheduler, Grouping)
 
   {
     std::vector<TransferBucket> b;
-    s.ComputePullBuckets(b, 21, 1000, "http://localhost/", BucketCompression_None);
+    s.ComputePullBuckets(b, 21, 1000, "http://localhost/", BucketCompression_None, BucketPacking_Identifier);
     ASSERT_EQ(1u, b.size());
     ASSERT_EQ(3u, b[0].GetChunksCount());
     ASSERT_EQ("d1", b[0].GetChunkInstanceId(0));
@@ -309,7 +737,7 @@ TEST(TransferScheduler, Grouping)
   {
     std::string longBase(2048, '_');
     std::vector<TransferBucket> b;
-    s.ComputePullBuckets(b, 21, 1000, longBase, BucketCompression_None);
+    s.ComputePullBuckets(b, 21, 1000, longBase, BucketCompression_None, BucketPacking_Identifier);
     ASSERT_EQ(3u, b.size());
     ASSERT_EQ(1u, b[0].GetChunksCount());
     ASSERT_EQ("d1", b[0].GetChunkInstanceId(0));
@@ -321,6 +749,45 @@ TEST(TransferScheduler, Grouping)
 }
 
 
+TEST(TransferScheduler, UrlLength)
+{  
+  using namespace OrthancPlugins;
+
+  TransferScheduler s;
+
+  for (size_t i = 0; i < 200; i++)
+  {
+    // Length of an Orthanc identifier
+    std::string id = boost::lexical_cast<std::string>(i);
+    id = std::string(44 - id.size(), '0') + id;
+    s.AddInstance(DicomInstanceInfo(id, 10, ""));
+  }
+
+  {
+    // The buckets that are sent in the URL are capped by its length
+    std::vector<TransferBucket> b;
+    s.ComputePullBuckets(b, 10000, 20000, "http://localhost/", BucketCompression_None, BucketPacking_Identifier);
+    ASSERT_LT(1u, b.size());
+
+    for (size_t i = 0; i < b.size(); i++)
+    {
+      std::string uri;
+      b[i].ComputePullUri(uri, BucketCompression_None);
+      ASSERT_GT(2000u, std::string("http://localhost/" + uri).size());
+    }
+  }
+
+  {
+    // The buckets that are sent in the body are only sized by bytes
+    std::vector<TransferBucket> b;
+    s.ComputePullBuckets(b, 10000, 20000, "", BucketCompression_None, BucketPacking_Identifier);
+    ASSERT_EQ(1u, b.size());
+    ASSERT_EQ(200u, b[0].GetChunksCount());
+    ASSERT_EQ(2000u, b[0].GetTotalSize());
+  }
+}
+
+
 TEST(TransferScheduler, Splitting)
 {  
   using namespace OrthancPlugins;
@@ -334,7 +801,7 @@ TEST(TransferScheduler, Splitting)
 
     {
       std::vector<TransferBucket> b;
-      s.ComputePullBuckets(b, 1, 1000, "http://localhost/", BucketCompression_None);
+      s.ComputePullBuckets(b, 1, 1000, "http://localhost/", BucketCompression_None, BucketPacking_Identifier);
       ASSERT_EQ(1u, b.size());
       ASSERT_EQ(1u, b[0].GetChunksCount());
       ASSERT_EQ("dicom", b[0].GetChunkInstanceId(0));
@@ -351,7 +818,7 @@ TEST(TransferScheduler, Splitting)
         count = dicom.GetSize() / split;
     
       std::vector<TransferBucket> b;
-      s.ComputePullBuckets(b, 1, split, "http://localhost/", BucketCompression_None);
+      s.ComputePullBuckets(b, 1, split, "http://localhost/", BucketCompression_None, BucketPacking_Identifier);
       ASSERT_EQ(count, b.size());
 
       size_t size = dicom.GetSize() / count;
@@ -372,65 +839,4227 @@ TEST(TransferScheduler, Splitting)
 }
 
 
-TEST(DownloadArea, Basic)
-{
+TEST(TransferScheduler, Locality)
+{  
   using namespace OrthancPlugins;
-  
-  std::string s1 = "Hello";
-  std::string s2 = "Hello, World!";
 
-  std::string md1, md2;
-  Orthanc::Toolbox::ComputeMD5(md1, s1);
-  Orthanc::Toolbox::ComputeMD5(md2, s2);
-  
-  std::vector<DicomInstanceInfo> instances;
-  instances.push_back(DicomInstanceInfo("d1", s1.size(), md1));
-  instances.push_back(DicomInstanceInfo("d2", s2.size(), md2));
+  // The instances are added in the order of the DICOM hierarchy,
+  // which differs from the order of their identifiers
+  TransferScheduler s;
+  s.AddInstance(DicomInstanceInfo("z1", 5, ""));   // Series 1
+  s.AddInstance(DicomInstanceInfo("a1", 5, ""));
+  s.AddInstance(DicomInstanceInfo("m1", 30, ""));
+  s.AddInstance(DicomInstanceInfo("b1", 5, ""));
+  s.AddInstance(DicomInstanceInfo("y2", 5, ""));   // Series 2
+  s.AddInstance(DicomInstanceInfo("c2", 5, ""));
+  s.AddInstance(DicomInstanceInfo("z1", 5, ""));   // Duplicates keep their rank
 
-  {
-    DownloadArea area(instances);
-    ASSERT_EQ(s1.size() + s2.size(), area.GetTotalSize());
-    ASSERT_THROW(area.CheckMD5(), Orthanc::OrthancException);
+  std::vector<DicomInstanceInfo> i;
+  s.ListInstances(i);
+  ASSERT_EQ(6u, i.size());
+  ASSERT_EQ("z1", i[0].GetId());
+  ASSERT_EQ("a1", i[1].GetId());
+  ASSERT_EQ("m1", i[2].GetId());
+  ASSERT_EQ("b1", i[3].GetId());
+  ASSERT_EQ("y2", i[4].GetId());
+  ASSERT_EQ("c2", i[5].GetId());
 
-    area.WriteInstance("d1", s1.c_str(), s1.size());
-    area.WriteInstance("d2", s2.c_str(), s2.size());
-  
-    area.CheckMD5();
+  {
+    std::vector<TransferBucket> b;
+    s.ComputePullBuckets(b, 10, 1000, "http://localhost/", BucketCompression_None, BucketPacking_Identifier);
+    ASSERT_EQ(4u, b.size());
+    ASSERT_EQ(1u, b[0].GetChunksCount());
+    ASSERT_EQ("m1", b[0].GetChunkInstanceId(0));
+    ASSERT_EQ(2u, b[1].GetChunksCount());
+    ASSERT_EQ("a1", b[1].GetChunkInstanceId(0));
+    ASSERT_EQ("b1", b[1].GetChunkInstanceId(1));
+    ASSERT_EQ(2u, b[2].GetChunksCount());
+    ASSERT_EQ("c2", b[2].GetChunkInstanceId(0));
+    ASSERT_EQ("y2", b[2].GetChunkInstanceId(1));
+    ASSERT_EQ(1u, b[3].GetChunksCount());
+    ASSERT_EQ("z1", b[3].GetChunkInstanceId(0));
   }
 
   {
-    DownloadArea area(instances);
-    ASSERT_THROW(area.CheckMD5(), Orthanc::OrthancException);
+    std::vector<TransferBucket> b;
+    s.ComputePullBuckets(b, 10, 1000, "http://localhost/", BucketCompression_None, BucketPacking_Locality);
+    ASSERT_EQ(4u, b.size());
+    ASSERT_EQ(2u, b[0].GetChunksCount());
+    ASSERT_EQ("z1", b[0].GetChunkInstanceId(0));
+    ASSERT_EQ("a1", b[0].GetChunkInstanceId(1));
+    ASSERT_EQ(1u, b[1].GetChunksCount());
+    ASSERT_EQ("m1", b[1].GetChunkInstanceId(0));
+    ASSERT_EQ(2u, b[2].GetChunksCount());
+    ASSERT_EQ("b1", b[2].GetChunkInstanceId(0));
+    ASSERT_EQ("y2", b[2].GetChunkInstanceId(1));
+    ASSERT_EQ(1u, b[3].GetChunksCount());
+    ASSERT_EQ("c2", b[3].GetChunkInstanceId(0));
 
-    {
-      TransferBucket b;
-      b.AddChunk(instances[0] /*d1*/, 0, 2);
-      area.WriteBucket(b, s1.c_str(), 2, BucketCompression_None);
-    }
+    Json::Value v;
+    std::vector<TransferBucket> c;
+    s.FormatPushTransaction(v, c, 10, 1000, BucketCompression_None, BucketPacking_Locality);
+    ASSERT_EQ(4u, c.size());
+    ASSERT_EQ(4u, v["Buckets"].size());
 
+    for (size_t j = 0; j < b.size(); j++)
     {
-      TransferBucket b;
-      b.AddChunk(instances[0] /*d1*/, 2, 3);
-      b.AddChunk(instances[1] /*d2*/, 0, 4);
-      std::string s = s1.substr(2, 3) + s2.substr(0, 4);
-      area.WriteBucket(b, s.c_str(), s.size(), BucketCompression_None);
+      ASSERT_EQ(b[j].GetChunksCount(), c[j].GetChunksCount());
+      ASSERT_EQ(b[j].GetChunkInstanceId(0), c[j].GetChunkInstanceId(0));
     }
+  }
+}
 
-    {
-      TransferBucket b;
-      b.AddChunk(instances[1] /*d2*/, 4, 9);
-      std::string s = s2.substr(4);
-      std::string t;
-      Orthanc::GzipCompressor compressor;
-      compressor.Compress(t, s.c_str(), s.size());
-      area.WriteBucket(b, t.c_str(), t.size(), BucketCompression_Gzip);
-    }
 
-    area.CheckMD5();
+TEST(TransferScheduler, Balanced)
+{  
+  using namespace OrthancPlugins;
+
+  TransferScheduler s;
+  s.AddInstance(DicomInstanceInfo("a", 6, ""));
+  s.AddInstance(DicomInstanceInfo("b", 4, ""));
+  s.AddInstance(DicomInstanceInfo("c", 5, ""));
+  s.AddInstance(DicomInstanceInfo("d", 5, ""));
+  s.AddInstance(DicomInstanceInfo("e", 3, ""));
+  s.AddInstance(DicomInstanceInfo("f", 30, ""));
+  s.AddInstance(DicomInstanceInfo("g", 7, ""));
+  s.AddInstance(DicomInstanceInfo("h", 2, ""));
+
+  {
+    // Greedy grouping: The 2 chunks of "f" go first, then [a,b]
+    // [c,d] [e,g] and a runt [h] at the end
+    std::vector<TransferBucket> b;
+    s.ComputePullBuckets(b, 10, 20, "http://localhost/", BucketCompression_None, BucketPacking_Identifier);
+    ASSERT_EQ(6u, b.size());
+    ASSERT_EQ(15u, b[0].GetTotalSize());
+    ASSERT_EQ(15u, b[1].GetTotalSize());
+    ASSERT_EQ(10u, b[2].GetTotalSize());
+    ASSERT_EQ(10u, b[3].GetTotalSize());
+    ASSERT_EQ(10u, b[4].GetTotalSize());
+    ASSERT_EQ(2u, b[5].GetTotalSize());
+  }
+
+  {
+    // First-fit decreasing into buckets of at most 20 bytes: [g,a,c,h]
+    // and [d,b,e], then the buckets are sorted by decreasing size
+    std::vector<TransferBucket> b;
+    s.ComputePullBuckets(b, 10, 20, "http://localhost/", BucketCompression_None, BucketPacking_Balanced);
+    ASSERT_EQ(4u, b.size());
+    ASSERT_EQ(4u, b[0].GetChunksCount());
+    ASSERT_EQ("g", b[0].GetChunkInstanceId(0));
+    ASSERT_EQ("a", b[0].GetChunkInstanceId(1));
+    ASSERT_EQ("c", b[0].GetChunkInstanceId(2));
+    ASSERT_EQ("h", b[0].GetChunkInstanceId(3));
+    ASSERT_EQ(20u, b[0].GetTotalSize());
+    ASSERT_EQ("f", b[1].GetChunkInstanceId(0));
+    ASSERT_EQ(0u, b[1].GetChunkOffset(0));
+    ASSERT_EQ("f", b[2].GetChunkInstanceId(0));
+    ASSERT_EQ(15u, b[2].GetChunkOffset(0));
+    ASSERT_EQ(3u, b[3].GetChunksCount());
+    ASSERT_EQ("d", b[3].GetChunkInstanceId(0));
+    ASSERT_EQ("b", b[3].GetChunkInstanceId(1));
+    ASSERT_EQ("e", b[3].GetChunkInstanceId(2));
+    ASSERT_EQ(12u, b[3].GetTotalSize());
+
+    Json::Value v;
+    std::vector<TransferBucket> c;
+    s.FormatPushTransaction(v, c, 10, 20, BucketCompression_None, BucketPacking_Balanced);
+    ASSERT_EQ(4u, c.size());
   }
 }
 
 
+namespace
+{
+  // Expander whose DICOM hierarchy is stored in memory, instead of
+  // being read from the Orthanc core
+  class ResourcesExpanderForTests : public OrthancPlugins::ResourcesExpander
+  {
+  private:
+    typedef std::map<std::string, Json::Value>  Resources;
+
+    boost::mutex                  mutex_;
+    Resources                     resources_;
+    std::map<std::string, size_t> lookups_;
+
+  protected:
+    virtual bool LookupResource(Json::Value& target,
+                                const std::string& uri) ORTHANC_OVERRIDE
+    {
+      boost::mutex::scoped_lock lock(mutex_);
+      lookups_[uri]++;
+
+      Resources::const_iterator found = resources_.find(uri);
+      if (found == resources_.end())
+      {
+        return false;
+      }
+      else
+      {
+        target = found->second;
+        return true;
+      }
+    }
+
+  public:
+    ResourcesExpanderForTests(OrthancPlugins::OrthancInstancesCache& cache,
+                              const Json::Value& resources) :
+      ResourcesExpander(cache, resources)
+    {
+    }
+
+    void AddChildren(const std::string& uri,
+                     const std::string& key,
+                     const std::string& child1,
+                     const std::string& child2)
+    {
+      Json::Value resource;
+      resource[key].append(child1);
+      resource[key].append(child2);
+      resources_[uri] = resource;
+    }
+
+    void AddSeriesInstance(const std::string& series,
+                           const std::string& instance,
+                           int indexInSeries /* negative if unknown */)
+    {
+      Json::Value item;
+      item["ID"] = instance;
+
+      if (indexInSeries >= 0)
+      {
+        item["IndexInSeries"] = indexInSeries;
+      }
+
+      resources_["/series/" + series + "/instances"].append(item);
+    }
+
+    size_t GetLookupsCount(const std::string& uri)
+    {
+      boost::mutex::scoped_lock lock(mutex_);
+      return lookups_[uri];
+    }
+  };
+
+
+  void AddResourceToList(Json::Value& target,
+                         const std::string& level,
+                         const std::string& id)
+  {
+    Json::Value item;
+    item["Level"] = level;
+    item["ID"] = id;
+    target.append(item);
+  }
+}
+
+
+TEST(ResourcesExpander, Basic)
+{
+  InstancesCacheForTests cache(1);
+  cache.SetAttachmentInfoAvailable(true);
+  cache.AddInstance("i1", 10);
+  cache.AddInstance("i2", 20);
+  cache.AddInstance("i3", 30);
+  cache.AddInstance("i4", 40);
+  cache.AddInstance("i5", 50);
+
+  // The study "s1", its series and the instance "i2" are also
+  // contained in the patient: They must only be handled once
+  Json::Value resources = Json::arrayValue;
+  AddResourceToList(resources, "Instance", "i2");
+  AddResourceToList(resources, "Patient", "p");
+  AddResourceToList(resources, "Study", "s1");
+
+  ResourcesExpanderForTests expander(cache, resources);
+  expander.AddChildren("/patients/p", "Studies", "s1", "s2");
+  expander.AddChildren("/studies/s1", "Series", "r1", "r2");
+  expander.AddChildren("/studies/s2", "Series", "r3", "r3");
+  expander.AddSeriesInstance("r1", "i3", 2);
+  expander.AddSeriesInstance("r1", "i1", 0);
+  expander.AddSeriesInstance("r1", "i2", 1);
+  expander.AddSeriesInstance("r2", "i5", -1);
+  expander.AddSeriesInstance("r2", "i4", 7);
+  expander.AddSeriesInstance("r3", "i4", 7);
+
+  OrthancPlugins::TransferScheduler scheduler;
+  ASSERT_THROW(expander.FillScheduler(scheduler), Orthanc::OrthancException);
+
+  {
+    // Interrupted before completion, then resumed
+    OrthancPlugins::ResourcesExpander::Runner runner(expander, 4);
+  }
+
+  {
+    OrthancPlugins::ResourcesExpander::Runner runner(expander, 4);
+    expander.WaitComplete();
+  }
+
+  ASSERT_EQ(OrthancPlugins::ResourcesExpander::Status_Success, expander.WaitComplete(0));
+
+  size_t expandedResources, lookedUpInstances, pendingTasks;
+  expander.GetStatistics(expandedResources, lookedUpInstances, pendingTasks);
+  ASSERT_EQ(6u, expandedResources);
+  ASSERT_EQ(5u, lookedUpInstances);
+  ASSERT_EQ(0u, pendingTasks);
+
+  ASSERT_EQ(1u, expander.GetLookupsCount("/patients/p"));
+  ASSERT_EQ(1u, expander.GetLookupsCount("/studies/s1"));
+  ASSERT_EQ(1u, expander.GetLookupsCount("/series/r3/instances"));
+
+  expander.FillScheduler(scheduler);
+  ASSERT_EQ(5u, scheduler.GetInstancesCount());
+  ASSERT_EQ(150u, scheduler.GetTotalSize());
+
+  // The requested instance comes first, then the hierarchy is
+  // walked in order, by index in the series
+  std::vector<OrthancPlugins::DicomInstanceInfo> instances;
+  scheduler.ListInstances(instances);
+  ASSERT_EQ(5u, instances.size());
+  ASSERT_EQ("i2", instances[0].GetId());
+  ASSERT_EQ("i1", instances[1].GetId());
+  ASSERT_EQ("i3", instances[2].GetId());
+  ASSERT_EQ("i4", instances[3].GetId());
+  ASSERT_EQ("i5", instances[4].GetId());
+  ASSERT_EQ(20u, instances[0].GetSize());
+}
+
+
+TEST(ResourcesExpander, Errors)
+{
+  InstancesCacheForTests cache(1);
+
+  ASSERT_THROW(ResourcesExpanderForTests(cache, Json::objectValue), Orthanc::OrthancException);
+
+  Json::Value bad = Json::arrayValue;
+  AddResourceToList(bad, "Nope", "p");
+  ASSERT_THROW(ResourcesExpanderForTests(cache, bad), Orthanc::OrthancException);
+
+  {
+    Json::Value empty = Json::arrayValue;
+    ResourcesExpanderForTests expander(cache, empty);
+
+    {
+      OrthancPlugins::ResourcesExpander::Runner runner(expander, 2);
+      expander.WaitComplete();
+    }
+
+    OrthancPlugins::TransferScheduler scheduler;
+    expander.FillScheduler(scheduler);
+    ASSERT_EQ(0u, scheduler.GetInstancesCount());
+  }
+
+  {
+    Json::Value resources = Json::arrayValue;
+    AddResourceToList(resources, "Study", "missing");
+
+    ResourcesExpanderForTests expander(cache, resources);
+
+    {
+      OrthancPlugins::ResourcesExpander::Runner runner(expander, 2);
+      expander.WaitComplete();
+    }
+
+    ASSERT_EQ(OrthancPlugins::ResourcesExpander::Status_Failure, expander.WaitComplete(0));
+
+    OrthancPlugins::TransferScheduler scheduler;
+
+    try
+    {
+      expander.FillScheduler(scheduler);
+      FAIL();
+    }
+    catch (Orthanc::OrthancException& e)
+    {
+      ASSERT_EQ(Orthanc::ErrorCode_UnknownResource, e.GetErrorCode());
+    }
+  }
+
+  {
+    // Unknown instance, whose size cannot be retrieved
+    Json::Value resources = Json::arrayValue;
+    AddResourceToList(resources, "Instance", "nope");
+
+    ResourcesExpanderForTests expander(cache, resources);
+
+    {
+      OrthancPlugins::ResourcesExpander::Runner runner(expander, 1);
+      expander.WaitComplete();
+    }
+
+    ASSERT_EQ(OrthancPlugins::ResourcesExpander::Status_Failure, expander.WaitComplete(0));
+  }
+}
+
+
+TEST(ResourcesExpander, Pages)
+{
+  InstancesCacheForTests cache(1);
+  cache.SetLoadDelay(20);  // The instances are not known all at once
+
+  Json::Value resources = Json::arrayValue;
+
+  for (unsigned int i = 0; i < 10; i++)
+  {
+    const std::string id = "i" + boost::lexical_cast<std::string>(i);
+    cache.AddInstance(id, 10 + i);
+    AddResourceToList(resources, "Instance", id);
+  }
+
+  ResourcesExpanderForTests expander(cache, resources);
+
+  std::vector<OrthancPlugins::DicomInstanceInfo> instances;
+  size_t pages = 0;
+
+  {
+    OrthancPlugins::ResourcesExpander::Runner runner(expander, 2);
+
+    for (;;)
+    {
+      OrthancPlugins::ResourcesExpander::Status status =
+        expander.WaitLookedUpInstances(instances, instances.size(), 3, 1000);
+      pages++;
+
+      ASSERT_NE(OrthancPlugins::ResourcesExpander::Status_Failure, status);
+
+      if (status == OrthancPlugins::ResourcesExpander::Status_Success &&
+          instances.size() == 10u)
+      {
+        break;
+      }
+    }
+  }
+
+  ASSERT_LE(4u, pages);
+
+  // Each instance is answered exactly once
+  std::set<std::string> ids;
+  size_t totalSize = 0;
+  for (size_t i = 0; i < instances.size(); i++)
+  {
+    ids.insert(instances[i].GetId());
+    totalSize += instances[i].GetSize();
+  }
+
+  ASSERT_EQ(10u, ids.size());
+  ASSERT_EQ(145u, totalSize);
+
+  // Reading after the end does not wait
+  instances.clear();
+  ASSERT_EQ(OrthancPlugins::ResourcesExpander::Status_Success,
+            expander.WaitLookedUpInstances(instances, 10, 3, 1000));
+  ASSERT_TRUE(instances.empty());
+}
+
+
+TEST(DownloadArea, Basic)
+{
+  using namespace OrthancPlugins;
+  
+  std::string s1 = "Hello";
+  std::string s2 = "Hello, World!";
+
+  std::string md1, md2;
+  Orthanc::Toolbox::ComputeMD5(md1, s1);
+  Orthanc::Toolbox::ComputeMD5(md2, s2);
+  
+  std::vector<DicomInstanceInfo> instances;
+  instances.push_back(DicomInstanceInfo("d1", s1.size(), md1));
+  instances.push_back(DicomInstanceInfo("d2", s2.size(), md2));
+
+  {
+    DownloadArea area(instances);
+    ASSERT_EQ(s1.size() + s2.size(), area.GetTotalSize());
+    ASSERT_THROW(area.CheckMD5(), Orthanc::OrthancException);
+
+    area.WriteInstance("d1", s1.c_str(), s1.size());
+    area.WriteInstance("d2", s2.c_str(), s2.size());
+  
+    area.CheckMD5();
+  }
+
+  {
+    DownloadArea area(instances);
+    ASSERT_THROW(area.CheckMD5(), Orthanc::OrthancException);
+
+    {
+      TransferBucket b;
+      b.AddChunk(instances[0] /*d1*/, 0, 2);
+      area.WriteBucket(b, s1.c_str(), 2, BucketCompression_None);
+    }
+
+    {
+      TransferBucket b;
+      b.AddChunk(instances[0] /*d1*/, 2, 3);
+      b.AddChunk(instances[1] /*d2*/, 0, 4);
+      std::string s = s1.substr(2, 3) + s2.substr(0, 4);
+      area.WriteBucket(b, s.c_str(), s.size(), BucketCompression_None);
+    }
+
+    {
+      TransferBucket b;
+      b.AddChunk(instances[1] /*d2*/, 4, 9);
+      std::string s = s2.substr(4);
+      std::string t;
+      Orthanc::GzipCompressor compressor;
+      compressor.Compress(t, s.c_str(), s.size());
+      area.WriteBucket(b, t.c_str(), t.size(), BucketCompression_Gzip);
+    }
+
+    area.CheckMD5();
+  }
+}
+
+
+TEST(DownloadArea, BucketDigest)
+{
+  using namespace OrthancPlugins;
+  
+  std::string s1 = "Hello";
+  std::string s2 = "Hello, World!";
+
+  std::string md1, md2;
+  Orthanc::Toolbox::ComputeMD5(md1, s1);
+  Orthanc::Toolbox::ComputeMD5(md2, s2);
+
+  std::vector<DicomInstanceInfo> instances;
+  instances.push_back(DicomInstanceInfo("d1", s1.size(), md1));
+  instances.push_back(DicomInstanceInfo("d2", s2.size(), md2));
+
+  for (unsigned int i = 0; i < 2; i++)
+  {
+    if (i == 1)
+    {
+      // Wrong MD5 in the manifest: The digests of the buckets do not
+      // replace the check of the whole instances on commit
+      instances[1] = DicomInstanceInfo("d2", s2.size(), "nope");
+    }
+
+    DownloadArea area(instances);
+
+    TransferBucket b;
+    b.AddChunk(instances[0] /*d1*/, 0, 5);
+    b.AddChunk(instances[1] /*d2*/, 0, 4);
+    std::string s = s1 + s2.substr(0, 4);
+
+    std::string md5;
+    Orthanc::Toolbox::ComputeMD5(md5, s);
+
+    // Corrupted bucket
+    std::string corrupted = s;
+    corrupted[3] = 'X';
+    ASSERT_THROW(area.WriteBucket(b, corrupted.c_str(), corrupted.size(), BucketCompression_None, md5),
+                 Orthanc::OrthancException);
+
+    area.WriteBucket(b, s.c_str(), s.size(), BucketCompression_None, md5);
+
+    {
+      // The bucket is checked before being uncompressed
+      TransferBucket b2;
+      b2.AddChunk(instances[1] /*d2*/, 4, 9);
+
+      std::string t;
+      Orthanc::GzipCompressor compressor;
+      compressor.Compress(t, s2.c_str() + 4, 9);
+
+      std::string md5b;
+      Orthanc::Toolbox::ComputeMD5(md5b, t);
+      ASSERT_THROW(area.WriteBucket(b2, t.c_str(), t.size(), BucketCompression_Gzip, md5), Orthanc::OrthancException);
+      area.WriteBucket(b2, t.c_str(), t.size(), BucketCompression_Gzip, md5b);
+    }
+
+    if (i == 0)
+    {
+      area.CheckMD5();
+    }
+    else
+    {
+      ASSERT_THROW(area.CheckMD5(), Orthanc::OrthancException);
+    }
+  }
+}
+
+
+TEST(HttpQueriesQueue, CorruptedBucket)
+{
+  using namespace OrthancPlugins;
+
+  {
+    // "MaxHttpRetries" is zero
+    HttpQueriesQueue::RetryBudget budget(0, 2);
+    ASSERT_FALSE(budget.Retry(false));
+  }
+
+  {
+    HttpQueriesQueue::RetryBudget budget(1, 2);
+    ASSERT_TRUE(budget.Retry(true));
+    ASSERT_TRUE(budget.Retry(false));
+    ASSERT_TRUE(budget.Retry(true));
+    ASSERT_FALSE(budget.Retry(true));
+    ASSERT_FALSE(budget.Retry(false));
+  }
+
+  std::string s1 = "Hello";
+  std::string s2 = "Hello, World!";
+
+  std::string md1, md2;
+  Orthanc::Toolbox::ComputeMD5(md1, s1);
+  Orthanc::Toolbox::ComputeMD5(md2, s2);
+
+  std::vector<DicomInstanceInfo> instances;
+  instances.push_back(DicomInstanceInfo("d1", s1.size(), md1));
+  instances.push_back(DicomInstanceInfo("d2", s2.size(), md2));
+
+  DownloadArea area(instances);
+
+  TransferBucket bucket;
+  bucket.AddChunk(instances[0], 0, s1.size());
+  bucket.AddChunk(instances[1], 0, s2.size());
+
+  const std::string s = s1 + s2;
+
+  std::map<std::string, std::string> headers;
+  Orthanc::Toolbox::ComputeMD5(headers[HEADER_KEY_BUCKET_MD5], s);
+
+  std::string corrupted = s;
+  corrupted[7] = 'X';
+
+  // Same loop as "HttpQueriesQueue::ExecuteOneQuery()", in which the
+  // first answer of the peer is corrupted
+  BucketPullQuery query(area, bucket, "peer", BucketCompression_None, false, NULL, 0, "");
+  HttpQueriesQueue::RetryBudget budget(0, 2);
+
+  unsigned int attempts = 0;
+
+  for (;;)
+  {
+    const std::string& answer = (attempts == 0 ? corrupted : s);
+    attempts++;
+
+    try
+    {
+      query.HandleAnswer(answer.c_str(), answer.size(), headers);
+      break;
+    }
+    catch (Orthanc::OrthancException& e)
+    {
+      ASSERT_EQ(Orthanc::ErrorCode_CorruptedFile, e.GetErrorCode());
+      ASSERT_TRUE(budget.Retry(true));
+    }
+  }
+
+  ASSERT_EQ(2u, attempts);
+  area.CheckMD5();
+}
+
+
+
+TEST(OrthancInstancesCache, Basic)
+{
+  InstancesCacheForTests cache(2);
+  ASSERT_EQ(2u, cache.GetShardsCount());
+  cache.SetMaxMemorySize(100);
+
+  cache.AddInstance("a", 30);
+  cache.AddInstance("b", 30);
+  cache.AddInstance("c", 30);
+  cache.AddInstance("d", 30);
+
+  size_t size;
+  std::string md5;
+  cache.GetInstanceInfo(size, md5, "a");
+  ASSERT_EQ(30u, size);
+  ASSERT_EQ(1u, cache.GetLoadsCount());
+  ASSERT_EQ(30u, cache.GetMemorySize());
+  ASSERT_EQ(1u, cache.GetInstancesCount());
+
+  {
+    OrthancPlugins::BucketContent content;
+    cache.AddChunk(content, "a", 0, 30);
+    ASSERT_EQ(1u, cache.GetLoadsCount());
+    ASSERT_EQ(30u, content.GetSize());
+    ASSERT_EQ(1u, cache.GetCacheHitCount());
+    ASSERT_EQ(1u, cache.GetCacheMissCount());
+
+    std::string chunk, chunkMD5;
+    content.Flatten(chunk);
+    Orthanc::Toolbox::ComputeMD5(chunkMD5, chunk);
+    ASSERT_EQ(md5, chunkMD5);
+
+    cache.AddChunk(content, "a", 10, 5);
+    ASSERT_EQ(2u, content.GetSlicesCount());
+    ASSERT_EQ(35u, content.GetSize());
+    ASSERT_EQ(5u, content.GetSlice(1).GetSize());
+    ASSERT_EQ(static_cast<char>((10 * 7 + 1) % 256),
+              reinterpret_cast<const char*>(content.GetSlice(1).GetData()) [0]);
+    ASSERT_THROW(cache.AddChunk(content, "a", 10, 21), Orthanc::OrthancException);
+    ASSERT_EQ(2u, content.GetSlicesCount());
+  }
+
+  cache.GetInstanceInfo(size, md5, "b");
+  cache.GetInstanceInfo(size, md5, "c");
+  ASSERT_EQ(3u, cache.GetLoadsCount());
+  ASSERT_EQ(90u, cache.GetMemorySize());
+  ASSERT_EQ(3u, cache.GetInstancesCount());
+
+  // The global budget must be respected, whatever the shards are
+  cache.GetInstanceInfo(size, md5, "d");
+  ASSERT_EQ(4u, cache.GetLoadsCount());
+  ASSERT_LE(cache.GetMemorySize(), 100u);
+  ASSERT_EQ(30u * cache.GetInstancesCount(), cache.GetMemorySize());
+
+  ASSERT_THROW(cache.GetInstanceInfo(size, md5, "nope"), Orthanc::OrthancException);
+
+  cache.SetMaxMemorySize(30);
+  ASSERT_EQ(30u, cache.GetMemorySize());
+  ASSERT_EQ(1u, cache.GetInstancesCount());
+}
+
+
+TEST(OrthancInstancesCache, Oversized)
+{
+  for (size_t shards = 1; shards <= 4; shards++)
+  {
+    InstancesCacheForTests cache(shards);
+    cache.SetMaxMemorySize(100);
+    cache.AddInstance("small", 10);
+    cache.AddInstance("large", 500);
+
+    size_t size;
+    std::string md5;
+    cache.GetInstanceInfo(size, md5, "small");
+    ASSERT_EQ(10u, cache.GetMemorySize());
+
+    // A single instance is allowed to overtake the budget
+    cache.GetInstanceInfo(size, md5, "large");
+    ASSERT_EQ(500u, size);
+    ASSERT_EQ(500u, cache.GetMemorySize());
+    ASSERT_EQ(1u, cache.GetInstancesCount());
+
+    cache.GetInstanceInfo(size, md5, "large");
+    ASSERT_EQ(2u, cache.GetLoadsCount());
+  }
+}
+
+
+TEST(OrthancInstancesCache, Concurrency)
+{
+  InstancesCacheForTests cache(8);
+  cache.SetMaxMemorySize(20 * 1000);
+
+  for (size_t i = 0; i < 50; i++)
+  {
+    cache.AddInstance("instance-" + boost::lexical_cast<std::string>(i), 1000);
+  }
+
+  struct Worker
+  {
+    static void Apply(InstancesCacheForTests* cache,
+                      size_t seed)
+    {
+      for (size_t i = 0; i < 1000; i++)
+      {
+        OrthancPlugins::BucketContent content;
+        cache->AddChunk(content, "instance-" + boost::lexical_cast<std::string>((seed * 31 + i * 17) % 50), i % 500, 100);
+        ASSERT_EQ(100u, content.GetSize());
+      }
+    }
+  };
+
+  std::vector<boost::thread*> threads;
+  for (size_t i = 0; i < 8; i++)
+  {
+    threads.push_back(new boost::thread(Worker::Apply, &cache, i));
+  }
+
+  for (size_t i = 0; i < threads.size(); i++)
+  {
+    threads[i]->join();
+    delete threads[i];
+  }
+
+  ASSERT_LE(cache.GetMemorySize(), 20u * 1000u);
+  ASSERT_EQ(1000u * cache.GetInstancesCount(), cache.GetMemorySize());
+  ASSERT_EQ(8000u, cache.GetCacheHitCount() + cache.GetLoadsCount() + cache.GetMergedLoadsCount());
+  ASSERT_EQ(cache.GetCacheMissCount(), cache.GetLoadsCount());
+}
+
+
+TEST(OrthancInstancesCache, SingleFlight)
+{
+  struct Worker
+  {
+    static void Apply(InstancesCacheForTests* cache,
+                      const std::string* instanceId,
+                      bool* success)
+    {
+      try
+      {
+        size_t size;
+        std::string md5;
+        cache->GetInstanceInfo(size, md5, *instanceId);
+        *success = (size == 1000);
+      }
+      catch (Orthanc::OrthancException&)
+      {
+        *success = false;
+      }
+    }
+  };
+
+  static const size_t THREADS_COUNT = 8;
+
+  InstancesCacheForTests cache(4);
+  cache.AddInstance("large", 1000);
+  cache.SetLoadDelay(200);
+
+  const std::string ids[2] = { "large", "missing" };
+
+  for (size_t i = 0; i < 2; i++)
+  {
+    bool success[THREADS_COUNT];
+
+    std::vector<boost::thread*> threads;
+    for (size_t j = 0; j < THREADS_COUNT; j++)
+    {
+      threads.push_back(new boost::thread(Worker::Apply, &cache, &ids[i], &success[j]));
+    }
+
+    for (size_t j = 0; j < threads.size(); j++)
+    {
+      threads[j]->join();
+      delete threads[j];
+      ASSERT_EQ(i == 0, success[j]);  // The load of "missing" fails for all the threads
+    }
+
+    ASSERT_EQ(i + 1, cache.GetLoadsCount());
+    ASSERT_EQ((i + 1) * (THREADS_COUNT - 1), cache.GetMergedLoadsCount());
+  }
+
+  ASSERT_EQ(1u, cache.GetCacheMissCount());
+  ASSERT_EQ(0u, cache.GetCacheHitCount());
+  ASSERT_EQ(1000u, cache.GetMemorySize());
+}
+
+
+TEST(InstanceInfoIndex, Basic)
+{
+  ASSERT_THROW(OrthancPlugins::InstanceInfoIndex(0), Orthanc::OrthancException);
+
+  OrthancPlugins::InstanceInfoIndex index(2);
+  ASSERT_THROW(index.Register(OrthancPlugins::DicomInstanceInfo("a", 10, "")), Orthanc::OrthancException);
+
+  index.Register(OrthancPlugins::DicomInstanceInfo("a", 10, "md5a"));
+  index.Register(OrthancPlugins::DicomInstanceInfo("b", 20, "md5b"));
+  ASSERT_EQ(2u, index.GetSize());
+
+  OrthancPlugins::DicomInstanceInfo info;
+  ASSERT_TRUE(index.Lookup(info, "a"));
+  ASSERT_EQ("a", info.GetId());
+  ASSERT_EQ(10u, info.GetSize());
+  ASSERT_EQ("md5a", info.GetMD5());
+
+  // "b" is the least recently used entry
+  index.Register(OrthancPlugins::DicomInstanceInfo("c", 30, "md5c"));
+  ASSERT_EQ(2u, index.GetSize());
+  ASSERT_FALSE(index.Lookup(info, "b"));
+  ASSERT_TRUE(index.Lookup(info, "c"));
+  ASSERT_EQ(30u, info.GetSize());
+
+  index.Register(OrthancPlugins::DicomInstanceInfo("c", 31, "md5d"));
+  ASSERT_TRUE(index.Lookup(info, "c"));
+  ASSERT_EQ(31u, info.GetSize());
+  ASSERT_EQ("md5d", info.GetMD5());
+
+  index.Forget("c");
+  index.Forget("nope");
+  ASSERT_EQ(1u, index.GetSize());
+  ASSERT_FALSE(index.Lookup(info, "c"));
+  ASSERT_EQ(3u, index.GetHitCount());
+  ASSERT_EQ(2u, index.GetMissCount());
+
+  // Entries without MD5, if Orthanc does not store it
+  size_t size;
+  index.RegisterSize("d", 40);
+  ASSERT_FALSE(index.Lookup(info, "d"));
+  ASSERT_TRUE(index.LookupSize(size, "d"));
+  ASSERT_EQ(40u, size);
+  ASSERT_FALSE(index.LookupSize(size, "c"));
+
+  // The MD5 replaces the size-only entry, but not the other way round
+  index.Register(OrthancPlugins::DicomInstanceInfo("d", 41, "md5d"));
+  index.RegisterSize("d", 42);
+  ASSERT_TRUE(index.Lookup(info, "d"));
+  ASSERT_EQ(41u, info.GetSize());
+  ASSERT_TRUE(index.LookupSize(size, "d"));
+  ASSERT_EQ(41u, size);
+}
+
+
+TEST(OrthancInstancesCache, InstanceInfo)
+{
+  InstancesCacheForTests cache(1);
+  cache.AddInstance("a", 30);
+  cache.AddInstance("b", 40);
+
+  size_t size;
+  std::string md5, md5a, md5b;
+
+  // No attachment information: The DICOM file is read
+  cache.GetInstanceInfo(size, md5a, "a");
+  ASSERT_EQ(30u, size);
+  ASSERT_EQ(1u, cache.GetLoadsCount());
+
+  // Once read, the information is in the index
+  cache.SetMaxMemorySize(1);
+  cache.GetInstanceInfo(size, md5, "a");
+  ASSERT_EQ(30u, size);
+  ASSERT_EQ(md5a, md5);
+  ASSERT_EQ(1u, cache.GetLoadsCount());
+
+  // The attachment information avoids reading the DICOM file
+  cache.SetAttachmentInfoAvailable(true);
+  cache.GetInstanceInfo(size, md5b, "b");
+  ASSERT_EQ(40u, size);
+  ASSERT_EQ(1u, cache.GetLoadsCount());
+  ASSERT_EQ(1u, cache.GetInfoIndex().GetHitCount());
+
+  // The information registered by "OnStoredInstance()" has priority
+  cache.GetInfoIndex().Register(OrthancPlugins::DicomInstanceInfo("c", 50, "md5c"));
+  cache.GetInstanceInfo(size, md5, "c");
+  ASSERT_EQ(50u, size);
+  ASSERT_EQ("md5c", md5);
+  ASSERT_EQ(1u, cache.GetLoadsCount());
+
+  // The MD5 from the index must match the one of the DICOM file
+  cache.GetInfoIndex().Forget("b");
+  cache.SetAttachmentInfoAvailable(false);
+  cache.GetInstanceInfo(size, md5, "b");
+  ASSERT_EQ(40u, size);
+  ASSERT_EQ(md5b, md5);
+  ASSERT_EQ(2u, cache.GetLoadsCount());
+
+  ASSERT_THROW(cache.GetInstanceInfo(size, md5, "nope"), Orthanc::OrthancException);
+}
+
+
+TEST(OrthancInstancesCache, IsInstanceStored)
+{
+  InstancesCacheForTests cache(1);
+  cache.AddInstance("a", 30);
+
+  size_t size;
+  std::string md5;
+  cache.GetInstanceInfo(size, md5, "a");
+
+  // The index is not trusted, only the attachments of Orthanc
+  ASSERT_FALSE(cache.IsInstanceStored(OrthancPlugins::DicomInstanceInfo("a", 30, md5)));
+
+  cache.SetAttachmentInfoAvailable(true);
+  ASSERT_TRUE(cache.IsInstanceStored(OrthancPlugins::DicomInstanceInfo("a", 30, md5)));
+  ASSERT_FALSE(cache.IsInstanceStored(OrthancPlugins::DicomInstanceInfo("a", 31, md5)));
+  ASSERT_FALSE(cache.IsInstanceStored(OrthancPlugins::DicomInstanceInfo("a", 30, "nope")));
+  ASSERT_FALSE(cache.IsInstanceStored(OrthancPlugins::DicomInstanceInfo("a", 30, "")));
+  ASSERT_FALSE(cache.IsInstanceStored(OrthancPlugins::DicomInstanceInfo("b", 30, md5)));
+
+  ASSERT_EQ(1u, cache.GetLoadsCount());
+}
+
+
+TEST(BucketContent, Compression)
+{
+  InstancesCacheForTests cache(1);
+  cache.AddInstance("a", 100000);
+  cache.AddInstance("b", 5);
+  cache.AddInstance("c", 70000);
+
+  OrthancPlugins::BucketContent content;
+
+  std::string s;
+  content.Flatten(s);
+  ASSERT_TRUE(s.empty());
+  content.Compress(s, OrthancPlugins::BucketCompression_Gzip);
+
+  std::string u;
+  Orthanc::GzipCompressor gzip;
+  Orthanc::IBufferCompressor::Uncompress(u, gzip, s);
+  ASSERT_TRUE(u.empty());
+  
+  cache.AddChunk(content, "a", 50000, 50000);
+  cache.AddChunk(content, "b", 0, 0);  // Ignored
+  cache.AddChunk(content, "b", 0, 5);
+  cache.AddChunk(content, "c", 0, 30000);
+  ASSERT_EQ(3u, content.GetSlicesCount());
+  ASSERT_EQ(80005u, content.GetSize());
+
+  std::string raw;
+  content.Compress(raw, OrthancPlugins::BucketCompression_None);
+  ASSERT_EQ(80005u, raw.size());
+  ASSERT_EQ(0, memcmp(raw.c_str(), content.GetSlice(0).GetData(), 50000));
+  ASSERT_EQ(0, memcmp(raw.c_str() + 50000, content.GetSlice(1).GetData(), 5));
+  ASSERT_EQ(0, memcmp(raw.c_str() + 50005, content.GetSlice(2).GetData(), 30000));
+
+  std::string compressed;
+  content.Compress(compressed, OrthancPlugins::BucketCompression_Gzip);
+  ASSERT_LT(compressed.size(), raw.size());
+
+  // The streamed compression must be compatible with the Orthanc framework
+  Orthanc::IBufferCompressor::Uncompress(u, gzip, compressed);
+  ASSERT_EQ(raw, u);
+}
+
+
+namespace
+{
+  class CompressionTaskForTests : public OrthancPlugins::CompressionThreadPool::ITask
+  {
+  private:
+    std::vector<unsigned int>&  output_;
+    size_t                      index_;
+    bool                        fail_;
+
+  public:
+    CompressionTaskForTests(std::vector<unsigned int>& output,
+                            size_t index,
+                            bool fail) :
+      output_(output),
+      index_(index),
+      fail_(fail)
+    {
+    }
+
+    virtual void Apply() ORTHANC_OVERRIDE
+    {
+      if (fail_)
+      {
+        throw Orthanc::OrthancException(Orthanc::ErrorCode_CorruptedFile);
+      }
+
+      boost::this_thread::sleep(boost::posix_time::microseconds(100));
+      output_[index_]++;
+    }
+  };
+
+
+  // Compressible content, split into segments of various sizes
+  void GenerateSegments(std::string& raw,
+                        OrthancPlugins::BlockCompression::Segments& segments,
+                        size_t size)
+  {
+    raw.resize(size);
+
+    uint32_t state = 42;
+    for (size_t i = 0; i < size; i++)
+    {
+      state = state * 1664525u + 1013904223u;
+      raw[i] = static_cast<char>((i / 64) % 16 + ((state >> 24) % 4));
+    }
+
+    segments.clear();
+
+    for (size_t pos = 0, count = 1; pos < size; count = count * 3 + 7)
+    {
+      const size_t length = std::min(count, size - pos);
+      segments.push_back(std::make_pair(raw.c_str() + pos, length));
+      pos += length;
+    }
+  }
+}
+
+
+TEST(CompressedBucketsCache, Basic)
+{
+  using namespace OrthancPlugins;
+
+  InstancesCacheForTests cache(1);
+  cache.AddInstance("a", 100000);
+  cache.AddInstance("b", 70000);
+
+  BucketContent ab;
+  cache.AddChunk(ab, "a", 50000, 50000);
+  cache.AddChunk(ab, "b", 0, 30000);
+
+  BucketContent b;
+  cache.AddChunk(b, "b", 0, 30000);
+
+  CompressedBucketsCache compressed(1024 * 1024);
+  ASSERT_EQ(0u, compressed.GetSize());
+  ASSERT_EQ(0u, compressed.GetCount());
+  ASSERT_DOUBLE_EQ(0, compressed.GetHitRatio());
+
+  CompressedBucketsCache::PayloadPtr p1 = compressed.Compress(ab, BucketCompression_Gzip, 0);
+
+  {
+    std::string expected;
+    ab.Compress(expected, BucketCompression_Gzip, 0);
+    ASSERT_EQ(expected, p1->GetData());
+
+    std::string md5, expectedMD5;
+    ASSERT_TRUE(p1->LookupMD5(md5));
+    Orthanc::Toolbox::ComputeMD5(expectedMD5, expected);
+    ASSERT_EQ(expectedMD5, md5);
+  }
+
+  ASSERT_EQ(1u, compressed.GetCount());
+  ASSERT_LT(p1->GetData().size(), compressed.GetSize());
+  ASSERT_EQ(0u, compressed.GetHitCount());
+  ASSERT_EQ(1u, compressed.GetMissCount());
+
+  // Another bucket with the same content hits the cache
+  {
+    BucketContent again;
+    cache.AddChunk(again, "a", 50000, 50000);
+    cache.AddChunk(again, "b", 0, 30000);
+
+    CompressedBucketsCache::PayloadPtr p2 = compressed.Compress(again, BucketCompression_Gzip, 0);
+    ASSERT_EQ(p1.get(), p2.get());
+    ASSERT_EQ(1u, compressed.GetHitCount());
+    ASSERT_DOUBLE_EQ(0.5, compressed.GetHitRatio());
+    ASSERT_DOUBLE_EQ(p1->GetCompressionTime(), compressed.GetSavedCompressionTime());
+  }
+
+  // The level and the slices are part of the key
+  ASSERT_NE(p1.get(), compressed.Compress(ab, BucketCompression_Gzip, 1).get());
+  ASSERT_NE(p1.get(), compressed.Compress(b, BucketCompression_Gzip, 0).get());
+  ASSERT_EQ(3u, compressed.GetCount());
+  ASSERT_EQ(3u, compressed.GetMissCount());
+
+  // The buckets that are not compressed are not cached
+  {
+    CompressedBucketsCache::PayloadPtr raw = compressed.Compress(ab, BucketCompression_None, 0);
+    ASSERT_EQ(80000u, raw->GetData().size());
+
+    std::string md5;
+    ASSERT_FALSE(raw->LookupMD5(md5));
+    ASSERT_EQ(3u, compressed.GetCount());
+    ASSERT_EQ(3u, compressed.GetMissCount());
+  }
+
+  // The MD5 of the instances is part of the key: A modified instance
+  // with the same identifier does not hit the cache
+  {
+    InstancesCacheForTests modified(1);
+    modified.AddInstance("a", 100001);
+    modified.AddInstance("b", 70000);
+
+    BucketContent content;
+    modified.AddChunk(content, "a", 50000, 50000);
+    modified.AddChunk(content, "b", 0, 30000);
+
+    std::string key1, key2;
+    CompressedBucketsCache::ComputeKey(key1, ab, BucketCompression_Gzip, 0);
+    CompressedBucketsCache::ComputeKey(key2, content, BucketCompression_Gzip, 0);
+    ASSERT_NE(key1, key2);
+
+    CompressedBucketsCache::ComputeKey(key2, ab, BucketCompression_Gzip, 0);
+    ASSERT_EQ(key1, key2);
+  }
+
+  // The least recently used payloads are evicted first
+  compressed.Compress(ab, BucketCompression_Gzip, 0);  // Hit
+  compressed.SetMaxSize(compressed.GetSize() - 1);
+  ASSERT_EQ(2u, compressed.GetCount());
+  ASSERT_EQ(p1.get(), compressed.Compress(ab, BucketCompression_Gzip, 0).get());
+  ASSERT_EQ(3u, compressed.GetHitCount());
+
+  // The evicted payloads remain valid for their users
+  ASSERT_FALSE(p1->GetData().empty());
+  compressed.SetMaxSize(0);
+  ASSERT_EQ(0u, compressed.GetCount());
+  ASSERT_EQ(0u, compressed.GetSize());
+  ASSERT_FALSE(p1->GetData().empty());
+
+  // Disabled cache
+  ASSERT_NE(p1.get(), compressed.Compress(ab, BucketCompression_Gzip, 0).get());
+  ASSERT_EQ(0u, compressed.GetCount());
+  ASSERT_EQ(3u, compressed.GetHitCount());
+  ASSERT_EQ(3u, compressed.GetMissCount());
+
+  // A payload that is larger than the cache is not stored
+  compressed.SetMaxSize(p1->GetData().size());
+  compressed.Compress(ab, BucketCompression_Gzip, 0);
+  ASSERT_EQ(0u, compressed.GetCount());
+}
+
+
+TEST(CompressedBucketsCache, Invalidate)
+{
+  using namespace OrthancPlugins;
+
+  InstancesCacheForTests cache(1);
+  cache.AddInstance("a", 10000);
+  cache.AddInstance("b", 10000);
+
+  BucketContent ab;
+  cache.AddChunk(ab, "a", 0, 10000);
+  cache.AddChunk(ab, "b", 0, 10000);
+
+  BucketContent b;
+  cache.AddChunk(b, "b", 0, 5000);
+
+  CompressedBucketsCache compressed(1024 * 1024);
+  compressed.Compress(ab, BucketCompression_Gzip, 0);
+  compressed.Compress(b, BucketCompression_Gzip, 0);
+  ASSERT_EQ(2u, compressed.GetCount());
+
+  compressed.Invalidate("c");
+  ASSERT_EQ(2u, compressed.GetCount());
+
+  compressed.Invalidate("a");
+  ASSERT_EQ(1u, compressed.GetCount());
+  compressed.Compress(b, BucketCompression_Gzip, 0);
+  ASSERT_EQ(1u, compressed.GetHitCount());
+
+  compressed.Invalidate("b");
+  ASSERT_EQ(0u, compressed.GetCount());
+  ASSERT_EQ(0u, compressed.GetSize());
+
+  compressed.Compress(ab, BucketCompression_Gzip, 0);
+  ASSERT_EQ(1u, compressed.GetHitCount());
+  ASSERT_EQ(1u, compressed.GetCount());
+}
+
+
+TEST(CompressionThreadPool, Basic)
+{
+  using namespace OrthancPlugins;
+
+  for (size_t threads = 0; threads <= 4; threads += 2)
+  {
+    CompressionThreadPool pool(threads);
+    ASSERT_EQ(threads, pool.GetThreadsCount());
+
+    std::vector<unsigned int> output(100);
+    std::vector<CompressionThreadPool::ITask*> tasks;
+
+    for (size_t i = 0; i < output.size(); i++)
+    {
+      tasks.push_back(new CompressionTaskForTests(output, i, false));
+    }
+
+    CompressionThreadPool::Run(&pool, tasks);
+    CompressionThreadPool::Run(NULL, tasks);
+
+    for (size_t i = 0; i < output.size(); i++)
+    {
+      ASSERT_EQ(2u, output[i]);
+    }
+
+    // The first error is reported once all the tasks are over
+    tasks.push_back(new CompressionTaskForTests(output, 0, true));
+    ASSERT_THROW(CompressionThreadPool::Run(&pool, tasks), Orthanc::OrthancException);
+
+    for (size_t i = 1; i < output.size(); i++)
+    {
+      ASSERT_EQ(3u, output[i]);
+    }
+
+    for (size_t i = 0; i < tasks.size(); i++)
+    {
+      delete tasks[i];
+    }
+  }
+}
+
+
+TEST(BlockCompression, Gzip)
+{
+  using namespace OrthancPlugins;
+
+  std::string raw;
+  BlockCompression::Segments segments;
+  GenerateSegments(raw, segments, 300000);
+
+  Orthanc::GzipCompressor gzip;
+
+  std::string single;
+  BlockCompression::Configure(NULL, 0);
+  BlockCompression::Compress(single, segments, BucketCompression_Gzip, 0);
+  ASSERT_EQ(0x00, static_cast<uint8_t>(single[3]));  // No extra field
+
+  CompressionThreadPool pool(3);
+
+  for (unsigned int i = 0; i < 2; i++)
+  {
+    BlockCompression::Configure(i == 0 ? NULL : &pool, 64 * 1024);
+
+    std::string compressed;
+    BlockCompression::Compress(compressed, segments, BucketCompression_Gzip, 0);
+    ASSERT_EQ(0x04, static_cast<uint8_t>(compressed[3]));  // FEXTRA
+    ASSERT_EQ('O', compressed[12]);
+    ASSERT_EQ('T', compressed[13]);
+    ASSERT_EQ(5u * 8u, static_cast<uint8_t>(compressed[14]));  // 5 blocks
+    ASSERT_LT(compressed.size(), raw.size() / 2);
+
+    // The receivers that ignore the blocks can still uncompress
+    std::string u;
+    Orthanc::IBufferCompressor::Uncompress(u, gzip, compressed);
+    ASSERT_EQ(raw, u);
+
+    BlockCompression::Uncompress(u, compressed.c_str(), compressed.size(), raw.size(), BucketCompression_Gzip);
+    ASSERT_EQ(raw, u);
+
+    // Standard gzip is uncompressed as a whole
+    BlockCompression::Uncompress(u, single.c_str(), single.size(), raw.size(), BucketCompression_Gzip);
+    ASSERT_EQ(raw, u);
+
+    ASSERT_THROW(BlockCompression::Uncompress(u, compressed.c_str(), compressed.size(), raw.size() - 1,
+                                              BucketCompression_Gzip), Orthanc::OrthancException);
+    ASSERT_THROW(BlockCompression::Uncompress(u, compressed.c_str(), compressed.size() - 1, raw.size(),
+                                              BucketCompression_Gzip), Orthanc::OrthancException);
+
+    // Corruption of the last byte of the first block, then of the CRC32
+    std::string corrupted = compressed;
+    corrupted[corrupted.size() / 2] ^= 0x55;
+    ASSERT_THROW(BlockCompression::Uncompress(u, corrupted.c_str(), corrupted.size(), raw.size(),
+                                              BucketCompression_Gzip), Orthanc::OrthancException);
+
+    corrupted = compressed;
+    corrupted[corrupted.size() - 8] ^= 0x01;
+    ASSERT_THROW(BlockCompression::Uncompress(u, corrupted.c_str(), corrupted.size(), raw.size(),
+                                              BucketCompression_Gzip), Orthanc::OrthancException);
+  }
+
+  {
+    // Too many blocks for the gzip header: The blocks are enlarged
+    BlockCompression::Configure(&pool, 16);
+
+    std::string compressed, u;
+    BlockCompression::Compress(compressed, segments, BucketCompression_Gzip, 0);
+    BlockCompression::Uncompress(u, compressed.c_str(), compressed.size(), raw.size(), BucketCompression_Gzip);
+    ASSERT_EQ(raw, u);
+  }
+
+  {
+    // Empty content
+    BlockCompression::Segments empty;
+    std::string compressed, u;
+    BlockCompression::Compress(compressed, empty, BucketCompression_Gzip, 0);
+    BlockCompression::Uncompress(u, compressed.c_str(), compressed.size(), 0, BucketCompression_Gzip);
+    ASSERT_TRUE(u.empty());
+  }
+
+  BlockCompression::Configure(NULL, 0);
+}
+
+
+TEST(BlockCompression, DownloadArea)
+{
+  using namespace OrthancPlugins;
+
+  InstancesCacheForTests cache(1);
+  cache.AddInstance("a", 300000);
+  cache.AddInstance("b", 200000);
+
+  std::vector<DicomInstanceInfo> instances;
+
+  for (char c = 'a'; c <= 'b'; c++)
+  {
+    size_t size;
+    std::string md5;
+    cache.GetInstanceInfo(size, md5, std::string(1, c));
+    instances.push_back(DicomInstanceInfo(std::string(1, c), size, md5));
+  }
+
+  TransferBucket bucket;
+  bucket.AddChunk(instances[0], 0, 300000);
+  bucket.AddChunk(instances[1], 0, 200000);
+
+  BucketContent content;
+  cache.ReadBucket(content, bucket);
+
+  CompressionThreadPool pool(2);
+  BlockCompression::Configure(&pool, 100 * 1024);
+
+  std::vector<BucketCompression> compressions;
+  compressions.push_back(BucketCompression_Gzip);
+
+  if (IsBucketCompressionSupported(BucketCompression_Zstd))
+  {
+    compressions.push_back(BucketCompression_Zstd);
+  }
+
+  for (size_t i = 0; i < compressions.size(); i++)
+  {
+    std::string compressed;
+    content.Compress(compressed, compressions[i]);
+
+    DownloadArea area(instances);
+    area.WriteBucket(bucket, compressed.c_str(), compressed.size(), compressions[i]);
+    area.CheckMD5();
+  }
+
+  BlockCompression::Configure(NULL, 0);
+}
+
+
+namespace
+{
+  // DICOM file made of a meta-information header with the given
+  // transfer syntax, followed by "size" bytes of random or of
+  // compressible content
+  void GenerateDicomFile(std::string& target,
+                         const std::string& transferSyntax,
+                         size_t size,
+                         bool random)
+  {
+    std::string uid = transferSyntax;
+    if (uid.size() % 2 == 1)
+    {
+      uid.push_back('\0');
+    }
+
+    target.assign(128, '\0');
+    target.append("DICM");
+
+    // (0002,0001) OB: File Meta Information Version
+    const char version[] = { 0x02, 0x00, 0x01, 0x00, 'O', 'B', 0x00, 0x00, 0x02, 0x00, 0x00, 0x00, 0x00, 0x01 };
+    target.append(version, sizeof(version));
+
+    // (0002,0010) UI: Transfer Syntax UID
+    const char tag[] = { 0x02, 0x00, 0x10, 0x00, 'U', 'I',
+                         static_cast<char>(uid.size() & 0xff), static_cast<char>(uid.size() >> 8) };
+    target.append(tag, sizeof(tag));
+    target.append(uid);
+
+    uint32_t state = static_cast<uint32_t>(size);
+    for (size_t i = 0; i < size; i++)
+    {
+      state = state * 1664525u + 1013904223u;
+      target.push_back(random ? static_cast<char>(state >> 24) : static_cast<char>((i / 128) % 8));
+    }
+  }
+}
+
+
+TEST(AutoCompression, TransferSyntax)
+{
+  using namespace OrthancPlugins;
+
+  std::string dicom, s;
+  GenerateDicomFile(dicom, "1.2.840.10008.1.2.4.50", 100, true);
+  ASSERT_TRUE(AutoCompression::LookupTransferSyntax(s, dicom.c_str(), dicom.size()));
+  ASSERT_EQ("1.2.840.10008.1.2.4.50", s);
+  ASSERT_TRUE(AutoCompression::IsCompressedTransferSyntax(s));
+
+  GenerateDicomFile(dicom, "1.2.840.10008.1.2.1", 100, true);
+  ASSERT_TRUE(AutoCompression::LookupTransferSyntax(s, dicom.c_str(), dicom.size()));
+  ASSERT_EQ("1.2.840.10008.1.2.1", s);  // The padding is removed
+  ASSERT_FALSE(AutoCompression::IsCompressedTransferSyntax(s));
+
+  ASSERT_FALSE(AutoCompression::LookupTransferSyntax(s, dicom.c_str(), 150));  // Truncated
+  ASSERT_FALSE(AutoCompression::LookupTransferSyntax(s, dicom.c_str() + 1, dicom.size() - 1));
+  ASSERT_FALSE(AutoCompression::LookupTransferSyntax(s, NULL, 0));
+
+  ASSERT_TRUE(AutoCompression::IsCompressedTransferSyntax("1.2.840.10008.1.2.4.90"));  // JPEG 2000
+  ASSERT_TRUE(AutoCompression::IsCompressedTransferSyntax("1.2.840.10008.1.2.4.80"));  // JPEG-LS
+  ASSERT_TRUE(AutoCompression::IsCompressedTransferSyntax("1.2.840.10008.1.2.5"));     // RLE
+  ASSERT_FALSE(AutoCompression::IsCompressedTransferSyntax("1.2.840.10008.1.2"));
+  ASSERT_FALSE(AutoCompression::IsCompressedTransferSyntax("1.2.840.10008.1.2.2"));
+}
+
+
+TEST(AutoCompression, IsCompressible)
+{
+  using namespace OrthancPlugins;
+
+  std::string random, constant;
+  GenerateDicomFile(random, "", 200000, true);
+  GenerateDicomFile(constant, "", 200000, false);
+
+  ASSERT_FALSE(AutoCompression::IsCompressible(random.c_str() + 200, random.size() - 200));
+  ASSERT_TRUE(AutoCompression::IsCompressible(constant.c_str() + 200, constant.size() - 200));
+  ASSERT_TRUE(AutoCompression::IsCompressible(random.c_str() + 200, 1000));  // Small data
+}
+
+
+#if ORTHANC_TRANSFERS_ENABLE_ZSTD == 1
+TEST(AutoCompression, Bucket)
+{
+  using namespace OrthancPlugins;
+
+  std::vector<boost::shared_ptr<SourceDicomInstance> > files;
+
+  {
+    std::string jpeg, raw, page, noise;
+    GenerateDicomFile(jpeg, "1.2.840.10008.1.2.4.50", 100000, true);
+    GenerateDicomFile(raw, "1.2.840.10008.1.2.1", 100000, false);
+    GenerateDicomFile(page, "", 100000, false);
+    GenerateDicomFile(noise, "", 100000, true);
+
+    // The last two files have no meta-information header, which
+    // simulates the pages of the range reads
+    files.push_back(boost::shared_ptr<SourceDicomInstance>(new SourceDicomInstance("jpeg", jpeg)));
+    files.push_back(boost::shared_ptr<SourceDicomInstance>(new SourceDicomInstance("raw", raw)));
+    files.push_back(boost::shared_ptr<SourceDicomInstance>(new SourceDicomInstance("page", page.substr(200))));
+    files.push_back(boost::shared_ptr<SourceDicomInstance>(new SourceDicomInstance("noise", noise.substr(200))));
+  }
+
+  std::vector<DicomInstanceInfo> instances;
+  TransferBucket bucket;
+  BucketContent content;
+
+  for (size_t i = 0; i < files.size(); i++)
+  {
+    instances.push_back(files[i]->GetInfo());
+    bucket.AddChunk(files[i]->GetInfo(), 0, files[i]->GetInfo().GetSize());
+    content.AddSlice(files[i], 0, files[i]->GetInfo().GetSize());
+  }
+
+  std::string flat, zstd, compressed, u;
+  content.Flatten(flat);
+  content.Compress(zstd, BucketCompression_Zstd);
+  content.Compress(compressed, BucketCompression_Auto);
+
+  // The JPEG and the noise are sent raw, the rest is compressed
+  ASSERT_GT(compressed.size(), files[0]->GetInfo().GetSize() + files[3]->GetInfo().GetSize());
+  ASSERT_LT(compressed.size(), files[0]->GetInfo().GetSize() + files[3]->GetInfo().GetSize() + 10000);
+  ASSERT_LT(compressed.size(), flat.size() / 2 + 10000);
+
+  AutoCompression::Uncompress(u, compressed.c_str(), compressed.size(), flat.size());
+  ASSERT_EQ(flat, u);
+
+  ASSERT_THROW(AutoCompression::Uncompress(u, compressed.c_str(), compressed.size() - 1, flat.size()),
+               Orthanc::OrthancException);
+  ASSERT_THROW(AutoCompression::Uncompress(u, compressed.c_str(), compressed.size(), flat.size() + 1),
+               Orthanc::OrthancException);
+
+  std::string corrupted = compressed;
+  corrupted[0] = 7;  // Unknown method
+  ASSERT_THROW(AutoCompression::Uncompress(u, corrupted.c_str(), corrupted.size(), flat.size()),
+               Orthanc::OrthancException);
+
+  DownloadArea area(instances);
+  area.WriteBucket(bucket, compressed.c_str(), compressed.size(), BucketCompression_Auto);
+  area.CheckMD5();
+
+  {
+    // Empty bucket
+    BucketContent empty;
+    empty.Compress(compressed, BucketCompression_Auto);
+    ASSERT_TRUE(compressed.empty());
+    AutoCompression::Uncompress(u, compressed.c_str(), compressed.size(), 0);
+    ASSERT_TRUE(u.empty());
+  }
+}
+#endif
+
+
+#if ORTHANC_TRANSFERS_ENABLE_ZSTD == 1
+TEST(BucketContent, Zstd)
+{
+  using namespace OrthancPlugins;
+
+  InstancesCacheForTests cache(1);
+  cache.AddInstance("a", 100000);
+  cache.AddInstance("b", 5);
+  cache.AddInstance("c", 70000);
+
+  std::vector<DicomInstanceInfo> instances;
+
+  for (char c = 'a'; c <= 'c'; c++)
+  {
+    size_t size;
+    std::string md5;
+    cache.GetInstanceInfo(size, md5, std::string(1, c));
+    instances.push_back(DicomInstanceInfo(std::string(1, c), size, md5));
+  }
+
+  TransferBucket bucket;
+  bucket.AddChunk(instances[0], 50000, 50000);
+  bucket.AddChunk(instances[1], 0, 5);
+  bucket.AddChunk(instances[2], 0, 30000);
+
+  BucketContent content;
+  cache.ReadBucket(content, bucket);
+  ASSERT_EQ(3u, content.GetSlicesCount());
+
+  std::string raw;
+  content.Flatten(raw);
+
+  const int level = BucketContent::GetZstdLevel();
+  ASSERT_THROW(BucketContent::SetZstdLevel(ZSTD_maxCLevel() + 1), Orthanc::OrthancException);
+  ASSERT_EQ(level, BucketContent::GetZstdLevel());
+
+  const int levels[] = { 1, 3, 19 };
+
+  for (size_t i = 0; i < sizeof(levels) / sizeof(int); i++)
+  {
+    BucketContent::SetZstdLevel(levels[i]);
+
+    std::string compressed;
+    content.Compress(compressed, BucketCompression_Zstd);
+    ASSERT_LT(compressed.size(), raw.size());
+
+    // The streamed compression writes the size of the content
+    ASSERT_EQ(raw.size(), ZSTD_getFrameContentSize(compressed.c_str(), compressed.size()));
+
+    std::string u;
+    u.resize(raw.size());
+    ASSERT_EQ(raw.size(), ZSTD_decompress(&u[0], u.size(), compressed.c_str(), compressed.size()));
+    ASSERT_EQ(raw, u);
+
+    // The partial instances are not committed, the buckets must
+    // only be accepted by the download area
+    DownloadArea area(instances);
+    area.WriteBucket(bucket, compressed.c_str(), compressed.size(), BucketCompression_Zstd);
+    ASSERT_THROW(area.WriteBucket(bucket, compressed.c_str(), compressed.size() - 1, BucketCompression_Zstd),
+                 Orthanc::OrthancException);
+  }
+
+  BucketContent::SetZstdLevel(level);
+
+  {
+    // Empty bucket
+    BucketContent empty;
+    std::string compressed;
+    empty.Compress(compressed, BucketCompression_Zstd);
+    ASSERT_EQ(0u, ZSTD_getFrameContentSize(compressed.c_str(), compressed.size()));
+  }
+}
+
+
+TEST(BlockCompression, Zstd)
+{
+  using namespace OrthancPlugins;
+
+  std::string raw;
+  BlockCompression::Segments segments;
+  GenerateSegments(raw, segments, 300000);
+
+  CompressionThreadPool pool(3);
+
+  for (unsigned int i = 0; i < 2; i++)
+  {
+    BlockCompression::Configure(i == 0 ? NULL : &pool, 64 * 1024);
+
+    std::string compressed;
+    BlockCompression::Compress(compressed, segments, BucketCompression_Zstd, 3);
+    ASSERT_LT(compressed.size(), raw.size() / 2);
+
+    // One frame per block, each with the size of its content
+    ASSERT_EQ(64u * 1024u, ZSTD_getFrameContentSize(compressed.c_str(), compressed.size()));
+
+    // The receivers that ignore the blocks can still uncompress
+    std::string u;
+    u.resize(raw.size());
+    ASSERT_EQ(raw.size(), ZSTD_decompress(&u[0], u.size(), compressed.c_str(), compressed.size()));
+    ASSERT_EQ(raw, u);
+
+    BlockCompression::Uncompress(u, compressed.c_str(), compressed.size(), raw.size(), BucketCompression_Zstd);
+    ASSERT_EQ(raw, u);
+
+    ASSERT_THROW(BlockCompression::Uncompress(u, compressed.c_str(), compressed.size(), raw.size() - 1,
+                                              BucketCompression_Zstd), Orthanc::OrthancException);
+    ASSERT_THROW(BlockCompression::Uncompress(u, compressed.c_str(), compressed.size() - 1, raw.size(),
+                                              BucketCompression_Zstd), Orthanc::OrthancException);
+  }
+
+  BlockCompression::Configure(NULL, 0);
+
+  {
+    // A single frame that is shorter than the size of the bucket
+    std::string single;
+    single.resize(ZSTD_compressBound(raw.size()));
+    single.resize(ZSTD_compress(&single[0], single.size(), raw.c_str(), raw.size(), 3));
+
+    std::string u;
+    BlockCompression::Uncompress(u, single.c_str(), single.size(), raw.size(), BucketCompression_Zstd);
+    ASSERT_EQ(raw, u);
+
+    try
+    {
+      BlockCompression::Uncompress(u, single.c_str(), single.size(), raw.size() + 1, BucketCompression_Zstd);
+      FAIL();
+    }
+    catch (Orthanc::OrthancException& e)
+    {
+      ASSERT_EQ(Orthanc::ErrorCode_CorruptedFile, e.GetErrorCode());
+    }
+  }
+}
+
+
+namespace
+{
+  // Element of a DICOM file in the explicit VR little endian transfer
+  // syntax, with a value of even length
+  void AppendDicomElement(std::string& target,
+                          uint16_t group,
+                          uint16_t element,
+                          const char* vr,
+                          const std::string& value)
+  {
+    std::string padded = value;
+    if (padded.size() % 2 == 1)
+    {
+      padded.push_back(std::string(vr) == "UI" ? '\0' : ' ');
+    }
+
+    const char tag[] = { static_cast<char>(group & 0xff), static_cast<char>(group >> 8),
+                         static_cast<char>(element & 0xff), static_cast<char>(element >> 8),
+                         vr[0], vr[1],
+                         static_cast<char>(padded.size() & 0xff), static_cast<char>(padded.size() >> 8) };
+    target.append(tag, sizeof(tag));
+    target.append(padded);
+  }
+
+
+  // Small DICOM instance whose header is made of the usual tags, with
+  // values that vary across the patients, studies and series. It is
+  // followed by "pixelsSize" bytes of pixel data, if not zero (the
+  // structured reports have no pixel data).
+  void GenerateSmallDicomInstance(std::string& target,
+                                  uint32_t seed,
+                                  size_t pixelsSize)
+  {
+    static const char* const NAMES[] = { "DOE^JOHN", "SMITH^JANE", "MARTIN^PAUL", "DUPONT^MARIE", "GARCIA^LUIS", "MULLER^ANNA" };
+    static const char* const MODALITIES[] = { "CT", "MR", "CR", "SR", "KO", "PR" };
+    static const char* const SOP_CLASSES[] = {
+      "1.2.840.10008.5.1.4.1.1.2", "1.2.840.10008.5.1.4.1.1.4", "1.2.840.10008.5.1.4.1.1.1",
+      "1.2.840.10008.5.1.4.1.1.88.22", "1.2.840.10008.5.1.4.1.1.88.59", "1.2.840.10008.5.1.4.1.1.11.1" };
+    static const char* const MANUFACTURERS[] = { "SIEMENS", "GE MEDICAL SYSTEMS", "Philips", "TOSHIBA" };
+
+    const uint32_t patient = seed / 60;
+    const uint32_t study = seed / 20;
+    const uint32_t series = seed / 5;
+    const size_t modality = study % 6;
+
+    const std::string root = "1.2.826.0.1.3680043.8.498.";
+    const std::string sopInstance = root + boost::lexical_cast<std::string>(seed * 7919u + 1000003u) + ".1";
+    const std::string date = ("20" + boost::lexical_cast<std::string>(10 + study % 15) + "0" +
+                              boost::lexical_cast<std::string>(1 + study % 9) + boost::lexical_cast<std::string>(10 + study % 18));
+
+    target.assign(128, '\0');
+    target.append("DICM");
+
+    // (0002,0001) OB: File Meta Information Version
+    const char version[] = { 0x02, 0x00, 0x01, 0x00, 'O', 'B', 0x00, 0x00, 0x02, 0x00, 0x00, 0x00, 0x00, 0x01 };
+    target.append(version, sizeof(version));
+
+    AppendDicomElement(target, 0x0002, 0x0002, "UI", SOP_CLASSES[modality]);
+    AppendDicomElement(target, 0x0002, 0x0003, "UI", sopInstance);
+    AppendDicomElement(target, 0x0002, 0x0010, "UI", "1.2.840.10008.1.2.1");
+    AppendDicomElement(target, 0x0002, 0x0012, "UI", "1.2.826.0.1.3680043.2.1143.107.104.103.115.3.6.2");
+    AppendDicomElement(target, 0x0002, 0x0013, "SH", "ORTHANC_3_6_2");
+    AppendDicomElement(target, 0x0008, 0x0005, "CS", "ISO_IR 100");
+    AppendDicomElement(target, 0x0008, 0x0008, "CS", "ORIGINAL\\PRIMARY\\AXIAL");
+    AppendDicomElement(target, 0x0008, 0x0016, "UI", SOP_CLASSES[modality]);
+    AppendDicomElement(target, 0x0008, 0x0018, "UI", sopInstance);
+    AppendDicomElement(target, 0x0008, 0x0020, "DA", date);
+    AppendDicomElement(target, 0x0008, 0x0030, "TM", boost::lexical_cast<std::string>(80000 + (study * 137) % 90000) + ".000");
+    AppendDicomElement(target, 0x0008, 0x0050, "SH", "ACC" + boost::lexical_cast<std::string>(study * 31 + 100000));
+    AppendDicomElement(target, 0x0008, 0x0060, "CS", MODALITIES[modality]);
+    AppendDicomElement(target, 0x0008, 0x0070, "LO", MANUFACTURERS[study % 4]);
+    AppendDicomElement(target, 0x0008, 0x0080, "LO", "UNIVERSITY HOSPITAL");
+    AppendDicomElement(target, 0x0008, 0x0090, "PN", NAMES[(study + 3) % 6]);
+    AppendDicomElement(target, 0x0008, 0x1030, "LO", std::string(MODALITIES[modality]) + " THORAX ABDOMEN");
+    AppendDicomElement(target, 0x0008, 0x103e, "LO", "SERIES " + boost::lexical_cast<std::string>(series % 7));
+    AppendDicomElement(target, 0x0010, 0x0010, "PN", NAMES[patient % 6] + std::string("^") + boost::lexical_cast<std::string>(patient));
+    AppendDicomElement(target, 0x0010, 0x0020, "LO", "PAT" + boost::lexical_cast<std::string>(patient * 7 + 1000));
+    AppendDicomElement(target, 0x0010, 0x0030, "DA", "19" + boost::lexical_cast<std::string>(40 + patient % 60) + "0615");
+    AppendDicomElement(target, 0x0010, 0x0040, "CS", patient % 2 == 0 ? "M" : "F");
+    AppendDicomElement(target, 0x0018, 0x0050, "DS", boost::lexical_cast<std::string>(1 + series % 5));
+    AppendDicomElement(target, 0x0020, 0x000d, "UI", root + boost::lexical_cast<std::string>(study * 104729u + 7u));
+    AppendDicomElement(target, 0x0020, 0x000e, "UI", root + boost::lexical_cast<std::string>(series * 1299709u + 11u));
+    AppendDicomElement(target, 0x0020, 0x0011, "IS", boost::lexical_cast<std::string>(series % 7 + 1));
+    AppendDicomElement(target, 0x0020, 0x0013, "IS", boost::lexical_cast<std::string>(seed % 5 + 1));
+    AppendDicomElement(target, 0x0020, 0x0032, "DS", "-250\\-250\\" + boost::lexical_cast<std::string>(seed % 400));
+    AppendDicomElement(target, 0x0020, 0x0037, "DS", "1\\0\\0\\0\\1\\0");
+    AppendDicomElement(target, 0x0028, 0x0004, "CS", "MONOCHROME2");
+    AppendDicomElement(target, 0x0028, 0x1050, "DS", boost::lexical_cast<std::string>(40 + seed % 3));
+    AppendDicomElement(target, 0x0028, 0x1051, "DS", boost::lexical_cast<std::string>(400 + seed % 5));
+
+    if (pixelsSize > 0)
+    {
+      // (7FE0,0010) OW: Pixel Data
+      const uint32_t size = static_cast<uint32_t>(pixelsSize + pixelsSize % 2);
+      const char tag[] = { static_cast<char>(0xe0), 0x7f, 0x10, 0x00, 'O', 'W', 0x00, 0x00,
+                           static_cast<char>(size & 0xff), static_cast<char>((size >> 8) & 0xff),
+                           static_cast<char>((size >> 16) & 0xff), static_cast<char>(size >> 24) };
+      target.append(tag, sizeof(tag));
+
+      uint32_t state = seed;
+      for (size_t i = 0; i < size; i++)
+      {
+        state = state * 1664525u + 1013904223u;
+        target.push_back(i % 2 == 1 ? static_cast<char>((i / 256) % 4) : static_cast<char>((i / 16) % 64 + (state >> 28)));
+      }
+    }
+  }
+
+
+  void TrainDictionaryForTests(OrthancPlugins::CompressionDictionaries::DictionaryPtr& target,
+                               uint32_t firstSeed,
+                               size_t count)
+  {
+    std::vector<std::string> samples;
+
+    for (uint32_t seed = firstSeed; seed < firstSeed + count; seed++)
+    {
+      std::string dicom, header;
+      GenerateSmallDicomInstance(dicom, seed, 1024);
+      ASSERT_TRUE(OrthancPlugins::CompressionDictionaries::ExtractHeader(header, dicom.c_str(), dicom.size()));
+      samples.push_back(header);
+    }
+
+    target = OrthancPlugins::CompressionDictionaries::Train(samples);
+    ASSERT_TRUE(target.get() != NULL);
+  }
+}
+
+
+TEST(CompressionDictionaries, Registry)
+{
+  using namespace OrthancPlugins;
+
+  CompressionDictionaries::Clear();
+  ASSERT_TRUE(CompressionDictionaries::IsSupported());
+
+  {
+    std::string dicom, header;
+    GenerateSmallDicomInstance(dicom, 42, 1000);
+    ASSERT_TRUE(CompressionDictionaries::ExtractHeader(header, dicom.c_str(), dicom.size()));
+    ASSERT_EQ(dicom.size() - 1000 - 12, header.size());  // Up to the tag of the pixel data
+    ASSERT_EQ(0, dicom.compare(0, header.size(), header));
+
+    // The structured reports are made of their header
+    GenerateSmallDicomInstance(dicom, 42, 0);
+    ASSERT_TRUE(CompressionDictionaries::ExtractHeader(header, dicom.c_str(), dicom.size()));
+    ASSERT_EQ(dicom, header);
+
+    ASSERT_FALSE(CompressionDictionaries::ExtractHeader(header, dicom.c_str(), 131));
+    ASSERT_FALSE(CompressionDictionaries::ExtractHeader(header, dicom.c_str() + 1, dicom.size() - 1));  // No "DICM"
+    ASSERT_FALSE(CompressionDictionaries::ExtractHeader(header, NULL, 0));
+  }
+
+  ASSERT_TRUE(CompressionDictionaries::GetCurrent().get() == NULL);
+  ASSERT_TRUE(CompressionDictionaries::Lookup(1234).get() == NULL);
+
+  CompressionDictionaries::DictionaryPtr dictionary;
+  TrainDictionaryForTests(dictionary, 0, 500);
+  ASSERT_NE(0u, dictionary->GetId());
+  ASSERT_EQ(dictionary.get(), CompressionDictionaries::GetCurrent().get());
+  ASSERT_EQ(dictionary.get(), CompressionDictionaries::Lookup(dictionary->GetId()).get());
+
+  std::vector<uint32_t> ids;
+  CompressionDictionaries::ListDictionaries(ids);
+  ASSERT_EQ(1u, ids.size());
+  ASSERT_EQ(dictionary->GetId(), ids[0]);
+
+  // Registering the same dictionary again (e.g. pushed by a peer) is a no-op
+  ASSERT_EQ(dictionary.get(), CompressionDictionaries::Register(dictionary->GetContent()).get());
+  ASSERT_THROW(CompressionDictionaries::Register("nope"), Orthanc::OrthancException);
+  ASSERT_THROW(CompressionDictionaries::Train(std::vector<std::string>()), Orthanc::OrthancException);
+
+  {
+    // The samples are only collected if enabled, once per instance
+    std::string dicom;
+    GenerateSmallDicomInstance(dicom, 1000, 100);
+    CompressionDictionaries::AddSample("a", dicom.c_str(), dicom.size());
+    ASSERT_EQ(0u, CompressionDictionaries::GetSamplesCount());
+
+    CompressionDictionaries::SetEnabled(true);
+    ASSERT_TRUE(CompressionDictionaries::IsEnabled());
+    CompressionDictionaries::AddSample("a", dicom.c_str(), dicom.size());
+    CompressionDictionaries::AddSample("a", dicom.c_str(), dicom.size());
+    CompressionDictionaries::AddSample("b", dicom.c_str(), 100);  // Not a DICOM file
+    ASSERT_EQ(1u, CompressionDictionaries::GetSamplesCount());
+
+    CompressionDictionaries::SetEnabled(false);
+    ASSERT_FALSE(CompressionDictionaries::IsEnabled());
+  }
+
+  CompressionDictionaries::Clear();
+  ASSERT_TRUE(CompressionDictionaries::GetCurrent().get() == NULL);
+  ASSERT_TRUE(CompressionDictionaries::Lookup(dictionary->GetId()).get() == NULL);
+  ASSERT_EQ(0u, CompressionDictionaries::GetSamplesCount());
+}
+
+
+TEST(CompressionDictionaries, Eviction)
+{
+  using namespace OrthancPlugins;
+
+  CompressionDictionaries::Clear();
+
+  std::vector<std::string> contents;
+  std::vector<uint32_t> ids;
+
+  for (uint32_t i = 0; i < 10u; i++)
+  {
+    CompressionDictionaries::DictionaryPtr dictionary;
+    TrainDictionaryForTests(dictionary, i * 1000, 100);
+    contents.push_back(dictionary->GetContent());
+    ids.push_back(dictionary->GetId());
+  }
+
+  // Without a current dictionary, as if they were pushed by peers
+  CompressionDictionaries::Clear();
+
+  // The first dictionary is in use by a transfer
+  CompressionDictionaries::DictionaryPtr inUse = CompressionDictionaries::Register(contents[0]);
+
+  for (size_t i = 1; i < 8; i++)
+  {
+    CompressionDictionaries::Register(contents[i]);
+  }
+
+  // The second dictionary is used by the buckets of a transfer
+  ASSERT_TRUE(CompressionDictionaries::Lookup(ids[1]).get() != NULL);
+
+  CompressionDictionaries::Register(contents[8]);
+  CompressionDictionaries::Register(contents[9]);
+
+  std::vector<uint32_t> registered;
+  CompressionDictionaries::ListDictionaries(registered);
+  ASSERT_EQ(8u, registered.size());
+
+  // The least recently used dictionaries are forgotten first
+  ASSERT_EQ(inUse.get(), CompressionDictionaries::Lookup(ids[0]).get());
+  ASSERT_TRUE(CompressionDictionaries::Lookup(ids[1]).get() != NULL);
+  ASSERT_TRUE(CompressionDictionaries::Lookup(ids[2]).get() == NULL);
+  ASSERT_TRUE(CompressionDictionaries::Lookup(ids[3]).get() == NULL);
+  ASSERT_TRUE(CompressionDictionaries::Lookup(ids[9]).get() != NULL);
+
+  // The limit is exceeded, rather than forgetting the dictionaries
+  // that are in use
+  std::vector<CompressionDictionaries::DictionaryPtr> transfers;
+  for (size_t i = 0; i < 10; i++)
+  {
+    transfers.push_back(CompressionDictionaries::Register(contents[i]));
+  }
+
+  CompressionDictionaries::ListDictionaries(registered);
+  ASSERT_EQ(10u, registered.size());
+
+  transfers.clear();
+  CompressionDictionaries::Register(contents[0]);  // Already known, nothing is forgotten
+  CompressionDictionaries::ListDictionaries(registered);
+  ASSERT_EQ(10u, registered.size());
+
+  CompressionDictionaries::Clear();
+}
+
+
+TEST(CompressionDictionaries, Training)
+{
+  using namespace OrthancPlugins;
+
+  CompressionDictionaries::Clear();
+  CompressionDictionaries::SetEnabled(true);
+
+  // The first dictionary is trained in the background as soon as
+  // enough instances are read
+  for (uint32_t seed = 0; seed < 1000u; seed++)
+  {
+    std::string dicom;
+    GenerateSmallDicomInstance(dicom, seed, 512);
+    CompressionDictionaries::AddSample(boost::lexical_cast<std::string>(seed), dicom.c_str(), dicom.size());
+  }
+
+  CompressionDictionaries::WaitForTraining();
+  ASSERT_TRUE(CompressionDictionaries::GetCurrent().get() != NULL);
+  ASSERT_EQ(1000u, CompressionDictionaries::GetSamplesCount());
+
+  // Another training can start once the previous one is over
+  for (uint32_t seed = 1000; seed < 21000u; seed++)
+  {
+    std::string dicom;
+    GenerateSmallDicomInstance(dicom, seed, 512);
+    CompressionDictionaries::AddSample(boost::lexical_cast<std::string>(seed), dicom.c_str(), dicom.size());
+  }
+
+  CompressionDictionaries::WaitForTraining();
+
+  std::vector<uint32_t> ids;
+  CompressionDictionaries::ListDictionaries(ids);
+  ASSERT_EQ(2u, ids.size());
+
+  CompressionDictionaries::SetEnabled(false);
+  CompressionDictionaries::Clear();
+}
+
+
+TEST(BlockCompression, Dictionary)
+{
+  using namespace OrthancPlugins;
+
+  CompressionDictionaries::Clear();
+
+  CompressionDictionaries::DictionaryPtr dictionary;
+  TrainDictionaryForTests(dictionary, 0, 500);
+
+  // A bucket made of a few instances that were not used for training
+  std::vector<std::string> files(4);
+  BlockCompression::Segments segments;
+  std::string raw;
+
+  for (size_t i = 0; i < files.size(); i++)
+  {
+    GenerateSmallDicomInstance(files[i], 10000 + static_cast<uint32_t>(i) * 97, i == 0 ? 0 : 512);
+    segments.push_back(std::make_pair(files[i].c_str(), files[i].size()));
+    raw += files[i];
+  }
+
+  std::string plain, compressed, u;
+  BlockCompression::Compress(plain, segments, BucketCompression_Zstd, 3);
+  BlockCompression::Compress(compressed, segments, BucketCompression_Zstd, 3, dictionary.get());
+  ASSERT_LT(compressed.size(), plain.size());
+
+  // The receiver finds the dictionary from its ID in the frames
+  ASSERT_EQ(0u, ZSTD_getDictID_fromFrame(plain.c_str(), plain.size()));
+  ASSERT_EQ(dictionary->GetId(), ZSTD_getDictID_fromFrame(compressed.c_str(), compressed.size()));
+
+  BlockCompression::Uncompress(u, compressed.c_str(), compressed.size(), raw.size(), BucketCompression_Zstd);
+  ASSERT_EQ(raw, u);
+
+  // The dictionary is ignored by gzip
+  std::string gzip;
+  BlockCompression::Compress(gzip, segments, BucketCompression_Gzip, 0, dictionary.get());
+  BlockCompression::Uncompress(u, gzip.c_str(), gzip.size(), raw.size(), BucketCompression_Gzip);
+  ASSERT_EQ(raw, u);
+
+  {
+    // Also by blocks, as each frame carries the ID of the dictionary
+    CompressionThreadPool pool(2);
+    BlockCompression::Configure(&pool, 1024);
+
+    std::string blocks;
+    BlockCompression::Compress(blocks, segments, BucketCompression_Zstd, 3, dictionary.get());
+    BlockCompression::Uncompress(u, blocks.c_str(), blocks.size(), raw.size(), BucketCompression_Zstd);
+    ASSERT_EQ(raw, u);
+
+    BlockCompression::Configure(NULL, 0);
+  }
+
+  // Unknown dictionary on the receiver side
+  const std::string content = dictionary->GetContent();
+  dictionary.reset();
+  CompressionDictionaries::Clear();
+  ASSERT_THROW(BlockCompression::Uncompress(u, compressed.c_str(), compressed.size(), raw.size(), BucketCompression_Zstd),
+               Orthanc::OrthancException);
+
+  // Once pushed by the sender, the dictionary is known
+  CompressionDictionaries::Register(content);
+  BlockCompression::Uncompress(u, compressed.c_str(), compressed.size(), raw.size(), BucketCompression_Zstd);
+  ASSERT_EQ(raw, u);
+
+  CompressionDictionaries::Clear();
+}
+
+
+TEST(BucketContent, Dictionary)
+{
+  using namespace OrthancPlugins;
+
+  CompressionDictionaries::Clear();
+
+  CompressionDictionaries::DictionaryPtr dictionary;
+  TrainDictionaryForTests(dictionary, 0, 500);
+
+  BucketContent small;
+  std::vector<DicomInstanceInfo> instances;
+  TransferBucket bucket;
+
+  for (uint32_t i = 0; i < 5; i++)
+  {
+    std::string dicom;
+    GenerateSmallDicomInstance(dicom, 20000 + i * 13, 2048);
+
+    boost::shared_ptr<SourceDicomInstance> instance(new SourceDicomInstance(boost::lexical_cast<std::string>(i), dicom));
+    small.AddSlice(instance, 0, instance->GetInfo().GetSize());
+    instances.push_back(instance->GetInfo());
+    bucket.AddChunk(instance->GetInfo(), 0, instance->GetInfo().GetSize());
+  }
+
+  ASSERT_TRUE(small.IsMadeOfSmallInstances());
+
+  std::string raw;
+  small.Flatten(raw);
+
+  const BucketCompression compressions[] = { BucketCompression_Zstd, BucketCompression_Auto };
+
+  for (size_t i = 0; i < 2; i++)
+  {
+    std::string plain, compressed, u;
+    small.Compress(plain, compressions[i], 0);
+    small.Compress(compressed, compressions[i], 0, dictionary.get());
+    ASSERT_LT(compressed.size(), plain.size());
+
+    if (compressions[i] == BucketCompression_Auto)
+    {
+      AutoCompression::Uncompress(u, compressed.c_str(), compressed.size(), raw.size());
+    }
+    else
+    {
+      BlockCompression::Uncompress(u, compressed.c_str(), compressed.size(), raw.size(), compressions[i]);
+    }
+
+    ASSERT_EQ(raw, u);
+
+    DownloadArea area(instances);
+    area.WriteBucket(bucket, compressed.c_str(), compressed.size(), compressions[i]);
+    area.CheckMD5();
+  }
+
+  {
+    // The dictionary is not used for the large instances
+    std::string dicom;
+    GenerateSmallDicomInstance(dicom, 30000, 512 * KB);
+
+    BucketContent large;
+    large.AddSlice(boost::shared_ptr<SourceDicomInstance>(new SourceDicomInstance("large", dicom)), 0, dicom.size());
+    ASSERT_FALSE(large.IsMadeOfSmallInstances());
+
+    std::string plain, compressed;
+    large.Compress(plain, BucketCompression_Zstd, 0);
+    large.Compress(compressed, BucketCompression_Zstd, 0, dictionary.get());
+    ASSERT_EQ(plain, compressed);
+  }
+
+  {
+    // The payloads compressed with and without dictionary are cached separately
+    std::string a, b;
+    CompressedBucketsCache::ComputeKey(a, small, BucketCompression_Zstd, 3);
+    CompressedBucketsCache::ComputeKey(b, small, BucketCompression_Zstd, 3, dictionary->GetId());
+    ASSERT_NE(a, b);
+
+    CompressedBucketsCache cache(MB);
+    CompressedBucketsCache::PayloadPtr plain = cache.Compress(small, BucketCompression_Zstd, 3);
+    CompressedBucketsCache::PayloadPtr compressed = cache.Compress(small, BucketCompression_Zstd, 3, dictionary.get());
+    ASSERT_LT(compressed->GetData().size(), plain->GetData().size());
+    ASSERT_EQ(2u, cache.GetCount());
+    ASSERT_EQ(0u, cache.GetHitCount());
+
+    ASSERT_EQ(compressed.get(), cache.Compress(small, BucketCompression_Zstd, 3, dictionary.get()).get());
+    ASSERT_EQ(1u, cache.GetHitCount());
+  }
+
+  CompressionDictionaries::Clear();
+}
+
+
+/**
+ * Compares the compression ratio and the throughput of zstd with and
+ * without a dictionary, on buckets of various sizes that are made of
+ * small instances: Structured reports (i.e. DICOM headers only), then
+ * small images. The dictionary is trained from the headers of other
+ * instances than the ones that are compressed.
+ **/
+TEST(CompressionDictionaries, DISABLED_Benchmark)
+{
+  using namespace OrthancPlugins;
+
+  static const size_t DATASET_SIZE = 64 * MB;
+
+  CompressionDictionaries::Clear();
+
+  boost::posix_time::ptime start = boost::posix_time::microsec_clock::universal_time();
+
+  CompressionDictionaries::DictionaryPtr dictionary;
+  TrainDictionaryForTests(dictionary, 0, 1000);
+
+  printf("Dictionary of %d bytes trained in %.1f ms\n", static_cast<int>(dictionary->GetContent().size()),
+         static_cast<double>((boost::posix_time::microsec_clock::universal_time() - start).total_microseconds()) / 1000.0);
+
+  const size_t bucketSizes[] = { 16 * KB, 64 * KB, 256 * KB, MB };
+
+  for (unsigned int dataset = 0; dataset < 2; dataset++)
+  {
+    // Structured reports, or small images with 1 to 16KB of pixel data
+    std::vector<boost::shared_ptr<SourceDicomInstance> > files;
+
+    size_t total = 0;
+    for (uint32_t seed = 100000; total < DATASET_SIZE; seed++)
+    {
+      std::string dicom;
+      GenerateSmallDicomInstance(dicom, seed, dataset == 0 ? 0 : (seed % 16 + 1) * KB);
+      total += dicom.size();
+      files.push_back(boost::shared_ptr<SourceDicomInstance>(new SourceDicomInstance(boost::lexical_cast<std::string>(seed), dicom)));
+    }
+
+    printf("%s: %d instances\n", dataset == 0 ? "Structured reports" : "Small images", static_cast<int>(files.size()));
+
+    for (size_t s = 0; s < sizeof(bucketSizes) / sizeof(size_t); s++)
+    {
+      std::vector<BucketContent*> buckets;
+      buckets.push_back(new BucketContent);
+
+      for (size_t i = 0; i < files.size(); i++)
+      {
+        if (buckets.back()->GetSize() >= bucketSizes[s])
+        {
+          buckets.push_back(new BucketContent);
+        }
+
+        buckets.back()->AddSlice(files[i], 0, files[i]->GetInfo().GetSize());
+      }
+
+      for (unsigned int k = 0; k < 2; k++)
+      {
+        CompressionDictionaries::Dictionary* used = (k == 0 ? NULL : dictionary.get());
+
+        uint64_t rawSize = 0;
+        uint64_t compressedSize = 0;
+        double compressTime = 0;
+        double uncompressTime = 0;
+
+        for (size_t i = 0; i < buckets.size(); i++)
+        {
+          std::string compressed, uncompressed;
+
+          boost::posix_time::ptime a = boost::posix_time::microsec_clock::universal_time();
+          buckets[i]->Compress(compressed, BucketCompression_Zstd, 3, used);
+          boost::posix_time::ptime b = boost::posix_time::microsec_clock::universal_time();
+          BlockCompression::Uncompress(uncompressed, compressed.c_str(), compressed.size(),
+                                       buckets[i]->GetSize(), BucketCompression_Zstd);
+          boost::posix_time::ptime c = boost::posix_time::microsec_clock::universal_time();
+
+          ASSERT_EQ(buckets[i]->GetSize(), uncompressed.size());
+          rawSize += buckets[i]->GetSize();
+          compressedSize += compressed.size();
+          compressTime += static_cast<double>((b - a).total_microseconds()) / 1000000.0;
+          uncompressTime += static_cast<double>((c - b).total_microseconds()) / 1000000.0;
+        }
+
+        const double mb = static_cast<double>(rawSize) / static_cast<double>(MB);
+
+        printf("  buckets of %4d KB, %-13s: ratio %5.2f, compression %7.1f MB/s, decompression %7.1f MB/s\n",
+               static_cast<int>(bucketSizes[s] / KB), used == NULL ? "no dictionary" : "dictionary",
+               static_cast<double>(rawSize) / static_cast<double>(compressedSize),
+               mb / compressTime, mb / uncompressTime);
+      }
+
+      for (size_t i = 0; i < buckets.size(); i++)
+      {
+        delete buckets[i];
+      }
+    }
+  }
+
+  CompressionDictionaries::Clear();
+}
+
+
+namespace
+{
+  // Synthetic uncompressed DICOM-like instances: A header followed by
+  // 16-bit pixels made of a body with smooth intensities and noise,
+  // surrounded by a constant (CT) or noisy (MR) background
+  void GenerateSyntheticImage(std::string& target,
+                              unsigned int width,
+                              unsigned int height,
+                              bool isCT,
+                              uint32_t seed)
+  {
+    std::string header;
+    for (unsigned int i = 0; header.size() < 2048; i++)
+    {
+      header += "(0008,0018) UI 1.2.826.0.1.3680043.8.498." + boost::lexical_cast<std::string>(seed * 1000 + i) + "\n";
+    }
+
+    target = header;
+    target.resize(header.size() + 2 * width * height);
+
+    uint8_t* pixels = reinterpret_cast<uint8_t*>(&target[header.size()]);
+    uint32_t state = seed * 2654435761u + 1;
+
+    for (unsigned int y = 0; y < height; y++)
+    {
+      for (unsigned int x = 0; x < width; x++)
+      {
+        state = state * 1664525u + 1013904223u;
+        const int noise = static_cast<int>((state >> 16) % 41) - 20;
+
+        const double dx = (static_cast<double>(x) - width / 2.0) / (width / 2.0);
+        const double dy = (static_cast<double>(y) - height / 2.0) / (height / 2.0);
+        const double r2 = dx * dx + dy * dy;
+
+        int value;
+        if (r2 < 0.7)
+        {
+          // Soft tissues around 1000-1100 (CT), or 300-900 (MR)
+          value = (isCT ? 1040 + static_cast<int>(60.0 * dx) : 600 + static_cast<int>(300.0 * dy)) + noise;
+        }
+        else if (isCT)
+        {
+          value = 0;  // Air, after the rescale
+        }
+        else
+        {
+          value = (noise + 20) / 4;
+        }
+
+        pixels[2 * (y * width + x)] = static_cast<uint8_t>(value & 0xff);
+        pixels[2 * (y * width + x) + 1] = static_cast<uint8_t>(value >> 8);
+      }
+    }
+  }
+}
+
+
+/**
+ * Compares the compression ratio and the throughput of gzip, zstd and
+ * "auto" on buckets of uncompressed CT and MR instances, and of JPEG
+ * instances whose pixel data is already compressed, both on one thread
+ * and by blocks of 1MB on a pool of 4 threads. The instances are
+ * synthetic, unless the folder given by the environment variable
+ * "TRANSFERS_BENCHMARK_FOLDER" contains real DICOM files.
+ **/
+TEST(BucketContent, DISABLED_BenchmarkCompression)
+{
+  using namespace OrthancPlugins;
+
+  static const size_t DATASET_SIZE = 128 * MB;
+  static const size_t BUCKET_SIZE = 4 * MB;
+
+  std::map<std::string, std::vector<boost::shared_ptr<SourceDicomInstance> > > datasets;
+
+  const char* folder = getenv("TRANSFERS_BENCHMARK_FOLDER");
+
+  if (folder != NULL)
+  {
+    size_t total = 0;
+    for (boost::filesystem::recursive_directory_iterator it(folder);
+         it != boost::filesystem::recursive_directory_iterator() && total < DATASET_SIZE; ++it)
+    {
+      if (boost::filesystem::is_regular_file(it->status()))
+      {
+        std::string content;
+        Orthanc::SystemToolbox::ReadFile(content, it->path().string());
+        total += content.size();
+        datasets[folder].push_back(boost::shared_ptr<SourceDicomInstance>(
+          new SourceDicomInstance(it->path().string(), content)));
+      }
+    }
+  }
+  else
+  {
+    for (unsigned int modality = 0; modality < 2; modality++)
+    {
+      const bool isCT = (modality == 0);
+      const unsigned int size = (isCT ? 512 : 256);
+
+      for (size_t total = 0; total < DATASET_SIZE; )
+      {
+        std::string content;
+        GenerateSyntheticImage(content, size, size, isCT, static_cast<uint32_t>(total / KB));
+        total += content.size();
+        datasets[isCT ? "Synthetic CT" : "Synthetic MR"].push_back(boost::shared_ptr<SourceDicomInstance>(
+          new SourceDicomInstance(boost::lexical_cast<std::string>(total), content)));
+      }
+    }
+
+    // Already compressed pixel data, which is only worth compressing
+    // for its DICOM header
+    for (size_t total = 0; total < DATASET_SIZE; )
+    {
+      std::string content;
+      // The size is the seed of the random generator: Make it vary
+      GenerateDicomFile(content, "1.2.840.10008.1.2.4.50", 256 * KB + datasets["Synthetic JPEG"].size(), true);
+      total += content.size();
+      datasets["Synthetic JPEG"].push_back(boost::shared_ptr<SourceDicomInstance>(
+        new SourceDicomInstance(boost::lexical_cast<std::string>(total), content)));
+    }
+  }
+
+  const int level = BucketContent::GetZstdLevel();
+
+  CompressionThreadPool pool(3);  // The calling thread is the 4th one
+
+  for (std::map<std::string, std::vector<boost::shared_ptr<SourceDicomInstance> > >::const_iterator
+         dataset = datasets.begin(); dataset != datasets.end(); ++dataset)
+  {
+    // Group the instances into buckets of about "BUCKET_SIZE"
+    std::vector<BucketContent*> buckets;
+    buckets.push_back(new BucketContent);
+
+    for (size_t i = 0; i < dataset->second.size(); i++)
+    {
+      if (buckets.back()->GetSize() >= BUCKET_SIZE)
+      {
+        buckets.push_back(new BucketContent);
+      }
+
+      buckets.back()->AddSlice(dataset->second[i], 0, dataset->second[i]->GetInfo().GetSize());
+    }
+
+    printf("%s: %d instances in %d buckets\n", dataset->first.c_str(),
+           static_cast<int>(dataset->second.size()), static_cast<int>(buckets.size()));
+
+    // The level is ignored by gzip
+    const std::pair<BucketCompression, int> configurations[] = {
+      std::make_pair(BucketCompression_Gzip, 0),
+      std::make_pair(BucketCompression_Zstd, 1),
+      std::make_pair(BucketCompression_Zstd, 3),
+      std::make_pair(BucketCompression_Zstd, 6),
+      std::make_pair(BucketCompression_Zstd, 9),
+      std::make_pair(BucketCompression_Auto, 3)
+    };
+
+    const size_t count = sizeof(configurations) / sizeof(std::pair<BucketCompression, int>);
+
+    for (size_t k = 0; k < 2 * count; k++)
+    {
+      const BucketCompression compression = configurations[k % count].first;
+      const bool blocks = (k >= count);
+      BlockCompression::Configure(blocks ? &pool : NULL, blocks ? MB : 0);
+      BucketContent::SetZstdLevel(configurations[k % count].second == 0 ? level : configurations[k % count].second);
+
+      uint64_t rawSize = 0;
+      uint64_t compressedSize = 0;
+      double compressTime = 0;
+      double uncompressTime = 0;
+
+      for (size_t i = 0; i < buckets.size(); i++)
+      {
+        std::string compressed, uncompressed;
+
+        boost::posix_time::ptime start = boost::posix_time::microsec_clock::universal_time();
+        buckets[i]->Compress(compressed, compression);
+        boost::posix_time::ptime middle = boost::posix_time::microsec_clock::universal_time();
+
+        if (compression == BucketCompression_Auto)
+        {
+          AutoCompression::Uncompress(uncompressed, compressed.c_str(), compressed.size(), buckets[i]->GetSize());
+        }
+        else
+        {
+          BlockCompression::Uncompress(uncompressed, compressed.c_str(), compressed.size(),
+                                       buckets[i]->GetSize(), compression);
+        }
+
+        boost::posix_time::ptime end = boost::posix_time::microsec_clock::universal_time();
+
+        ASSERT_EQ(buckets[i]->GetSize(), uncompressed.size());
+        rawSize += buckets[i]->GetSize();
+        compressedSize += compressed.size();
+        compressTime += static_cast<double>((middle - start).total_microseconds()) / 1000000.0;
+        uncompressTime += static_cast<double>((end - middle).total_microseconds()) / 1000000.0;
+      }
+
+      const double mb = static_cast<double>(rawSize) / static_cast<double>(MB);
+
+      printf("  %-8s %-9s: ratio %5.2f, compression %7.1f MB/s, decompression %7.1f MB/s\n",
+             compression == BucketCompression_Gzip ? "gzip" :
+             (std::string(EnumerationToString(compression)) + "-" +
+              boost::lexical_cast<std::string>(configurations[k % count].second)).c_str(),
+             blocks ? "(blocks)" : "(single)",
+             static_cast<double>(rawSize) / static_cast<double>(compressedSize),
+             mb / compressTime, mb / uncompressTime);
+    }
+
+    for (size_t i = 0; i < buckets.size(); i++)
+    {
+      delete buckets[i];
+    }
+  }
+
+  BlockCompression::Configure(NULL, 0);
+  BucketContent::SetZstdLevel(level);
+}
+#endif
+
+
+TEST(InstancesCachePolicy, LRU)
+{
+  std::unique_ptr<OrthancPlugins::IInstancesCachePolicy> policy(
+    OrthancPlugins::IInstancesCachePolicy::Create(OrthancPlugins::CachePolicy_LRU));
+  policy->SetCapacity(100);
+
+  ASSERT_THROW(policy->GetVictim(), Orthanc::OrthancException);
+  policy->Add("a", 10);
+  policy->Add("b", 10);
+  policy->Add("c", 10);
+  ASSERT_THROW(policy->Add("a", 10), Orthanc::OrthancException);
+  ASSERT_EQ(3u, policy->GetSize());
+  ASSERT_EQ("a", policy->GetVictim());
+
+  policy->Touch("a");
+  ASSERT_EQ("b", policy->GetVictim());
+  policy->Remove("b");
+  ASSERT_EQ("c", policy->GetVictim());
+  policy->Remove("c");
+  ASSERT_EQ("a", policy->GetVictim());
+  ASSERT_TRUE(policy->Admit("d", 1000, 1000));
+  ASSERT_THROW(policy->Touch("b"), Orthanc::OrthancException);
+  ASSERT_THROW(policy->Remove("b"), Orthanc::OrthancException);
+}
+
+
+TEST(InstancesCachePolicy, SLRU)
+{
+  OrthancPlugins::SegmentedLruPolicy policy(true);
+  policy.SetCapacity(100);  // 80 bytes for the protected segment
+
+  policy.Add("a", 40);
+  policy.Add("b", 40);
+  policy.Add("c", 10);
+  ASSERT_EQ("a", policy.GetVictim());
+
+  // "a" and "b" are promoted to the protected segment
+  policy.Touch("a");
+  policy.Touch("b");
+  ASSERT_EQ("c", policy.GetVictim());
+
+  // A new instance is evicted before the protected ones, and is not
+  // promoted by the next chunks of the same burst, even if another
+  // instance starts a new burst in the meantime
+  policy.RecordAccess("d");
+  policy.Add("d", 30);
+  policy.RecordAccess("d");
+  policy.RecordAccess("f");
+  policy.Touch("d");
+  ASSERT_EQ("c", policy.GetVictim());
+  policy.Remove("c");
+  ASSERT_EQ("d", policy.GetVictim());
+  policy.Remove("d");
+  ASSERT_EQ("a", policy.GetVictim());
+
+  // Promoting "e" overflows the protected segment, which demotes "a"
+  policy.Add("e", 40);
+  policy.Touch("e");
+  ASSERT_EQ("a", policy.GetVictim());
+  policy.Touch("a");
+  ASSERT_EQ("b", policy.GetVictim());
+  ASSERT_EQ(3u, policy.GetSize());
+
+  // Shrinking the capacity demotes the protected instances
+  policy.SetCapacity(0);
+  ASSERT_EQ("b", policy.GetVictim());
+  policy.Remove("b");
+  ASSERT_EQ("e", policy.GetVictim());
+}
+
+
+static void RecordSeparateAccesses(OrthancPlugins::IInstancesCachePolicy& policy,
+                                   const std::string& instanceId,
+                                   unsigned int count)
+{
+  for (unsigned int i = 0; i < count; i++)
+  {
+    // Access other instances, so that this access is not part of a burst
+    for (unsigned int j = 0; j < 8; j++)
+    {
+      policy.RecordAccess("other-" + boost::lexical_cast<std::string>(j));
+    }
+
+    policy.RecordAccess(instanceId);
+  }
+}
+
+
+TEST(InstancesCachePolicy, TinyLFU)
+{
+  OrthancPlugins::TinyLfuPolicy policy;
+  policy.SetCapacity(100);
+
+  ASSERT_EQ(0u, policy.EstimateFrequency("hot"));
+
+  // Accesses in a row (e.g. the successive chunks of one instance) only count once
+  for (unsigned int i = 0; i < 5; i++)
+  {
+    policy.RecordAccess("hot");
+  }
+
+  ASSERT_EQ(1u, policy.EstimateFrequency("hot"));
+
+  RecordSeparateAccesses(policy, "hot", 4);
+  ASSERT_EQ(5u, policy.EstimateFrequency("hot"));
+
+  RecordSeparateAccesses(policy, "hot", 100);
+  ASSERT_EQ(15u, policy.EstimateFrequency("hot"));  // Saturation
+  
+  policy.Add("hot", 50);
+  policy.Touch("hot");  // Promoted to the protected segment
+  RecordSeparateAccesses(policy, "warm", 2);
+  policy.Add("warm", 40);
+
+  // Nothing to evict
+  RecordSeparateAccesses(policy, "small", 1);
+  ASSERT_TRUE(policy.Admit("small", 10, 0));
+
+  // "large" would have to evict "warm" and "hot", that are more frequently used
+  RecordSeparateAccesses(policy, "large", 1);
+  ASSERT_FALSE(policy.Admit("large", 60, 50));
+
+  // Evicting "warm" only
+  RecordSeparateAccesses(policy, "large", 2);
+  ASSERT_EQ(3u, policy.EstimateFrequency("large"));
+  ASSERT_TRUE(policy.Admit("large", 40, 30));
+  ASSERT_FALSE(policy.Admit("large", 80, 70));
+
+  // An instance that is requested again right after its rejection is admitted
+  policy.RecordAccess("huge");
+  ASSERT_FALSE(policy.Admit("huge", 80, 70));
+  policy.RecordAccess("huge");
+  ASSERT_TRUE(policy.Admit("huge", 80, 70));
+  ASSERT_EQ(1u, policy.EstimateFrequency("huge"));
+
+  // The burst state belongs to each instance: Other threads can record
+  // accesses between the rejection and the admission of the next chunk
+  policy.RecordAccess("huge");
+  policy.RecordAccess("new");
+  ASSERT_TRUE(policy.Admit("huge", 80, 70));
+  ASSERT_FALSE(policy.Admit("new", 80, 70));
+}
+
+
+TEST(OrthancInstancesCache, TinyLFU)
+{
+  InstancesCacheForTests cache(1, OrthancPlugins::CachePolicy_TinyLFU);
+  cache.SetMaxMemorySize(100);
+
+  cache.AddInstance("hot", 30);
+  cache.AddInstance("warm", 30);
+  cache.AddInstance("huge", 1000);
+
+  for (unsigned int i = 0; i < 3; i++)
+  {
+    OrthancPlugins::BucketContent content;
+    cache.AddChunk(content, "hot", 0, 10);
+    cache.AddChunk(content, "warm", 0, 10);
+  }
+
+  ASSERT_EQ(60u, cache.GetMemorySize());
+  ASSERT_EQ(2u, cache.GetLoadsCount());
+
+  // The huge instance is served, but does not flush the cache
+  OrthancPlugins::BucketContent content;
+  cache.AddChunk(content, "huge", 0, 1000);
+  ASSERT_EQ(1000u, content.GetSize());
+  ASSERT_EQ(3u, cache.GetLoadsCount());
+  ASSERT_EQ(1u, cache.GetRejectedCount());
+  ASSERT_EQ(60u, cache.GetMemorySize());
+  ASSERT_EQ(2u, cache.GetInstancesCount());
+
+  cache.AddChunk(content, "hot", 0, 10);
+  ASSERT_EQ(3u, cache.GetLoadsCount());
+}
+
+
+TEST(OrthancInstancesCache, Prefetch)
+{
+  InstancesCacheForTests cache(1);
+  cache.SetMaxMemorySize(100);
+
+  cache.AddInstance("a", 10);
+  cache.AddInstance("b", 10);
+  cache.AddInstance("c", 95);
+
+  cache.Prefetch("a");
+  cache.Prefetch("a");
+  ASSERT_EQ(1u, cache.GetLoadsCount());
+  ASSERT_EQ(0u, cache.GetCacheHitCount());
+  ASSERT_EQ(0u, cache.GetCacheMissCount());
+
+  size_t prefetchCount, prefetchHitCount, wastedPrefetchCount;
+  cache.GetPrefetchStatistics(prefetchCount, prefetchHitCount, wastedPrefetchCount);
+  ASSERT_EQ(1u, prefetchCount);
+  ASSERT_EQ(0u, prefetchHitCount);
+  ASSERT_EQ(0u, wastedPrefetchCount);
+
+  {
+    OrthancPlugins::BucketContent content;
+    cache.AddChunk(content, "a", 0, 10);
+    cache.AddChunk(content, "a", 0, 10);  // Only the first access is a prefetch hit
+  }
+
+  ASSERT_EQ(1u, cache.GetLoadsCount());
+
+  cache.GetPrefetchStatistics(prefetchCount, prefetchHitCount, wastedPrefetchCount);
+  ASSERT_EQ(1u, prefetchCount);
+  ASSERT_EQ(1u, prefetchHitCount);
+  ASSERT_EQ(0u, wastedPrefetchCount);
+
+  // Prefetching "c" evicts "a" (that was used) and "b" (that was not)
+  cache.Prefetch("b");
+  cache.Prefetch("c");
+  ASSERT_EQ(3u, cache.GetLoadsCount());
+  ASSERT_EQ(95u, cache.GetMemorySize());
+
+  cache.GetPrefetchStatistics(prefetchCount, prefetchHitCount, wastedPrefetchCount);
+  ASSERT_EQ(3u, prefetchCount);
+  ASSERT_EQ(1u, prefetchHitCount);
+  ASSERT_EQ(1u, wastedPrefetchCount);
+
+  // Errors are reported to the caller, and the load can be retried
+  ASSERT_THROW(cache.Prefetch("nope"), Orthanc::OrthancException);
+  ASSERT_THROW(cache.Prefetch("nope"), Orthanc::OrthancException);
+}
+
+
+TEST(InstancesPrefetcher, Basic)
+{
+  InstancesCacheForTests cache(4);
+  cache.SetMaxMemorySize(1000);
+
+  std::vector<std::string> plan;
+  for (unsigned int i = 0; i < 10; i++)
+  {
+    std::string id = "instance-" + boost::lexical_cast<std::string>(i);
+    cache.AddInstance(id, 10);
+    plan.push_back(id);
+  }
+
+  plan.push_back("instance-3");  // Duplicates are ignored
+
+  {
+    OrthancPlugins::InstancesPrefetcher prefetcher(cache, 2, 3);
+    ASSERT_TRUE(prefetcher.IsEnabled());
+    ASSERT_EQ(0u, prefetcher.GetPlansCount());
+
+    size_t planId = prefetcher.AddPlan(plan);
+    ASSERT_NE(0u, planId);
+    ASSERT_EQ(1u, prefetcher.GetPlansCount());
+
+    // The first 3 instances of the plan are read ahead
+    ASSERT_TRUE(cache.WaitForLoads(3));
+    boost::this_thread::sleep(boost::posix_time::milliseconds(50));
+    ASSERT_EQ(3u, cache.GetLoadsCount());
+
+    // Accessing an instance moves the window
+    {
+      OrthancPlugins::BucketContent content;
+      prefetcher.NotifyAccess("instance-1");
+      cache.AddChunk(content, "instance-1", 0, 10);
+    }
+
+    ASSERT_TRUE(cache.WaitForLoads(5));
+    boost::this_thread::sleep(boost::posix_time::milliseconds(50));
+    ASSERT_EQ(5u, cache.GetLoadsCount());
+    ASSERT_EQ(1u, cache.GetCacheHitCount());
+    ASSERT_EQ(0u, cache.GetCacheMissCount());
+
+    size_t prefetchCount, prefetchHitCount, wastedPrefetchCount;
+    cache.GetPrefetchStatistics(prefetchCount, prefetchHitCount, wastedPrefetchCount);
+    ASSERT_EQ(5u, prefetchCount);
+    ASSERT_EQ(1u, prefetchHitCount);
+    ASSERT_EQ(0u, wastedPrefetchCount);
+
+    // Unknown instances are ignored
+    prefetcher.NotifyAccess("nope");
+
+    // The plan is discarded once its last instance is accessed
+    prefetcher.NotifyAccess("instance-9");
+    ASSERT_EQ(0u, prefetcher.GetPlansCount());
+
+    planId = prefetcher.AddPlan(plan);
+    ASSERT_EQ(1u, prefetcher.GetPlansCount());
+
+    // Extending a plan, e.g. with the next page of a lookup
+    std::vector<std::string> extension;
+    extension.push_back("instance-9");  // Already in the plan
+    extension.push_back("instance-10");
+    ASSERT_TRUE(prefetcher.ExtendPlan(planId, extension));
+    prefetcher.NotifyAccess("instance-9");
+    ASSERT_EQ(1u, prefetcher.GetPlansCount());
+    prefetcher.NotifyAccess("instance-10");
+    ASSERT_EQ(0u, prefetcher.GetPlansCount());
+    ASSERT_FALSE(prefetcher.ExtendPlan(planId, extension));
+
+    planId = prefetcher.AddPlan(plan);
+    ASSERT_EQ(1u, prefetcher.GetPlansCount());
+    prefetcher.RemovePlan(planId);
+    ASSERT_EQ(0u, prefetcher.GetPlansCount());
+  }
+
+  {
+    OrthancPlugins::InstancesPrefetcher disabled(cache, 0, 0);
+    ASSERT_FALSE(disabled.IsEnabled());
+    ASSERT_EQ(0u, disabled.AddPlan(plan));
+    ASSERT_EQ(0u, disabled.GetPlansCount());
+  }
+
+  ASSERT_THROW(OrthancPlugins::InstancesPrefetcher(cache, 1, 0), Orthanc::OrthancException);
+
+  std::vector<OrthancPlugins::TransferBucket> buckets(2);
+  buckets[0].AddChunk(OrthancPlugins::DicomInstanceInfo("a", 10, ""), 0, 10);
+  buckets[0].AddChunk(OrthancPlugins::DicomInstanceInfo("b", 20, ""), 0, 10);
+  buckets[1].AddChunk(OrthancPlugins::DicomInstanceInfo("b", 20, ""), 10, 10);
+  buckets[1].AddChunk(OrthancPlugins::DicomInstanceInfo("c", 10, ""), 0, 10);
+
+  OrthancPlugins::InstancesPrefetcher::ListInstances(plan, buckets);
+  ASSERT_EQ(3u, plan.size());
+  ASSERT_EQ("a", plan[0]);
+  ASSERT_EQ("b", plan[1]);
+  ASSERT_EQ("c", plan[2]);
+
+  {
+    // The plan of a pulling peer follows the order of its buckets
+    OrthancPlugins::TransferScheduler s;
+    s.AddInstance(OrthancPlugins::DicomInstanceInfo("a", 6, ""));
+    s.AddInstance(OrthancPlugins::DicomInstanceInfo("b", 4, ""));
+    s.AddInstance(OrthancPlugins::DicomInstanceInfo("c", 30, ""));
+
+    OrthancPlugins::InstancesPrefetcher::ListPullInstances(plan, s, 0, OrthancPlugins::BucketPacking_Balanced);
+    ASSERT_EQ(3u, plan.size());
+    ASSERT_EQ("a", plan[0]);
+    ASSERT_EQ("b", plan[1]);
+    ASSERT_EQ("c", plan[2]);
+
+    // The largest buckets go first: The 2 chunks of "c", then [a,b]
+    OrthancPlugins::InstancesPrefetcher::ListPullInstances(plan, s, 10, OrthancPlugins::BucketPacking_Balanced);
+    ASSERT_EQ(3u, plan.size());
+    ASSERT_EQ("c", plan[0]);
+    ASSERT_EQ("a", plan[1]);
+    ASSERT_EQ("b", plan[2]);
+  }
+}
+
+
+TEST(OrthancInstancesCache, Pin)
+{
+  InstancesCacheForTests cache(1);
+  cache.SetMaxMemorySize(100);
+  cache.SetAttachmentInfoAvailable(true);  // Pinning must not read the instances
+
+  cache.AddInstance("a", 40);
+  cache.AddInstance("b", 40);
+  cache.AddInstance("c", 40);
+  cache.AddInstance("d", 40);
+
+  std::vector<std::string> instances;
+  instances.push_back("a");
+  ASSERT_TRUE(cache.Pin(instances, 0));
+  ASSERT_EQ(40u, cache.GetPinnedSize());
+  ASSERT_EQ(0u, cache.GetLoadsCount());
+
+  {
+    OrthancPlugins::BucketContent content;
+    cache.AddChunk(content, "a", 0, 10);
+    cache.AddChunk(content, "b", 0, 10);
+    cache.AddChunk(content, "c", 0, 10);  // Evicts "b", but not "a"
+    cache.AddChunk(content, "a", 0, 10);
+    cache.AddChunk(content, "d", 0, 10);  // Evicts "c", but not "a"
+  }
+
+  ASSERT_EQ(4u, cache.GetLoadsCount());
+  ASSERT_EQ(80u, cache.GetMemorySize());
+
+  // Pins are reference-counted
+  ASSERT_TRUE(cache.Pin(instances, 0));
+  ASSERT_EQ(40u, cache.GetPinnedSize());
+  cache.Unpin("a");
+  ASSERT_EQ(40u, cache.GetPinnedSize());
+  cache.Unpin("a");
+  ASSERT_EQ(0u, cache.GetPinnedSize());
+  ASSERT_THROW(cache.Unpin("a"), Orthanc::OrthancException);
+
+  {
+    // "a" can be evicted again, but it is now more recent than "d"
+    OrthancPlugins::BucketContent content;
+    cache.AddChunk(content, "b", 0, 10);
+    cache.AddChunk(content, "a", 0, 10);
+  }
+
+  ASSERT_EQ(5u, cache.GetLoadsCount());
+  ASSERT_EQ(80u, cache.GetMemorySize());
+}
+
+
+namespace
+{
+  class PinThread : public boost::noncopyable
+  {
+  private:
+    InstancesCacheForTests&   cache_;
+    std::vector<std::string>  instances_;
+    bool                      granted_;
+    boost::thread             thread_;
+
+    static void Worker(PinThread* that)
+    {
+      that->granted_ = that->cache_.Pin(that->instances_, 10);
+    }
+
+  public:
+    PinThread(InstancesCacheForTests& cache,
+              const std::string& instanceId) :
+      cache_(cache),
+      granted_(false)
+    {
+      instances_.push_back(instanceId);
+      thread_ = boost::thread(Worker, this);
+    }
+
+    bool Join(unsigned int milliseconds)
+    {
+      return thread_.timed_join(boost::posix_time::milliseconds(milliseconds));
+    }
+
+    bool IsGranted() const
+    {
+      return granted_;
+    }
+  };
+}
+
+
+TEST(OrthancInstancesCache, PinBackpressure)
+{
+  InstancesCacheForTests cache(2);
+  cache.SetMaxMemorySize(100);  // At most 50 bytes can be pinned without waiting
+  cache.SetAttachmentInfoAvailable(true);
+
+  cache.AddInstance("a", 40);
+  cache.AddInstance("b", 40);
+  cache.AddInstance("c", 40);
+
+  std::vector<std::string> instances;
+  instances.push_back("a");
+  ASSERT_TRUE(cache.Pin(instances, 0));  // The first pin is always granted
+
+  // Over budget: Nothing is pinned once the timeout has elapsed
+  instances[0] = "b";
+  ASSERT_FALSE(cache.Pin(instances, 0));
+  ASSERT_EQ(40u, cache.GetPinnedSize());
+
+  // Pinning an instance that is already pinned needs no budget
+  instances[0] = "a";
+  ASSERT_TRUE(cache.Pin(instances, 0));
+  ASSERT_EQ(40u, cache.GetPinnedSize());
+
+  PinThread thread(cache, "c");
+  ASSERT_FALSE(thread.Join(100));  // Waiting for the other instances to be unpinned
+
+  cache.Unpin("a");
+  ASSERT_FALSE(thread.Join(100));  // "a" is still pinned once
+
+  cache.Unpin("a");
+  ASSERT_TRUE(thread.Join(5000));
+  ASSERT_TRUE(thread.IsGranted());
+  ASSERT_EQ(40u, cache.GetPinnedSize());
+
+  cache.Unpin("c");
+  ASSERT_EQ(0u, cache.GetPinnedSize());
+}
+
+
+TEST(InstancesPinner, Basic)
+{
+  InstancesCacheForTests cache(4);
+  cache.SetMaxMemorySize(1000);
+  cache.SetAttachmentInfoAvailable(true);
+
+  cache.AddInstance("a", 10);
+  cache.AddInstance("b", 20);
+  cache.AddInstance("c", 10);
+
+  std::vector<OrthancPlugins::TransferBucket> buckets(3);
+  buckets[0].AddChunk(OrthancPlugins::DicomInstanceInfo("a", 10, ""), 0, 10);
+  buckets[0].AddChunk(OrthancPlugins::DicomInstanceInfo("b", 20, ""), 0, 10);
+  buckets[1].AddChunk(OrthancPlugins::DicomInstanceInfo("b", 20, ""), 10, 10);
+  buckets[2].AddChunk(OrthancPlugins::DicomInstanceInfo("c", 10, ""), 0, 10);
+
+  OrthancPlugins::TransferBucket unknown;
+  unknown.AddChunk(OrthancPlugins::DicomInstanceInfo("nope", 10, ""), 0, 10);
+
+  {
+    OrthancPlugins::InstancesPinner pinner(cache, buckets);
+    ASSERT_EQ(0u, pinner.GetPinnedInstancesCount());
+    ASSERT_THROW(pinner.AcquireBucket(unknown, 0), Orthanc::OrthancException);
+    ASSERT_FALSE(pinner.PinInstance("nope"));
+
+    ASSERT_TRUE(pinner.AcquireBucket(buckets[0], 0));
+    ASSERT_EQ(2u, pinner.GetPinnedInstancesCount());
+    ASSERT_EQ(30u, cache.GetPinnedSize());
+
+    // "b" is still needed by the second bucket
+    pinner.ReleaseBucket(buckets[0]);
+    ASSERT_EQ(1u, pinner.GetPinnedInstancesCount());
+    ASSERT_EQ(20u, cache.GetPinnedSize());
+
+    ASSERT_TRUE(pinner.AcquireBucket(buckets[1], 0));
+    ASSERT_EQ(20u, cache.GetPinnedSize());
+    pinner.ReleaseBucket(buckets[1]);
+    ASSERT_EQ(0u, pinner.GetPinnedInstancesCount());
+    ASSERT_EQ(0u, cache.GetPinnedSize());
+
+    // A bucket that is sent again has nothing left to pin
+    ASSERT_FALSE(pinner.PinInstance("b"));
+    ASSERT_TRUE(pinner.AcquireBucket(buckets[1], 0));
+    ASSERT_EQ(0u, cache.GetPinnedSize());
+    pinner.ReleaseBucket(buckets[1]);
+
+    // The prefetcher pins the instance before its bucket is read
+    ASSERT_TRUE(pinner.PinInstance("c"));
+    ASSERT_EQ(10u, cache.GetPinnedSize());
+
+    // The transfer stops before releasing the last bucket
+    ASSERT_TRUE(pinner.AcquireBucket(buckets[2], 0));
+    ASSERT_EQ(10u, cache.GetPinnedSize());
+  }
+
+  ASSERT_EQ(0u, cache.GetPinnedSize());
+  ASSERT_EQ(0u, cache.GetLoadsCount());
+
+  {
+    OrthancPlugins::InstancesPinner pinner(cache, buckets);
+
+    {
+      OrthancPlugins::InstancesPinner::BucketGuard guard(pinner, buckets[0]);
+      ASSERT_EQ(0u, cache.GetPinnedSize());
+      ASSERT_TRUE(guard.Acquire(0));
+      ASSERT_EQ(30u, cache.GetPinnedSize());
+    }
+
+    ASSERT_EQ(20u, cache.GetPinnedSize());
+
+    // The pins are released if the bucket cannot be read
+    try
+    {
+      OrthancPlugins::InstancesPinner::BucketGuard guard(pinner, buckets[1]);
+      ASSERT_TRUE(guard.Acquire(0));
+      throw Orthanc::OrthancException(Orthanc::ErrorCode_InexistentFile);
+    }
+    catch (Orthanc::OrthancException&)
+    {
+    }
+
+    ASSERT_EQ(0u, pinner.GetPinnedInstancesCount());
+    ASSERT_EQ(0u, cache.GetPinnedSize());
+  }
+
+  {
+    // Instances that are announced by the pages of a lookup
+    std::vector<OrthancPlugins::DicomInstanceInfo> page;
+    page.push_back(OrthancPlugins::DicomInstanceInfo("b", 20, ""));
+
+    OrthancPlugins::InstancesPinner pinner(cache);
+    ASSERT_THROW(pinner.AcquireBucket(buckets[1], 0), Orthanc::OrthancException);
+
+    pinner.AddInstances(page);
+    ASSERT_TRUE(pinner.AcquireBucket(buckets[1], 0));
+    ASSERT_EQ(20u, cache.GetPinnedSize());
+    pinner.ReleaseBucket(buckets[1]);
+    ASSERT_EQ(20u, cache.GetPinnedSize());  // Only half of "b" has been served
+  }
+
+  ASSERT_EQ(0u, cache.GetPinnedSize());
+}
+
+
+namespace
+{
+  class AcquireThread : public boost::noncopyable
+  {
+  private:
+    OrthancPlugins::InstancesPinner&       pinner_;
+    const OrthancPlugins::TransferBucket&  bucket_;
+    bool                                   granted_;
+    boost::thread                          thread_;
+
+    static void Worker(AcquireThread* that)
+    {
+      that->granted_ = that->pinner_.AcquireBucket(that->bucket_, 10);
+    }
+
+  public:
+    AcquireThread(OrthancPlugins::InstancesPinner& pinner,
+                  const OrthancPlugins::TransferBucket& bucket) :
+      pinner_(pinner),
+      bucket_(bucket),
+      granted_(false)
+    {
+      thread_ = boost::thread(Worker, this);
+    }
+
+    bool Join(unsigned int milliseconds)
+    {
+      return thread_.timed_join(boost::posix_time::milliseconds(milliseconds));
+    }
+
+    bool IsGranted() const
+    {
+      return granted_;
+    }
+  };
+}
+
+
+TEST(InstancesPinner, Budget)
+{
+  InstancesCacheForTests cache(4);
+  cache.SetMaxMemorySize(40);  // At most 20 bytes can be pinned without waiting
+  cache.SetAttachmentInfoAvailable(true);
+
+  cache.AddInstance("a", 20);
+  cache.AddInstance("b", 20);
+
+  std::vector<OrthancPlugins::TransferBucket> buckets(2);
+  buckets[0].AddChunk(OrthancPlugins::DicomInstanceInfo("b", 20, ""), 0, 10);
+  buckets[1].AddChunk(OrthancPlugins::DicomInstanceInfo("b", 20, ""), 10, 10);
+
+  std::vector<std::string> other;
+  other.push_back("a");
+  ASSERT_TRUE(cache.Pin(other, 0));  // Pinned by another transfer
+
+  OrthancPlugins::InstancesPinner pinner(cache, buckets);
+
+  // The prefetcher never waits, and the bucket is not pinned past the budget
+  ASSERT_FALSE(pinner.PinInstance("b"));
+  ASSERT_FALSE(pinner.AcquireBucket(buckets[0], 0));
+  ASSERT_EQ(0u, pinner.GetPinnedInstancesCount());
+  ASSERT_EQ(20u, cache.GetPinnedSize());
+
+  // The second bucket waits for the pin that is in flight for the
+  // first bucket, instead of reading "b" unpinned
+  AcquireThread first(pinner, buckets[0]);
+  ASSERT_FALSE(first.Join(100));
+
+  AcquireThread second(pinner, buckets[1]);
+  ASSERT_FALSE(second.Join(100));
+
+  cache.Unpin("a");
+  ASSERT_TRUE(first.Join(5000));
+  ASSERT_TRUE(second.Join(5000));
+  ASSERT_TRUE(first.IsGranted());
+  ASSERT_TRUE(second.IsGranted());
+  ASSERT_EQ(1u, pinner.GetPinnedInstancesCount());
+  ASSERT_EQ(20u, cache.GetPinnedSize());
+
+  pinner.ReleaseBucket(buckets[0]);
+  pinner.ReleaseBucket(buckets[1]);
+  ASSERT_EQ(0u, cache.GetPinnedSize());
+}
+
+
+namespace
+{
+  class TemporaryFolder : public boost::noncopyable
+  {
+  private:
+    boost::filesystem::path  path_;
+
+  public:
+    TemporaryFolder() :
+      path_(boost::filesystem::temp_directory_path() / boost::filesystem::unique_path())
+    {
+    }
+
+    ~TemporaryFolder()
+    {
+      boost::system::error_code error;
+      boost::filesystem::remove_all(path_, error);
+    }
+
+    std::string GetPath() const
+    {
+      return path_.string();
+    }
+
+    // Counts the files in the folder and in its subfolders
+    size_t GetFilesCount() const
+    {
+      size_t count = 0;
+
+      for (boost::filesystem::recursive_directory_iterator it(path_);
+           it != boost::filesystem::recursive_directory_iterator(); ++it)
+      {
+        if (boost::filesystem::is_regular_file(it->path()))
+        {
+          count++;
+        }
+      }
+
+      return count;
+    }
+  };
+}
+
+
+TEST(DiskInstancesCache, Basic)
+{
+  TemporaryFolder folder;
+
+  std::string content;
+  for (unsigned int i = 0; i < 40; i++)
+  {
+    content.push_back(static_cast<char>(i));
+  }
+
+  OrthancPlugins::SourceDicomInstance a("a", content);
+  OrthancPlugins::SourceDicomInstance b("b", content);
+  OrthancPlugins::SourceDicomInstance c("c", content);
+
+  std::unique_ptr<OrthancPlugins::SourceDicomInstance> mapped;
+
+  {
+    OrthancPlugins::DiskInstancesCache disk(folder.GetPath(), 100, OrthancPlugins::CachePolicy_LRU);
+    ASSERT_EQ(0u, folder.GetFilesCount());
+
+    ASSERT_TRUE(disk.Lookup("a") == NULL);
+    ASSERT_EQ(1u, disk.GetMissCount());
+
+    disk.Store(a);
+    disk.Store(a);
+    ASSERT_EQ(1u, disk.GetStoredCount());
+    ASSERT_EQ(40u, disk.GetSize());
+    ASSERT_EQ(1u, folder.GetFilesCount());
+
+    mapped.reset(disk.Lookup("a"));
+    ASSERT_TRUE(mapped.get() != NULL);
+    ASSERT_EQ(1u, disk.GetHitCount());
+    ASSERT_EQ("a", mapped->GetInfo().GetId());
+    ASSERT_EQ(a.GetInfo().GetMD5(), mapped->GetInfo().GetMD5());
+    ASSERT_EQ(40u, mapped->GetInfo().GetSize());
+    ASSERT_EQ(0, memcmp(content.c_str(), mapped->GetBuffer(), 40));
+
+    // Storing "c" evicts "a", which remains readable from its mapping
+    disk.Store(b);
+    disk.Store(c);
+    ASSERT_EQ(80u, disk.GetSize());
+    ASSERT_EQ(2u, disk.GetInstancesCount());
+    ASSERT_FALSE(disk.Contains("a"));
+    ASSERT_TRUE(disk.Contains("b"));
+    ASSERT_TRUE(disk.Contains("c"));
+    ASSERT_EQ(2u, folder.GetFilesCount());
+    ASSERT_TRUE(disk.Lookup("a") == NULL);
+
+    // Instances larger than the cache, or whose identifier could
+    // escape from the folder, are ignored
+    OrthancPlugins::SourceDicomInstance large("d", std::string(200, 'x'));
+    OrthancPlugins::SourceDicomInstance invalid("../e", content);
+    disk.Store(large);
+    disk.Store(invalid);
+    ASSERT_EQ(2u, disk.GetInstancesCount());
+    ASSERT_TRUE(disk.Lookup("../e") == NULL);
+  }
+
+  ASSERT_EQ(0, memcmp(content.c_str(), mapped->GetBuffer(), 40));
+
+  // The files are removed when the cache is destroyed
+  ASSERT_EQ(0u, folder.GetFilesCount());
+}
+
+
+TEST(DiskInstancesCache, Remove)
+{
+  TemporaryFolder folder;
+
+  std::string content(40, 'x');
+
+  OrthancPlugins::SourceDicomInstance a("a", content);
+  OrthancPlugins::SourceDicomInstance page0("a-page0", content);
+  OrthancPlugins::SourceDicomInstance page1("a-page1", content);
+  OrthancPlugins::SourceDicomInstance b("b", content);
+
+  {
+    OrthancPlugins::DiskInstancesCache disk(folder.GetPath(), 1000, OrthancPlugins::CachePolicy_LRU);
+
+    // Unrelated files are never purged, even in the subfolder of the cache
+    std::string s = "hello";
+    Orthanc::SystemToolbox::WriteFile(s, (boost::filesystem::path(folder.GetPath()) / "other.dcm").string());
+    Orthanc::SystemToolbox::WriteFile(s, (disk.GetFolder() / "other.txt").string());
+    Orthanc::SystemToolbox::WriteFile(s, (disk.GetFolder() / "not valid.dcm").string());
+    ASSERT_EQ(3u, folder.GetFilesCount());
+
+    disk.Store(a);
+    disk.Store(page0);
+    disk.Store(page1);
+    disk.Store(b);
+    ASSERT_EQ(4u, disk.GetInstancesCount());
+    ASSERT_EQ(7u, folder.GetFilesCount());
+
+    disk.RemoveByPrefix("a-page");
+    ASSERT_EQ(2u, disk.GetInstancesCount());
+    ASSERT_TRUE(disk.Contains("a"));
+    ASSERT_TRUE(disk.Contains("b"));
+
+    disk.Remove("a");
+    disk.Remove("nope");
+    ASSERT_EQ(1u, disk.GetInstancesCount());
+    ASSERT_EQ(40u, disk.GetSize());
+    ASSERT_TRUE(disk.Lookup("a") == NULL);
+    ASSERT_EQ(4u, folder.GetFilesCount());
+  }
+
+  ASSERT_EQ(3u, folder.GetFilesCount());
+
+  {
+    // A previous execution left files in the subfolder of the cache
+    OrthancPlugins::DiskInstancesCache disk(folder.GetPath(), 1000, OrthancPlugins::CachePolicy_LRU);
+    std::string s = "hello";
+    Orthanc::SystemToolbox::WriteFile(s, (disk.GetFolder() / "c.dcm").string());
+    Orthanc::SystemToolbox::WriteFile(s, (disk.GetFolder() / "d.tmp").string());
+  }
+
+  {
+    OrthancPlugins::DiskInstancesCache disk(folder.GetPath(), 1000, OrthancPlugins::CachePolicy_LRU);
+    ASSERT_EQ(3u, folder.GetFilesCount());
+  }
+}
+
+
+TEST(OrthancInstancesCache, DiskCache)
+{
+  TemporaryFolder folder;
+
+  InstancesCacheForTests cache(1);
+  cache.SetAttachmentInfoAvailable(true);
+  cache.SetMaxMemorySize(100);
+  cache.SetDiskCache(new OrthancPlugins::DiskInstancesCache(folder.GetPath(), 1000, OrthancPlugins::CachePolicy_LRU));
+
+  cache.AddInstance("a", 40);
+  cache.AddInstance("b", 40);
+  cache.AddInstance("c", 40);
+
+  std::string expected, actual;
+
+  {
+    OrthancPlugins::BucketContent content;
+    cache.AddChunk(content, "a", 0, 40);
+    content.Flatten(expected);
+  }
+
+  {
+    OrthancPlugins::BucketContent content;
+    cache.AddChunk(content, "b", 0, 10);
+    cache.AddChunk(content, "c", 0, 10);  // "a" is demoted to the disk
+  }
+
+  ASSERT_EQ(3u, cache.GetLoadsCount());
+  ASSERT_EQ(1u, cache.GetDiskCache().GetInstancesCount());
+  ASSERT_TRUE(cache.GetDiskCache().Contains("a"));
+
+  {
+    // "a" is read back from the disk, and "b" is demoted
+    OrthancPlugins::BucketContent content;
+    cache.AddChunk(content, "a", 0, 40);
+    content.Flatten(actual);
+  }
+
+  ASSERT_EQ(3u, cache.GetLoadsCount());
+  ASSERT_EQ(expected, actual);
+  ASSERT_EQ(1u, cache.GetDiskCache().GetHitCount());
+  ASSERT_EQ(2u, cache.GetDiskCache().GetInstancesCount());
+  ASSERT_TRUE(cache.GetDiskCache().Contains("b"));
+
+  {
+    // Reading "b" once again evicts "c", the disk cache is inclusive
+    OrthancPlugins::BucketContent content;
+    cache.AddChunk(content, "b", 0, 10);
+  }
+
+  ASSERT_EQ(3u, cache.GetLoadsCount());
+  ASSERT_EQ(2u, cache.GetDiskCache().GetHitCount());
+  ASSERT_EQ(3u, cache.GetDiskCache().GetInstancesCount());
+  ASSERT_EQ(120u, cache.GetDiskCache().GetSize());
+
+  {
+    // "c" is stored again in Orthanc with another content, behind the
+    // back of the cache: The stale file is not served
+    cache.AddInstance("c", 30);
+    OrthancPlugins::BucketContent content;
+    cache.AddChunk(content, "c", 0, 30);
+    content.Flatten(actual);
+  }
+
+  ASSERT_EQ(4u, cache.GetLoadsCount());
+  ASSERT_EQ(cache.GetContent("c"), actual);
+  ASSERT_EQ(3u, cache.GetDiskCache().GetHitCount());
+
+  // Deleting an instance removes it from the disk
+  ASSERT_TRUE(cache.GetDiskCache().Contains("a"));
+  cache.Invalidate("a");
+  ASSERT_FALSE(cache.GetDiskCache().Contains("a"));
+}
+
+
+TEST(OrthancInstancesCache, RangeReads)
+{
+  InstancesCacheForTests cache(4);
+  cache.SetMaxMemorySize(1000);
+  cache.SetRangeReads(500, 100);
+  cache.SetAttachmentInfoAvailable(true);
+
+  cache.AddInstance("large", 1050);
+  cache.AddInstance("small", 200);
+
+  const std::string large = cache.GetContent("large");
+
+  {
+    // The chunk overlaps 2 pages
+    OrthancPlugins::BucketContent content;
+    cache.AddChunk(content, "large", 150, 120);
+    ASSERT_EQ(2u, content.GetSlicesCount());
+
+    std::string s;
+    content.Flatten(s);
+    ASSERT_EQ(large.substr(150, 120), s);
+  }
+
+  ASSERT_EQ(0u, cache.GetLoadsCount());
+  ASSERT_EQ(2u, cache.GetRangeLoadsCount());
+  ASSERT_EQ(200u, cache.GetMemorySize());
+
+  {
+    // The last page is truncated, the cached pages are reused
+    OrthancPlugins::BucketContent content;
+    cache.AddChunk(content, "large", 250, 800);
+
+    std::string s;
+    content.Flatten(s);
+    ASSERT_EQ(large.substr(250, 800), s);
+  }
+
+  ASSERT_EQ(0u, cache.GetLoadsCount());
+  ASSERT_EQ(10u, cache.GetRangeLoadsCount());
+  ASSERT_EQ(950u, cache.GetLoadedBytes());
+  ASSERT_LE(cache.GetMemorySize(), 1000u);
+
+  {
+    OrthancPlugins::BucketContent content;
+    ASSERT_THROW(cache.AddChunk(content, "large", 1000, 51), Orthanc::OrthancException);
+  }
+
+  {
+    // The small instances are still read as a whole
+    OrthancPlugins::BucketContent content;
+    cache.AddChunk(content, "small", 10, 20);
+  }
+
+  ASSERT_EQ(1u, cache.GetLoadsCount());
+
+  // The large instances are neither prefetched, nor pinned
+  cache.Prefetch("large");
+  ASSERT_EQ(1u, cache.GetLoadsCount());
+  ASSERT_EQ(10u, cache.GetRangeLoadsCount());
+
+  std::vector<std::string> instances;
+  instances.push_back("large");
+  cache.Pin(instances, 0);
+  ASSERT_EQ(0u, cache.GetPinnedSize());
+  cache.Unpin("large");
+
+  {
+    // Without its size, an instance is read as a whole
+    InstancesCacheForTests cache2(4);
+    cache2.SetMaxMemorySize(2000);
+    cache2.SetRangeReads(500, 100);
+    cache2.AddInstance("large", 1050);
+
+    OrthancPlugins::BucketContent content;
+    cache2.AddChunk(content, "large", 150, 120);
+    ASSERT_EQ(1u, cache2.GetLoadsCount());
+    ASSERT_EQ(0u, cache2.GetRangeLoadsCount());
+  }
+
+  {
+    // If Orthanc doesn't store the MD5 of the attachments, their
+    // size is still enough to read the large instances by pages
+    InstancesCacheForTests cache3(4);
+    cache3.SetMaxMemorySize(2000);
+    cache3.SetRangeReads(500, 100);
+    cache3.SetAttachmentInfoAvailable(true);
+    cache3.SetAttachmentMD5Available(false);
+    cache3.AddInstance("large", 1050);
+
+    OrthancPlugins::BucketContent content;
+    cache3.AddChunk(content, "large", 150, 120);
+    ASSERT_EQ(0u, cache3.GetLoadsCount());
+    ASSERT_EQ(2u, cache3.GetRangeLoadsCount());
+    ASSERT_EQ(1u, cache3.GetAttachmentInfoCount());
+
+    // The size is indexed alone: The next chunks and the pins need no
+    // more information about the attachment
+    cache3.AddChunk(content, "large", 270, 120);
+    cache3.Prefetch("large");
+
+    std::vector<std::string> instances;
+    instances.push_back("large");
+    ASSERT_TRUE(cache3.Pin(instances, 0));
+    cache3.Unpin("large");
+    ASSERT_EQ(1u, cache3.GetAttachmentInfoCount());
+
+    // The MD5 is not indexed if unknown, it is computed from the file
+    size_t size;
+    std::string md5, expected;
+    cache3.GetInstanceInfo(size, md5, "large");
+    Orthanc::Toolbox::ComputeMD5(expected, cache3.GetContent("large"));
+    ASSERT_EQ(1050u, size);
+    ASSERT_EQ(expected, md5);
+    ASSERT_FALSE(cache3.IsInstanceStored(OrthancPlugins::DicomInstanceInfo("large", size, md5)));
+  }
+}
+
+
+namespace
+{
+  class InstanceListenerForTests : public OrthancPlugins::OrthancInstancesCache::IInstanceListener
+  {
+  private:
+    boost::mutex              mutex_;
+    std::vector<std::string>  instances_;
+
+  public:
+    virtual void SignalInstanceLoaded(const std::string& instanceId,
+                                      const void* dicom,
+                                      size_t size) ORTHANC_OVERRIDE
+    {
+      boost::mutex::scoped_lock lock(mutex_);
+      instances_.push_back(instanceId + ":" + boost::lexical_cast<std::string>(size));
+    }
+
+    std::vector<std::string> GetInstances()
+    {
+      boost::mutex::scoped_lock lock(mutex_);
+      return instances_;
+    }
+  };
+}
+
+
+TEST(OrthancInstancesCache, InstanceListener)
+{
+  InstanceListenerForTests listener;
+
+  InstancesCacheForTests cache(4);
+  cache.SetMaxMemorySize(1000);
+  cache.SetRangeReads(500, 100);
+  cache.SetAttachmentInfoAvailable(true);
+  cache.SetInstanceListener(&listener);
+
+  cache.AddInstance("large", 1050);
+  cache.AddInstance("small", 200);
+
+  OrthancPlugins::BucketContent content;
+  cache.AddChunk(content, "small", 10, 20);
+  cache.AddChunk(content, "small", 30, 20);  // Cache hit
+  cache.AddChunk(content, "large", 150, 120);  // Pages are not notified
+
+  std::vector<std::string> instances = listener.GetInstances();
+  ASSERT_EQ(1u, instances.size());
+  ASSERT_EQ("small:200", instances[0]);
+
+  cache.SetInstanceListener(NULL);
+  cache.Invalidate("small");
+  cache.AddChunk(content, "small", 10, 20);
+  ASSERT_EQ(1u, listener.GetInstances().size());
+}
+
+
+TEST(OrthancInstancesCache, Invalidate)
+{
+  InstancesCacheForTests cache(4);
+  cache.SetMaxMemorySize(1000);
+  cache.SetRangeReads(500, 100);
+  cache.SetAttachmentInfoAvailable(true);
+
+  cache.AddInstance("large", 1050);
+  cache.AddInstance("small", 200);
+
+  {
+    OrthancPlugins::BucketContent content;
+    cache.AddChunk(content, "large", 150, 120);
+    cache.AddChunk(content, "small", 0, 200);
+  }
+
+  ASSERT_EQ(3u, cache.GetInstancesCount());
+  ASSERT_EQ(400u, cache.GetMemorySize());
+
+  size_t size;
+  std::string md5;
+  cache.GetInstanceInfo(size, md5, "small");
+  ASSERT_EQ(200u, size);
+
+  // The pages of the large instance are spread over the shards
+  cache.Invalidate("large");
+  ASSERT_EQ(1u, cache.GetInstancesCount());
+  ASSERT_EQ(200u, cache.GetMemorySize());
+
+  // "small" is stored again with another content
+  cache.AddInstance("small", 150);
+  cache.Invalidate("small");
+  ASSERT_EQ(0u, cache.GetInstancesCount());
+  ASSERT_EQ(0u, cache.GetMemorySize());
+
+  {
+    OrthancPlugins::BucketContent content;
+    cache.AddChunk(content, "small", 0, 150);
+
+    std::string s;
+    content.Flatten(s);
+    ASSERT_EQ(cache.GetContent("small"), s);
+  }
+
+  ASSERT_EQ(2u, cache.GetLoadsCount());
+  cache.GetInstanceInfo(size, md5, "small");
+  ASSERT_EQ(150u, size);
+
+  {
+    OrthancPlugins::BucketContent content;
+    cache.AddChunk(content, "large", 150, 120);
+  }
+
+  ASSERT_EQ(4u, cache.GetRangeLoadsCount());
+}
+
+
+TEST(BandwidthDelayEstimator, Basic)
+{
+  ASSERT_THROW(OrthancPlugins::BandwidthDelayEstimator(true, 0, 10), Orthanc::OrthancException);
+  ASSERT_THROW(OrthancPlugins::BandwidthDelayEstimator(true, 20, 10), Orthanc::OrthancException);
+
+  const size_t MB = 1024 * 1024;
+
+  OrthancPlugins::BandwidthDelayEstimator estimator(true, 1 * MB, 32 * MB);
+
+  double rtt, throughput;
+  ASSERT_FALSE(estimator.LookupLink(rtt, throughput, "peer"));
+  ASSERT_EQ(4 * MB, estimator.ComputeBucketSize("peer", 4 * MB));
+
+  // Link with a latency of 200ms and a throughput of 10MB/s
+  for (size_t i = 0; i < 100; i++)
+  {
+    const size_t size = (1 + i % 8) * MB;
+    estimator.RecordQuery("peer", size, size, 0.2 + static_cast<double>(size) / (10.0 * MB));
+  }
+
+  ASSERT_TRUE(estimator.LookupLink(rtt, throughput, "peer"));
+  ASSERT_NEAR(0.2, rtt, 0.001);
+  ASSERT_NEAR(10.0 * MB, throughput, 0.01 * MB);
+
+  // 4 times the bandwidth-delay product, which is 2MB
+  ASSERT_NEAR(8.0 * MB, static_cast<double>(estimator.ComputeBucketSize("peer", 4 * MB)), 0.1 * MB);
+
+  // The other peers are not affected
+  ASSERT_FALSE(estimator.LookupLink(rtt, throughput, "other"));
+  ASSERT_EQ(4 * MB, estimator.ComputeBucketSize("other", 4 * MB));
+
+  // Fast link with a large latency: The size is clamped
+  for (size_t i = 0; i < 100; i++)
+  {
+    const size_t size = (1 + i % 8) * MB;
+    estimator.RecordQuery("far", size, size, 1.0 + static_cast<double>(size) / (100.0 * MB));
+  }
+
+  ASSERT_EQ(32 * MB, estimator.ComputeBucketSize("far", 4 * MB));
+
+  // Local link, whose duration is dominated by the transfer
+  for (size_t i = 0; i < 100; i++)
+  {
+    const size_t size = (1 + i % 8) * MB;
+    estimator.RecordQuery("near", size, size, 0.0001 + static_cast<double>(size) / (100.0 * MB));
+  }
+
+  ASSERT_EQ(1 * MB, estimator.ComputeBucketSize("near", 4 * MB));
+
+  // The recent queries have more weight: The latency has increased
+  for (size_t i = 0; i < 200; i++)
+  {
+    const size_t size = (1 + i % 8) * MB;
+    estimator.RecordQuery("peer", size, size, 0.4 + static_cast<double>(size) / (10.0 * MB));
+  }
+
+  ASSERT_TRUE(estimator.LookupLink(rtt, throughput, "peer"));
+  ASSERT_NEAR(0.4, rtt, 0.01);
+  ASSERT_NEAR(16.0 * MB, static_cast<double>(estimator.ComputeBucketSize("peer", 4 * MB)), 0.5 * MB);
+
+  OrthancPlugins::BandwidthDelayEstimator disabled(false, 1 * MB, 32 * MB);
+  for (size_t i = 0; i < 100; i++)
+  {
+    disabled.RecordQuery("peer", (1 + i % 8) * MB, (1 + i % 8) * MB, 1.0);
+  }
+
+  ASSERT_TRUE(disabled.LookupLink(rtt, throughput, "peer"));
+  ASSERT_EQ(4 * MB, disabled.ComputeBucketSize("peer", 4 * MB));
+
+  // Same link as the first one, but the buckets are compressed with a
+  // ratio of 2: The buckets are planned from their uncompressed size
+  for (size_t i = 0; i < 100; i++)
+  {
+    const size_t size = (1 + i % 8) * MB;
+    estimator.RecordQuery("compressed", size, 2 * size, 0.2 + static_cast<double>(size) / (10.0 * MB));
+  }
+
+  ASSERT_TRUE(estimator.LookupLink(rtt, throughput, "compressed"));
+  ASSERT_NEAR(10.0 * MB, throughput, 0.01 * MB);
+  ASSERT_NEAR(16.0 * MB, static_cast<double>(estimator.ComputeBucketSize("compressed", 4 * MB)), 0.2 * MB);
+}
+
+
+TEST(CompressionLevelController, Basic)
+{
+  using namespace OrthancPlugins;
+
+  const size_t MB = 1024 * 1024;
+
+  BandwidthDelayEstimator estimator(true, 1 * MB, 32 * MB);
+
+  {
+    CompressionLevelController none(estimator, "peer", BucketCompression_None);
+    ASSERT_EQ(0, none.GetLevel());
+    none.RecordBucket(0, 4 * MB, 4 * MB, 1.0);
+    ASSERT_EQ(0, none.GetLevel());
+  }
+
+  CompressionLevelController gzip(estimator, "peer", BucketCompression_Gzip);
+  ASSERT_EQ(BucketCompression_Gzip, gzip.GetCompression());
+  ASSERT_EQ(6, gzip.GetLevel());
+
+  // No decision as long as the link to the peer is unknown
+  for (size_t i = 0; i < 8; i++)
+  {
+    gzip.RecordBucket(6, 4 * MB, 2 * MB, 1.0);
+  }
+
+  ASSERT_EQ(6, gzip.GetLevel());
+
+  // Link with a throughput of 10MB/s of compressed data, i.e. 20MB/s
+  // of uncompressed data with a ratio of 2
+  for (size_t i = 0; i < 100; i++)
+  {
+    const size_t size = (1 + i % 8) * MB;
+    estimator.RecordQuery("peer", size, size, 0.01 + static_cast<double>(size) / (10.0 * MB));
+  }
+
+  // The compression runs at 4MB/s: The CPU is the bottleneck. The
+  // buckets that were recorded before the link was known are used.
+  gzip.RecordBucket(6, 4 * MB, 2 * MB, 1.0);
+  ASSERT_EQ(5, gzip.GetLevel());
+
+  for (size_t i = 0; i < 3; i++)
+  {
+    gzip.RecordBucket(5, 4 * MB, 2 * MB, 1.0);
+  }
+
+  ASSERT_EQ(5, gzip.GetLevel());
+  gzip.RecordBucket(5, 4 * MB, 2 * MB, 1.0);
+  ASSERT_EQ(4, gzip.GetLevel());
+
+  // The buckets that were compressed at the previous level are ignored
+  for (size_t i = 0; i < 8; i++)
+  {
+    gzip.RecordBucket(5, 4 * MB, 2 * MB, 0.001);
+  }
+
+  ASSERT_EQ(4, gzip.GetLevel());
+
+  for (int level = 4; level > 1; level--)
+  {
+    for (size_t i = 0; i < 4; i++)
+    {
+      gzip.RecordBucket(level, 4 * MB, 2 * MB, 1.0);
+    }
+  }
+
+  ASSERT_EQ(1, gzip.GetLevel());
+
+  for (size_t i = 0; i < 4; i++)
+  {
+    gzip.RecordBucket(1, 4 * MB, 2 * MB, 1.0);
+  }
+
+  ASSERT_EQ(1, gzip.GetLevel());  // Lowest level of gzip
+
+  // The compression runs at 400MB/s: The network is the bottleneck
+  for (int level = 1; level < 12; level++)
+  {
+    for (size_t i = 0; i < 4; i++)
+    {
+      gzip.RecordBucket(gzip.GetLevel(), 4 * MB, 2 * MB, 0.01);
+    }
+  }
+
+  ASSERT_EQ(9, gzip.GetLevel());  // Highest level of gzip
+
+  // Within the hysteresis: The level is kept
+  for (size_t i = 0; i < 8; i++)
+  {
+    gzip.RecordBucket(9, 4 * MB, 2 * MB, 0.15);
+  }
+
+  ASSERT_EQ(9, gzip.GetLevel());
+
+  // Each transfer has its own level
+  CompressionLevelController other(estimator, "peer", BucketCompression_Gzip);
+  ASSERT_EQ(6, other.GetLevel());
+
+  ASSERT_TRUE(CompressionLevelController::IsAdaptive());
+  CompressionLevelController::SetAdaptive(false);
+
+  {
+    CompressionLevelController fixed(estimator, "peer", BucketCompression_Gzip);
+
+    for (size_t i = 0; i < 8; i++)
+    {
+      fixed.RecordBucket(6, 4 * MB, 2 * MB, 1.0);
+    }
+
+    ASSERT_EQ(6, fixed.GetLevel());
+  }
+
+  CompressionLevelController::SetAdaptive(true);
+
+#if ORTHANC_TRANSFERS_ENABLE_ZSTD == 1
+  {
+    CompressionLevelController zstd(estimator, "peer", BucketCompression_Zstd);
+    ASSERT_EQ(BucketContent::GetZstdLevel(), zstd.GetLevel());
+
+    for (size_t i = 0; i < 4; i++)
+    {
+      zstd.RecordBucket(zstd.GetLevel(), 4 * MB, 2 * MB, 0.01);
+    }
+
+    ASSERT_EQ(BucketContent::GetZstdLevel() + 1, zstd.GetLevel());
+  }
+#endif
+
+  // The levels that are requested by the peers
+  ASSERT_EQ(0, CompressionLevelController::ClampLevel(BucketCompression_None, 5));
+  ASSERT_EQ(0, CompressionLevelController::ClampLevel(BucketCompression_Gzip, 0));
+  ASSERT_EQ(1, CompressionLevelController::ClampLevel(BucketCompression_Gzip, -3));
+  ASSERT_EQ(5, CompressionLevelController::ClampLevel(BucketCompression_Gzip, 5));
+  ASSERT_EQ(9, CompressionLevelController::ClampLevel(BucketCompression_Gzip, 100));
+  ASSERT_EQ(0, CompressionLevelController::ClampLevel(BucketCompression_Zstd, 0));
+  ASSERT_EQ(19, CompressionLevelController::ClampLevel(BucketCompression_Zstd, 1000000));
+  ASSERT_EQ(1, CompressionLevelController::ClampLevel(BucketCompression_Zstd, -1000000));
+  ASSERT_EQ(10, CompressionLevelController::ClampLevel(BucketCompression_Auto, 10));
+  ASSERT_THROW(CompressionLevelController::ClampLevel(static_cast<BucketCompression>(1000), 5), Orthanc::OrthancException);
+}
+
+
+/**
+ * Replays a trace of accesses to the cache, and reports the hit ratio
+ * of the different cache policies. The trace is read from the file
+ * given by the "TRANSFERS_CACHE_TRACE" environment variable, whose
+ * lines are formatted as "<instance> <size in bytes>". If this
+ * variable is not set, a synthetic trace is used, in which a set of
+ * warm CT slices is interleaved with the scans of large whole-slide
+ * images. Disabled by default, as for the other benchmarks.
+ **/
+TEST(OrthancInstancesCache, DISABLED_BenchmarkReplay)
+{
+  typedef std::pair<std::string, size_t>  Access;
+  std::vector<Access> trace;
+
+  const char* path = getenv("TRANSFERS_CACHE_TRACE");
+  if (path != NULL)
+  {
+    std::string content;
+    Orthanc::SystemToolbox::ReadFile(content, path);
+
+    std::vector<std::string> lines;
+    Orthanc::Toolbox::TokenizeString(lines, content, '\n');
+
+    for (size_t i = 0; i < lines.size(); i++)
+    {
+      std::vector<std::string> tokens;
+      Orthanc::Toolbox::TokenizeString(tokens, Orthanc::Toolbox::StripSpaces(lines[i]), ' ');
+      if (tokens.size() == 2)
+      {
+        trace.push_back(std::make_pair(tokens[0], boost::lexical_cast<size_t>(tokens[1])));
+      }
+    }
+  }
+  else
+  {
+    static const size_t SLICES_COUNT = 400;
+    static const size_t SLICE_SIZE = 64 * KB;
+    static const size_t SLIDE_SIZE = 12 * MB;
+    static const size_t BUCKET_SIZE = 1 * MB;
+
+    uint32_t seed = 42;
+
+    for (size_t i = 0; i < 20000; i++)
+    {
+      seed = seed * 1664525u + 1013904223u;
+
+      if (i % 2500 == 0)
+      {
+        // Scan of a whole-slide image, bucket by bucket
+        std::string slide = "slide-" + boost::lexical_cast<std::string>(i);
+        for (size_t j = 0; j < SLIDE_SIZE / BUCKET_SIZE; j++)
+        {
+          trace.push_back(std::make_pair(slide, SLIDE_SIZE));
+        }
+      }
+
+      // Skewed popularity of the CT slices
+      double r = static_cast<double>(seed >> 8) / static_cast<double>(1 << 24);
+      size_t slice = static_cast<size_t>(r * r * r * static_cast<double>(SLICES_COUNT));
+      trace.push_back(std::make_pair("slice-" + boost::lexical_cast<std::string>(slice), SLICE_SIZE));
+    }
+  }
+
+  const OrthancPlugins::CachePolicy policies[] = {
+    OrthancPlugins::CachePolicy_LRU,
+    OrthancPlugins::CachePolicy_SLRU,
+    OrthancPlugins::CachePolicy_TinyLFU
+  };
+
+  for (size_t p = 0; p < sizeof(policies) / sizeof(OrthancPlugins::CachePolicy); p++)
+  {
+    InstancesCacheForTests cache(1, policies[p]);
+    cache.SetMaxMemorySize(16 * MB);
+
+    std::set<std::string> known;
+
+    for (size_t i = 0; i < trace.size(); i++)
+    {
+      if (known.insert(trace[i].first).second)
+      {
+        cache.AddInstance(trace[i].first, trace[i].second);
+      }
+
+      OrthancPlugins::BucketContent content;
+      cache.AddChunk(content, trace[i].first, 0, 1);
+    }
+
+    printf("Policy %-8s: %6.2f%% hits, %6d loads, %5d rejected, %8.1f MB read\n",
+           OrthancPlugins::EnumerationToString(policies[p]),
+           100.0 * static_cast<double>(cache.GetCacheHitCount()) / static_cast<double>(trace.size()),
+           static_cast<int>(cache.GetLoadsCount()), static_cast<int>(cache.GetRejectedCount()),
+           static_cast<double>(cache.GetLoadedBytes()) / static_cast<double>(MB));
+  }
+}
+
+
+/**
+ * Benchmark of the hit path of the cache. Disabled by default, run it
+ * with: "./UnitTests --gtest_also_run_disabled_tests --gtest_filter=*Benchmark*"
+ **/
+TEST(OrthancInstancesCache, DISABLED_BenchmarkHits)
+{
+  static const size_t INSTANCES_COUNT = 64;
+  static const size_t INSTANCE_SIZE = 4 * MB;
+  static const size_t CHUNK_SIZE = 64 * KB;
+  static const size_t READS_PER_THREAD = 2000;
+
+  struct Worker
+  {
+    static void Apply(OrthancPlugins::OrthancInstancesCache* cache,
+                      size_t seed)
+    {
+      for (size_t i = 0; i < READS_PER_THREAD; i++)
+      {
+        OrthancPlugins::BucketContent content;
+        size_t instance = (seed * 7919 + i * 104729) % INSTANCES_COUNT;
+        cache->AddChunk(content, "instance-" + boost::lexical_cast<std::string>(instance),
+                        (i % (INSTANCE_SIZE / CHUNK_SIZE)) * CHUNK_SIZE, CHUNK_SIZE);
+
+        std::string chunk;
+        content.Flatten(chunk);
+      }
+    }
+  };
+
+  const size_t shards[] = { 1, 16 };
+
+  for (size_t s = 0; s < sizeof(shards) / sizeof(size_t); s++)
+  {
+    InstancesCacheForTests cache(shards[s]);
+    cache.SetMaxMemorySize(2 * INSTANCES_COUNT * INSTANCE_SIZE);
+
+    for (size_t i = 0; i < INSTANCES_COUNT; i++)
+    {
+      std::string id = "instance-" + boost::lexical_cast<std::string>(i);
+      cache.AddInstance(id, INSTANCE_SIZE);
+
+      // Warm up the cache, so that only the hit path is measured
+      size_t size;
+      std::string md5;
+      cache.GetInstanceInfo(size, md5, id);
+    }
+
+    for (size_t threadsCount = 1; threadsCount <= 16; threadsCount *= 2)
+    {
+      boost::posix_time::ptime start = boost::posix_time::microsec_clock::universal_time();
+
+      std::vector<boost::thread*> threads;
+      for (size_t i = 0; i < threadsCount; i++)
+      {
+        threads.push_back(new boost::thread(Worker::Apply, &cache, i));
+      }
+
+      for (size_t i = 0; i < threads.size(); i++)
+      {
+        threads[i]->join();
+        delete threads[i];
+      }
+
+      double elapsed = static_cast<double>(
+        (boost::posix_time::microsec_clock::universal_time() - start).total_microseconds()) / 1000000.0;
+      double reads = static_cast<double>(threadsCount * READS_PER_THREAD);
+
+      printf("Cache with %2d shard(s), %2d thread(s): %10.0f chunks/s, %8.1f MB/s\n",
+             static_cast<int>(shards[s]), static_cast<int>(threadsCount),
+             reads / elapsed, reads * static_cast<double>(CHUNK_SIZE) / static_cast<double>(MB) / elapsed);
+    }
+
+    ASSERT_EQ(INSTANCES_COUNT, cache.GetLoadsCount());
+  }
+}
+
+
+/**
+ * Compares the packings of the buckets, on a synthetic set of series
+ * of CT-like small instances mixed with a few larger instances. For
+ * each packing, reports the mean number of buckets between the first
+ * and the last bucket of each series (i.e. the delay before a series
+ * is complete on the receiver), and the number of times two successive
+ * chunks belong to different series (i.e. the non-sequential reads on
+ * the sender).
+ **/
+TEST(TransferScheduler, DISABLED_BenchmarkPacking)
+{
+  using namespace OrthancPlugins;
+
+  static const size_t SERIES_COUNT = 40;
+  static const size_t INSTANCES_PER_SERIES = 250;
+  static const size_t BUCKET_SIZE = 4 * MB;
+
+  TransferScheduler s;
+  std::map<std::string, size_t> seriesOfInstance;
+
+  for (size_t i = 0; i < SERIES_COUNT; i++)
+  {
+    for (size_t j = 0; j < INSTANCES_PER_SERIES; j++)
+    {
+      const size_t k = i * INSTANCES_PER_SERIES + j;
+
+      // Pseudo-random identifiers, as for the SHA-1 of Orthanc
+      const std::string id = boost::lexical_cast<std::string>((k * 2654435761u) % 4294967291u);
+      const size_t size = (k % 50 == 0 ? 6 * MB : 200 * KB + (k * 7919) % (400 * KB));
+
+      s.AddInstance(DicomInstanceInfo(id, size, ""));
+      seriesOfInstance[id] = i;
+    }
+  }
+
+  const BucketPacking packings[] = {
+    BucketPacking_Identifier,
+    BucketPacking_Locality
+  };
+
+  for (size_t p = 0; p < sizeof(packings) / sizeof(BucketPacking); p++)
+  {
+    std::vector<TransferBucket> buckets;
+    s.ComputePullBuckets(buckets, BUCKET_SIZE, 2 * BUCKET_SIZE, "", BucketCompression_None, packings[p]);
+
+    std::vector<size_t> first(SERIES_COUNT, buckets.size());
+    std::vector<size_t> last(SERIES_COUNT, 0);
+    size_t switches = 0;
+    size_t previous = SERIES_COUNT;
+
+    for (size_t i = 0; i < buckets.size(); i++)
+    {
+      for (size_t j = 0; j < buckets[i].GetChunksCount(); j++)
+      {
+        const size_t series = seriesOfInstance[buckets[i].GetChunkInstanceId(j)];
+        first[series] = std::min(first[series], i);
+        last[series] = std::max(last[series], i);
+
+        if (previous != SERIES_COUNT &&
+            previous != series)
+        {
+          switches++;
+        }
+
+        previous = series;
+      }
+    }
+
+    double span = 0;
+    for (size_t i = 0; i < SERIES_COUNT; i++)
+    {
+      span += static_cast<double>(last[i] - first[i] + 1);
+    }
+
+    printf("Packing %-10s: %5d buckets, %8.1f buckets per series, %6d series switches\n",
+           EnumerationToString(packings[p]), static_cast<int>(buckets.size()),
+           span / static_cast<double>(SERIES_COUNT), static_cast<int>(switches));
+  }
+}
+
+
+/**
+ * Simulates the total duration of a transfer job whose buckets are
+ * processed in order by a pool of HTTP threads, for the different
+ * packings of the buckets. The cost of one bucket is modeled as a
+ * fixed latency, plus its size divided by the bandwidth of one thread.
+ **/
+TEST(TransferScheduler, DISABLED_BenchmarkMakespan)
+{
+  using namespace OrthancPlugins;
+
+  static const size_t BUCKET_SIZE = 4 * MB;
+  static const double LATENCY = 0.030;                 // In seconds
+  static const double BANDWIDTH = 50.0 * MB;           // In bytes per second and per thread
+
+  const size_t instancesCount[] = { 300, 3000 };
+
+  const BucketPacking packings[] = {
+    BucketPacking_Identifier,
+    BucketPacking_Locality,
+    BucketPacking_Balanced
+  };
+
+  const size_t workers[] = { 4, 8, 16 };
+
+  for (size_t c = 0; c < sizeof(instancesCount) / sizeof(size_t); c++)
+  {
+    TransferScheduler s;
+
+    for (size_t i = 0; i < instancesCount[c]; i++)
+    {
+      size_t size;
+      if (i % 100 == 0)
+      {
+        size = 20 * MB + (i * 7919) % (60 * MB);       // Large instances (e.g. mammography)
+      }
+      else if (i % 10 == 0)
+      {
+        size = 2 * MB + (i * 7919) % (5 * MB);         // Medium instances
+      }
+      else
+      {
+        size = 50 * KB + (i * 7919) % (500 * KB);      // Small instances (e.g. CT slices)
+      }
+
+      s.AddInstance(DicomInstanceInfo(boost::lexical_cast<std::string>((i * 2654435761u) % 4294967291u), size, ""));
+    }
+
+    for (size_t p = 0; p < sizeof(packings) / sizeof(BucketPacking); p++)
+    {
+      std::vector<TransferBucket> buckets;
+      s.ComputePullBuckets(buckets, BUCKET_SIZE, 2 * BUCKET_SIZE, "", BucketCompression_None, packings[p]);
+
+      for (size_t w = 0; w < sizeof(workers) / sizeof(size_t); w++)
+      {
+        // Each bucket is processed by the first thread that is available
+        std::vector<double> available(workers[w], 0.0);
+        double total = 0;
+
+        for (size_t i = 0; i < buckets.size(); i++)
+        {
+          const double cost = LATENCY + static_cast<double>(buckets[i].GetTotalSize()) / BANDWIDTH;
+          std::vector<double>::iterator worker = std::min_element(available.begin(), available.end());
+          *worker += cost;
+          total += cost;
+        }
+
+        const double makespan = *std::max_element(available.begin(), available.end());
+
+        printf("%4d instances, packing %-10s, %2d thread(s): %5d buckets, %7.2f s (lower bound: %7.2f s)\n",
+               static_cast<int>(instancesCount[c]), EnumerationToString(packings[p]),
+               static_cast<int>(workers[w]), static_cast<int>(buckets.size()),
+               makespan, total / static_cast<double>(workers[w]));
+      }
+    }
+  }
+}
+
+
+namespace
+{
+  size_t GetAllocatedMemory()
+  {
+#if defined(__GLIBC__) && (__GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 33))
+    return mallinfo2().uordblks;
+#elif defined(__GLIBC__)
+    return static_cast<unsigned int>(mallinfo().uordblks);
+#else
+    return 0;  // Not available
+#endif
+  }
+
+  // Formats a pseudo-random SHA-1 or MD5 as done by Orthanc
+  std::string FormatHash(size_t value,
+                         size_t length,
+                         bool dashes)
+  {
+    static const char HEX[] = "0123456789abcdef";
+
+    std::string s;
+    uint64_t state = static_cast<uint64_t>(value) * 6364136223846793005ull + 1442695040888963407ull;
+
+    for (size_t i = 0; i < length; i++)
+    {
+      if (dashes && i != 0 && i % 8 == 0)
+      {
+        s.push_back('-');
+      }
+
+      state = state * 6364136223846793005ull + 1442695040888963407ull;
+      s.push_back(HEX[(state >> 60) & 0x0f]);
+    }
+
+    return s;
+  }
+}
+
+
+TEST(TransferScheduler, DISABLED_BenchmarkMemory)
+{
+  using namespace OrthancPlugins;
+
+  static const size_t INSTANCES_COUNT = 1000000;
+  static const size_t BUCKET_SIZE = 4 * MB;
+
+  const size_t start = GetAllocatedMemory();
+
+  {
+    // Layout of the previous versions, with the identifiers and the
+    // MD5 stored as "std::string" in the tables of the scheduler, and
+    // in each chunk of the buckets
+    struct Chunk
+    {
+      std::string  instanceId_;
+      size_t       offset_;
+      size_t       size_;
+    };
+
+    std::map<std::string, std::pair<std::string, size_t> > instances;
+    std::map<std::string, size_t> ranks;
+    std::vector<std::vector<Chunk> > buckets;
+
+    for (size_t i = 0; i < INSTANCES_COUNT; i++)
+    {
+      const std::string id = FormatHash(i, 40, true);
+      instances[id] = std::make_pair(FormatHash(i, 32, false), 100 * KB);
+      ranks[id] = i;
+
+      if (i % (BUCKET_SIZE / (100 * KB)) == 0)
+      {
+        buckets.push_back(std::vector<Chunk>());
+      }
+
+      Chunk chunk;
+      chunk.instanceId_ = id;
+      chunk.offset_ = 0;
+      chunk.size_ = 100 * KB;
+      buckets.back().push_back(chunk);
+    }
+
+    printf("Previous layout: %7.1f MB\n", static_cast<double>(GetAllocatedMemory() - start) / static_cast<double>(MB));
+  }
+
+  {
+    TransferScheduler s;
+
+    for (size_t i = 0; i < INSTANCES_COUNT; i++)
+    {
+      s.AddInstance(DicomInstanceInfo(FormatHash(i, 40, true), 100 * KB, FormatHash(i, 32, false)));
+    }
+
+    const size_t scheduler = GetAllocatedMemory() - start;
+
+    std::vector<TransferBucket> buckets;
+    s.ComputePushBuckets(buckets, BUCKET_SIZE, 2 * BUCKET_SIZE, BucketPacking_Locality);
+
+    const size_t total = GetAllocatedMemory() - start;
+
+    printf("Compact layout:  %7.1f MB (scheduler: %.1f MB, %d buckets: %.1f MB)\n",
+           static_cast<double>(total) / static_cast<double>(MB),
+           static_cast<double>(scheduler) / static_cast<double>(MB),
+           static_cast<int>(buckets.size()),
+           static_cast<double>(total - scheduler) / static_cast<double>(MB));
+  }
+}
+
 
 int main(int argc, char **argv)
 {